@@ -11,7 +11,7 @@
  * - File Transfer
  * 
  * === COMPILE ===
- * gcc -o client client.c protocol.c -pthread -Wall -Wextra
+ * gcc -o client client.c protocol.c -pthread -lz -Wall -Wextra
  * 
  * === RUN ===
  * ./client
@@ -26,6 +26,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "protocol.h"
 
@@ -202,44 +203,22 @@ void clear_chat_history() {
 // TCP FUNCTIONS
 // ===========================
 
+// Buffer đọc từ server: 1 lần recv() lấy được nhiều frame
+static FrameReader server_reader;
+
 int recv_message(socket_t socket_fd, char *buffer, size_t buffer_size) {
     if (buffer == NULL || buffer_size == 0) return -1;
     
-    uint32_t msg_length;
-    int total_received = 0;
-    int bytes_received;
-    
-    while (total_received < sizeof(uint32_t)) {
-        bytes_received = recv(socket_fd, 
-                            ((char *)&msg_length) + total_received,
-                            sizeof(uint32_t) - total_received, 
-                            0);
-        
-        if (bytes_received <= 0) return bytes_received;
-        total_received += bytes_received;
+    if (server_reader.socket_fd != socket_fd) {
+        frame_reader_init(&server_reader, socket_fd);
     }
     
-    msg_length = ntohl(msg_length);
-    
-    if (msg_length == 0 || msg_length > buffer_size - 1) {
-        return -1;
-    }
-    
-    total_received = 0;
-    while (total_received < (int)msg_length) {
-        bytes_received = recv(socket_fd, 
-                            buffer + total_received,
-                            msg_length - total_received, 
-                            0);
-        
-        if (bytes_received <= 0) return bytes_received;
-        total_received += bytes_received;
-    }
-    
-    buffer[total_received] = '\0';
-    return total_received;
+    return frame_reader_next(&server_reader, buffer, buffer_size);
 }
 
+// Receive thread trả PONG song song với main thread: 1 frame phải gửi liền 1 mạch
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int send_message(socket_t socket_fd, const char *message, size_t length) {
     if (message == NULL || length == 0) return -1;
     
@@ -247,13 +226,18 @@ int send_message(socket_t socket_fd, const char *message, size_t length) {
     int total_sent = 0;
     int bytes_sent;
     
+    pthread_mutex_lock(&send_lock);
+    
     while (total_sent < sizeof(uint32_t)) {
         bytes_sent = send(socket_fd, 
                          ((char *)&msg_length) + total_sent,
                          sizeof(uint32_t) - total_sent, 
                          0);
         
-        if (bytes_sent < 0) return -1;
+        if (bytes_sent < 0) {
+            pthread_mutex_unlock(&send_lock);
+            return -1;
+        }
         total_sent += bytes_sent;
     }
     
@@ -264,27 +248,51 @@ int send_message(socket_t socket_fd, const char *message, size_t length) {
                          length - total_sent, 
                          0);
         
-        if (bytes_sent < 0) return -1;
+        if (bytes_sent < 0) {
+            pthread_mutex_unlock(&send_lock);
+            return -1;
+        }
         total_sent += bytes_sent;
     }
     
+    pthread_mutex_unlock(&send_lock);
     return total_sent;
 }
 
+// Version gửi lên server: v1 tới khi server trả MSG_HELLO (server cũ không trả)
+static int server_protocol = PROTOCOL_V1;
+// Server nhận body nén (MSG_HELLO trả lại "deflate")
+static int server_compress = 0;
+
 int send_message_struct(socket_t socket_fd, const Message *msg) {
     if (msg == NULL) return -1;
     
     char buffer[BUFFER_SIZE];
-    int len = serialize_message(msg, buffer, sizeof(buffer));
+    int len = encode_message(msg, __atomic_load_n(&server_protocol, __ATOMIC_ACQUIRE),
+                             buffer, sizeof(buffer));
     
     if (len < 0) {
         print_error("Failed to serialize message");
         return -1;
     }
     
+    if (__atomic_load_n(&server_compress, __ATOMIC_ACQUIRE)) {
+        char packed[BUFFER_SIZE];
+        int packed_len = compress_body(buffer, (size_t)len, COMPRESS_MIN_DEFAULT,
+                                       packed, sizeof(packed));
+        if (packed_len > 0) return send_message(socket_fd, packed, packed_len);
+    }
+    
     return send_message(socket_fd, buffer, len);
 }
 
+// Thời điểm hiện tại (ms, monotonic) dùng làm token PING
+static unsigned long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)(ts.tv_nsec / 1000000);
+}
+
 // ===========================
 // RECEIVE THREAD
 // ===========================
@@ -305,7 +313,7 @@ THREAD_RETURN receive_thread(void *arg) {
             break;
         }
         
-        if (parse_message(buffer, &msg) < 0) {
+        if (decode_message(buffer, (size_t)bytes, &msg) < 0) {
             continue;
         }
         
@@ -409,6 +417,45 @@ THREAD_RETURN receive_thread(void *arg) {
                 fflush(stdout);
                 break;
                 
+            case MSG_HELLO:
+                // Server chọn version, các message sau gửi theo version đó
+                {
+                    int version = atoi(msg.content);
+                    if (version >= PROTOCOL_V1 && version <= PROTOCOL_MAX) {
+                        __atomic_store_n(&server_protocol, version, __ATOMIC_RELEASE);
+                    }
+                    __atomic_store_n(&server_compress,
+                                     hello_has_capability(msg.content, COMPRESS_CAPABILITY),
+                                     __ATOMIC_RELEASE);
+                }
+                break;
+                
+            case MSG_PING:
+                // Heartbeat của server: trả lại đúng token
+                {
+                    Message pong;
+                    create_response_message(&pong, MSG_PONG, current_username, "SERVER", msg.content);
+                    send_message_struct(server_socket, &pong);
+                }
+                break;
+                
+            case MSG_PONG:
+                // Trả lời cho ping_server(): CONTENT là thời điểm gửi
+                {
+                    unsigned long long sent = strtoull(msg.content, NULL, 10);
+                    unsigned long long now = now_ms();
+                    char info[BUFFER_SIZE];
+                    snprintf(info, sizeof(info), "Pong from server: %llu ms%s%s%s",
+                             now >= sent ? now - sent : 0ULL,
+                             msg.extra[0] ? " (server-measured RTT " : "",
+                             msg.extra, msg.extra[0] ? ")" : "");
+                    printf("\n");
+                    print_info(info);
+                    printf("> ");
+                    fflush(stdout);
+                }
+                break;
+                
             case MSG_ERROR:
                 print_error(msg.content);
                 // Nếu login/register thất bại, clear state
@@ -462,6 +509,14 @@ int connect_to_server(const char *host, int port) {
     }
     
     print_success("Connected to server!");
+    
+    // Đề nghị protocol v2 và body nén (gửi bằng v1 để server cũ vẫn đọc được)
+    Message hello;
+    char version[32];
+    snprintf(version, sizeof(version), "%d,%s", PROTOCOL_MAX, COMPRESS_CAPABILITY);
+    create_response_message(&hello, MSG_HELLO, "", "SERVER", version);
+    send_message_struct(server_socket, &hello);
+    
     return 0;
 }
 
@@ -838,6 +893,17 @@ void view_groups_list() {
 // MENU
 // ===========================
 
+void ping_server() {
+    Message msg;
+    char token[32];
+    snprintf(token, sizeof(token), "%llu", now_ms());
+    create_response_message(&msg, MSG_PING, current_username, "SERVER", token);
+    
+    if (send_message_struct(server_socket, &msg) > 0) {
+        print_info("Ping sent, waiting for pong...");
+    }
+}
+
 void print_main_menu() {
     set_color(COLOR_CYAN);
     printf("\n╔══════════════════════════════════════════════════════════╗\n");
@@ -872,7 +938,7 @@ void print_main_menu() {
     set_color(COLOR_YELLOW);
     printf("║  SYSTEM:                                                 ║\n");
     set_color(COLOR_WHITE);
-    printf("║   0. Exit                                                ║\n");
+    printf("║   18. Ping Server              0. Exit                   ║\n");
     set_color(COLOR_CYAN);
     printf("╚══════════════════════════════════════════════════════════╝\n");
     set_color(COLOR_RESET);
@@ -1026,6 +1092,7 @@ int main(int argc, char *argv[]) {
             case 14: view_online_users(); break;
             case 15: view_groups_list(); break;
             case 16: load_chat_history(); break;
+            case 18: ping_server(); break;
             case 17: 
                 {
                     char confirm;
@@ -2,7 +2,7 @@
  * ChatOnline Client - GTK+3 GUI for Linux
  *
  * === COMPILE ===
- * gcc -o client_gtk client_gtk.c protocol.c `pkg-config --cflags --libs gtk+-3.0` -pthread -Wall
+ * gcc -o client_gtk client_gtk.c protocol.c `pkg-config --cflags --libs gtk+-3.0` -pthread -lz -Wall
  *
  * === RUN ===
  * ./client_gtk
@@ -275,36 +275,20 @@ int send_packet(const char *data, int len)
     return total_sent;
 }
 
+// Buffer đọc từ server: 1 lần recv() lấy được nhiều frame
+static FrameReader server_reader;
+
 int recv_packet(char *buffer, size_t buffer_size)
 {
-    uint32_t msg_length;
-    size_t total_received = 0; // ĐỔI: int -> size_t
-
-    while (total_received < sizeof(uint32_t))
-    {
-        int bytes = recv(client_socket, ((char *)&msg_length) + total_received,
-                         sizeof(uint32_t) - total_received, 0);
-        if (bytes <= 0)
-            return bytes;
-        total_received += bytes;
-    }
-
-    msg_length = ntohl(msg_length);
-    if (msg_length == 0 || msg_length > buffer_size - 1)
-        return -1;
+    return frame_reader_next(&server_reader, buffer, buffer_size);
+}
 
-    total_received = 0;
-    while (total_received < msg_length)
-    { // Bây giờ cùng kiểu size_t
-        int bytes = recv(client_socket, buffer + total_received,
-                         msg_length - total_received, 0);
-        if (bytes <= 0)
-            return bytes;
-        total_received += bytes;
-    }
+// Version gửi lên server: v1 tới khi server trả MSG_HELLO (server cũ không trả)
+static int server_protocol = PROTOCOL_V1;
 
-    buffer[total_received] = '\0';
-    return (int)total_received; // Cast về int khi return
+static int server_protocol_version(void)
+{
+    return __atomic_load_n(&server_protocol, __ATOMIC_ACQUIRE);
 }
 
 void send_request(int type, const char *content, const char *to)
@@ -313,13 +297,23 @@ void send_request(int type, const char *content, const char *to)
     create_response_message(&msg, type, current_username, to, content);
 
     char buffer[BUFFER_SIZE];
-    int len = serialize_message(&msg, buffer, sizeof(buffer));
+    int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
     if (len > 0)
     {
         send_packet(buffer, len);
     }
 }
 
+// Trả PONG cho heartbeat của server. Chạy trên main thread (g_idle_add) như mọi
+// lần gửi khác nên không xen vào giữa frame/file data main thread đang gửi
+gboolean send_pong_idle(gpointer data)
+{
+    char *token = (char *)data;
+    send_request(MSG_PONG, token, "SERVER");
+    g_free(token);
+    return FALSE;
+}
+
 // ===========================
 // GUI UPDATE FUNCTIONS (Thread-safe)
 // ===========================
@@ -1095,10 +1089,10 @@ void show_file_receive_dialog(const char *from, const char *filename, uint32_t f
 // MESSAGE PROCESSING
 // ===========================
 
-void process_message(const char *raw_data)
+void process_message(const char *raw_data, size_t length)
 {
     Message msg;
-    if (parse_message(raw_data, &msg) < 0)
+    if (decode_message(raw_data, length, &msg) < 0)
         return;
 
     char buffer[BUFFER_SIZE];
@@ -1261,19 +1255,13 @@ void process_message(const char *raw_data)
             char *file_buffer = malloc(file_size);
             if (file_buffer != NULL)
             {
-                uint32_t total_received = 0;
-                while (total_received < file_size)
+                // File data có thể đã nằm sẵn trong server_reader cùng frame header
+                uint32_t total_received = file_size;
+                if (file_size > 0 && frame_reader_read_raw(&server_reader, file_buffer, file_size) <= 0)
                 {
-                    int bytes = recv(client_socket, file_buffer + total_received,
-                                     file_size - total_received, 0);
-                    if (bytes <= 0)
-                    {
-                        printf("[FILE] Failed to receive file data\n");
-                        free(file_buffer);
-                        file_buffer = NULL;
-                        break;
-                    }
-                    total_received += bytes;
+                    printf("[FILE] Failed to receive file data\n");
+                    free(file_buffer);
+                    file_buffer = NULL;
                 }
 
                 if (file_buffer != NULL)
@@ -1290,6 +1278,19 @@ void process_message(const char *raw_data)
         }
         break;
 
+    case MSG_HELLO:
+        // Server chọn version, các request sau gửi theo version đó
+        {
+            int version = atoi(msg.content);
+            if (version >= PROTOCOL_V1 && version <= PROTOCOL_MAX)
+                __atomic_store_n(&server_protocol, version, __ATOMIC_RELEASE);
+        }
+        break;
+
+    case MSG_PING:
+        g_idle_add(send_pong_idle, g_strdup(msg.content));
+        break;
+
     case MSG_FILE_ACCEPT:
         snprintf(buffer, sizeof(buffer), "[FILE] %s accepted your file\n", msg.from);
         append_to_chat_tab(msg.from, buffer);
@@ -1327,7 +1328,7 @@ void *receive_thread(void *arg)
             break;
         }
 
-        process_message(buffer);
+        process_message(buffer, (size_t)bytes);
     }
 
     return NULL;
@@ -1351,9 +1352,17 @@ bool connect_to_server(const char *ip, int port)
         return false;
     }
 
+    frame_reader_init(&server_reader, client_socket);
     pthread_create(&recv_thread_id, NULL, receive_thread, NULL);
     pthread_detach(recv_thread_id);
 
+    // Đề nghị protocol v2 và nhận body nén (gửi bằng v1 để server cũ vẫn đọc được);
+    // decode_message tự giải nén, request của GUI ngắn nên vẫn gửi không nén
+    __atomic_store_n(&server_protocol, PROTOCOL_V1, __ATOMIC_RELEASE);
+    char version[32];
+    snprintf(version, sizeof(version), "%d,%s", PROTOCOL_MAX, COMPRESS_CAPABILITY);
+    send_request(MSG_HELLO, version, "SERVER");
+
     return true;
 }
 
@@ -1587,7 +1596,7 @@ void on_group_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer data)
         strncpy(msg.extra, group_name, sizeof(msg.extra) - 1);
 
         char buffer[BUFFER_SIZE];
-        int len = serialize_message(&msg, buffer, sizeof(buffer));
+        int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
         if (len > 0)
         {
             send_packet(buffer, len);
@@ -1605,7 +1614,7 @@ void on_group_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer data)
         strncpy(msg.extra, group_name, sizeof(msg.extra) - 1);
 
         char buffer[BUFFER_SIZE];
-        int len = serialize_message(&msg, buffer, sizeof(buffer));
+        int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
         if (len > 0)
         {
             send_packet(buffer, len);
@@ -1734,7 +1743,7 @@ void on_btn_create_group_clicked(GtkWidget *widget, gpointer data)
             strncpy(msg.extra, selected_friends, sizeof(msg.extra) - 1);
 
             char buffer[BUFFER_SIZE];
-            int len = serialize_message(&msg, buffer, sizeof(buffer));
+            int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
             if (len > 0)
             {
                 send_packet(buffer, len);
@@ -1769,7 +1778,7 @@ void on_btn_join_group_clicked(GtkWidget *widget, gpointer data)
     strncpy(msg.extra, group_name, sizeof(msg.extra) - 1);
 
     char buffer[BUFFER_SIZE];
-    int len = serialize_message(&msg, buffer, sizeof(buffer));
+    int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
     if (len > 0)
     {
         send_packet(buffer, len);
@@ -1893,7 +1902,7 @@ void on_btn_send_file_clicked(GtkWidget *widget, gpointer data)
         msg.extra[MAX_MESSAGE_LEN - 1] = '\0';
 
         char buffer[BUFFER_SIZE];
-        int len = serialize_message(&msg, buffer, sizeof(buffer));
+        int len = encode_message(&msg, server_protocol_version(), buffer, sizeof(buffer));
         if (len > 0)
         {
             // Send message header
@@ -219,6 +219,10 @@ void ProcessMessage(char* rawData) {
         case MSG_ERROR:
             MessageBox(hMainWnd, msg.content, "Server Error", MB_ICONERROR);
             break;
+        case MSG_PING:
+            // Heartbeat: trả lại đúng token (chạy trên UI thread như mọi lần gửi khác)
+            SendRequest(MSG_PONG, msg.content, "SERVER");
+            break;
     }
 }
 
@@ -4,6 +4,14 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
 
 /**
  * Initialize network - Linux (no-op)
@@ -30,154 +38,1333 @@ void sleep_ms(int milliseconds) {
 
 
 /**
- * Parse raw message string thành struct Message
- * Format: TYPE|FROM:username|TO:recipient|CONTENT:text|TIME:timestamp|EXTRA:data
+ * Kiểm tra frame hoàn chỉnh ở đầu data
  */
-int parse_message(const char *raw, Message *msg) {
-    if (raw == NULL || msg == NULL) {
+int frame_peek(const char *data, size_t length, size_t max_body, uint32_t *body_length) {
+    if (length < FRAME_HEADER_SIZE) return 0;
+    
+    uint32_t msg_length;
+    memcpy(&msg_length, data, FRAME_HEADER_SIZE);
+    msg_length = ntohl(msg_length);
+    
+    if (msg_length == 0 || msg_length > max_body) {
+        fprintf(stderr, "[ERROR] Invalid message length: %u (max: %zu)\n",
+                msg_length, max_body);
         return -1;
     }
     
-    // Clear message struct
-    memset(msg, 0, sizeof(Message));
+    if (length - FRAME_HEADER_SIZE < msg_length) return 0;
+    
+    *body_length = msg_length;
+    return 1;
+}
+
+/**
+ * Khởi tạo frame reader
+ */
+void frame_reader_init(FrameReader *reader, socket_t socket_fd) {
+    reader->socket_fd = socket_fd;
+    reader->cancel = NULL;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/**
+ * recv() 1 khối vào phần trống cuối buffer (dồn dữ liệu cũ về đầu nếu cần)
+ * Return: số bytes nhận được, 0 nếu connection đóng, -1 nếu lỗi
+ */
+static int frame_reader_fill(FrameReader *reader) {
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    } else if (reader->end == sizeof(reader->data)) {
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    
+    while (1) {
+        // Owner yêu cầu dừng đọc (vd. server hot upgrade): trả -1/EINTR, buffer giữ nguyên
+        if (reader->cancel != NULL && __atomic_load_n(reader->cancel, __ATOMIC_ACQUIRE)) {
+            errno = EINTR;
+            return -1;
+        }
+        
+        ssize_t bytes = recv(reader->socket_fd, reader->data + reader->end,
+                             sizeof(reader->data) - reader->end, 0);
+        
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes > 0) reader->end += bytes;
+        
+        return (int)bytes;
+    }
+}
+
+/**
+ * Lấy frame tiếp theo từ reader, body nằm tại chỗ trong buffer của reader
+ */
+int frame_reader_next_view(FrameReader *reader, const char **body, size_t max_body) {
+    if (reader == NULL || body == NULL) return -1;
+    
+    while (1) {
+        uint32_t body_length;
+        int ready = frame_peek(reader->data + reader->start, reader->end - reader->start,
+                               max_body, &body_length);
+        
+        if (ready < 0) return -1;
+        
+        if (ready > 0) {
+            *body = reader->data + reader->start + FRAME_HEADER_SIZE;
+            reader->start += FRAME_HEADER_SIZE + body_length;
+            return (int)body_length;
+        }
+        
+        int bytes = frame_reader_fill(reader);
+        if (bytes <= 0) return bytes;
+    }
+}
+
+/**
+ * Lấy frame tiếp theo từ reader (copy vào buffer của caller)
+ */
+int frame_reader_next(FrameReader *reader, char *buffer, size_t buffer_size) {
+    if (buffer == NULL || buffer_size == 0) return -1;
+    
+    const char *body;
+    int length = frame_reader_next_view(reader, &body, buffer_size - 1);
+    
+    if (length > 0) {
+        memcpy(buffer, body, length);
+        buffer[length] = '\0';
+    }
+    
+    return length;
+}
+
+/**
+ * Đọc dữ liệu thô đi sau frame
+ */
+int frame_reader_read_raw(FrameReader *reader, char *buffer, size_t length) {
+    if (reader == NULL || buffer == NULL) return -1;
+    
+    // Phần đã nằm sẵn trong buffer của reader
+    size_t buffered = reader->end - reader->start;
+    size_t take = buffered < length ? buffered : length;
+    memcpy(buffer, reader->data + reader->start, take);
+    reader->start += take;
+    
+    // Phần còn lại đọc thẳng vào buffer của caller
+    size_t total = take;
+    while (total < length) {
+        ssize_t bytes = recv(reader->socket_fd, buffer + total, length - total, 0);
+        
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return (int)bytes;
+        
+        total += bytes;
+    }
+    
+    return (int)total;
+}
+
+// ===========================
+// DELIMITER SCAN
+// ===========================
+
+static const unsigned char scan_class[256] = {
+    ['|'] = SCAN_PIPE, [':'] = SCAN_COLON, [','] = SCAN_COMMA, ['\n'] = SCAN_NEWLINE
+};
+
+// Byte của từng class theo thứ tự bit SCAN_*
+static const char scan_bytes[4] = { '|', ':', ',', '\n' };
+
+typedef size_t (*ScanFunction)(const char *data, size_t length, unsigned classes,
+                               uint32_t *positions, size_t max_positions, size_t *scanned);
+
+/**
+ * Duyệt từng byte, dùng cho phần đuôi không đủ 1 khối của các kernel
+ */
+static size_t scan_bytewise(const char *data, size_t length, unsigned classes,
+                            uint32_t *positions, size_t max_positions, size_t *scanned) {
+    size_t count = 0;
+    
+    for (size_t i = 0; i < length; i++) {
+        if ((scan_class[(unsigned char)data[i]] & classes) == 0) continue;
+        
+        if (count == max_positions) {
+            *scanned = i;
+            return count;
+        }
+        positions[count++] = (uint32_t)i;
+    }
+    
+    *scanned = length;
+    return count;
+}
+
+/**
+ * Bản scalar: so sánh 8 bytes/lần trong thanh ghi 64-bit (SWAR), byte trùng
+ * được đánh dấu chính xác ở bit cao nhất của byte đó
+ */
+static size_t scan_scalar(const char *data, size_t length, unsigned classes,
+                          uint32_t *positions, size_t max_positions, size_t *scanned) {
+    size_t count = 0;
+    size_t i = 0;
+    
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+    uint64_t needles[4];
+    int needle_count = 0;
+    
+    for (int k = 0; k < 4; k++) {
+        if (classes & (1u << k)) needles[needle_count++] = ones * (unsigned char)scan_bytes[k];
+    }
+    
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        
+        uint64_t hits = 0;
+        for (int k = 0; k < needle_count; k++) {
+            uint64_t x = word ^ needles[k];
+            hits |= ~(((x & low7) + low7) | x | low7);
+        }
+        
+        while (hits != 0) {
+            size_t position = i + (__builtin_ctzll(hits) >> 3);
+            
+            if (count == max_positions) {
+                *scanned = position;
+                return count;
+            }
+            positions[count++] = (uint32_t)position;
+            hits &= hits - 1;
+        }
+    }
+#endif
+    
+    size_t tail_scanned;
+    size_t tail = scan_bytewise(data + i, length - i, classes, positions + count,
+                                max_positions - count, &tail_scanned);
+    for (size_t k = count; k < count + tail; k++) {
+        positions[k] += (uint32_t)i;
+    }
+    *scanned = i + tail_scanned;
+    return count + tail;
+}
+
+#ifdef SCAN_X86
+/**
+ * Byte cần so sánh cho 4 class, class không chọn lặp lại byte của class có chọn
+ * để kernel luôn so sánh đủ 4 lần không cần rẽ nhánh
+ */
+static void scan_needles(unsigned classes, char needles[4]) {
+    char fallback = scan_bytes[__builtin_ctz(classes)];
+    
+    for (int i = 0; i < 4; i++) {
+        needles[i] = (classes & (1u << i)) ? scan_bytes[i] : fallback;
+    }
+}
+
+/**
+ * Ghi vị trí các bit của mask (khối bắt đầu tại offset)
+ * Return: 0 nếu positions đầy giữa chừng (*scanned = vị trí chưa ghi)
+ */
+static inline int scan_emit(uint32_t mask, size_t offset, uint32_t *positions,
+                             size_t max_positions, size_t *count, size_t *scanned) {
+    while (mask != 0) {
+        size_t position = offset + __builtin_ctz(mask);
+        
+        if (*count == max_positions) {
+            *scanned = position;
+            return 0;
+        }
+        positions[(*count)++] = (uint32_t)position;
+        mask &= mask - 1;
+    }
+    
+    return 1;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *data, size_t length, unsigned classes,
+                        uint32_t *positions, size_t max_positions, size_t *scanned) {
+    char needles[4];
+    scan_needles(classes, needles);
+    
+    const __m128i n0 = _mm_set1_epi8(needles[0]);
+    const __m128i n1 = _mm_set1_epi8(needles[1]);
+    const __m128i n2 = _mm_set1_epi8(needles[2]);
+    const __m128i n3 = _mm_set1_epi8(needles[3]);
+    size_t count = 0;
+    size_t i = 0;
+    
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, n0), _mm_cmpeq_epi8(block, n1)),
+            _mm_or_si128(_mm_cmpeq_epi8(block, n2), _mm_cmpeq_epi8(block, n3)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        
+        if (!scan_emit(mask, i, positions, max_positions, &count, scanned)) {
+            return count;
+        }
+    }
+    
+    size_t tail_scanned;
+    size_t tail = scan_bytewise(data + i, length - i, classes, positions + count,
+                                max_positions - count, &tail_scanned);
+    for (size_t k = count; k < count + tail; k++) {
+        positions[k] += (uint32_t)i;
+    }
+    *scanned = i + tail_scanned;
+    return count + tail;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *data, size_t length, unsigned classes,
+                        uint32_t *positions, size_t max_positions, size_t *scanned) {
+    char needles[4];
+    scan_needles(classes, needles);
+    
+    const __m256i n0 = _mm256_set1_epi8(needles[0]);
+    const __m256i n1 = _mm256_set1_epi8(needles[1]);
+    const __m256i n2 = _mm256_set1_epi8(needles[2]);
+    const __m256i n3 = _mm256_set1_epi8(needles[3]);
+    size_t count = 0;
+    size_t i = 0;
+    
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, n0), _mm256_cmpeq_epi8(block, n1)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, n2), _mm256_cmpeq_epi8(block, n3)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        
+        if (!scan_emit(mask, i, positions, max_positions, &count, scanned)) {
+            return count;
+        }
+    }
     
-    // Create a copy to work with
-    char buffer[BUFFER_SIZE];
-    strncpy(buffer, raw, BUFFER_SIZE - 1);
-    buffer[BUFFER_SIZE - 1] = '\0';
-    
-    // Parse TYPE 
-    char *ptr = buffer;
-    char *pipe = strchr(ptr, '|');
-    if (pipe == NULL) {
-        // Only type, no other fields
-        msg->type = (MessageType)atoi(ptr);
+    // Phần đuôi < 32 bytes: thêm 1 khối 16 bytes (VEX, tránh chuyển AVX/SSE) rồi scalar
+    if (i + 16 <= length) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(n0)),
+                         _mm_cmpeq_epi8(block, _mm256_castsi256_si128(n1))),
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(n2)),
+                         _mm_cmpeq_epi8(block, _mm256_castsi256_si128(n3))));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        
+        if (!scan_emit(mask, i, positions, max_positions, &count, scanned)) {
+            return count;
+        }
+        i += 16;
+    }
+    
+    size_t tail_scanned;
+    size_t tail = scan_bytewise(data + i, length - i, classes, positions + count,
+                                max_positions - count, &tail_scanned);
+    for (size_t k = count; k < count + tail; k++) {
+        positions[k] += (uint32_t)i;
+    }
+    *scanned = i + tail_scanned;
+    return count + tail;
+}
+#endif
+
+static const char *const scan_kernel_names[SCAN_KERNEL_COUNT] = { "scalar", "sse2", "avx2" };
+static const ScanFunction scan_functions[SCAN_KERNEL_COUNT] = {
+    scan_scalar,
+#ifdef SCAN_X86
+    scan_sse2,
+    scan_avx2,
+#endif
+};
+
+static ScanKernel scan_kernel = SCAN_KERNEL_COUNT;  // Chưa chọn
+
+static int scan_kernel_supported(ScanKernel kernel) {
+    switch (kernel) {
+        case SCAN_KERNEL_SCALAR:
+            return 1;
+#ifdef SCAN_X86
+        case SCAN_KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case SCAN_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+ScanKernel scan_active_kernel(void) {
+    ScanKernel kernel = __atomic_load_n(&scan_kernel, __ATOMIC_RELAXED);
+    if (kernel != SCAN_KERNEL_COUNT) return kernel;
+    
+    // Lần đầu: kernel tốt nhất CPU hỗ trợ (các thread chọn giống nhau nên race vô hại)
+    kernel = SCAN_KERNEL_AVX2;
+    while (!scan_kernel_supported(kernel)) kernel--;
+    
+    __atomic_store_n(&scan_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel;
+}
+
+int scan_select_kernel(ScanKernel kernel) {
+    if (kernel >= SCAN_KERNEL_COUNT || !scan_kernel_supported(kernel)) return -1;
+    
+    __atomic_store_n(&scan_kernel, kernel, __ATOMIC_RELAXED);
+    return 0;
+}
+
+const char *scan_kernel_name(ScanKernel kernel) {
+    return kernel < SCAN_KERNEL_COUNT ? scan_kernel_names[kernel] : "unknown";
+}
+
+size_t scan_delimiters(const char *data, size_t length, unsigned classes,
+                       uint32_t *positions, size_t max_positions, size_t *scanned) {
+    classes &= SCAN_PIPE | SCAN_COLON | SCAN_COMMA | SCAN_NEWLINE;
+    if (classes == 0 || max_positions == 0) {
+        *scanned = classes == 0 ? length : 0;
         return 0;
     }
     
-    *pipe = '\0';
-    msg->type = (MessageType)atoi(ptr);
-    ptr = pipe + 1;
+    return scan_functions[scan_active_kernel()](data, length, classes,
+                                                positions, max_positions, scanned);
+}
+
+void delim_cursor_init(DelimCursor *cursor, const char *data, size_t length, unsigned classes) {
+    cursor->data = data;
+    cursor->length = length;
+    cursor->classes = classes;
+    cursor->scanned = 0;
+    cursor->base = 0;
+    cursor->count = 0;
+    cursor->index = 0;
+}
+
+size_t delim_cursor_next(DelimCursor *cursor) {
+    if (cursor->index == cursor->count) {
+        if (cursor->scanned >= cursor->length) return cursor->length;
+        
+        size_t used;
+        cursor->base = cursor->scanned;
+        cursor->count = scan_delimiters(cursor->data + cursor->base, cursor->length - cursor->base,
+                                        cursor->classes, cursor->positions, DELIM_BATCH, &used);
+        cursor->scanned += used;
+        cursor->index = 0;
+        if (cursor->count == 0) return cursor->length;
+    }
+    
+    return cursor->base + cursor->positions[cursor->index++];
+}
+
+size_t delim_cursor_find(DelimCursor *cursor, char c) {
+    size_t position;
+    
+    while ((position = delim_cursor_next(cursor)) < cursor->length) {
+        if (cursor->data[position] == c) break;
+    }
+    
+    return position;
+}
+
+int split_fields(const char *data, size_t length, unsigned separator,
+                 FieldView *fields, int max_fields) {
+    if (max_fields <= 0) return 0;
+    
+    DelimCursor cursor;
+    delim_cursor_init(&cursor, data, length, separator | SCAN_NEWLINE);
+    
+    int count = 0;
+    size_t start = 0;
+    
+    while (count < max_fields) {
+        size_t position = delim_cursor_next(&cursor);
+        
+        fields[count].data = data + start;
+        fields[count].length = position - start;
+        count++;
+        
+        if (position == length || data[position] == '\n') break;
+        start = position + 1;
+    }
+    
+    return count;
+}
+
+// ===========================
+// MESSAGE VIEW
+// ===========================
+
+static int parse_view_v2(const char *data, size_t length, MessageView *view);
+static int schema_decode_v1(const char *data, size_t length, size_t start, MessageView *view);
+
+/**
+ * atoi() trên slice không null-terminate
+ */
+static int view_atoi(const char *data, size_t length) {
+    size_t i = 0;
+    int sign = 1;
+    int value = 0;
+    
+    while (i < length && (data[i] == ' ' || data[i] == '\t')) i++;
+    if (i < length && (data[i] == '-' || data[i] == '+')) {
+        if (data[i] == '-') sign = -1;
+        i++;
+    }
+    while (i < length && data[i] >= '0' && data[i] <= '9') {
+        value = value * 10 + (data[i] - '0');
+        i++;
+    }
+    
+    return sign * value;
+}
+
+static int key_equals(const char *key, size_t length, const char *name) {
+    return strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+static int starts_with(const char *data, size_t length, const char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    return length >= prefix_length && memcmp(data, prefix, prefix_length) == 0;
+}
+
+/**
+ * View body v1
+ * Format: TYPE|FROM:username|TO:recipient|CONTENT:text|TIME:timestamp|EXTRA:data
+ * CONTENT kéo dài tới |TIME: hoặc |EXTRA: (có thể chứa |), EXTRA tới hết body
+ * Body theo layout của type đi qua codec của schema, còn lại (thứ tự field khác,
+ * field lặp...) dùng parser chung: vị trí '|' và ':' quét theo khối bằng DelimCursor
+ */
+static int parse_view_v1(const char *data, size_t length, MessageView *view) {
+    const char *type_end = memchr(data, '|', length);
+    size_t pipe = type_end != NULL ? (size_t)(type_end - data) : length;
+    
+    view->type = (MessageType)view_atoi(data, pipe);
+    if (pipe == length) return 0;  // Only type, no other fields
     
-    // Parse remaining fields: FROM:, TO:, CONTENT:, TIME:, EXTRA:
-    while (*ptr != '\0') {
+    // Field đúng layout của type trong schema: decode riêng theo type
+    if (schema_decode_v1(data, length, pipe + 1, view) == 0) return 0;
+    
+    DelimCursor cursor;
+    delim_cursor_init(&cursor, data, length, SCAN_PIPE | SCAN_COLON);
+    cursor.scanned = pipe + 1;  // Quét từ sau TYPE|
+    
+    size_t ptr = pipe + 1;
+    
+    while (ptr < length) {
         // Find next field (KEY:VALUE|...)
-        char *colon = strchr(ptr, ':');
-        if (colon == NULL) break;
-        
-        *colon = '\0';
-        char *key = ptr;
-        char *value_start = colon + 1;
-        
-        // Find end of value (next | or end of string)
-        char *value_end = value_start;
-        char *next_pipe = NULL;
-        
-        // Special handling for CONTENT and EXTRA - they may contain |
-        if (strcmp(key, "CONTENT") == 0) {
-            // CONTENT: read until |TIME: or |EXTRA: or end
-            next_pipe = strstr(value_start, "|TIME:");
-            if (next_pipe == NULL) next_pipe = strstr(value_start, "|EXTRA:");
-            if (next_pipe == NULL) {
-                // CONTENT is last field
-                strncpy(msg->content, value_start, MAX_MESSAGE_LEN - 1);
-                msg->content[MAX_MESSAGE_LEN - 1] = '\0';
+        size_t colon = delim_cursor_find(&cursor, ':');
+        if (colon == length) break;
+        
+        const char *key = data + ptr;
+        size_t key_length = colon - ptr;
+        size_t value = colon + 1;
+        
+        if (key_equals(key, key_length, "CONTENT")) {
+            // |TIME: đầu tiên, không có thì |EXTRA: đầu tiên
+            size_t next = length;
+            size_t extra = length;
+            
+            for (size_t p = delim_cursor_find(&cursor, '|'); p < length;
+                 p = delim_cursor_find(&cursor, '|')) {
+                if (starts_with(data + p + 1, length - p - 1, "TIME:")) {
+                    next = p;
+                    break;
+                }
+                if (extra == length && starts_with(data + p + 1, length - p - 1, "EXTRA:")) {
+                    extra = p;
+                }
+            }
+            
+            if (next == length && extra != length) {
+                // Cursor đã đi hết body: gán EXTRA luôn
+                view->content.data = data + value;
+                view->content.length = extra - value;
+                view->extra.data = data + extra + 7;
+                view->extra.length = length - extra - 7;
                 break;
-            } else {
-                size_t len = next_pipe - value_start;
-                if (len >= MAX_MESSAGE_LEN) len = MAX_MESSAGE_LEN - 1;
-                strncpy(msg->content, value_start, len);
-                msg->content[len] = '\0';
-                ptr = next_pipe + 1;
-                continue;
             }
-        } else if (strcmp(key, "EXTRA") == 0) {
-            // EXTRA: read until end (usually last field)
-            strncpy(msg->extra, value_start, MAX_MESSAGE_LEN - 1);
-            msg->extra[MAX_MESSAGE_LEN - 1] = '\0';
-            break;
+            
+            view->content.data = data + value;
+            view->content.length = next - value;
+            if (next == length) break;  // CONTENT is last field
+            
+            ptr = next + 1;
+            continue;
         }
         
-        // For FROM, TO, TIME: find next |
-        next_pipe = strchr(value_start, '|');
-        if (next_pipe != NULL) {
-            *next_pipe = '\0';
-            value_end = next_pipe;
-        } else {
-            value_end = value_start + strlen(value_start);
+        if (key_equals(key, key_length, "EXTRA")) {
+            view->extra.data = data + value;
+            view->extra.length = length - value;
+            break;
         }
         
-        // Store value
-        if (strcmp(key, "FROM") == 0) {
-            strncpy(msg->from, value_start, MAX_USERNAME_LEN - 1);
-            msg->from[MAX_USERNAME_LEN - 1] = '\0';
-        } else if (strcmp(key, "TO") == 0) {
-            strncpy(msg->to, value_start, MAX_USERNAME_LEN - 1);
-            msg->to[MAX_USERNAME_LEN - 1] = '\0';
-        } else if (strcmp(key, "TIME") == 0) {
-            strncpy(msg->timestamp, value_start, 31);
-            msg->timestamp[31] = '\0';
+        // FROM, TO, TIME: tới | tiếp theo
+        size_t next = delim_cursor_find(&cursor, '|');
+        FieldView field = { data + value, next - value };
+        
+        if (key_equals(key, key_length, "FROM")) {
+            view->from = field;
+        } else if (key_equals(key, key_length, "TO")) {
+            view->to = field;
+        } else if (key_equals(key, key_length, "TIME")) {
+            view->timestamp = field;
         }
         
-        // Move to next field
-        if (next_pipe == NULL) break;
-        ptr = value_end + 1;
+        if (next == length) break;
+        ptr = next + 1;
     }
     
     return 0;
 }
 
+/**
+ * Parse body của frame thành view, nhận diện v1/v2 theo byte đầu
+ */
+int parse_message_view(const char *data, size_t length, MessageView *view) {
+    if (data == NULL || view == NULL || length == 0) return -1;
+    
+    memset(view, 0, sizeof(MessageView));
+    view->raw = data;
+    view->raw_length = length;
+    
+    if ((unsigned char)data[0] == PROTOCOL_V2_MAGIC) {
+        view->version = PROTOCOL_V2;
+        return parse_view_v2(data, length, view);
+    }
+    
+    view->version = PROTOCOL_V1;
+    return parse_view_v1(data, length, view);
+}
+
+void copy_field(char *dest, size_t size, FieldView field) {
+    size_t length = field.length < size - 1 ? field.length : size - 1;
+    if (length > 0) memcpy(dest, field.data, length);
+    dest[length] = '\0';
+}
+
+/**
+ * Copy view vào Message: chỉ copy bytes thật của từng field, không memset cả struct
+ */
+void message_from_view(const MessageView *view, Message *msg) {
+    msg->type = view->type;
+    copy_field(msg->from, sizeof(msg->from), view->from);
+    copy_field(msg->to, sizeof(msg->to), view->to);
+    copy_field(msg->content, sizeof(msg->content), view->content);
+    copy_field(msg->timestamp, sizeof(msg->timestamp), view->timestamp);
+    copy_field(msg->extra, sizeof(msg->extra), view->extra);
+}
+
+// ===========================
+// PACKED MESSAGE & ARENA
+// ===========================
+
+// Giới hạn độ dài field giống buffer của Message (không tính null terminator)
+static const size_t packed_limits[PROTOCOL_V2_FIELDS] = {
+    MAX_USERNAME_LEN - 1, MAX_USERNAME_LEN - 1, MAX_MESSAGE_LEN - 1,
+    sizeof(((Message *)0)->timestamp) - 1, MAX_MESSAGE_LEN - 1
+};
+
+static size_t packed_length(const MessageView *view, int index) {
+    const FieldView *fields[PROTOCOL_V2_FIELDS] = {
+        &view->from, &view->to, &view->content, &view->timestamp, &view->extra
+    };
+    size_t length = fields[index]->length;
+    return length < packed_limits[index] ? length : packed_limits[index];
+}
+
+/**
+ * Bytes cần cho các field của view (kể cả null terminator)
+ */
+size_t packed_message_size(const MessageView *view) {
+    size_t total = 0;
+    
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        total += packed_length(view, i) + 1;
+    }
+    
+    return total;
+}
+
+/**
+ * Copy các field của view nối tiếp nhau vào storage, msg trỏ vào đó
+ */
+void pack_message_view(const MessageView *view, PackedMessage *msg, char *storage) {
+    const FieldView *fields[PROTOCOL_V2_FIELDS] = {
+        &view->from, &view->to, &view->content, &view->timestamp, &view->extra
+    };
+    const char **targets[PROTOCOL_V2_FIELDS] = {
+        &msg->from, &msg->to, &msg->content, &msg->timestamp, &msg->extra
+    };
+    
+    msg->type = view->type;
+    
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        size_t length = packed_length(view, i);
+        if (length > 0) memcpy(storage, fields[i]->data, length);
+        storage[length] = '\0';
+        *targets[i] = storage;
+        storage += length + 1;
+    }
+}
+
+/**
+ * PackedMessage trỏ vào các mảng của Message có sẵn
+ */
+PackedMessage message_ref(const Message *msg) {
+    PackedMessage ref = { msg->type, msg->from, msg->to, msg->content, msg->timestamp, msg->extra };
+    return ref;
+}
+
+void arena_init(Arena *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size;
+}
+
+/**
+ * Cấp phát từ block hiện tại, hết chỗ thì thêm block mới (đủ lớn cho size)
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->head;
+    
+    if (block == NULL || block->size - block->used < size) {
+        size_t capacity = size > arena->block_size ? size : arena->block_size;
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (block == NULL) return NULL;
+        
+        block->next = arena->head;
+        block->used = 0;
+        block->size = capacity;
+        arena->head = block;
+    }
+    
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    
+    arena->head = NULL;
+}
+
+/**
+ * Parse raw message string thành struct Message
+ * Format: TYPE|FROM:username|TO:recipient|CONTENT:text|TIME:timestamp|EXTRA:data
+ */
+int parse_message(const char *raw, Message *msg) {
+    if (raw == NULL || msg == NULL) {
+        return -1;
+    }
+    
+    MessageView view;
+    memset(&view, 0, sizeof(view));
+    view.version = PROTOCOL_V1;
+    parse_view_v1(raw, strnlen(raw, BUFFER_SIZE - 1), &view);
+    message_from_view(&view, msg);
+    
+    return 0;
+}
+
 /**
  * Serialize struct Message thành raw string
  * Format: TYPE|FROM:username|TO:recipient|CONTENT:text|TIME:timestamp|EXTRA:data
  */
 int serialize_message(const Message *msg, char *buffer, size_t buffer_size) {
-    if (msg == NULL || buffer == NULL || buffer_size == 0) {
+    if (msg == NULL) return -1;
+    
+    PackedMessage ref = message_ref(msg);
+    return encode_packed_message(&ref, PROTOCOL_V1, buffer, buffer_size);
+}
+
+// ===========================
+// PROTOCOL V2 (BINARY)
+// ===========================
+
+/**
+ * Ghi varint (7 bit/byte, bit cao = còn byte tiếp theo)
+ * Return: số bytes đã ghi, 0 nếu không đủ chỗ
+ */
+static size_t varint_write(uint32_t value, unsigned char *out, size_t space) {
+    size_t n = 0;
+    
+    do {
+        if (n == space) return 0;
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        out[n++] = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+    
+    return n;
+}
+
+/**
+ * Đọc varint tối đa 5 bytes (uint32)
+ * Return: số bytes đã đọc, 0 nếu thiếu dữ liệu hoặc quá dài
+ */
+static size_t varint_read(const unsigned char *in, size_t length, uint32_t *value) {
+    uint32_t result = 0;
+    
+    for (size_t n = 0; n < length && n < 5; n++) {
+        result |= (uint32_t)(in[n] & 0x7F) << (7 * n);
+        if ((in[n] & 0x80) == 0) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * View body v2
+ * Format: [0xB2][type][flags][varint length...][field bytes...]
+ */
+static int parse_view_v2(const char *data, size_t length, MessageView *view) {
+    const unsigned char *in = (const unsigned char *)data;
+    if (length < 3 || in[0] != PROTOCOL_V2_MAGIC) return -1;
+    
+    view->type = (MessageType)in[1];
+    unsigned char flags = in[2];
+    size_t pos = 3;
+    
+    // Header: length của các field có mặt, tổng không vượt quá body
+    uint32_t lengths[PROTOCOL_V2_FIELDS] = { 0 };
+    size_t total = 0;
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        if ((flags & (1u << i)) == 0) continue;
+        
+        size_t used = varint_read(in + pos, length - pos, &lengths[i]);
+        if (used == 0) return -1;
+        pos += used;
+        total += lengths[i];
+    }
+    
+    if (total > length - pos) return -1;
+    
+    FieldView *fields[PROTOCOL_V2_FIELDS] = {
+        &view->from, &view->to, &view->content, &view->timestamp, &view->extra
+    };
+    
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        fields[i]->data = data + pos;
+        fields[i]->length = lengths[i];
+        pos += lengths[i];
+    }
+    
+    return 0;
+}
+
+/**
+ * Parse body v2 thành Message
+ */
+int parse_message_v2(const char *data, size_t length, Message *msg) {
+    if (data == NULL || msg == NULL) return -1;
+    
+    MessageView view;
+    if (parse_message_view(data, length, &view) < 0 || view.version != PROTOCOL_V2) {
         return -1;
     }
     
-    int len = 0;
+    message_from_view(&view, msg);
+    return 0;
+}
+
+// ===========================
+// SCHEMA CODECS
+// Mỗi type trong MESSAGE_SCHEMA có encode v1/v2 và decode v1 riêng, sinh từ cùng
+// 1 hàm inline với layout là hằng số nên compiler bỏ các field không có trong layout
+// ===========================
+
+#define FIELD_INDEX_CONTENT 2
+#define FIELD_INDEX_EXTRA 4
+
+// Key v1 theo thứ tự bit FIELD_*
+static const struct {
+    const char *text;
+    size_t length;
+} field_keys[PROTOCOL_V2_FIELDS] = {
+    { "FROM:", 5 }, { "TO:", 3 }, { "CONTENT:", 8 }, { "TIME:", 5 }, { "EXTRA:", 6 }
+};
+
+/**
+ * Body v1: type (dạng text có sẵn) rồi |KEY:value cho từng field khác rỗng của layout
+ */
+static inline __attribute__((always_inline))
+int encode_v1_layout(const PackedMessage *msg, const char *type_text, size_t type_length,
+                     unsigned fields, char *buffer, size_t buffer_size) {
+    if (buffer == NULL || type_length >= buffer_size) return -1;
+    
+    const char *values[PROTOCOL_V2_FIELDS] = {
+        msg->from, msg->to, msg->content, msg->timestamp, msg->extra
+    };
+    
+    memcpy(buffer, type_text, type_length);
+    size_t len = type_length;
+    
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        if (!(fields & (1u << i)) || values[i][0] == '\0') continue;
+        
+        size_t value_length = strlen(values[i]);
+        size_t key_length = field_keys[i].length;
+        if (1 + key_length + value_length >= buffer_size - len) return -1;
+        
+        buffer[len++] = '|';
+        memcpy(buffer + len, field_keys[i].text, key_length);
+        len += key_length;
+        memcpy(buffer + len, values[i], value_length);
+        len += value_length;
+    }
+    
+    buffer[len] = '\0';
+    return (int)len;
+}
+
+/**
+ * Body v2: field rỗng hoặc ngoài layout không được ghi (bit flags = 0)
+ */
+static inline __attribute__((always_inline))
+int encode_v2_layout(const PackedMessage *msg, int type, unsigned fields,
+                     char *buffer, size_t buffer_size) {
+    if (buffer == NULL || buffer_size < 3) return -1;
+    if ((unsigned)type > 0xFF) return -1;
+    
+    const char *values[PROTOCOL_V2_FIELDS] = {
+        msg->from, msg->to, msg->content, msg->timestamp, msg->extra
+    };
     
-    // TYPE
-    len = snprintf(buffer, buffer_size, "%d", msg->type);
-    if (len < 0 || (size_t)len >= buffer_size) return -1;
+    unsigned char *out = (unsigned char *)buffer;
+    out[0] = PROTOCOL_V2_MAGIC;
+    out[1] = (unsigned char)type;
+    out[2] = 0;
+    size_t pos = 3;
     
-    // FROM
-    if (msg->from[0] != '\0') {
-        int ret = snprintf(buffer + len, buffer_size - len, "|FROM:%s", msg->from);
-        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
-        len += ret;
+    size_t lengths[PROTOCOL_V2_FIELDS];
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        lengths[i] = (fields & (1u << i)) ? strlen(values[i]) : 0;
+        if (lengths[i] == 0) continue;
+        
+        out[2] |= (unsigned char)(1u << i);
+        size_t used = varint_write((uint32_t)lengths[i], out + pos, buffer_size - pos);
+        if (used == 0) return -1;
+        pos += used;
     }
     
-    // TO
-    if (msg->to[0] != '\0') {
-        int ret = snprintf(buffer + len, buffer_size - len, "|TO:%s", msg->to);
-        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
-        len += ret;
+    for (int i = 0; i < PROTOCOL_V2_FIELDS; i++) {
+        if (lengths[i] == 0) continue;
+        if (lengths[i] > buffer_size - pos) return -1;
+        memcpy(out + pos, values[i], lengths[i]);
+        pos += lengths[i];
     }
     
-    // CONTENT
-    if (msg->content[0] != '\0') {
-        int ret = snprintf(buffer + len, buffer_size - len, "|CONTENT:%s", msg->content);
-        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
-        len += ret;
+    return (int)pos;
+}
+
+/**
+ * CONTENT kéo dài tới |TIME: đầu tiên, không có thì tới |EXTRA: đầu tiên
+ */
+static size_t content_end(const char *data, size_t length, size_t value) {
+    size_t extra = length;
+    const char *pipe = data + value;
+    
+    while ((pipe = memchr(pipe, '|', data + length - pipe)) != NULL) {
+        size_t offset = pipe - data;
+        
+        if (starts_with(pipe + 1, length - offset - 1, "TIME:")) return offset;
+        if (extra == length && starts_with(pipe + 1, length - offset - 1, "EXTRA:")) {
+            extra = offset;
+        }
+        pipe++;
     }
     
-    // TIME
-    if (msg->timestamp[0] != '\0') {
-        int ret = snprintf(buffer + len, buffer_size - len, "|TIME:%s", msg->timestamp);
-        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
-        len += ret;
+    return extra;
+}
+
+/**
+ * Decode body v1 (từ start, sau TYPE|) khi các field đúng thứ tự của layout:
+ * so key với prefix cố định thay vì tách key rồi so chuỗi
+ * Return: -1 nếu body không theo layout (để parser chung xử lý), view không đổi
+ */
+static inline __attribute__((always_inline))
+int decode_v1_layout(const char *data, size_t length, size_t start, unsigned fields,
+                     MessageView *view) {
+    FieldView found[PROTOCOL_V2_FIELDS] = { { NULL, 0 } };
+    size_t pos = start;
+    
+    for (int i = 0; i < PROTOCOL_V2_FIELDS && pos < length; i++) {
+        if (!(fields & (1u << i))) continue;
+        if (!starts_with(data + pos, length - pos, field_keys[i].text)) continue;
+        
+        size_t value = pos + field_keys[i].length;
+        size_t end = length;
+        
+        if (i == FIELD_INDEX_CONTENT) {
+            end = content_end(data, length, value);
+        } else if (i != FIELD_INDEX_EXTRA) {
+            const char *pipe = memchr(data + value, '|', length - value);
+            if (pipe != NULL) end = pipe - data;
+        }
+        
+        found[i].data = data + value;
+        found[i].length = end - value;
+        pos = end + 1;
     }
     
-    // EXTRA
-    if (msg->extra[0] != '\0') {
-        int ret = snprintf(buffer + len, buffer_size - len, "|EXTRA:%s", msg->extra);
-        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
-        len += ret;
+    if (pos < length) return -1;
+    
+    view->from = found[0];
+    view->to = found[1];
+    view->content = found[2];
+    view->timestamp = found[3];
+    view->extra = found[4];
+    return 0;
+}
+
+typedef struct {
+    unsigned fields;
+    int (*encode_v1)(const PackedMessage *msg, char *buffer, size_t buffer_size);
+    int (*encode_v2)(const PackedMessage *msg, char *buffer, size_t buffer_size);
+    int (*decode_v1)(const char *data, size_t length, size_t start, MessageView *view);
+} MessageCodec;
+
+#define X(name, value, fields) \
+    static int encode_v1_##name(const PackedMessage *msg, char *buffer, size_t buffer_size) { \
+        return encode_v1_layout(msg, #value, sizeof(#value) - 1, fields, buffer, buffer_size); \
+    } \
+    static int encode_v2_##name(const PackedMessage *msg, char *buffer, size_t buffer_size) { \
+        return encode_v2_layout(msg, value, fields, buffer, buffer_size); \
+    } \
+    static int decode_v1_##name(const char *data, size_t length, size_t start, MessageView *view) { \
+        return decode_v1_layout(data, length, start, fields, view); \
     }
+MESSAGE_SCHEMA(X)
+#undef X
+
+static const MessageCodec message_codecs[MESSAGE_TYPE_LIMIT] = {
+#define X(name, value, fields) [value] = { fields, encode_v1_##name, encode_v2_##name, decode_v1_##name },
+    MESSAGE_SCHEMA(X)
+#undef X
+};
+
+/**
+ * Return: codec của type, NULL nếu type không có trong schema
+ */
+static const MessageCodec *message_codec(int type) {
+    if (type < 0 || (size_t)type >= MESSAGE_TYPE_LIMIT) return NULL;
     
-    return len;
+    const MessageCodec *codec = &message_codecs[type];
+    return codec->encode_v1 != NULL ? codec : NULL;
+}
+
+static int schema_decode_v1(const char *data, size_t length, size_t start, MessageView *view) {
+    const MessageCodec *codec = message_codec(view->type);
+    if (codec == NULL) return -1;
+    
+    return codec->decode_v1(data, length, start, view);
+}
+
+/**
+ * Các field khác rỗng của msg
+ */
+static unsigned packed_fields(const PackedMessage *msg) {
+    return (msg->from[0] != '\0' ? FIELD_FROM : 0) |
+           (msg->to[0] != '\0' ? FIELD_TO : 0) |
+           (msg->content[0] != '\0' ? FIELD_CONTENT : 0) |
+           (msg->timestamp[0] != '\0' ? FIELD_TIME : 0) |
+           (msg->extra[0] != '\0' ? FIELD_EXTRA : 0);
+}
+
+/**
+ * Codec chung: type ngoài schema hoặc message có field ngoài layout của type
+ */
+static int serialize_packed_v1(const PackedMessage *msg, char *buffer, size_t buffer_size) {
+    char type_text[16];
+    int type_length = snprintf(type_text, sizeof(type_text), "%d", msg->type);
+    
+    return encode_v1_layout(msg, type_text, (size_t)type_length, FIELD_ALL, buffer, buffer_size);
+}
+
+static int serialize_packed_v2(const PackedMessage *msg, char *buffer, size_t buffer_size) {
+    return encode_v2_layout(msg, msg->type, FIELD_ALL, buffer, buffer_size);
+}
+
+/**
+ * Serialize body v2
+ */
+int serialize_message_v2(const Message *msg, char *buffer, size_t buffer_size) {
+    if (msg == NULL) return -1;
+    
+    PackedMessage ref = message_ref(msg);
+    return encode_packed_message(&ref, PROTOCOL_V2, buffer, buffer_size);
+}
+
+/**
+ * Parse body của frame theo byte đầu (0xB2 = v2, 0xC5 = nén, còn lại là text v1)
+ */
+int decode_message(const char *data, size_t length, Message *msg) {
+    if (msg == NULL) return -1;
+    
+    char inflated[BUFFER_SIZE];
+    MessageView view;
+    if (parse_frame_view(data, length, inflated, sizeof(inflated), &view) < 0) return -1;
+    
+    message_from_view(&view, msg);
+    return 0;
+}
+
+/**
+ * Serialize theo version đã thương lượng
+ */
+int encode_message(const Message *msg, int version, char *buffer, size_t buffer_size) {
+    if (msg == NULL) return -1;
+    
+    PackedMessage ref = message_ref(msg);
+    return encode_packed_message(&ref, version, buffer, buffer_size);
+}
+
+/**
+ * Serialize PackedMessage theo version
+ */
+int encode_packed_message(const PackedMessage *msg, int version, char *buffer, size_t buffer_size) {
+    if (msg == NULL) return -1;
+    
+    const MessageCodec *codec = message_codec(msg->type);
+    if (codec != NULL && (packed_fields(msg) & ~codec->fields) == 0) {
+        return version == PROTOCOL_V2 ? codec->encode_v2(msg, buffer, buffer_size)
+                                      : codec->encode_v1(msg, buffer, buffer_size);
+    }
+    
+    if (version == PROTOCOL_V2) {
+        return serialize_packed_v2(msg, buffer, buffer_size);
+    }
+    
+    return serialize_packed_v1(msg, buffer, buffer_size);
+}
+
+// ===========================
+// FRAME COMPRESSION (DEFLATE)
+// ===========================
+
+#define COMPRESS_LEVEL Z_BEST_SPEED     // Frame nhỏ: mức cao hơn gần như không nhỏ thêm
+#define COMPRESS_WINDOW_BITS 13         // 8 KB đủ cho dictionary + body tối đa, raw deflate
+#define COMPRESS_MEM_LEVEL 6            // deflate ~48 KB/thread thay vì ~256 KB
+
+/*
+ * Preset dictionary, 2 bên phải dùng đúng bản này (đổi nội dung là đổi protocol).
+ * Deflate ưu tiên match gần nên chuỗi hay gặp nhất nằm cuối
+ */
+static const char compress_dictionary[] =
+    "Failed to Friend request not found already sent accepted rejected pending "
+    "User not found Group not found Login successful Already friends online offline,"
+    "SERVER|TO:SERVER|CONTENT:|EXTRA:|TIME:2026-01-01 00:00:00|FROM:";
+
+// Stream dùng lại trong thread (deflateInit cấp phát lớn, không làm mỗi frame)
+typedef struct {
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+} CompressContext;
+
+static pthread_key_t compress_key;
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+static CompressStats compress_stats;
+
+static void compress_context_free(void *arg) {
+    CompressContext *ctx = arg;
+    if (ctx->deflate_ready) deflateEnd(&ctx->deflate);
+    if (ctx->inflate_ready) inflateEnd(&ctx->inflate);
+    free(ctx);
+}
+
+static void compress_key_create(void) {
+    pthread_key_create(&compress_key, compress_context_free);
+}
+
+static CompressContext *compress_context(void) {
+    pthread_once(&compress_once, compress_key_create);
+    
+    CompressContext *ctx = pthread_getspecific(compress_key);
+    if (ctx == NULL) {
+        ctx = calloc(1, sizeof(CompressContext));
+        if (ctx == NULL) return NULL;
+        pthread_setspecific(compress_key, ctx);
+    }
+    
+    return ctx;
+}
+
+static uint64_t compress_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void compress_count(uint64_t *counter, uint64_t value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Nén body; chỉ dùng bản nén khi nhỏ hơn body gốc
+ */
+int compress_body(const char *body, size_t length, size_t threshold, char *out, size_t out_size) {
+    if (body == NULL || out == NULL || length == 0) return 0;
+    
+    if (length < threshold) {
+        compress_count(&compress_stats.skipped, 1);
+        return 0;
+    }
+    
+    // Header [magic][varint length], phần nén phải làm tổng nhỏ hơn body gốc
+    unsigned char *dst = (unsigned char *)out;
+    if (out_size < 2) return 0;
+    dst[0] = COMPRESS_MAGIC;
+    size_t header = 1 + varint_write((uint32_t)length, dst + 1, out_size - 1);
+    size_t limit = length < out_size ? length : out_size;
+    if (header == 1 || header + 1 >= limit) return 0;
+    
+    CompressContext *ctx = compress_context();
+    if (ctx == NULL) return 0;
+    
+    uint64_t start = compress_clock_ns();
+    z_stream *stream = &ctx->deflate;
+    int rc;
+    
+    if (!ctx->deflate_ready) {
+        rc = deflateInit2(stream, COMPRESS_LEVEL, Z_DEFLATED, -COMPRESS_WINDOW_BITS,
+                          COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+        if (rc != Z_OK) return 0;
+        ctx->deflate_ready = 1;
+    } else {
+        deflateReset(stream);
+    }
+    deflateSetDictionary(stream, (const Bytef *)compress_dictionary,
+                         sizeof(compress_dictionary) - 1);
+    
+    stream->next_in = (Bytef *)body;
+    stream->avail_in = (uInt)length;
+    stream->next_out = dst + header;
+    stream->avail_out = (uInt)(limit - header - 1);
+    rc = deflate(stream, Z_FINISH);
+    
+    size_t total = header + stream->total_out;
+    compress_count(&compress_stats.compress_ns, compress_clock_ns() - start);
+    compress_count(&compress_stats.bytes_in, length);
+    
+    // Hết chỗ trước khi xong = không nhỏ hơn body gốc
+    if (rc != Z_STREAM_END) {
+        compress_count(&compress_stats.incompressible, 1);
+        compress_count(&compress_stats.bytes_out, length);
+        return 0;
+    }
+    
+    compress_count(&compress_stats.frames, 1);
+    compress_count(&compress_stats.bytes_out, total);
+    return (int)total;
+}
+
+/**
+ * Giải nén body nén (không lồng nhau: body gốc phải là v1/v2)
+ */
+int decompress_body(const char *data, size_t length, char *out, size_t out_size) {
+    const unsigned char *in = (const unsigned char *)data;
+    if (data == NULL || out == NULL || length < 2 || in[0] != COMPRESS_MAGIC) return -1;
+    
+    uint32_t raw_length;
+    size_t used = varint_read(in + 1, length - 1, &raw_length);
+    if (used == 0 || raw_length == 0 || raw_length > out_size) {
+        compress_count(&compress_stats.errors, 1);
+        return -1;
+    }
+    size_t header = 1 + used;
+    
+    CompressContext *ctx = compress_context();
+    if (ctx == NULL) return -1;
+    
+    uint64_t start = compress_clock_ns();
+    z_stream *stream = &ctx->inflate;
+    int rc;
+    
+    if (!ctx->inflate_ready) {
+        if (inflateInit2(stream, -COMPRESS_WINDOW_BITS) != Z_OK) return -1;
+        ctx->inflate_ready = 1;
+    } else {
+        inflateReset(stream);
+    }
+    inflateSetDictionary(stream, (const Bytef *)compress_dictionary,
+                         sizeof(compress_dictionary) - 1);
+    
+    stream->next_in = (Bytef *)(in + header);
+    stream->avail_in = (uInt)(length - header);
+    stream->next_out = (Bytef *)out;
+    stream->avail_out = raw_length;
+    rc = inflate(stream, Z_FINISH);
+    
+    compress_count(&compress_stats.inflate_ns, compress_clock_ns() - start);
+    
+    if (rc != Z_STREAM_END || stream->total_out != raw_length || stream->avail_in != 0 ||
+        (unsigned char)out[0] == COMPRESS_MAGIC) {
+        compress_count(&compress_stats.errors, 1);
+        return -1;
+    }
+    
+    compress_count(&compress_stats.inflated, 1);
+    compress_count(&compress_stats.inflated_in, length);
+    compress_count(&compress_stats.inflated_out, raw_length);
+    return (int)raw_length;
+}
+
+/**
+ * Parse body của frame, giải nén trước nếu là body nén
+ */
+int parse_frame_view(const char *data, size_t length, char *buffer, size_t buffer_size,
+                     MessageView *view) {
+    if (data != NULL && length > 0 && (unsigned char)data[0] == COMPRESS_MAGIC) {
+        int inflated = decompress_body(data, length, buffer, buffer_size);
+        if (inflated < 0) return -1;
+        data = buffer;
+        length = (size_t)inflated;
+    }
+    
+    return parse_message_view(data, length, view);
+}
+
+void compress_stats_read(CompressStats *stats) {
+    const uint64_t *src = (const uint64_t *)&compress_stats;
+    uint64_t *dst = (uint64_t *)stats;
+    
+    for (size_t i = 0; i < sizeof(CompressStats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Token trong CONTENT của MSG_HELLO, phân cách bằng ','
+ */
+int hello_has_capability(const char *content, const char *capability) {
+    size_t length = strlen(capability);
+    const char *token = strchr(content, ',');
+    
+    while (token != NULL) {
+        token++;
+        const char *end = strchr(token, ',');
+        size_t token_length = end != NULL ? (size_t)(end - token) : strlen(token);
+        if (token_length == length && memcmp(token, capability, length) == 0) return 1;
+        token = end;
+    }
+    
+    return 0;
 }
 
 /**
@@ -31,6 +31,9 @@ typedef int socket_t;
 #define PORT 8888
 #define BUFFER_SIZE 4096
 
+#define FRAME_HEADER_SIZE 4                // [4 bytes length big-endian][message data]
+#define FRAME_READER_SIZE (16 * BUFFER_SIZE)  // Mỗi recv() đọc tối đa 64KB
+
 // THÊM: File transfer constants
 #define MAX_FILE_SIZE (10 * 1024 * 1024)  // 10MB max file size
 #define FILE_CHUNK_SIZE 8192               // 8KB chunks for transfer
@@ -39,62 +42,137 @@ typedef int socket_t;
 // MESSAGE TYPES - Các loại message
 // ===========================
 
+// Field của message, cùng thứ tự bit với flags của protocol v2
+#define FIELD_FROM    0x01
+#define FIELD_TO      0x02
+#define FIELD_CONTENT 0x04
+#define FIELD_TIME    0x08
+#define FIELD_EXTRA   0x10
+#define FIELD_ALL     0x1F
+
+// Layout thường gặp (create_response_message điền FROM/TO/CONTENT/TIME)
+#define LAYOUT_STATUS (FIELD_FROM | FIELD_CONTENT | FIELD_TIME)
+#define LAYOUT_ROUTED (FIELD_FROM | FIELD_TO | FIELD_CONTENT | FIELD_TIME)
+#define LAYOUT_TAGGED (LAYOUT_ROUTED | FIELD_EXTRA)
+
+/*
+ * Schema duy nhất của các message: X(name, value, fields)
+ * Sinh ra enum MessageType và codec riêng cho từng type (protocol.c). fields là
+ * các field type đó mang; message có field ngoài layout vẫn được encode/decode
+ * đúng bằng codec chung
+ */
+#define MESSAGE_SCHEMA(X) \
+    /* Authentication */ \
+    X(MSG_REGISTER,          1,  LAYOUT_ROUTED) \
+    X(MSG_LOGIN,             2,  LAYOUT_ROUTED) \
+    X(MSG_LOGOUT,            3,  LAYOUT_ROUTED) \
+    /* Status */ \
+    X(MSG_SUCCESS,           10, LAYOUT_ROUTED) \
+    X(MSG_ERROR,             11, LAYOUT_ROUTED) \
+    X(MSG_USER_ONLINE,       12, LAYOUT_STATUS) \
+    X(MSG_USER_OFFLINE,      13, LAYOUT_STATUS) \
+    /* Response messages (for client) */ \
+    X(MSG_RESPONSE_SUCCESS,  14, LAYOUT_ROUTED) \
+    X(MSG_RESPONSE_ERROR,    15, LAYOUT_ROUTED) \
+    X(MSG_NOTIFICATION,      16, LAYOUT_TAGGED) \
+    X(MSG_ONLINE_USERS_LIST, 17, LAYOUT_ROUTED) \
+    /* Friends */ \
+    X(MSG_FRIEND_REQUEST,    20, LAYOUT_ROUTED) \
+    X(MSG_FRIEND_ACCEPT,     21, LAYOUT_ROUTED) \
+    X(MSG_FRIEND_REJECT,     22, LAYOUT_ROUTED) \
+    X(MSG_FRIEND_REMOVE,     23, LAYOUT_ROUTED) \
+    X(MSG_FRIEND_LIST,       24, LAYOUT_ROUTED) \
+    /* Private Chat */ \
+    X(MSG_PRIVATE_MESSAGE,   30, LAYOUT_TAGGED) \
+    X(MSG_PRIVATE_CHAT_START, 31, LAYOUT_ROUTED) \
+    X(MSG_PRIVATE_CHAT_END,  32, LAYOUT_ROUTED) \
+    X(MSG_USER_TYPING,       33, LAYOUT_ROUTED) \
+    /* Group Chat: EXTRA = tên nhóm */ \
+    X(MSG_GROUP_CREATE,      40, LAYOUT_TAGGED) \
+    X(MSG_GROUP_INVITE,      41, LAYOUT_TAGGED) \
+    X(MSG_GROUP_JOIN,        42, LAYOUT_TAGGED) \
+    X(MSG_GROUP_LEAVE,       43, LAYOUT_TAGGED) \
+    X(MSG_GROUP_MESSAGE,     44, LAYOUT_TAGGED) \
+    X(MSG_GROUP_LIST,        45, LAYOUT_TAGGED) \
+    /* Offline Messages */ \
+    X(MSG_OFFLINE_SYNC,      50, LAYOUT_ROUTED) \
+    X(MSG_OFFLINE_COUNT,     51, LAYOUT_ROUTED) \
+    /* File Transfer: EXTRA = tên file */ \
+    X(MSG_FILE_SEND,         60, LAYOUT_TAGGED) \
+    X(MSG_FILE_RECEIVE,      61, LAYOUT_TAGGED) \
+    X(MSG_FILE_ACCEPT,       62, LAYOUT_TAGGED) \
+    X(MSG_FILE_REJECT,       63, LAYOUT_TAGGED) \
+    X(MSG_FILE_TRANSFER,     64, LAYOUT_TAGGED) \
+    /* List requests */ \
+    X(MSG_GET_ONLINE_USERS,  70, LAYOUT_ROUTED) \
+    X(MSG_GET_FRIENDS,       71, LAYOUT_ROUTED) \
+    X(MSG_GET_GROUPS,        72, LAYOUT_ROUTED) \
+    /* Heartbeat: bên nhận PING trả PONG với cùng CONTENT (token), EXTRA = RTT */ \
+    X(MSG_PING,              80, LAYOUT_ROUTED) \
+    X(MSG_PONG,              81, LAYOUT_TAGGED) \
+    /* Thương lượng protocol: client gửi (bằng v1) CONTENT = version cao nhất hỗ trợ, */ \
+    /* server trả CONTENT = version dùng cho connection */ \
+    X(MSG_HELLO,             90, LAYOUT_ROUTED)
+
 typedef enum {
-    // Authentication
-    MSG_REGISTER = 1,
-    MSG_LOGIN = 2,
-    MSG_LOGOUT = 3,
-    
-    // Status
-    MSG_SUCCESS = 10,
-    MSG_ERROR = 11,
-    MSG_USER_ONLINE = 12,
-    MSG_USER_OFFLINE = 13,
-    
-    // Response messages (for client)
-    MSG_RESPONSE_SUCCESS = 14,
-    MSG_RESPONSE_ERROR = 15,
-    MSG_NOTIFICATION = 16,
-    MSG_ONLINE_USERS_LIST = 17,
-    
-    // Friends
-    MSG_FRIEND_REQUEST = 20,
-    MSG_FRIEND_ACCEPT = 21,
-    MSG_FRIEND_REJECT = 22,
-    MSG_FRIEND_REMOVE = 23,
-    MSG_FRIEND_LIST = 24,
-    
-    // Private Chat
-    MSG_PRIVATE_MESSAGE = 30,
-    MSG_PRIVATE_CHAT_START = 31,
-    MSG_PRIVATE_CHAT_END = 32,
-    MSG_USER_TYPING = 33,
-    
-    // Group Chat
-    MSG_GROUP_CREATE = 40,
-    MSG_GROUP_INVITE = 41,
-    MSG_GROUP_JOIN = 42,
-    MSG_GROUP_LEAVE = 43,
-    MSG_GROUP_MESSAGE = 44,
-    MSG_GROUP_LIST = 45,
-    
-    // Offline Messages
-    MSG_OFFLINE_SYNC = 50,
-    MSG_OFFLINE_COUNT = 51,
-    
-    // File Transfer
-    MSG_FILE_SEND = 60,
-    MSG_FILE_RECEIVE = 61,
-    MSG_FILE_ACCEPT = 62,
-    MSG_FILE_REJECT = 63,
-    MSG_FILE_TRANSFER = 64,
-    
-    // List requests
-    MSG_GET_ONLINE_USERS = 70,
-    MSG_GET_FRIENDS = 71,
-    MSG_GET_GROUPS = 72
+#define X(name, value, fields) name = value,
+    MESSAGE_SCHEMA(X)
+#undef X
 } MessageType;
 
+// Giá trị type lớn nhất + 1 (kích thước bảng tra theo type)
+typedef union {
+#define X(name, value, fields) char name##_slot[value + 1];
+    MESSAGE_SCHEMA(X)
+#undef X
+} MessageTypeSlots;
+
+#define MESSAGE_TYPE_LIMIT sizeof(MessageTypeSlots)
+
+// ===========================
+// PROTOCOL VERSIONS
+// v1: text TYPE|FROM:..|TO:..|CONTENT:..|TIME:..|EXTRA:..
+// v2: binary, không quét delimiter
+//     [0xB2][type 1B][flags 1B][varint length của từng field có mặt][bytes các field]
+//     flags bit i = field i có mặt: 0 FROM, 1 TO, 2 CONTENT, 3 TIME, 4 EXTRA
+// Cả 2 đều nằm trong frame [4B length][body]. Body v1 luôn bắt đầu bằng chữ số nên
+// bên nhận nhận diện từng frame theo byte đầu; chỉ bên gửi cần thương lượng.
+// ===========================
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_MAX PROTOCOL_V2
+#define PROTOCOL_V2_MAGIC 0xB2
+#define PROTOCOL_V2_FIELDS 5
+
+// ===========================
+// FRAME COMPRESSION
+// Body nén: [0xC5][varint độ dài body gốc][raw deflate], body gốc là body v1/v2.
+// Deflate dùng preset dictionary chung (token protocol, chuỗi hay gặp) nên frame
+// vài trăm bytes cũng nén được. Body ngắn hơn ngưỡng hoặc nén không nhỏ hơn thì gửi
+// nguyên. Thương lượng qua MSG_HELLO: CONTENT = "<version>,deflate", bên kia trả lại
+// token nếu đồng ý; bên nhận nhận diện body nén theo byte đầu như v2
+// ===========================
+
+#define COMPRESS_MAGIC 0xC5
+#define COMPRESS_CAPABILITY "deflate"
+#define COMPRESS_MIN_DEFAULT 256    // Body ngắn hơn thì không nén
+
+// Counter cộng dồn của cả process (mọi thread)
+typedef struct {
+    uint64_t frames;            // Frame gửi bản nén
+    uint64_t skipped;           // Frame dưới ngưỡng, không thử nén
+    uint64_t incompressible;    // Đã nén nhưng không nhỏ hơn, gửi bản gốc
+    uint64_t bytes_in;          // Tổng body gốc của các frame đã thử nén
+    uint64_t bytes_out;         // Tổng body thực gửi của các frame đó
+    uint64_t compress_ns;       // Thời gian nén
+    uint64_t inflated;          // Frame nén đã nhận và giải nén
+    uint64_t inflated_in;       // Bytes nén đã nhận
+    uint64_t inflated_out;      // Bytes sau giải nén
+    uint64_t inflate_ns;        // Thời gian giải nén
+    uint64_t errors;            // Body nén không hợp lệ
+} CompressStats;
+
 // ===========================
 // MESSAGE STRUCTURE
 // Format: TYPE|FROM:username|TO:recipient|CONTENT:text|TIME:timestamp|[EXTRA:data]
@@ -109,6 +187,95 @@ typedef struct {
     char extra[MAX_MESSAGE_LEN];  // For additional data (group name, file name, etc.)
 } Message;
 
+// ===========================
+// MESSAGE VIEW
+// Slice (con trỏ, độ dài) trỏ thẳng vào body của frame, không copy, không
+// null-terminate. Chỉ hợp lệ khi buffer nhận còn nguyên; handler cần bản sở hữu
+// thì gọi message_from_view()
+// ===========================
+
+typedef struct {
+    const char *data;
+    size_t length;
+} FieldView;
+
+typedef struct {
+    MessageType type;
+    FieldView from;
+    FieldView to;
+    FieldView content;
+    FieldView timestamp;
+    FieldView extra;
+    const char *raw;            // Body gốc của frame (relay nguyên bytes)
+    size_t raw_length;
+    int version;                // PROTOCOL_V1/PROTOCOL_V2 của body gốc
+} MessageView;
+
+// ===========================
+// PACKED MESSAGE
+// Cùng tên field với Message nhưng là chuỗi null-terminate có độ dài đúng bằng nội
+// dung (cắt theo giới hạn của Message), nằm trong khối cấp phát của chủ sở hữu
+// (vd. WorkItem của hàng đợi worker). Arena cấp phát tuần tự cho message giữ lại
+// theo lô rồi giải phóng cả lô (record chờ ghi của offline store)
+// message_ref() xem 1 Message có sẵn như PackedMessage (không copy)
+// ===========================
+
+typedef struct {
+    MessageType type;
+    const char *from;
+    const char *to;
+    const char *content;
+    const char *timestamp;
+    const char *extra;
+} PackedMessage;
+
+// Arena: cấp phát tuần tự trong các block, giải phóng tất cả 1 lần
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t block_size;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// ===========================
+// DELIMITER SCAN
+// Tìm vị trí các byte phân cách theo khối 16/32 bytes (SSE2/AVX2, chọn lúc chạy)
+// thay cho duyệt từng byte; có bản scalar cho CPU khác
+// ===========================
+
+#define SCAN_PIPE    0x01  // '|'
+#define SCAN_COLON   0x02  // ':'
+#define SCAN_COMMA   0x04  // ','
+#define SCAN_NEWLINE 0x08  // '\n'
+
+typedef enum {
+    SCAN_KERNEL_SCALAR = 0,
+    SCAN_KERNEL_SSE2,
+    SCAN_KERNEL_AVX2,
+    SCAN_KERNEL_COUNT
+} ScanKernel;
+
+#define DELIM_BATCH 32
+
+// Duyệt lần lượt các delimiter của 1 buffer, quét DELIM_BATCH vị trí mỗi lần
+typedef struct {
+    const char *data;
+    size_t length;
+    unsigned classes;
+    size_t scanned;             // Bytes đã quét xong
+    size_t base;                // Offset của positions[] trong data
+    size_t count;
+    size_t index;
+    uint32_t positions[DELIM_BATCH];
+} DelimCursor;
+
 // ===========================
 // USER STRUCTURE
 // ===========================
@@ -156,6 +323,19 @@ typedef struct {
     uint8_t *file_data;
 } FileTransfer;
 
+// ===========================
+// BUFFERED FRAME READER
+// Đọc khối lớn từ socket, tách nhiều frame từ 1 lần recv()
+// ===========================
+
+typedef struct {
+    socket_t socket_fd;
+    const int *cancel;              // != NULL và *cancel != 0: recv() bị ngắt (EINTR) thì dừng
+    size_t start;                   // Bytes chưa xử lý nằm trong data[start, end)
+    size_t end;
+    char data[FRAME_READER_SIZE];
+} FrameReader;
+
 // ===========================
 // PROTOCOL FUNCTIONS - Dùng chung
 // ===========================
@@ -184,6 +364,160 @@ int parse_message(const char *raw, Message *msg);
  */
 int serialize_message(const Message *msg, char *buffer, size_t buffer_size);
 
+/**
+ * Parse body của 1 frame thành view (v1/v2 theo byte đầu), không copy
+ * Return: 0 nếu thành công, -1 nếu body không hợp lệ
+ */
+int parse_message_view(const char *data, size_t length, MessageView *view);
+
+/**
+ * Copy các field của view vào Message (cắt theo kích thước buffer như parse_message)
+ */
+void message_from_view(const MessageView *view, Message *msg);
+
+/**
+ * Khởi tạo arena rỗng (block đầu được cấp phát khi cần)
+ */
+void arena_init(Arena *arena, size_t block_size);
+
+/**
+ * Cấp phát size bytes (align 8) từ arena
+ * Return: NULL nếu hết bộ nhớ
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Giải phóng toàn bộ block của arena
+ */
+void arena_free(Arena *arena);
+
+/**
+ * Số bytes cần để pack view (các field + null terminator)
+ */
+size_t packed_message_size(const MessageView *view);
+
+/**
+ * Pack view vào storage (ít nhất packed_message_size(view) bytes)
+ */
+void pack_message_view(const MessageView *view, PackedMessage *msg, char *storage);
+
+/**
+ * Xem Message như PackedMessage (trỏ vào các mảng của msg, không copy)
+ */
+PackedMessage message_ref(const Message *msg);
+
+/**
+ * Serialize PackedMessage theo version (PROTOCOL_V1/PROTOCOL_V2)
+ * Return: số bytes written, -1 nếu lỗi
+ */
+int encode_packed_message(const PackedMessage *msg, int version, char *buffer, size_t buffer_size);
+
+/**
+ * Ghi offset của các byte thuộc classes (SCAN_*) trong data vào positions theo thứ tự,
+ * dừng khi đủ max_positions. length phải < 4GB
+ * *scanned: số bytes đầu đã xét hết (quét tiếp từ đó)
+ * Return: số vị trí đã ghi
+ */
+size_t scan_delimiters(const char *data, size_t length, unsigned classes,
+                       uint32_t *positions, size_t max_positions, size_t *scanned);
+
+/**
+ * Chọn kernel cho scan_delimiters (mặc định: kernel tốt nhất CPU hỗ trợ)
+ * Return: 0 nếu thành công, -1 nếu CPU không hỗ trợ
+ */
+int scan_select_kernel(ScanKernel kernel);
+
+/**
+ * Kernel scan_delimiters đang dùng
+ */
+ScanKernel scan_active_kernel(void);
+
+const char *scan_kernel_name(ScanKernel kernel);
+
+void delim_cursor_init(DelimCursor *cursor, const char *data, size_t length, unsigned classes);
+
+/**
+ * Offset delimiter tiếp theo
+ * Return: cursor->length nếu hết
+ */
+size_t delim_cursor_next(DelimCursor *cursor);
+
+/**
+ * Offset delimiter tiếp theo bằng đúng byte c (c phải thuộc classes của cursor)
+ * Return: cursor->length nếu không còn
+ */
+size_t delim_cursor_find(DelimCursor *cursor, char c);
+
+/**
+ * Tách data (tới '\n' đầu tiên hoặc hết) theo separator (SCAN_PIPE/SCAN_COMMA),
+ * giữ cả field rỗng, bỏ các field vượt quá max_fields
+ * Return: số field đã ghi
+ */
+int split_fields(const char *data, size_t length, unsigned separator,
+                 FieldView *fields, int max_fields);
+
+/**
+ * Copy field vào dest (size bytes), cắt bớt nếu dài hơn, luôn null-terminate
+ */
+void copy_field(char *dest, size_t size, FieldView field);
+
+/**
+ * Parse body v2 (binary, có length) thành struct Message
+ * Field dài hơn buffer của Message bị cắt như v1
+ * Return: 0 nếu thành công, -1 nếu body không hợp lệ
+ */
+int parse_message_v2(const char *data, size_t length, Message *msg);
+
+/**
+ * Serialize struct Message thành body v2
+ * Return: số bytes written, -1 nếu buffer không đủ
+ */
+int serialize_message_v2(const Message *msg, char *buffer, size_t buffer_size);
+
+/**
+ * Parse body của 1 frame, tự nhận diện v1/v2/body nén theo byte đầu
+ * Return: 0 nếu thành công, -1 nếu lỗi
+ */
+int decode_message(const char *data, size_t length, Message *msg);
+
+/**
+ * Serialize theo version đã thương lượng (PROTOCOL_V1/PROTOCOL_V2)
+ * Return: số bytes written, -1 nếu lỗi
+ */
+int encode_message(const Message *msg, int version, char *buffer, size_t buffer_size);
+
+/**
+ * Nén body (v1/v2) thành body nén vào out
+ * threshold: body ngắn hơn thì không nén
+ * Return: độ dài body nén, 0 nếu nên gửi body gốc (dưới ngưỡng, không nhỏ hơn, lỗi)
+ */
+int compress_body(const char *body, size_t length, size_t threshold, char *out, size_t out_size);
+
+/**
+ * Giải nén body nén vào out; body gốc dài hơn out_size là lỗi
+ * Return: độ dài body gốc, -1 nếu body không hợp lệ
+ */
+int decompress_body(const char *data, size_t length, char *out, size_t out_size);
+
+/**
+ * Như parse_message_view nhưng nhận cả body nén: giải nén vào buffer rồi view trỏ vào
+ * buffer (buffer phải còn nguyên khi dùng view)
+ * Return: 0 nếu thành công, -1 nếu lỗi
+ */
+int parse_frame_view(const char *data, size_t length, char *buffer, size_t buffer_size,
+                     MessageView *view);
+
+/**
+ * Counter nén/giải nén tới thời điểm gọi
+ */
+void compress_stats_read(CompressStats *stats);
+
+/**
+ * Kiểm tra CONTENT của MSG_HELLO có token capability (vd. "2,deflate" có "deflate")
+ * Return: 1 nếu có, 0 nếu không
+ */
+int hello_has_capability(const char *content, const char *capability);
+
 /**
  * Tạo timestamp hiện tại
  */
@@ -195,6 +529,40 @@ void get_current_timestamp(char *timestamp, size_t size);
 void create_response_message(Message *msg, MessageType type, const char *from, 
                              const char *to, const char *content);
 
+/**
+ * Kiểm tra data có chứa 1 frame hoàn chỉnh ở đầu không
+ * max_body: độ dài body tối đa chấp nhận được
+ * Return: 1 nếu đủ frame (body_length = độ dài body), 0 nếu chưa đủ dữ liệu,
+ *         -1 nếu length trong header không hợp lệ
+ */
+int frame_peek(const char *data, size_t length, size_t max_body, uint32_t *body_length);
+
+/**
+ * Khởi tạo reader cho socket
+ */
+void frame_reader_init(FrameReader *reader, socket_t socket_fd);
+
+/**
+ * Lấy frame tiếp theo, không copy: *body trỏ vào buffer của reader và chỉ hợp lệ
+ * tới lần gọi reader tiếp theo
+ * Return: độ dài body, 0 nếu connection đóng, -1 nếu lỗi
+ */
+int frame_reader_next_view(FrameReader *reader, const char **body, size_t max_body);
+
+/**
+ * Lấy frame tiếp theo (copy body vào buffer, null-terminate)
+ * Chỉ gọi recv() khi trong buffer không còn frame hoàn chỉnh
+ * Return: độ dài body, 0 nếu connection đóng, -1 nếu lỗi
+ */
+int frame_reader_next(FrameReader *reader, char *buffer, size_t buffer_size);
+
+/**
+ * Đọc đúng length bytes dữ liệu thô (file data sau MSG_FILE_SEND),
+ * dùng phần đã buffer trước rồi mới recv() tiếp
+ * Return: length nếu thành công, 0 nếu connection đóng, -1 nếu lỗi
+ */
+int frame_reader_read_raw(FrameReader *reader, char *buffer, size_t length);
+
 /**
  * Cross-platform sleep function
  */
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// ===========================
+// MICROBENCHMARK: DELIMITER SCAN
+// So sánh các kernel scan_delimiters (scalar/SSE2/AVX2) và parser v1 mới (codec
+// theo schema + parser chung) với parser memchr/memmem trước đây trên cùng bộ dữ liệu.
+// Phần compress đo tỉ lệ nén và thời gian nén/giải nén theo cỡ frame
+// Build: make bench && ./client/protocol_bench [rounds]
+// ===========================
+
+#define BENCH_FRAMES 4096
+#define BENCH_LINES 4096
+#define BENCH_COMPRESS_FRAMES 512
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int key_is(const char *key, size_t length, const char *name) {
+    return strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+/**
+ * Parser v1 trước khi có scan theo khối (memchr/memmem từng field), giữ lại để so sánh
+ */
+static void legacy_parse_v1(const char *data, size_t length, MessageView *view) {
+    const char *end = data + length;
+    const char *pipe = memchr(data, '|', length);
+
+    memset(view, 0, sizeof(*view));
+    int type = 0;
+    for (const char *p = data; p < end && *p >= '0' && *p <= '9'; p++) {
+        type = type * 10 + (*p - '0');
+    }
+    view->type = (MessageType)type;
+    if (pipe == NULL) return;
+
+    const char *ptr = pipe + 1;
+
+    while (ptr < end) {
+        const char *colon = memchr(ptr, ':', end - ptr);
+        if (colon == NULL) break;
+
+        const char *key = ptr;
+        size_t key_length = colon - ptr;
+        const char *value = colon + 1;
+
+        if (key_is(key, key_length, "CONTENT")) {
+            const char *next = memmem(value, end - value, "|TIME:", 6);
+            if (next == NULL) next = memmem(value, end - value, "|EXTRA:", 7);
+
+            view->content.data = value;
+            view->content.length = (next != NULL ? next : end) - value;
+            if (next == NULL) break;
+
+            ptr = next + 1;
+            continue;
+        }
+
+        if (key_is(key, key_length, "EXTRA")) {
+            view->extra.data = value;
+            view->extra.length = end - value;
+            break;
+        }
+
+        const char *next = memchr(value, '|', end - value);
+        FieldView field = { value, (size_t)((next != NULL ? next : end) - value) };
+
+        if (key_is(key, key_length, "FROM")) {
+            view->from = field;
+        } else if (key_is(key, key_length, "TO")) {
+            view->to = field;
+        } else if (key_is(key, key_length, "TIME")) {
+            view->timestamp = field;
+        }
+
+        if (next == NULL) break;
+        ptr = next + 1;
+    }
+}
+
+static int field_same(FieldView a, FieldView b) {
+    return a.length == b.length && (a.length == 0 || memcmp(a.data, b.data, a.length) == 0);
+}
+
+static int view_same(const MessageView *a, const MessageView *b) {
+    return a->type == b->type && field_same(a->from, b->from) && field_same(a->to, b->to) &&
+           field_same(a->content, b->content) && field_same(a->timestamp, b->timestamp) &&
+           field_same(a->extra, b->extra);
+}
+
+typedef struct {
+    char *data;
+    size_t length;
+} Sample;
+
+/**
+ * Sinh frame v1 với nội dung dài ngắn khác nhau, 1 phần có '|' và ':' trong CONTENT
+ */
+static void make_frames(Sample *frames, int count) {
+    char content[MAX_MESSAGE_LEN];
+
+    for (int i = 0; i < count; i++) {
+        size_t content_length = (i % 8 == 0) ? 1500 + i % 500 : 8 + (i * 37) % 120;
+        for (size_t k = 0; k < content_length; k++) {
+            content[k] = "abcdefghij klmnopqrstuvwxyz"[(i + k) % 27];
+            if (i % 5 == 0 && k % 97 == 50) content[k] = (k % 2) ? '|' : ':';
+        }
+        content[content_length] = '\0';
+
+        // 1/4 số frame đảo thứ tự FROM/TO: không theo layout của schema, đi qua parser chung
+        const char *format = (i % 4 == 1)
+            ? "30|TO:user%2$d|FROM:user%1$d|CONTENT:%3$s|TIME:2024-01-01 10:%4$02d:00%5$s"
+            : "30|FROM:user%1$d|TO:user%2$d|CONTENT:%3$s|TIME:2024-01-01 10:%4$02d:00%5$s";
+        char buffer[BUFFER_SIZE];
+        int length = snprintf(buffer, sizeof(buffer), format,
+                              i % 97, (i + 1) % 97, content, i % 60,
+                              (i % 3 == 0) ? "|EXTRA:group,name" : "");
+        frames[i].data = malloc(length);
+        memcpy(frames[i].data, buffer, length);
+        frames[i].length = length;
+    }
+}
+
+/**
+ * Sinh dòng theo format groups.txt
+ */
+static void make_lines(Sample *lines, int count) {
+    for (int i = 0; i < count; i++) {
+        char buffer[512];
+        int length = snprintf(buffer, sizeof(buffer),
+                              "group_%d|creator_%d|alice%d,bob%d,carol%d,dave%d,erin%d|17000%05d\n",
+                              i, i % 50, i, i, i, i, i, i);
+        lines[i].data = malloc(length + 1);
+        memcpy(lines[i].data, buffer, length + 1);
+        lines[i].length = length;
+    }
+}
+
+static void bench_scan(const Sample *frames, int count, int rounds) {
+    uint32_t positions[1024];
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) bytes += frames[i].length;
+
+    size_t expected = 0;
+
+    for (ScanKernel kernel = SCAN_KERNEL_SCALAR; kernel < SCAN_KERNEL_COUNT; kernel++) {
+        if (scan_select_kernel(kernel) < 0) {
+            printf("[BENCH] scan %-6s: not supported on this CPU\n", scan_kernel_name(kernel));
+            continue;
+        }
+
+        size_t found = 0;
+        double start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < count; i++) {
+                size_t offset = 0;
+                while (offset < frames[i].length) {
+                    size_t scanned;
+                    found += scan_delimiters(frames[i].data + offset, frames[i].length - offset,
+                                             SCAN_PIPE | SCAN_COLON, positions, 1024, &scanned);
+                    offset += scanned;
+                }
+            }
+        }
+        double elapsed = now_seconds() - start;
+
+        if (expected == 0) expected = found;
+        printf("[BENCH] scan %-6s: %8.2f MB/s%s\n", scan_kernel_name(kernel),
+               bytes * (double)rounds / elapsed / 1e6, found == expected ? "" : "  MISMATCH");
+    }
+}
+
+static void bench_parse(const Sample *frames, int count, int rounds) {
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) bytes += frames[i].length;
+
+    MessageView view;
+    MessageView legacy;
+    volatile size_t sink = 0;
+
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            legacy_parse_v1(frames[i].data, frames[i].length, &legacy);
+            sink += legacy.content.length;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("[BENCH] parse legacy: %8.2f MB/s %8.0f ns/frame\n",
+           bytes * (double)rounds / elapsed / 1e6, elapsed * 1e9 / ((double)rounds * count));
+
+    for (ScanKernel kernel = SCAN_KERNEL_SCALAR; kernel < SCAN_KERNEL_COUNT; kernel++) {
+        if (scan_select_kernel(kernel) < 0) continue;
+
+        int mismatches = 0;
+        for (int i = 0; i < count; i++) {
+            parse_message_view(frames[i].data, frames[i].length, &view);
+            legacy_parse_v1(frames[i].data, frames[i].length, &legacy);
+            if (!view_same(&view, &legacy)) mismatches++;
+        }
+
+        start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < count; i++) {
+                parse_message_view(frames[i].data, frames[i].length, &view);
+                sink += view.content.length;
+            }
+        }
+        elapsed = now_seconds() - start;
+        printf("[BENCH] parse %-6s: %8.2f MB/s %8.0f ns/frame%s\n", scan_kernel_name(kernel),
+               bytes * (double)rounds / elapsed / 1e6, elapsed * 1e9 / ((double)rounds * count),
+               mismatches == 0 ? "" : "  MISMATCH");
+    }
+}
+
+/**
+ * Serializer v1 trước khi có codec theo schema (snprintf từng field)
+ */
+static int legacy_serialize_v1(const Message *msg, char *buffer, size_t buffer_size) {
+    int len = snprintf(buffer, buffer_size, "%d", msg->type);
+    const char *keys[] = { "FROM", "TO", "CONTENT", "TIME", "EXTRA" };
+    const char *values[] = { msg->from, msg->to, msg->content, msg->timestamp, msg->extra };
+
+    for (int i = 0; i < 5; i++) {
+        if (values[i][0] == '\0') continue;
+        int ret = snprintf(buffer + len, buffer_size - len, "|%s:%s", keys[i], values[i]);
+        if (ret < 0 || (size_t)ret >= buffer_size - len) return -1;
+        len += ret;
+    }
+
+    return len;
+}
+
+static void bench_encode(const Sample *frames, int count, int rounds) {
+    Message *messages = malloc(sizeof(Message) * count);
+    char buffer[BUFFER_SIZE];
+    char expected[BUFFER_SIZE];
+    volatile size_t sink = 0;
+    int mismatches = 0;
+
+    for (int i = 0; i < count; i++) {
+        decode_message(frames[i].data, frames[i].length, &messages[i]);
+
+        int a = legacy_serialize_v1(&messages[i], expected, sizeof(expected));
+        int b = serialize_message(&messages[i], buffer, sizeof(buffer));
+        if (a != b || memcmp(expected, buffer, a) != 0) mismatches++;
+    }
+
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) sink += legacy_serialize_v1(&messages[i], buffer, sizeof(buffer));
+    }
+    double elapsed = now_seconds() - start;
+    printf("[BENCH] encode legacy: %6.0f ns/frame\n", elapsed * 1e9 / ((double)rounds * count));
+
+    for (int version = PROTOCOL_V1; version <= PROTOCOL_V2; version++) {
+        start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < count; i++) {
+                sink += encode_message(&messages[i], version, buffer, sizeof(buffer));
+            }
+        }
+        elapsed = now_seconds() - start;
+        printf("[BENCH] encode v%d    : %6.0f ns/frame%s\n", version,
+               elapsed * 1e9 / ((double)rounds * count),
+               version == PROTOCOL_V1 && mismatches != 0 ? "  MISMATCH" : "");
+    }
+
+    free(messages);
+}
+
+/**
+ * Frame gần với thực tế cho phần nén: tin nhắn ghép từ từ vựng nhỏ (nội dung
+ * của make_frames lặp theo chu kỳ nên nén tốt bất thường) và danh sách username
+ */
+static void make_compress_frames(Sample *frames, int count) {
+    static const char *words[] = {
+        "hello", "ok", "see", "you", "tomorrow", "the", "meeting", "is", "at", "room",
+        "thanks", "lol", "can", "we", "talk", "later", "file", "sent", "check", "this",
+        "link", "https://example.com/a/", "what", "about", "lunch", "?", "!", "yes", "no",
+        "maybe", "project", "deadline", "friday", "build", "failed", "again", "fixed", "it"
+    };
+    static const char *syllables[] = {
+        "an", "bo", "chi", "du", "em", "phu", "giang", "ha", "khoa", "linh", "minh", "nam"
+    };
+    uint32_t seed = 12345;
+    char content[MAX_MESSAGE_LEN];
+
+    for (int i = 0; i < count; i++) {
+        size_t target = (i % 4 == 0) ? 64 : (i % 4 == 1) ? 300 : (i % 4 == 2) ? 900 : 1900;
+        size_t length = 0;
+        while (length + 40 < target) {
+            seed = seed * 1103515245u + 12345u;
+            if (i % 8 == 3) {
+                // Danh sách username kiểu send_online_users_list
+                length += snprintf(content + length, sizeof(content) - length, "%s%s%u,",
+                                   syllables[(seed >> 8) % 12], syllables[(seed >> 16) % 12],
+                                   (seed >> 4) % 1000);
+            } else {
+                length += snprintf(content + length, sizeof(content) - length, "%s ",
+                                   words[(seed >> 8) % (sizeof(words) / sizeof(words[0]))]);
+            }
+        }
+        content[length] = '\0';
+
+        char buffer[BUFFER_SIZE];
+        int n = snprintf(buffer, sizeof(buffer), "%d|FROM:%s|TO:user%d|CONTENT:%s|TIME:2026-03-0%d 1%d:2%d:0%d",
+                         i % 8 == 3 ? MSG_ONLINE_USERS_LIST : MSG_PRIVATE_MESSAGE,
+                         i % 8 == 3 ? "SERVER" : "alice", i % 97, content,
+                         i % 9 + 1, i % 10, i % 10, i % 10);
+        frames[i].data = malloc(n);
+        memcpy(frames[i].data, buffer, n);
+        frames[i].length = n;
+    }
+}
+
+static void bench_compress(const Sample *frames, int count, int rounds) {
+    static const size_t buckets[] = { 256, 512, 1024, 2048, BUFFER_SIZE };
+    char packed[BUFFER_SIZE];
+    char inflated[BUFFER_SIZE];
+    int mismatches = 0;
+
+    for (size_t b = 0; b < sizeof(buckets) / sizeof(buckets[0]); b++) {
+        size_t low = b == 0 ? 0 : buckets[b - 1];
+        size_t in = 0, out = 0;
+        int frames_in_bucket = 0;
+        double compress_time = 0, inflate_time = 0;
+
+        for (int i = 0; i < count; i++) {
+            if (frames[i].length < low || frames[i].length >= buckets[b]) continue;
+            frames_in_bucket++;
+
+            double start = now_seconds();
+            int n = 0;
+            for (int r = 0; r < rounds; r++) {
+                n = compress_body(frames[i].data, frames[i].length, 0, packed, sizeof(packed));
+            }
+            compress_time += now_seconds() - start;
+            in += frames[i].length;
+            out += n > 0 ? (size_t)n : frames[i].length;
+            if (n <= 0) continue;
+
+            start = now_seconds();
+            int m = 0;
+            for (int r = 0; r < rounds; r++) {
+                m = decompress_body(packed, (size_t)n, inflated, sizeof(inflated));
+            }
+            inflate_time += now_seconds() - start;
+            if (m != (int)frames[i].length || memcmp(inflated, frames[i].data, m) != 0) mismatches++;
+        }
+
+        if (frames_in_bucket == 0) continue;
+        printf("[BENCH] compress %4zu-%4zu B: %5.1f%% of original, deflate %6.0f ns, inflate %6.0f ns%s\n",
+               low, buckets[b] - 1, 100.0 * (double)out / (double)in,
+               compress_time * 1e9 / ((double)rounds * frames_in_bucket),
+               inflate_time * 1e9 / ((double)rounds * frames_in_bucket),
+               mismatches != 0 ? "  MISMATCH" : "");
+    }
+}
+
+static void bench_lines(const Sample *lines, int count, int rounds) {
+    char copy[512];
+    volatile size_t sink = 0;
+
+    // strtok phải làm trên bản copy vì nó sửa dòng
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            memcpy(copy, lines[i].data, lines[i].length + 1);
+            strtok(copy, "|");
+            strtok(NULL, "|");
+            char *members = strtok(NULL, "|");
+            strtok(NULL, "|\n");
+            for (char *m = strtok(members, ","); m != NULL; m = strtok(NULL, ",")) sink++;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("[BENCH] lines strtok: %8.0f ns/line\n", elapsed * 1e9 / ((double)rounds * count));
+
+    for (ScanKernel kernel = SCAN_KERNEL_SCALAR; kernel < SCAN_KERNEL_COUNT; kernel++) {
+        if (scan_select_kernel(kernel) < 0) continue;
+
+        start = now_seconds();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < count; i++) {
+                memcpy(copy, lines[i].data, lines[i].length + 1);
+                FieldView fields[4];
+                FieldView members[MAX_GROUP_MEMBERS];
+                split_fields(copy, lines[i].length, SCAN_PIPE, fields, 4);
+                sink += split_fields(fields[2].data, fields[2].length, SCAN_COMMA,
+                                     members, MAX_GROUP_MEMBERS);
+            }
+        }
+        elapsed = now_seconds() - start;
+        printf("[BENCH] lines %-6s: %8.0f ns/line\n", scan_kernel_name(kernel),
+               elapsed * 1e9 / ((double)rounds * count));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    if (rounds <= 0) rounds = 200;
+
+    static Sample frames[BENCH_FRAMES];
+    static Sample lines[BENCH_LINES];
+    make_frames(frames, BENCH_FRAMES);
+    make_lines(lines, BENCH_LINES);
+
+    printf("[BENCH] default kernel: %s, %d rounds\n", scan_kernel_name(scan_active_kernel()), rounds);
+    bench_scan(frames, BENCH_FRAMES, rounds);
+    bench_parse(frames, BENCH_FRAMES, rounds);
+    bench_encode(frames, BENCH_FRAMES, rounds);
+    bench_lines(lines, BENCH_LINES, rounds);
+
+    // Nén chậm hơn parse vài bậc: ít frame và ít vòng hơn
+    static Sample chats[BENCH_COMPRESS_FRAMES];
+    make_compress_frames(chats, BENCH_COMPRESS_FRAMES);
+    bench_compress(chats, BENCH_COMPRESS_FRAMES, rounds / 20 > 0 ? rounds / 20 : 1);
+    for (int i = 0; i < BENCH_COMPRESS_FRAMES; i++) free(chats[i].data);
+
+    for (int i = 0; i < BENCH_FRAMES; i++) free(frames[i].data);
+    for (int i = 0; i < BENCH_LINES; i++) free(lines[i].data);
+    return 0;
+}
@@ -9,8 +9,18 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 ServerState server_state;
+ServerOptions server_options = { PORT, IO_MODE_THREAD, 0, false,
+                                  SLOW_POLICY_DIVERT, SLOW_CONSUMER_BYTES, SLOW_CONSUMER_MS, 0, WORKER_QUEUE_DEPTH,
+                                  MAX_CONNECTIONS_DEFAULT, IDLE_TIMEOUT_SEC, FRAME_TIMEOUT_SEC,
+                                  UPLOAD_TIMEOUT_SEC, LOGIN_TIMEOUT_SEC, PING_INTERVAL_SEC,
+                                  PING_TIMEOUT_SEC, PROTOCOL_MAX, COMPRESS_MIN_DEFAULT, 0, false,
+                                  WAL_FSYNC_OFF, SNAPSHOT_INTERVAL_SEC };
 
 static void signal_handler(int signum);
 
@@ -39,6 +49,14 @@ int init_server_socket(int port) {
         return -1;
     }
     
+    // Mode --reuseport: mỗi reactor bind 1 socket riêng trên cùng port
+    if (server_options.reuseport &&
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("Setsockopt(SO_REUSEPORT) failed");
+        close(server_fd);
+        return -1;
+    }
+    
     // Configure address
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -52,7 +70,7 @@ int init_server_socket(int port) {
     }
     
     // Listen
-    if (listen(server_fd, MAX_CLIENTS) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(server_fd);
         return -1;
@@ -65,21 +83,9 @@ int init_server_socket(int port) {
 }
 
 /**
- * Accept client mới
+ * Cấu hình socket client: keepalive + receive timeout
  */
-int accept_client(int server_socket, ClientConnection *client) {
-    if (client == NULL) return -1;
-    
-    socklen_t addr_len = sizeof(client->address);
-    int client_socket = accept(server_socket, 
-                               (struct sockaddr *)&client->address, 
-                               &addr_len);
-    
-    if (client_socket < 0) {
-        perror("Accept failed");
-        return -1;
-    }
-    
+void configure_client_socket(int client_socket) {
     // Enable SO_KEEPALIVE để phát hiện kết nối bị mất
     int keepalive = 1;
     if (setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) < 0) {
@@ -95,32 +101,237 @@ int accept_client(int server_socket, ClientConnection *client) {
     setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
     setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
     
-    // Set receive timeout để phát hiện timeout
-    struct timeval timeout;
-    timeout.tv_sec = 300;   // 5 minutes timeout
-    timeout.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("Warning: Failed to set SO_RCVTIMEO");
+    // Idle/frame dở/upload timeout do timer wheel xử lý (start_client_timer),
+    // không dùng SO_RCVTIMEO vì chỉ có tác dụng với thread đang block trong recv()
+}
+
+/**
+ * Accept client mới
+ */
+int accept_client(int server_socket, ClientConnection *client) {
+    if (client == NULL) return -1;
+    
+    socklen_t addr_len = sizeof(client->address);
+    int client_socket = accept(server_socket, 
+                               (struct sockaddr *)&client->address, 
+                               &addr_len);
+    
+    if (client_socket < 0) {
+        if (errno != EINTR) perror("Accept failed");  // EINTR: SIGUSR2 (hot upgrade)
+        return -1;
     }
     
+    configure_client_socket(client_socket);
+    
     // Initialize client connection
     client->socket_fd = client_socket;
     client->is_authenticated = false;
     memset(client->username, 0, MAX_USERNAME_LEN);
+    attach_client_fd(client);
+    
+    log_client_connect(client);
+    start_client_timer(client);
     
+    return client_socket;
+}
+
+/**
+ * Log connection mới (IP:port + socket)
+ */
+void log_client_connect(const ClientConnection *client) {
     char client_ip[INET_ADDRSTRLEN];
     // Linux: Use inet_ntop
     inet_ntop(AF_INET, &(client->address.sin_addr), client_ip, INET_ADDRSTRLEN);
     
     printf("[SERVER] New connection from %s:%d (socket: %d)\n", 
-           client_ip, ntohs(client->address.sin_port), client_socket);
+           client_ip, ntohs(client->address.sin_port), client->socket_fd);
     
     char log_msg[256];
     snprintf(log_msg, sizeof(log_msg), "New connection from %s:%d", 
              client_ip, ntohs(client->address.sin_port));
     log_server_event("CLIENT_CONNECT", log_msg);
+}
+
+/**
+ * Slot theo index (index < client_capacity)
+ * Chunk của slab không bao giờ bị dời chỗ nên con trỏ ClientConnection luôn ổn định
+ */
+ClientConnection *client_slot(int index) {
+    return &server_state.client_chunks[index / CLIENT_SLAB_CHUNK][index % CLIENT_SLAB_CHUNK];
+}
+
+/**
+ * Thêm 1 chunk CLIENT_SLAB_CHUNK slot vào slab (caller giữ clients_mutex)
+ * Return: -1 nếu đã đủ max_clients hoặc hết bộ nhớ
+ */
+static int grow_client_slab(void) {
+    int chunk_index = server_state.client_capacity / CLIENT_SLAB_CHUNK;
     
-    return client_socket;
+    if (server_state.client_capacity >= server_options.max_clients ||
+        chunk_index >= CLIENT_SLAB_MAX_CHUNKS) {
+        return -1;
+    }
+    
+    ClientConnection *chunk = calloc(CLIENT_SLAB_CHUNK, sizeof(ClientConnection));
+    if (chunk == NULL) {
+        perror("Failed to grow connection slab");
+        return -1;
+    }
+    
+    server_state.client_chunks[chunk_index] = chunk;
+    
+    // Lock/cond của mỗi slot khởi tạo 1 lần, dùng lại qua các lần tái sử dụng slot
+    for (int i = CLIENT_SLAB_CHUNK - 1; i >= 0; i--) {
+        ClientConnection *client = &chunk[i];
+        mutex_init(&client->outq.lock, NULL);
+        pthread_cond_init(&client->outq.idle, NULL);
+        pthread_cond_init(&client->outq.ready, NULL);
+        mutex_init(&client->work.lock, NULL);
+        pthread_cond_init(&client->work.idle, NULL);
+        client->work.client = client;
+        client->slab_index = (uint32_t)(server_state.client_capacity + i);
+        client->socket_fd = -1;
+        client->next_free = server_state.client_free;
+        server_state.client_free = (int)client->slab_index;
+    }
+    
+    // Chunk đã sẵn sàng trước khi client_from_handle() thấy capacity mới
+    __atomic_store_n(&server_state.client_capacity,
+                     server_state.client_capacity + CLIENT_SLAB_CHUNK, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+/**
+ * Lấy 1 slot trống từ free list của slab (O(1)), slab tự mở rộng khi hết
+ * Return: NULL nếu đã đủ max_clients
+ */
+ClientConnection *alloc_client_slot(void) {
+    ClientConnection *client = NULL;
+    
+    mutex_lock(&server_state.clients_mutex);
+    
+    if (server_state.client_free >= 0 || grow_client_slab() == 0) {
+        client = client_slot(server_state.client_free);
+        server_state.client_free = client->next_free;
+        
+        memset(client, 0, offsetof(ClientConnection, outq));
+        client->outq.head = NULL;
+        client->outq.tail = NULL;
+        client->outq.bytes = 0;
+        client->outq.oldest_ms = 0;
+        client->outq.flushing = false;
+        client->outq.want_write = false;
+        client->outq.backpressure = false;
+        client->outq.slow = false;
+        client->outq.dropped = 0;
+        client->outq.diverted = 0;
+        client->outq.close_ms = 0;
+        client->work.head = NULL;
+        client->work.tail = NULL;
+        client->work.scheduled = false;
+        client->work.closed = false;
+        client->next_free = -1;
+        client->socket_fd = -1;
+        client->in_use = true;
+        if ((int)client->slab_index >= server_state.client_count) {
+            server_state.client_count = (int)client->slab_index + 1;
+        }
+    }
+    
+    mutex_unlock(&server_state.clients_mutex);
+    return client;
+}
+
+/**
+ * Handle của connection đang dùng
+ */
+ClientHandle client_handle(const ClientConnection *client) {
+    uint32_t generation = __atomic_load_n(&client->generation, __ATOMIC_ACQUIRE);
+    return ((uint64_t)generation << 32) | (uint64_t)(client->slab_index + 1);
+}
+
+/**
+ * Tra connection từ handle
+ * Return: NULL nếu slot đã được trả lại (có thể đang phục vụ connection khác)
+ */
+ClientConnection *client_from_handle(ClientHandle handle) {
+    uint32_t index = (uint32_t)(handle & 0xffffffffu);
+    if (index == 0) return NULL;
+    index--;
+    
+    if ((int)index >= __atomic_load_n(&server_state.client_capacity, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    
+    ClientConnection *client = client_slot((int)index);
+    if (__atomic_load_n(&client->generation, __ATOMIC_ACQUIRE) != (uint32_t)(handle >> 32) ||
+        !client->in_use) {
+        return NULL;
+    }
+    
+    return client;
+}
+
+/**
+ * Ghi connection vào fd_table sau khi đã có socket_fd
+ */
+void attach_client_fd(ClientConnection *client) {
+    if (client == NULL || client->socket_fd < 0) return;
+    
+    mutex_lock(&server_state.fd_mutex);
+    if (client->socket_fd < server_state.fd_table_size) {
+        server_state.fd_table[client->socket_fd] = client;
+    }
+    mutex_unlock(&server_state.fd_mutex);
+}
+
+/**
+ * Tìm connection theo socket fd (O(1))
+ */
+ClientConnection *find_client_by_fd(int socket_fd) {
+    if (socket_fd < 0) return NULL;
+    
+    ClientConnection *client = NULL;
+    
+    mutex_lock(&server_state.fd_mutex);
+    if (socket_fd < server_state.fd_table_size) {
+        client = server_state.fd_table[socket_fd];
+    }
+    mutex_unlock(&server_state.fd_mutex);
+    
+    return client;
+}
+
+/**
+ * Trả slot về bảng clients
+ */
+void release_client_slot(ClientConnection *client) {
+    if (client == NULL) return;
+    
+    mutex_lock(&server_state.clients_mutex);
+    
+    free_file_upload(client);
+    free(client->rbuf);
+    client->rbuf = NULL;
+    client->rbuf_len = 0;
+    client->reactor = NULL;
+    client->socket_fd = -1;
+    client->in_use = false;
+    
+    // Handle cũ của slot hết hiệu lực
+    __atomic_add_fetch(&client->generation, 1, __ATOMIC_ACQ_REL);
+    
+    client->next_free = server_state.client_free;
+    server_state.client_free = (int)client->slab_index;
+    
+    // Thu hẹp high-water mark nếu slot cuối cùng trống
+    while (server_state.client_count > 0 &&
+           !client_slot(server_state.client_count - 1)->in_use) {
+        server_state.client_count--;
+    }
+    
+    mutex_unlock(&server_state.clients_mutex);
 }
 
 // ===========================
@@ -128,120 +339,884 @@ int accept_client(int server_socket, ClientConnection *client) {
 // ===========================
 
 /**
- * Nhận message từ socket với xử lý phân mảnh
- * Protocol: [4 bytes length][message data]
+ * Nhận đúng length bytes dữ liệu thô (không có header) từ client
+ * Dùng cho file data đi sau MSG_FILE_SEND ở mode thread; phần file data
+ * đã nằm trong FrameReader (cùng lần recv() với frame) được lấy ra trước
  */
-int recv_message(int socket_fd, char *buffer, size_t buffer_size) {
-    if (buffer == NULL || buffer_size == 0) return -1;
+int client_recv_raw(ClientConnection *client, char *buffer, size_t length) {
+    if (client == NULL || buffer == NULL || client->reader == NULL) return -1;
     
-    // Bước 1: Đọc 4 bytes header chứa message length
-    uint32_t msg_length;
-    int total_received = 0;
-    int bytes_received;
+    return frame_reader_read_raw(client->reader, buffer, length) > 0 ? (int)length : -1;
+}
+
+/**
+ * Bỏ length bytes đầu rbuf (đã xử lý)
+ */
+static void consume_client_input(ClientConnection *client, size_t length) {
+    if (length == 0) return;
     
-    while (total_received < sizeof(uint32_t)) {
-        bytes_received = recv(socket_fd, 
-                            ((char *)&msg_length) + total_received,
-                            sizeof(uint32_t) - total_received, 
-                            0);
+    memmove(client->rbuf, client->rbuf + length, client->rbuf_len - length);
+    client->rbuf_len -= length;
+}
+
+/**
+ * Xử lý dữ liệu đã nhận trong rbuf (mode epoll/io_uring)
+ * - File data đang upload dở được lấy ra trước
+ * - Tách và dispatch tất cả frame hoàn chỉnh
+ * Frame được lấy ra khỏi rbuf TRƯỚC khi dispatch để phần file data
+ * nằm ngay sau MSG_FILE_SEND được xử lý ở vòng lặp kế tiếp.
+ * Return: -1 nếu connection cần đóng
+ */
+int process_client_input(ClientConnection *client) {
+    size_t offset = 0;  // Bytes đầu rbuf đã xử lý, dồn rbuf 1 lần cho cả lượt
+    int result = 0;
+    
+    while (1) {
+        if (client->upload != NULL) {
+            consume_client_input(client, offset);
+            offset = 0;
+            if (feed_file_upload(client) < 0) return -1;
+            if (client->upload != NULL) break;  // Chờ thêm file data
+        }
         
-        if (bytes_received < 0) {
-            if (errno == EINTR) continue;  // Interrupted, retry
-            perror("recv() failed on header");
-            return -1;
+        uint32_t msg_length;
+        int ready = frame_peek(client->rbuf + offset, client->rbuf_len - offset,
+                               BUFFER_SIZE - 1, &msg_length);
+        
+        if (ready < 0) return -1;
+        if (ready == 0) break;  // Frame chưa đủ, chờ lần đọc sau
+        
+        // Parse tại chỗ trong rbuf; frame được tính là đã xử lý TRƯỚC khi
+        // dispatch để file data nằm ngay sau MSG_FILE_SEND bắt đầu từ offset mới
+        const char *body = client->rbuf + offset + FRAME_HEADER_SIZE;
+        offset += FRAME_HEADER_SIZE + msg_length;
+        
+        char inflated[BUFFER_SIZE];
+        MessageView view;
+        if (parse_frame_view(body, msg_length, inflated, BUFFER_SIZE - 1, &view) < 0) {
+            fprintf(stderr, "[ERROR] Failed to parse message (%u bytes)\n", msg_length);
+            continue;
         }
         
-        if (bytes_received == 0) {
-            // Connection closed
-            return 0;
+        printf("[REACTOR] Received message type %d from socket %d\n",
+               view.type, client->socket_fd);
+        
+        // PING/PONG xử lý ngay tại đây (không qua worker), không tính là request
+        if (handle_heartbeat(client, &view)) {
+            continue;
         }
+        touch_client(client);
         
-        total_received += bytes_received;
+        if (submit_client_request(client, &view) < 0) {
+            result = -1;
+            break;
+        }
     }
     
-    // Convert từ network byte order
-    msg_length = ntohl(msg_length);
+    consume_client_input(client, offset);
+    return result;
+}
+
+/**
+ * Gửi message qua socket với xử lý phân mảnh
+ * Protocol: [4 bytes length][message data]
+ * Message được đưa vào hàng đợi gửi của connection, không block caller
+ */
+int send_message(int socket_fd, const char *message, size_t length) {
+    if (message == NULL || length == 0) return -1;
+    
+    SharedFrame *frame = shared_frame_create(message, length, true);
+    if (frame == NULL) return -1;
     
-    // Kiểm tra message length hợp lệ
-    if (msg_length == 0 || msg_length > buffer_size - 1) {
-        fprintf(stderr, "[ERROR] Invalid message length: %u (max: %zu)\n", 
-                msg_length, buffer_size - 1);
-        return -1;
+    int result = send_shared_frame(socket_fd, frame);
+    shared_frame_release(frame);
+    
+    return result < 0 ? -1 : (int)length;
+}
+
+/**
+ * Gửi dữ liệu thô (không có header), dùng cho file data sau MSG_FILE_SEND
+ */
+int send_raw_data(int socket_fd, const char *data, size_t length) {
+    if (data == NULL || length == 0) return -1;
+    
+    SharedFrame *frame = shared_frame_create(data, length, false);
+    if (frame == NULL) return -1;
+    
+    int result = send_shared_frame(socket_fd, frame);
+    shared_frame_release(frame);
+    
+    return result < 0 ? -1 : (int)length;
+}
+
+/**
+ * Xếp 1 frame đã encode vào hàng đợi gửi của socket_fd
+ * Hàng đợi tự lấy reference, caller vẫn giữ reference của mình
+ * Return: 0 nếu đã xếp hàng, -1 nếu connection không còn hoặc hàng đợi đầy
+ */
+int send_shared_frame(int socket_fd, SharedFrame *frame) {
+    if (frame == NULL) return -1;
+    
+    if (server_options.io_mode == IO_MODE_URING) {
+        return uring_send_fd(socket_fd, frame);
+    }
+    
+    // Receiver thuộc shard khác: chuyển qua inbox của shard đó
+    int routed = reactor_route_send(socket_fd, frame);
+    if (routed != 0) {
+        return routed > 0 ? 0 : -1;
+    }
+    
+    return enqueue_client_frame(socket_fd, frame);
+}
+
+// ===========================
+// SHARED FRAME
+// ===========================
+
+/**
+ * Tạo frame từ dữ liệu (framed = true: thêm 4 bytes length header), refs = 1
+ */
+SharedFrame *shared_frame_create(const char *data, size_t length, bool framed) {
+    size_t total = length + (framed ? FRAME_HEADER_SIZE : 0);
+    SharedFrame *frame = malloc(sizeof(SharedFrame) + total);
+    if (frame == NULL) return NULL;
+    
+    frame->refs = 1;
+    frame->version = PROTOCOL_V1;
+    frame->compressed = false;
+    frame->alt = NULL;
+    frame->length = total;
+    
+    if (framed) {
+        uint32_t msg_length = htonl((uint32_t)length);  // Convert to network byte order
+        memcpy(frame->data, &msg_length, FRAME_HEADER_SIZE);
+        memcpy(frame->data + FRAME_HEADER_SIZE, data, length);
+    } else {
+        memcpy(frame->data, data, length);
     }
     
-    // Bước 2: Đọc message data
-    total_received = 0;
-    while (total_received < msg_length) {
-        bytes_received = recv(socket_fd, 
-                            buffer + total_received,
-                            msg_length - total_received, 
-                            0);
+    return frame;
+}
+
+/**
+ * Serialize message 1 lần thành frame dùng chung cho nhiều receiver (v1, bản v2
+ * được tạo thêm 1 lần khi gặp receiver v2 đầu tiên)
+ */
+SharedFrame *shared_frame_encode(const PackedMessage *msg) {
+    char buffer[BUFFER_SIZE];
+    int len = encode_packed_message(msg, PROTOCOL_V1, buffer, sizeof(buffer));
+    
+    if (len < 0) {
+        fprintf(stderr, "[ERROR] Failed to serialize message\n");
+        return NULL;
+    }
+    
+    return shared_frame_create(buffer, (size_t)len, true);
+}
+
+/**
+ * Frame chứa nguyên bytes client gửi, để relay không phải serialize lại
+ * Return: NULL nếu loại message không được relay nguyên bytes
+ */
+SharedFrame *shared_frame_original(const MessageView *view) {
+    if (view->type != MSG_PRIVATE_MESSAGE) return NULL;
+    
+    SharedFrame *frame = shared_frame_create(view->raw, view->raw_length, true);
+    if (frame != NULL) frame->version = view->version;
+    
+    return frame;
+}
+
+void shared_frame_ref(SharedFrame *frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+void shared_frame_release(SharedFrame *frame) {
+    if (frame != NULL && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        shared_frame_release(frame->alt);
+        free(frame);
+    }
+}
+
+/**
+ * Thời gian monotonic tính bằng ms
+ */
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Cập nhật trạng thái backpressure theo số bytes đang chờ gửi
+ */
+static void outq_update_watermark(ClientConnection *client) {
+    OutQueue *queue = &client->outq;
+    
+    if (!queue->backpressure && queue->bytes >= OUTQ_HIGH_WATERMARK) {
+        queue->backpressure = true;
+        printf("[BACKPRESSURE] Socket %d (%s): %zu bytes queued, above high watermark\n",
+               client->socket_fd, client->username, queue->bytes);
+    } else if (queue->backpressure && queue->bytes <= OUTQ_LOW_WATERMARK) {
+        queue->backpressure = false;
+        printf("[BACKPRESSURE] Socket %d (%s): drained below low watermark\n",
+               client->socket_fd, client->username);
+    }
+}
+
+/**
+ * Cập nhật số bytes chờ gửi và thời điểm xếp hàng của frame cũ nhất
+ * Caller giữ lock của hàng đợi (outq.lock, hoặc sq_mutex ở mode io_uring);
+ * ghi atomic để send_message_struct() đọc không cần lock
+ */
+void outq_account(ClientConnection *client, long delta, uint64_t oldest_ms) {
+    __atomic_store_n(&client->outq.bytes, client->outq.bytes + delta, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->outq.oldest_ms, oldest_ms, __ATOMIC_RELAXED);
+    outq_update_watermark(client);
+}
+
+/**
+ * Bỏ toàn bộ dữ liệu chưa gửi (caller giữ outq.lock)
+ */
+static void outq_clear(ClientConnection *client) {
+    OutChunk *chunk = client->outq.head;
+    
+    while (chunk != NULL) {
+        OutChunk *next = chunk->next;
+        shared_frame_release(chunk->frame);
+        free(chunk);
+        chunk = next;
+    }
+    
+    client->outq.head = NULL;
+    client->outq.tail = NULL;
+    __atomic_store_n(&client->outq.bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->outq.oldest_ms, 0, __ATOMIC_RELAXED);
+    client->outq.backpressure = false;
+}
+
+/**
+ * Ghi nhận bytes_sent bytes của chunk đầu đã gửi, bỏ chunk nếu gửi hết
+ * (caller giữ outq.lock)
+ */
+static void outq_consume(ClientConnection *client, size_t bytes_sent) {
+    size_t remaining = bytes_sent;
+    
+    // 1 lần sendmsg() có thể gửi xong nhiều chunk
+    while (remaining > 0) {
+        OutChunk *chunk = client->outq.head;
+        size_t take = chunk->frame->length - chunk->offset;
+        if (take > remaining) take = remaining;
         
-        if (bytes_received < 0) {
-            if (errno == EINTR) continue;  // Interrupted, retry
-            perror("recv() failed on data");
-            return -1;
+        chunk->offset += take;
+        remaining -= take;
+        
+        if (chunk->offset == chunk->frame->length) {
+            client->outq.head = chunk->next;
+            if (client->outq.head == NULL) client->outq.tail = NULL;
+            shared_frame_release(chunk->frame);
+            free(chunk);
+        }
+    }
+    
+    outq_account(client, -(long)bytes_sent,
+                 client->outq.head != NULL ? client->outq.head->queued_ms : 0);
+}
+
+/**
+ * Gom tối đa OUTQ_IOV_MAX chunk đầu hàng đợi thành 1 sendmsg() non-blocking
+ * (header + body cùng chunk, nhiều frame cùng 1 syscall)
+ * Caller giữ outq.lock khi gọi; unlock = true: nhả lock trong lúc sendmsg()
+ * (chỉ flusher được bỏ chunk nên các chunk trong iov không bị free)
+ */
+static ssize_t outq_sendmsg(ClientConnection *client, int socket_fd, bool unlock) {
+    struct iovec iov[OUTQ_IOV_MAX];
+    int count = 0;
+    
+    for (OutChunk *chunk = client->outq.head; chunk != NULL && count < OUTQ_IOV_MAX;
+         chunk = chunk->next) {
+        iov[count].iov_base = chunk->frame->data + chunk->offset;
+        iov[count].iov_len = chunk->frame->length - chunk->offset;
+        count++;
+    }
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    
+    if (unlock) mutex_unlock(&client->outq.lock);
+    ssize_t bytes_sent = sendmsg(socket_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    int send_errno = errno;
+    if (unlock) mutex_lock(&client->outq.lock);
+    
+    errno = send_errno;
+    return bytes_sent;
+}
+
+/**
+ * Mode thread: mỗi connection có 1 writer thread, là thread duy nhất gửi outq.
+ * Sender (client thread khác, worker, timer) chỉ append rồi đánh thức writer nên
+ * không bao giờ chờ socket của người nhận, kể cả khi đang giữ groups_mutex/users_mutex.
+ * Writer gửi non-blocking, socket đầy thì chờ POLLOUT (cleanup_client shutdown()
+ * socket để đánh thức), thoát khi socket_fd của connection đổi
+ */
+static THREAD_RETURN client_writer_thread(void *arg) {
+    ClientConnection *client = (ClientConnection *)arg;
+    OutQueue *queue = &client->outq;
+    
+    mutex_lock(&queue->lock);
+    int socket_fd = client->socket_fd;
+    
+    while (client->socket_fd == socket_fd) {
+        // Socket đã chuyển cho process mới (hot upgrade): dữ liệu giữ lại trong hàng đợi
+        if (queue->head == NULL || upgrade_sends_blocked()) {
+            // Đã gửi hết frame cuối (vd. thông báo bị kick): reader thấy EOF và đóng
+            if (queue->head == NULL && queue->close_ms != 0) {
+                shutdown(socket_fd, SHUT_RDWR);
+            }
+            pthread_cond_wait(&queue->ready, &queue->lock);
+            continue;
         }
         
-        if (bytes_received == 0) {
-            // Connection closed unexpectedly
-            fprintf(stderr, "[ERROR] Connection closed while receiving data\n");
-            return 0;
+        queue->flushing = true;
+        ssize_t bytes_sent = outq_sendmsg(client, socket_fd, true);
+        int send_errno = errno;
+        queue->flushing = false;
+        pthread_cond_broadcast(&queue->idle);
+        
+        if (bytes_sent < 0 && (send_errno == EAGAIN || send_errno == EWOULDBLOCK)) {
+            mutex_unlock(&queue->lock);
+            struct pollfd pfd = { socket_fd, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+            mutex_lock(&queue->lock);
+            continue;
         }
         
-        total_received += bytes_received;
+        if (bytes_sent < 0) {
+            if (send_errno == EINTR) continue;
+            errno = send_errno;
+            perror("sendmsg() failed");
+            outq_clear(client);  // Reader thấy lỗi/EOF và đóng connection
+            continue;
+        }
+        
+        outq_consume(client, (size_t)bytes_sent);
+        
+        if (__atomic_load_n(&queue->slow, __ATOMIC_ACQUIRE)) {
+            mutex_unlock(&queue->lock);
+            check_slow_consumer(client, socket_fd);
+            mutex_lock(&queue->lock);
+        }
     }
     
-    buffer[total_received] = '\0';  // Null terminate
+    mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/**
+ * Tạo writer thread cho connection mode thread (gọi từ client_thread)
+ * Return: -1 nếu không tạo được thread
+ */
+static int start_client_writer(ClientConnection *client) {
+    if (pthread_create(&client->writer_id, NULL, client_writer_thread, client) != 0) {
+        fprintf(stderr, "Failed to create writer thread\n");
+        return -1;
+    }
     
-    return total_received;
+    client->has_writer = true;
+    return 0;
 }
 
 /**
- * Gửi message qua socket với xử lý phân mảnh
- * Protocol: [4 bytes length][message data]
+ * Đánh thức writer để gửi phần còn trong hàng đợi (vd. sau khi hot upgrade bị hủy)
  */
-int send_message(int socket_fd, const char *message, size_t length) {
-    if (message == NULL || length == 0) return -1;
+static void wake_client_writer(ClientConnection *client) {
+    mutex_lock(&client->outq.lock);
+    pthread_cond_signal(&client->outq.ready);
+    mutex_unlock(&client->outq.lock);
+}
+
+/**
+ * Mode epoll: reactor sở hữu gửi non-blocking tới khi hết dữ liệu hoặc EAGAIN,
+ * phần còn lại được gửi khi có EPOLLOUT
+ * Return: -1 nếu connection lỗi
+ */
+int flush_client_output(ClientConnection *client) {
+    OutQueue *queue = &client->outq;
+    int result = 0;
     
-    // Bước 1: Gửi 4 bytes header chứa message length
-    uint32_t msg_length = htonl((uint32_t)length);  // Convert to network byte order
-    int total_sent = 0;
-    int bytes_sent;
+    mutex_lock(&queue->lock);
     
-    while (total_sent < sizeof(uint32_t)) {
-        bytes_sent = send(socket_fd, 
-                         ((char *)&msg_length) + total_sent,
-                         sizeof(uint32_t) - total_sent, 
-                         0);
+    int socket_fd = client->socket_fd;
+    
+    while (queue->head != NULL && socket_fd >= 0) {
+        ssize_t bytes_sent = outq_sendmsg(client, socket_fd, false);
         
         if (bytes_sent < 0) {
-            if (errno == EINTR) continue;  // Interrupted, retry
-            perror("send() failed on header");
-            return -1;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("sendmsg() failed");
+            outq_clear(client);
+            result = -1;
+            break;
         }
         
-        total_sent += bytes_sent;
+        outq_consume(client, (size_t)bytes_sent);
     }
     
-    // Bước 2: Gửi message data
-    total_sent = 0;
-    while (total_sent < length) {
-        bytes_sent = send(socket_fd, 
-                         message + total_sent,
-                         length - total_sent, 
-                         0);
+    // Chỉ theo dõi EPOLLOUT khi còn dữ liệu chờ gửi
+    bool want_write = queue->head != NULL && result == 0;
+    if (want_write != queue->want_write && socket_fd >= 0) {
+        queue->want_write = want_write;
+        reactor_set_writable(client, want_write);
+    }
+    
+    // Đã gửi hết frame cuối: reactor nhận EPOLLHUP và đóng như bình thường
+    if (queue->head == NULL && queue->close_ms != 0 && socket_fd >= 0) {
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+    
+    mutex_unlock(&queue->lock);
+    
+    return result;
+}
+
+/**
+ * Bắt đầu gửi dữ liệu đang chờ trong hàng đợi (caller giữ outq.lock)
+ * - Mode epoll: reactor sở hữu flush ngay, thread khác chỉ bật EPOLLOUT để đánh thức nó
+ * - Mode thread: đánh thức writer thread của connection
+ * Return: -1 nếu connection lỗi
+ */
+static int start_client_flush(ClientConnection *client) {
+    OutQueue *queue = &client->outq;
+    
+    // Socket đã chuyển cho process mới (hot upgrade): dữ liệu giữ lại trong hàng đợi
+    if (upgrade_sends_blocked()) return 0;
+    
+    if (client->reactor != NULL) {
+        if (reactor_owns(client)) {
+            mutex_unlock(&queue->lock);
+            int result = flush_client_output(client);
+            mutex_lock(&queue->lock);
+            return result;
+        }
         
-        if (bytes_sent < 0) {
-            if (errno == EINTR) continue;  // Interrupted, retry
-            perror("send() failed on data");
-            return -1;
+        // Thread khác: bật EPOLLOUT, reactor sở hữu sẽ flush
+        if (!queue->want_write && queue->head != NULL) {
+            queue->want_write = true;
+            reactor_set_writable(client, true);
+        }
+        return 0;
+    }
+    
+    pthread_cond_signal(&queue->ready);
+    return 0;
+}
+
+// ===========================
+// SEND BATCH
+// ===========================
+// Handler (client_thread, reactor, io_uring engine) mở batch quanh phần xử lý;
+// frame gửi trong batch chỉ được xếp hàng, end_send_batch() flush mỗi socket 1 lần
+// nên các frame liên tiếp (vd. login: success + offline + groups) đi chung 1 sendmsg()
+
+typedef struct {
+    int depth;
+    int count;
+    int fds[SEND_BATCH_MAX];
+} SendBatch;
+
+static __thread SendBatch send_batch;
+
+/**
+ * Mở batch gửi cho thread hiện tại (lồng nhau được)
+ */
+void begin_send_batch(void) {
+    send_batch.depth++;
+}
+
+/**
+ * Ghi nhận socket cần flush khi đóng batch
+ * Return: true nếu được hoãn, false nếu caller phải flush ngay (không có batch/batch đầy)
+ */
+bool send_batch_defer(int socket_fd) {
+    if (send_batch.depth == 0) return false;
+    
+    for (int i = 0; i < send_batch.count; i++) {
+        if (send_batch.fds[i] == socket_fd) return true;
+    }
+    
+    if (send_batch.count == SEND_BATCH_MAX) return false;
+    
+    send_batch.fds[send_batch.count++] = socket_fd;
+    return true;
+}
+
+/**
+ * Flush tất cả socket đã gửi trong batch
+ */
+static void flush_socket(int socket_fd) {
+    if (server_options.io_mode == IO_MODE_URING) {
+        uring_flush_fd(socket_fd);
+        return;
+    }
+    
+    ClientConnection *client = find_client_by_fd(socket_fd);
+    if (client == NULL) return;
+    
+    mutex_lock(&client->outq.lock);
+    if (client->in_use && client->socket_fd == socket_fd && client->outq.head != NULL) {
+        start_client_flush(client);
+    }
+    mutex_unlock(&client->outq.lock);
+}
+
+/**
+ * Đóng batch, batch ngoài cùng flush các socket đã ghi nhận
+ */
+void end_send_batch(void) {
+    if (--send_batch.depth > 0) return;
+    
+    while (send_batch.count > 0) {
+        int socket_fd = send_batch.fds[--send_batch.count];
+        flush_socket(socket_fd);
+    }
+}
+
+/**
+ * Đóng connection sau khi các frame đã xếp hàng (vd. thông báo bị kick) gửi xong:
+ * thread sở hữu (writer/reactor/io_uring) shutdown socket khi hàng đợi rỗng, reader
+ * thấy EOF và đóng như bình thường. Client không đọc thì timer ngắt sau slow_ms
+ */
+void close_client_after_drain(ClientConnection *client) {
+    if (server_options.io_mode == IO_MODE_URING) {
+        __atomic_store_n(&client->outq.close_ms, monotonic_ms(), __ATOMIC_RELEASE);
+        timer_arm_earlier(&client->timer, (uint64_t)server_options.slow_ms);
+        uring_close_after_drain(client->socket_fd);
+        return;
+    }
+    
+    OutQueue *queue = &client->outq;
+    
+    mutex_lock(&queue->lock);
+    int socket_fd = client->socket_fd;
+    
+    if (client->in_use && socket_fd >= 0 && queue->close_ms == 0) {
+        __atomic_store_n(&queue->close_ms, monotonic_ms(), __ATOMIC_RELEASE);
+        timer_arm_earlier(&client->timer, (uint64_t)server_options.slow_ms);
+        
+        // Không chờ batch của caller: frame còn trong batch vẫn được gửi trước khi đóng
+        if (queue->head == NULL && !queue->flushing) {
+            shutdown(socket_fd, SHUT_RDWR);
+        } else {
+            start_client_flush(client);
+        }
+    }
+    
+    mutex_unlock(&queue->lock);
+}
+
+/**
+ * Đưa frame vào hàng đợi gửi của connection có socket_fd (hàng đợi lấy 1 reference)
+ * - Mode epoll: reactor sở hữu flush, thread khác chỉ bật EPOLLOUT để đánh thức nó
+ * - Mode thread: writer thread của connection gửi, sender chỉ đánh thức nó
+ * - Trong send batch: chỉ xếp hàng, end_send_batch() flush
+ * Return: 0 nếu đã xếp hàng, -1 nếu connection không còn hoặc hàng đợi đầy
+ */
+int enqueue_client_frame(int socket_fd, SharedFrame *frame) {
+    ClientConnection *client = find_client_by_fd(socket_fd);
+    if (client == NULL) return -1;
+    
+    size_t total = frame->length;
+    OutChunk *chunk = malloc(sizeof(OutChunk));
+    if (chunk == NULL) return -1;
+    
+    chunk->next = NULL;
+    chunk->frame = frame;
+    chunk->offset = 0;
+    chunk->queued_ms = monotonic_ms();
+    
+    OutQueue *queue = &client->outq;
+    
+    mutex_lock(&queue->lock);
+    
+    // Slot có thể đã đóng/tái sử dụng sau khi tra fd_table
+    if (!client->in_use || client->socket_fd != socket_fd) {
+        mutex_unlock(&queue->lock);
+        free(chunk);
+        return -1;
+    }
+    
+    if (queue->bytes + total > OUTQ_MAX_BYTES) {
+        printf("[BACKPRESSURE] Socket %d (%s): output queue full, dropping %zu bytes\n",
+               socket_fd, client->username, total);
+        mutex_unlock(&queue->lock);
+        free(chunk);
+        return -1;
+    }
+    
+    // Connection đang đóng sau khi gửi nốt hàng đợi: không nhận frame mới
+    if (queue->close_ms != 0) {
+        mutex_unlock(&queue->lock);
+        free(chunk);
+        return -1;
+    }
+    
+    if (queue->tail == NULL) {
+        queue->head = chunk;
+    } else {
+        queue->tail->next = chunk;
+    }
+    queue->tail = chunk;
+    shared_frame_ref(frame);
+    outq_account(client, (long)total, queue->head->queued_ms);
+    
+    // Đang trong batch: hoãn flush tới end_send_batch() để gộp frame, trừ khi
+    // frame cũ nhất đã chờ quá SEND_BATCH_DEADLINE_MS
+    if (chunk->queued_ms - queue->head->queued_ms < SEND_BATCH_DEADLINE_MS &&
+        send_batch_defer(socket_fd)) {
+        mutex_unlock(&queue->lock);
+        return 0;
+    }
+    
+    int result = 0;
+    
+    if (start_client_flush(client) < 0 && queue->head == NULL) {
+        result = -1;
+    }
+    
+    mutex_unlock(&queue->lock);
+    
+    return result;
+}
+
+/**
+ * Traffic tạm thời: bỏ được khi client chậm mà không mất dữ liệu
+ */
+static bool is_ephemeral_message(MessageType type) {
+    return type == MSG_USER_ONLINE || type == MSG_USER_OFFLINE ||
+           type == MSG_USER_TYPING || type == MSG_PRIVATE_CHAT_START ||
+           type == MSG_PRIVATE_CHAT_END;
+}
+
+/**
+ * Client chậm khi bytes chờ gửi >= slow_bytes hoặc frame cũ nhất đã chờ >= slow_ms
+ */
+static bool outq_lagging(OutQueue *queue, size_t *bytes, uint64_t *age) {
+    *bytes = __atomic_load_n(&queue->bytes, __ATOMIC_RELAXED);
+    uint64_t oldest = __atomic_load_n(&queue->oldest_ms, __ATOMIC_RELAXED);
+    uint64_t now = monotonic_ms();
+    *age = (oldest != 0 && now > oldest) ? now - oldest : 0;
+    
+    return *bytes >= server_options.slow_bytes || *age >= (uint64_t)server_options.slow_ms;
+}
+
+/**
+ * Thread sở hữu gọi sau khi gửi được dữ liệu của client đang chậm (không giữ lock nào):
+ * xuống dưới ngưỡng thì hết chậm, message đã chuyển vào mailbox trong lúc chậm được
+ * gửi lại ngay vì mailbox chỉ được đọc khi đăng nhập
+ */
+void check_slow_consumer(ClientConnection *client, int socket_fd) {
+    OutQueue *queue = &client->outq;
+    size_t bytes;
+    uint64_t age;
+    
+    // Gửi lại có thể làm client chậm rồi hết chậm lần nữa (thread sở hữu tự gửi)
+    while (__atomic_load_n(&queue->slow, __ATOMIC_ACQUIRE)) {
+        // Cùng outq.lock với nhánh divert: message chuyển offline trước lúc hết chậm
+        // đã nằm trong hàng đợi offline và được tính vào diverted
+        mutex_lock(&queue->lock);
+        bool recovered = queue->slow && !outq_lagging(queue, &bytes, &age);
+        uint32_t diverted = 0;
+        uint32_t dropped = 0;
+        if (recovered) {
+            __atomic_store_n(&queue->slow, false, __ATOMIC_RELEASE);
+            diverted = __atomic_exchange_n(&queue->diverted, 0, __ATOMIC_RELAXED);
+            dropped = __atomic_exchange_n(&queue->dropped, 0, __ATOMIC_RELAXED);
+        }
+        mutex_unlock(&queue->lock);
+        
+        if (!recovered) return;
+        
+        printf("[SLOW] Socket %d (%s) caught up: %u dropped, %u diverted to offline\n",
+               socket_fd, client->username, dropped, diverted);
+        
+        if (diverted == 0 || client->username[0] == '\0') return;
+        send_offline_messages(socket_fd, client->username);
+        
+        // Frame gửi lại không chờ batch của caller đóng: vòng sau cần thấy hàng đợi thật
+        flush_socket(socket_fd);
+    }
+}
+
+/**
+ * Áp dụng chính sách slow consumer trước khi xếp message vào hàng đợi
+ * Client hết chậm do thread sở hữu phát hiện khi gửi được (check_slow_consumer)
+ * Return: true nếu message đã được xử lý (bỏ/chuyển offline), không gửi nữa
+ */
+static bool apply_slow_consumer_policy(int socket_fd, const PackedMessage *msg) {
+    ClientConnection *client = find_client_by_fd(socket_fd);
+    if (client == NULL) return false;
+    
+    OutQueue *queue = &client->outq;
+    size_t bytes;
+    uint64_t age;
+    
+    if (!outq_lagging(queue, &bytes, &age)) {
+        return false;
+    }
+    
+    if (!__atomic_exchange_n(&queue->slow, true, __ATOMIC_ACQ_REL)) {
+        printf("[SLOW] Socket %d (%s): %zu bytes queued, oldest frame waiting %llu ms\n",
+               socket_fd, client->username, bytes, (unsigned long long)age);
+        
+        if (server_options.slow_policy == SLOW_POLICY_DISCONNECT) {
+            // Reader/reactor sở hữu thấy EOF và đóng connection như bình thường
+            mutex_lock(&queue->lock);
+            if (client->in_use && client->socket_fd == socket_fd && !upgrade_sends_blocked()) {
+                printf("[SLOW] Disconnecting slow consumer on socket %d\n", socket_fd);
+                shutdown(socket_fd, SHUT_RDWR);
+            }
+            mutex_unlock(&queue->lock);
         }
+    }
+    
+    if (is_ephemeral_message(msg->type)) {
+        __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    
+    if ((msg->type == MSG_PRIVATE_MESSAGE || msg->type == MSG_GROUP_MESSAGE) &&
+        server_options.slow_policy >= SLOW_POLICY_DIVERT && client->username[0] != '\0') {
+        // Group message có to = tên nhóm, offline store cần username người nhận
+        PackedMessage diverted = *msg;
+        diverted.to = client->username;
+        
+        // Thread sở hữu có thể vừa thấy client hết chậm: khi đó gửi như bình thường
+        mutex_lock(&queue->lock);
+        bool divert = __atomic_load_n(&queue->slow, __ATOMIC_ACQUIRE);
+        if (divert) {
+            save_offline_message(&diverted);
+            __atomic_add_fetch(&queue->diverted, 1, __ATOMIC_RELAXED);
+        }
+        mutex_unlock(&queue->lock);
         
-        total_sent += bytes_sent;
+        return divert;
+    }
+    
+    return server_options.slow_policy == SLOW_POLICY_DISCONNECT;
+}
+
+/**
+ * Version protocol đã thương lượng với connection có socket_fd
+ * *compress: client nhận body nén
+ */
+static int client_protocol(int socket_fd, bool *compress) {
+    ClientConnection *client = find_client_by_fd(socket_fd);
+    *compress = false;
+    if (client == NULL) return PROTOCOL_V1;
+    
+    *compress = __atomic_load_n(&client->compress, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&client->protocol, __ATOMIC_ACQUIRE) == PROTOCOL_V2 ?
+           PROTOCOL_V2 : PROTOCOL_V1;
+}
+
+/**
+ * Nén body cho client đã thương lượng nén
+ * Return: body gửi đi (packed hoặc body gốc nếu không đáng nén)
+ */
+static const char *compress_for_client(const char *body, size_t *length, char *packed) {
+    int packed_len = compress_body(body, *length, (size_t)server_options.compress_min,
+                                   packed, BUFFER_SIZE);
+    if (packed_len <= 0) return body;
+    
+    *length = (size_t)packed_len;
+    return packed;
+}
+
+/**
+ * Bản encode (version, nén) của frame cho receiver, encode lần đầu rồi nối vào chuỗi
+ * alt của frame cho các receiver sau. Frame gốc không bao giờ là bản nén
+ * Return: frame trong chuỗi (frame gốc giữ reference), NULL nếu lỗi
+ */
+static SharedFrame *shared_frame_variant(SharedFrame *frame, const PackedMessage *msg,
+                                         int version, bool compressed) {
+    SharedFrame **link = &frame->alt;
+    SharedFrame *variant;
+    
+    while ((variant = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+        if (variant->version == version && variant->compressed == compressed) return variant;
+        link = &variant->alt;
+    }
+    
+    // Cùng version: nén lại đúng bytes của frame gốc, không encode lại
+    char buffer[BUFFER_SIZE];
+    const char *body = frame->data + FRAME_HEADER_SIZE;
+    size_t length = frame->length - FRAME_HEADER_SIZE;
+    
+    if (version != frame->version) {
+        int len = encode_packed_message(msg, version, buffer, sizeof(buffer));
+        if (len < 0) {
+            fprintf(stderr, "[ERROR] Failed to serialize message\n");
+            return NULL;
+        }
+        body = buffer;
+        length = (size_t)len;
+    }
+    
+    char packed[BUFFER_SIZE];
+    if (compressed) {
+        body = compress_for_client(body, &length, packed);
+    }
+    
+    SharedFrame *encoded = shared_frame_create(body, length, true);
+    if (encoded == NULL) return NULL;
+    encoded->version = version;
+    encoded->compressed = compressed;
+    
+    // Nối vào cuối chuỗi; thread khác nối trước đúng bản này thì dùng bản của nó
+    SharedFrame *expected = NULL;
+    while (!__atomic_compare_exchange_n(link, &expected, encoded, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (expected->version == version && expected->compressed == compressed) {
+            shared_frame_release(encoded);
+            return expected;
+        }
+        link = &expected->alt;
+        expected = NULL;
     }
     
-    return total_sent;
+    return encoded;
+}
+
+/**
+ * Gửi frame đã encode sẵn của msg (broadcast/group fan-out, relay nguyên bytes)
+ * msg dùng cho chính sách slow consumer (bỏ/chuyển offline) và để encode lại
+ * khi receiver dùng version khác frame
+ */
+int send_message_shared(int socket_fd, const PackedMessage *msg, SharedFrame *frame) {
+    if (msg == NULL || frame == NULL) return -1;
+    
+    if (apply_slow_consumer_policy(socket_fd, msg)) {
+        return 0;
+    }
+    
+    bool compress;
+    int version = client_protocol(socket_fd, &compress);
+    
+    // Frame dưới ngưỡng nén: bản gốc dùng được cho cả receiver nhận body nén
+    if (compress && frame->length - FRAME_HEADER_SIZE < (size_t)server_options.compress_min) {
+        compress = false;
+    }
+    
+    if (version != frame->version || compress) {
+        frame = shared_frame_variant(frame, msg, version, compress);
+        if (frame == NULL) return -1;
+    }
+    
+    return send_shared_frame(socket_fd, frame);
 }
 
 /**
@@ -250,35 +1225,90 @@ int send_message(int socket_fd, const char *message, size_t length) {
 int send_message_struct(int socket_fd, const Message *msg) {
     if (msg == NULL) return -1;
     
+    PackedMessage ref = message_ref(msg);
+    return send_packed_message(socket_fd, &ref);
+}
+
+/**
+ * Gửi PackedMessage đã serialize theo version của connection
+ */
+int send_packed_message(int socket_fd, const PackedMessage *msg) {
+    if (msg == NULL) return -1;
+    
+    if (apply_slow_consumer_policy(socket_fd, msg)) {
+        return 0;
+    }
+    
+    bool compress;
+    int version = client_protocol(socket_fd, &compress);
     char buffer[BUFFER_SIZE];
-    int len = serialize_message(msg, buffer, sizeof(buffer));
+    int len = encode_packed_message(msg, version, buffer, sizeof(buffer));
     
     if (len < 0) {
         fprintf(stderr, "[ERROR] Failed to serialize message\n");
         return -1;
     }
     
+    if (compress) {
+        char packed[BUFFER_SIZE];
+        size_t length = (size_t)len;
+        const char *body = compress_for_client(buffer, &length, packed);
+        return send_message(socket_fd, body, length);
+    }
+    
     return send_message(socket_fd, buffer, len);
 }
 
+static Timer compress_stats_timer;
+
+/**
+ * Log counter nén: tỉ lệ bytes sau/trước nén và thời gian CPU trung bình mỗi frame
+ */
+void log_compress_stats(void) {
+    CompressStats stats;
+    compress_stats_read(&stats);
+    
+    uint64_t attempted = stats.frames + stats.incompressible;
+    printf("[COMPRESS] Sent: %llu compressed, %llu incompressible, %llu below threshold, "
+           "%llu -> %llu bytes (%.1f%%), %.2f us/frame\n",
+           (unsigned long long)stats.frames, (unsigned long long)stats.incompressible,
+           (unsigned long long)stats.skipped, (unsigned long long)stats.bytes_in,
+           (unsigned long long)stats.bytes_out,
+           stats.bytes_in > 0 ? 100.0 * (double)stats.bytes_out / (double)stats.bytes_in : 100.0,
+           attempted > 0 ? (double)stats.compress_ns / 1000.0 / (double)attempted : 0.0);
+    printf("[COMPRESS] Received: %llu compressed, %llu -> %llu bytes, %.2f us/frame, %llu invalid\n",
+           (unsigned long long)stats.inflated, (unsigned long long)stats.inflated_in,
+           (unsigned long long)stats.inflated_out,
+           stats.inflated > 0 ? (double)stats.inflate_ns / 1000.0 / (double)stats.inflated : 0.0,
+           (unsigned long long)stats.errors);
+}
+
+static void compress_stats_expired(Timer *timer) {
+    log_compress_stats();
+    timer_arm(timer, (uint64_t)server_options.compress_stats * 1000);
+}
+
+/**
+ * Log counter nén định kỳ theo --compress-stats (gọi sau start_timer_wheel)
+ */
+void start_compress_stats(void) {
+    if (server_options.compress_min <= 0 || server_options.compress_stats <= 0) return;
+    
+    compress_stats_timer.callback = compress_stats_expired;
+    timer_arm(&compress_stats_timer, (uint64_t)server_options.compress_stats * 1000);
+}
+
 // ===========================
 // 3. ACCOUNT MANAGEMENT
 // ===========================
 
 /**
- * Load users từ file
+ * Import users từ file format cũ (chỉ khi chuyển sang state WAL lần đầu)
  * Format: username|password|last_seen
  */
 int load_users_from_file(const char *filename) {
     FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
-        // File chưa tồn tại, tạo mới
-        fp = fopen(filename, "w");
-        if (fp != NULL) {
-            fclose(fp);
-        }
-        return 0;
-    }
+    if (fp == NULL) return 0;
     
     mutex_lock(&server_state.users_mutex);
     
@@ -289,19 +1319,18 @@ int load_users_from_file(const char *filename) {
            server_state.user_count < MAX_CLIENTS) {
         User *user = &server_state.users[server_state.user_count];
         
-        // Parse line
-        char *username = strtok(line, "|");
-        char *password = strtok(NULL, "|");
-        char *last_seen_str = strtok(NULL, "|\n");
+        // Parse line: username|password|last_seen
+        FieldView fields[3];
+        int field_count = split_fields(line, strlen(line), SCAN_PIPE, fields, 3);
         
-        if (username != NULL && password != NULL) {
-            strncpy(user->username, username, MAX_USERNAME_LEN - 1);
-            strncpy(user->password, password, MAX_PASSWORD_LEN - 1);
+        if (field_count >= 2 && fields[0].length > 0 && fields[1].length > 0) {
+            copy_field(user->username, MAX_USERNAME_LEN, fields[0]);
+            copy_field(user->password, MAX_PASSWORD_LEN, fields[1]);
             user->is_online = 0;
             user->socket_fd = -1;
             
-            if (last_seen_str != NULL) {
-                user->last_seen = (time_t)atoll(last_seen_str);
+            if (field_count == 3 && fields[2].length > 0) {
+                user->last_seen = (time_t)atoll(fields[2].data);
             } else {
                 user->last_seen = time(NULL);
             }
@@ -317,39 +1346,10 @@ int load_users_from_file(const char *filename) {
     return server_state.user_count;
 }
 
-/**
- * Save user mới vào file
- */
-int save_user_to_file(const char *filename, const User *user) {
-    if (user == NULL) return -1;
-    
-    mutex_lock(&server_state.file_mutex);
-    
-    FILE *fp = fopen(filename, "a");
-    if (fp == NULL) {
-        perror("[ERROR] Failed to open users file");
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("[ERROR] Current working directory: %s\n", cwd);
-        }
-        mutex_unlock(&server_state.file_mutex);
-        return -1;
-    }
-    
-    fprintf(fp, "%s|%s|%ld\n", user->username, user->password, user->last_seen);
-    fclose(fp);
-    
-    printf("[FILE] Saved user '%s' to %s\n", user->username, filename);
-    
-    mutex_unlock(&server_state.file_mutex);
-    
-    return 0;
-}
-
 /**
  * Xử lý đăng ký user mới
  */
-int handle_register(ClientConnection *client, const Message *msg) {
+int handle_register(ClientConnection *client, const PackedMessage *msg) {
     if (client == NULL || msg == NULL) return -1;
     
     Message response;
@@ -417,14 +1417,16 @@ int handle_register(ClientConnection *client, const Message *msg) {
     server_state.users[server_state.user_count] = new_user;
     server_state.user_count++;
     
-    mutex_unlock(&server_state.users_mutex);
+    // Ghi vào WAL trong lúc giữ lock: thứ tự record = thứ tự đăng ký
+    uint64_t lsn = wal_append(WAL_USER, "%s|%s|%ld", new_user.username, new_user.password,
+                              (long)new_user.last_seen);
     
-    // Lưu vào file
-    int save_result = save_user_to_file("users.txt", &new_user);
+    mutex_unlock(&server_state.users_mutex);
     
-    if (save_result < 0) {
-        printf("[ERROR] Failed to save user '%s' to file!\n", username);
+    if (lsn == 0) {
+        printf("[ERROR] Failed to save user '%s' to WAL!\n", username);
     }
+    wal_commit(lsn);
     
     // Gửi response thành công
     create_response_message(&response, MSG_SUCCESS, "SERVER", username, 
@@ -443,7 +1445,7 @@ int handle_register(ClientConnection *client, const Message *msg) {
 /**
  * Xử lý đăng nhập
  */
-int handle_login(ClientConnection *client, const Message *msg) {
+int handle_login(ClientConnection *client, const PackedMessage *msg) {
     if (client == NULL || msg == NULL) return -1;
     
     Message response;
@@ -516,8 +1518,9 @@ int handle_login(ClientConnection *client, const Message *msg) {
         // Tìm và cleanup client connection cũ
         mutex_lock(&server_state.clients_mutex);
         for (int i = 0; i < server_state.client_count; i++) {
-            if (server_state.clients[i].socket_fd == old_socket && 
-                strcmp(server_state.clients[i].username, username) == 0) {
+            ClientConnection *old_client = client_slot(i);
+            if (old_client->socket_fd == old_socket && 
+                strcmp(old_client->username, username) == 0) {
                 
                 // Gửi thông báo bị kick ra
                 Message kick_msg;
@@ -525,11 +1528,11 @@ int handle_login(ClientConnection *client, const Message *msg) {
                                        "You have been logged out (new login detected)");
                 send_message_struct(old_socket, &kick_msg);
                 
-                // Close socket cũ
-                close(old_socket);
-                server_state.clients[i].socket_fd = -1;
-                server_state.clients[i].is_authenticated = false;
-                memset(server_state.clients[i].username, 0, MAX_USERNAME_LEN);
+                // Shutdown socket cũ sau khi gửi xong thông báo, thread/reactor sở hữu
+                // sẽ tự close và trả slot
+                close_client_after_drain(old_client);
+                old_client->is_authenticated = false;
+                memset(old_client->username, 0, MAX_USERNAME_LEN);
                 
                 printf("[LOGIN] Closed old session for '%s'\n", username);
                 break;
@@ -576,7 +1579,8 @@ int handle_login(ClientConnection *client, const Message *msg) {
     // Broadcast user online status
     Message online_msg;
     create_response_message(&online_msg, MSG_USER_ONLINE, "SERVER", "", username);
-    broadcast_message(&online_msg, username);
+    PackedMessage packed = message_ref(&online_msg);
+    broadcast_message(&packed, username);
     
     return 0;
 }
@@ -593,15 +1597,44 @@ int handle_logout(ClientConnection *client) {
     Message offline_msg;
     create_response_message(&offline_msg, MSG_USER_OFFLINE, "SERVER", "", 
                            client->username);
-    broadcast_message(&offline_msg, client->username);
+    PackedMessage packed = message_ref(&offline_msg);
+    broadcast_message(&packed, client->username);
     
     // Remove từ online list
     remove_online_user(client->username);
     
-    char log_msg[256];
-    snprintf(log_msg, sizeof(log_msg), "User logged out: %s", client->username);
-    log_server_event("LOGOUT", log_msg);
+    char log_msg[256];
+    snprintf(log_msg, sizeof(log_msg), "User logged out: %s", client->username);
+    log_server_event("LOGOUT", log_msg);
+    
+    return 0;
+}
+
+/**
+ * Xử lý MSG_HELLO: chọn version cao nhất cả 2 bên hỗ trợ
+ * Reply đi bằng version cũ, các frame sau dùng version mới (client nhận cả 2)
+ */
+int handle_hello(ClientConnection *client, const PackedMessage *msg) {
+    int version = atoi(msg->content);
+    if (version < PROTOCOL_V1) version = PROTOCOL_V1;
+    if (version > server_options.max_protocol) version = server_options.max_protocol;
+    
+    // Nén chỉ khi client đề nghị và server bật (--compress-min > 0)
+    bool compress = server_options.compress_min > 0 &&
+                    hello_has_capability(msg->content, COMPRESS_CAPABILITY);
+    
+    char content[32];
+    snprintf(content, sizeof(content), "%d%s", version, compress ? "," COMPRESS_CAPABILITY : "");
+    
+    Message response;
+    create_response_message(&response, MSG_HELLO, "SERVER", client->username, content);
+    send_message_struct(client->socket_fd, &response);
+    
+    __atomic_store_n(&client->protocol, (uint8_t)version, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->compress, compress, __ATOMIC_RELEASE);
     
+    printf("[HELLO] Socket %d uses protocol v%d%s\n", client->socket_fd, version,
+           compress ? " + " COMPRESS_CAPABILITY : "");
     return 0;
 }
 
@@ -615,32 +1648,375 @@ int handle_logout(ClientConnection *client) {
 void cleanup_client(ClientConnection *client) {
     if (client == NULL) return;
     
+    // Timer và worker không còn chạy gì trên client này
+    stop_client_timer(client);
+    detach_client_work(client);
+    log_client_rtt(client);
+    
     if (client->is_authenticated) {
         handle_logout(client);
     }
     
     if (client->socket_fd > 0) {
-        close(client->socket_fd);
+        // Xóa khỏi fd_table TRƯỚC khi close để fd tái sử dụng không trỏ nhầm slot
+        mutex_lock(&server_state.fd_mutex);
+        if (client->socket_fd < server_state.fd_table_size &&
+            server_state.fd_table[client->socket_fd] == client) {
+            server_state.fd_table[client->socket_fd] = NULL;
+        }
+        mutex_unlock(&server_state.fd_mutex);
+        
+        // Đánh dấu đóng dưới outq.lock: sender không còn append/flush vào fd này
+        mutex_lock(&client->outq.lock);
+        int socket_fd = client->socket_fd;
+        shutdown(socket_fd, SHUT_RDWR);  // Writer thoát khỏi send()/poll()
+        while (client->outq.flushing) {
+            pthread_cond_wait(&client->outq.idle, &client->outq.lock);
+        }
         client->socket_fd = -1;
+        client->outq.want_write = false;
+        outq_clear(client);
+        pthread_cond_signal(&client->outq.ready);
+        mutex_unlock(&client->outq.lock);
+        
+        // Writer không còn poll() fd trước khi fd được close và tái sử dụng
+        if (client->has_writer) {
+            pthread_join(client->writer_id, NULL);
+            client->has_writer = false;
+        }
+        
+        close(socket_fd);
     }
     
     client->is_authenticated = false;
     memset(client->username, 0, MAX_USERNAME_LEN);
 }
 
+// Handler của 1 type: Return 0 nếu tiếp tục, -1 nếu connection cần đóng
+typedef int (*MessageHandler)(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame);
+
+typedef struct {
+    MessageHandler handler;
+    bool requires_auth;         // Bỏ qua request khi client chưa đăng nhập
+} DispatchEntry;
+
+static int dispatch_register(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_register(client, msg);
+    return 0;
+}
+
+static int dispatch_login(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_login(client, msg);
+    return 0;
+}
+
+static int dispatch_hello(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_hello(client, msg);
+    return 0;
+}
+
+static int dispatch_logout(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)msg;
+    (void)frame;
+    handle_logout(client);
+    return -1;  // Đóng connection
+}
+
+/**
+ * Tin nhắn riêng khi chưa đăng nhập được trả lỗi thay vì bỏ qua
+ */
+static int dispatch_private_message(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    if (!client->is_authenticated) {
+        Message err;
+        create_response_message(&err, MSG_ERROR, "SERVER", "", 
+                              "Not authenticated");
+        send_message_struct(client->socket_fd, &err);
+        return 0;
+    }
+    
+    relay_private_message(msg, frame);
+    return 0;
+}
+
+static int dispatch_private_chat_start(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_private_chat_start(msg);
+    return 0;
+}
+
+static int dispatch_private_chat_end(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_private_chat_end(msg);
+    return 0;
+}
+
+/**
+ * msg->content = group_name, msg->extra = friend1,friend2,friend3
+ */
+static int dispatch_group_create(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    int result = create_group_with_friends(msg->content, client->username, msg->extra);
+    Message response;
+    
+    if (result == -2) {
+        // Not enough friends (less than 2)
+        create_response_message(&response, MSG_ERROR, "SERVER", 
+                              client->username, 
+                              "Need at least 2 accepted friends to create a group");
+    } else if (result == -1) {
+        // Group already exists or other error
+        create_response_message(&response, MSG_ERROR, "SERVER", 
+                              client->username, 
+                              "Cannot create group (already exists or error)");
+    } else {
+        // Success
+        create_response_message(&response, MSG_SUCCESS, "SERVER", 
+                              client->username, "Group created successfully");
+        
+        // Gửi lời mời cho các bạn bè vừa thêm vào nhóm
+        char members_copy[BUFFER_SIZE];
+        strncpy(members_copy, msg->extra, sizeof(members_copy) - 1);
+        members_copy[sizeof(members_copy) - 1] = '\0';
+        char *member = strtok(members_copy, ",");
+        while (member != NULL) {
+            while (*member == ' ') member++;
+            if (strlen(member) > 0) {
+                Message invite;
+                create_response_message(&invite, MSG_GROUP_INVITE, client->username, member, "");
+                strncpy(invite.extra, msg->content, sizeof(invite.extra) - 1);
+                
+                int member_socket = find_user_socket(member);
+                if (member_socket >= 0) {
+                    send_message_struct(member_socket, &invite);
+                } else {
+                    PackedMessage packed = message_ref(&invite);
+                    save_offline_message(&packed);
+                }
+            }
+            member = strtok(NULL, ",");
+        }
+    }
+    send_message_struct(client->socket_fd, &response);
+    return 0;
+}
+
+static int dispatch_group_invite(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_group_invite(msg);
+    return 0;
+}
+
+/**
+ * msg->extra = group_name
+ */
+static int dispatch_group_join(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_group_join(msg->extra, client->username);
+    
+    Message response;
+    create_response_message(&response, MSG_SUCCESS, "SERVER", 
+                          client->username, "Joined group");
+    send_message_struct(client->socket_fd, &response);
+    return 0;
+}
+
+static int dispatch_group_leave(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_group_leave(msg->extra, client->username);
+    
+    Message response;
+    create_response_message(&response, MSG_SUCCESS, "SERVER", 
+                          client->username, "Left group");
+    send_message_struct(client->socket_fd, &response);
+    return 0;
+}
+
+static int dispatch_group_message(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    relay_group_message(msg);
+    return 0;
+}
+
+static int dispatch_friend_request(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_friend_request(msg);
+    return 0;
+}
+
+static int dispatch_friend_accept(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_friend_accept(msg);
+    return 0;
+}
+
+static int dispatch_friend_reject(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_friend_reject(msg);
+    return 0;
+}
+
+static int dispatch_friend_remove(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_friend_remove(msg);
+    return 0;
+}
+
+static int dispatch_get_online_users(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)msg;
+    (void)frame;
+    send_online_users_list(client->socket_fd);
+    return 0;
+}
+
+static int dispatch_get_friends(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)msg;
+    (void)frame;
+    send_friends_list(client->socket_fd, client->username);
+    return 0;
+}
+
+static int dispatch_get_groups(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)msg;
+    (void)frame;
+    send_user_groups_list(client->socket_fd, client->username);
+    return 0;
+}
+
+static int dispatch_file_send(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)frame;
+    handle_file_transfer(client, msg);
+    return 0;
+}
+
+static int dispatch_file_accept(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_file_accept(msg);
+    return 0;
+}
+
+static int dispatch_file_reject(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    (void)client;
+    (void)frame;
+    handle_file_reject(msg);
+    return 0;
+}
+
+// Bảng handler tra theo type (MESSAGE_SCHEMA), type không có handler bị bỏ qua
+static const DispatchEntry dispatch_table[MESSAGE_TYPE_LIMIT] = {
+    [MSG_REGISTER]           = { dispatch_register, false },
+    [MSG_LOGIN]              = { dispatch_login, false },
+    [MSG_HELLO]              = { dispatch_hello, false },
+    [MSG_LOGOUT]             = { dispatch_logout, false },
+    [MSG_PRIVATE_MESSAGE]    = { dispatch_private_message, false },
+    [MSG_PRIVATE_CHAT_START] = { dispatch_private_chat_start, true },
+    [MSG_PRIVATE_CHAT_END]   = { dispatch_private_chat_end, true },
+    [MSG_GROUP_CREATE]       = { dispatch_group_create, true },
+    [MSG_GROUP_INVITE]       = { dispatch_group_invite, true },
+    [MSG_GROUP_JOIN]         = { dispatch_group_join, true },
+    [MSG_GROUP_LEAVE]        = { dispatch_group_leave, true },
+    [MSG_GROUP_MESSAGE]      = { dispatch_group_message, true },
+    [MSG_FRIEND_REQUEST]     = { dispatch_friend_request, true },
+    [MSG_FRIEND_ACCEPT]      = { dispatch_friend_accept, true },
+    [MSG_FRIEND_REJECT]      = { dispatch_friend_reject, true },
+    [MSG_FRIEND_REMOVE]      = { dispatch_friend_remove, true },
+    [MSG_GET_ONLINE_USERS]   = { dispatch_get_online_users, true },
+    [MSG_GET_FRIENDS]        = { dispatch_get_friends, true },
+    [MSG_GET_GROUPS]         = { dispatch_get_groups, true },
+    [MSG_FILE_SEND]          = { dispatch_file_send, true },
+    [MSG_FILE_ACCEPT]        = { dispatch_file_accept, true },
+    [MSG_FILE_REJECT]        = { dispatch_file_reject, true },
+};
+
+/**
+ * Dispatch message theo type đến handler tương ứng
+ * Dùng chung cho client_thread (mode thread) và reactor (mode epoll)
+ * frame: bytes gốc của msg (shared_frame_original) cho relay, có thể NULL
+ * Return: 0 nếu tiếp tục, -1 nếu connection cần đóng (logout)
+ */
+int dispatch_message(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame) {
+    const DispatchEntry *entry = NULL;
+    if (msg->type >= 0 && (size_t)msg->type < MESSAGE_TYPE_LIMIT) {
+        entry = &dispatch_table[msg->type];
+    }
+    
+    if (entry == NULL || entry->handler == NULL) {
+        fprintf(stderr, "[WARNING] Unknown message type: %d\n", msg->type);
+        return 0;
+    }
+    
+    if (entry->requires_auth && !client->is_authenticated) {
+        return 0;
+    }
+    
+    return entry->handler(client, msg, frame);
+}
+
 /**
  * Thread xử lý mỗi client
  */
 void *client_thread(void *arg) {
     ClientConnection *client = (ClientConnection *)arg;
-    char buffer[BUFFER_SIZE];
-    Message msg;
+    const char *body;
+    char inflated[BUFFER_SIZE];
+    MessageView view;
+    
+    // 1 lần recv() có thể chứa nhiều frame, reader giữ phần dư cho lần sau
+    FrameReader *reader = malloc(sizeof(FrameReader));
+    if (reader == NULL) {
+        cleanup_client(client);
+        release_client_slot(client);
+        return 0;
+    }
+    frame_reader_init(reader, client->socket_fd);
+    reader->cancel = upgrade_cancel_flag();
+    
+    // Connection nhận từ process cũ (hot upgrade): frame dở nằm sẵn trong rbuf
+    if (client->rbuf != NULL) {
+        memcpy(reader->data, client->rbuf, client->rbuf_len);
+        reader->end = client->rbuf_len;
+        free(client->rbuf);
+        client->rbuf = NULL;
+        client->rbuf_len = 0;
+    }
+    client->reader = reader;
+    
+    // Chỉ writer gửi trên socket này (xem client_writer_thread)
+    if (start_client_writer(client) < 0) {
+        cleanup_client(client);
+        client->reader = NULL;
+        free(reader);
+        release_client_slot(client);
+        return 0;
+    }
     
     printf("[THREAD] Started thread for client socket %d\n", client->socket_fd);
     
     while (1) {
-        // Nhận message từ client
-        int bytes_received = recv_message(client->socket_fd, buffer, sizeof(buffer));
+        // Hot upgrade: dừng ở ranh giới frame, phần dư của reader được chuyển đi
+        if (upgrade_pending()) {
+            upgrade_park(client);
+            wake_client_writer(client);  // Upgrade bị hủy: gửi phần đã giữ lại
+            continue;
+        }
+        
+        // Nhận message từ client (body nằm tại chỗ trong buffer của reader)
+        int bytes_received = frame_reader_next_view(reader, &body, BUFFER_SIZE - 1);
+        
+        if (bytes_received < 0 && errno == EINTR && upgrade_pending()) {
+            continue;
+        }
         
         if (bytes_received <= 0) {
             // Client disconnected hoặc error
@@ -652,205 +2028,39 @@ void *client_thread(void *arg) {
             break;
         }
         
-        // Parse message
-        if (parse_message(buffer, &msg) < 0) {
-            fprintf(stderr, "[ERROR] Failed to parse message: %s\n", buffer);
+        // Parse message (body nén được giải nén vào inflated)
+        if (parse_frame_view(body, (size_t)bytes_received, inflated, BUFFER_SIZE - 1, &view) < 0) {
+            fprintf(stderr, "[ERROR] Failed to parse message (%d bytes)\n", bytes_received);
             continue;
         }
         
         printf("[THREAD] Received message type %d from socket %d\n", 
-               msg.type, client->socket_fd);
+               view.type, client->socket_fd);
         
-        // Dispatch message theo type
-        switch (msg.type) {
-            case MSG_REGISTER:
-                handle_register(client, &msg);
-                break;
-                
-            case MSG_LOGIN:
-                handle_login(client, &msg);
-                break;
-                
-            case MSG_LOGOUT:
-                handle_logout(client);
-                goto cleanup;  // Exit thread
-                
-            case MSG_PRIVATE_MESSAGE:
-                if (!client->is_authenticated) {
-                    Message err;
-                    create_response_message(&err, MSG_ERROR, "SERVER", "", 
-                                          "Not authenticated");
-                    send_message_struct(client->socket_fd, &err);
-                    break;
-                }
-                relay_private_message(&msg);
-                break;
-                
-            case MSG_PRIVATE_CHAT_START:
-                if (!client->is_authenticated) break;
-                handle_private_chat_start(&msg);
-                break;
-                
-            case MSG_PRIVATE_CHAT_END:
-                if (!client->is_authenticated) break;
-                handle_private_chat_end(&msg);
-                break;
-                
-            case MSG_GROUP_CREATE:
-                if (!client->is_authenticated) break;
-                {
-                    // msg.content = group_name
-                    // msg.extra = friend1,friend2,friend3
-                    int result = create_group_with_friends(msg.content, client->username, msg.extra);
-                    Message response;
-                    
-                    if (result == -2) {
-                        // Not enough friends (less than 2)
-                        create_response_message(&response, MSG_ERROR, "SERVER", 
-                                              client->username, 
-                                              "Need at least 2 accepted friends to create a group");
-                    } else if (result == -1) {
-                        // Group already exists or other error
-                        create_response_message(&response, MSG_ERROR, "SERVER", 
-                                              client->username, 
-                                              "Cannot create group (already exists or error)");
-                    } else {
-                        // Success
-                        create_response_message(&response, MSG_SUCCESS, "SERVER", 
-                                              client->username, "Group created successfully");
-                        
-                        // Gửi lời mời cho các bạn bè vừa thêm vào nhóm
-                        char members_copy[BUFFER_SIZE];
-                        strncpy(members_copy, msg.extra, sizeof(members_copy) - 1);
-                        char *member = strtok(members_copy, ",");
-                        while (member != NULL) {
-                            while (*member == ' ') member++;
-                            if (strlen(member) > 0) {
-                                Message invite;
-                                create_response_message(&invite, MSG_GROUP_INVITE, client->username, member, "");
-                                strncpy(invite.extra, msg.content, sizeof(invite.extra) - 1);
-                                
-                                int member_socket = find_user_socket(member);
-                                if (member_socket >= 0) {
-                                    send_message_struct(member_socket, &invite);
-                                } else {
-                                    save_offline_message(&invite);
-                                }
-                            }
-                            member = strtok(NULL, ",");
-                        }
-                    }
-                    send_message_struct(client->socket_fd, &response);
-                }
-                break;
-                break;
-                
-            case MSG_GROUP_INVITE:
-                if (!client->is_authenticated) break;
-                handle_group_invite(&msg);
-                break;
-                
-            case MSG_GROUP_JOIN:
-                if (!client->is_authenticated) break;
-                // msg.extra = group_name
-                handle_group_join(msg.extra, client->username);
-                {
-                    Message response;
-                    create_response_message(&response, MSG_SUCCESS, "SERVER", 
-                                          client->username, "Joined group");
-                    send_message_struct(client->socket_fd, &response);
-                }
-                break;
-                
-            case MSG_GROUP_LEAVE:
-                if (!client->is_authenticated) break;
-                handle_group_leave(msg.extra, client->username);
-                {
-                    Message response;
-                    create_response_message(&response, MSG_SUCCESS, "SERVER", 
-                                          client->username, "Left group");
-                    send_message_struct(client->socket_fd, &response);
-                }
-                break;
-                
-            case MSG_GROUP_MESSAGE:
-                if (!client->is_authenticated) break;
-                relay_group_message(&msg);
-                break;
-                
-            case MSG_FRIEND_REQUEST:
-                if (!client->is_authenticated) break;
-                handle_friend_request(&msg);
-                break;
-                
-            case MSG_FRIEND_ACCEPT:
-                if (!client->is_authenticated) break;
-                handle_friend_accept(&msg);
-                break;
-                
-            case MSG_FRIEND_REJECT:
-                if (!client->is_authenticated) break;
-                handle_friend_reject(&msg);
-                break;
-                
-            case MSG_FRIEND_REMOVE:
-                if (!client->is_authenticated) break;
-                handle_friend_remove(&msg);
-                break;
-                
-            case MSG_GET_ONLINE_USERS:
-                if (!client->is_authenticated) break;
-                send_online_users_list(client->socket_fd);
-                break;
-                
-            case MSG_GET_FRIENDS:
-                if (!client->is_authenticated) break;
-                send_friends_list(client->socket_fd, client->username);
-                break;
-                
-            case MSG_GET_GROUPS:
-                if (!client->is_authenticated) break;
-                send_user_groups_list(client->socket_fd, client->username);
-                break;
-                
-            case MSG_FILE_SEND:
-                if (!client->is_authenticated) break;
-                handle_file_transfer(client, &msg);
-                break;
-                
-            case MSG_FILE_ACCEPT:
-                if (!client->is_authenticated) break;
-                handle_file_accept(&msg);
-                break;
-                
-            case MSG_FILE_REJECT:
-                if (!client->is_authenticated) break;
-                handle_file_reject(&msg);
-                break;
-                
-            default:
-                fprintf(stderr, "[WARNING] Unknown message type: %d\n", msg.type);
-                break;
+        // PING/PONG xử lý ngay tại đây (không qua worker), không tính là request
+        if (handle_heartbeat(client, &view)) {
+            continue;
+        }
+        touch_client(client);
+        
+        // Các reply của 1 handler (vd. login) đi chung 1 sendmsg()
+        begin_send_batch();
+        int result = submit_client_request(client, &view);
+        end_send_batch();
+        
+        if (result < 0) {
+            break;  // Exit thread
         }
     }
     
-cleanup:
     // Cleanup client
     cleanup_client(client);
     
-    // Remove client from clients array
-    mutex_lock(&server_state.clients_mutex);
-    for (int i = 0; i < server_state.client_count; i++) {
-        if (&server_state.clients[i] == client) {
-            // Shift remaining clients
-            for (int j = i; j < server_state.client_count - 1; j++) {
-                server_state.clients[j] = server_state.clients[j + 1];
-            }
-            server_state.client_count--;
-            break;
-        }
-    }
-    mutex_unlock(&server_state.clients_mutex);
+    client->reader = NULL;
+    free(reader);
+    
+    // Trả slot về bảng clients (không dời các client khác)
+    release_client_slot(client);
     
     printf("[THREAD] Thread exiting for client\n");
     return 0;  // Windows thread return
@@ -874,7 +2084,21 @@ void init_server_state(void) {
     mutex_init(&server_state.clients_mutex, NULL);
     mutex_init(&server_state.users_mutex, NULL);
     mutex_init(&server_state.groups_mutex, NULL);
-    mutex_init(&server_state.file_mutex, NULL);
+    mutex_init(&server_state.fd_mutex, NULL);
+    
+    // Slab connection rỗng, mở rộng khi có client đầu tiên
+    server_state.client_capacity = 0;
+    server_state.client_free = -1;
+    
+    // fd_table đủ lớn cho mọi fd process có thể mở
+    struct rlimit limit;
+    int table_size = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur < (1 << 20)) {
+        table_size = (int)limit.rlim_cur;
+    }
+    server_state.fd_table = calloc(table_size, sizeof(ClientConnection *));
+    server_state.fd_table_size = server_state.fd_table != NULL ? table_size : 0;
     
     printf("[SERVER] Server state initialized\n");
 }
@@ -888,7 +2112,7 @@ void cleanup_server(void) {
     // Close all client connections
     mutex_lock(&server_state.clients_mutex);
     for (int i = 0; i < server_state.client_count; i++) {
-        cleanup_client(&server_state.clients[i]);
+        cleanup_client(client_slot(i));
     }
     mutex_unlock(&server_state.clients_mutex);
     
@@ -898,11 +2122,21 @@ void cleanup_server(void) {
         server_state.server_socket = -1;
     }
     
+    // Snapshot đang chạy còn lock users/groups: dừng trước khi hủy mutex
+    stop_state_store();
+    
     // Destroy mutexes
     mutex_destroy(&server_state.clients_mutex);
     mutex_destroy(&server_state.users_mutex);
     mutex_destroy(&server_state.groups_mutex);
-    mutex_destroy(&server_state.file_mutex);
+    mutex_destroy(&server_state.fd_mutex);
+    
+    if (server_options.compress_min > 0) {
+        log_compress_stats();
+    }
+    
+    // Ghi nốt offline messages đang chờ writer
+    stop_offline_writer();
     
     log_server_event("SERVER_STOP", "Server stopped");
     
@@ -918,10 +2152,146 @@ static void signal_handler(int signum) {
     exit(0);
 }
 
+/**
+ * In hướng dẫn sử dụng
+ */
+static void print_usage(const char *prog) {
+    printf("Usage: %s [port] [options]\n", prog);
+    printf("  --epoll             Dùng epoll reactor thay cho thread-per-client\n");
+    printf("  --reuseport         Epoll reactor, mỗi reactor 1 listening socket SO_REUSEPORT\n");
+    printf("                      + shard connection riêng, pin theo CPU\n");
+    printf("  --slow-policy P     Xử lý client đọc chậm: drop | divert | disconnect (mặc định: divert)\n");
+    printf("  --slow-bytes N      Ngưỡng bytes chờ gửi của client chậm (mặc định: %d)\n",
+           SLOW_CONSUMER_BYTES);
+    printf("  --slow-ms N         Ngưỡng thời gian chờ của frame cũ nhất (mặc định: %d)\n",
+           SLOW_CONSUMER_MS);
+    printf("  --io-uring          Dùng io_uring (multishot accept/recv) thay cho thread-per-client\n");
+    printf("  --io-threads N      Số reactor/ring thread (mặc định: số CPU)\n");
+    printf("  --workers N         Chạy handler trên pool N worker (mặc định: 0 = trên I/O thread)\n");
+    printf("  --worker-queue N    Số request tối đa chờ worker (mặc định: %d)\n",
+           WORKER_QUEUE_DEPTH);
+    printf("  --max-clients N     Số connection tối đa (mặc định: %d)\n",
+           MAX_CONNECTIONS_DEFAULT);
+    printf("  --idle-timeout S    Ngắt client không gửi frame nào sau S giây (mặc định: %d, 0 = tắt)\n",
+           IDLE_TIMEOUT_SEC);
+    printf("  --frame-timeout S   Ngắt client gửi dở 1 frame quá S giây (mặc định: %d)\n",
+           FRAME_TIMEOUT_SEC);
+    printf("  --upload-timeout S  Thời gian tối đa nhận file data (mặc định: %d)\n",
+           UPLOAD_TIMEOUT_SEC);
+    printf("  --login-timeout S   Ngắt client chưa đăng nhập sau S giây (mặc định: %d)\n",
+           LOGIN_TIMEOUT_SEC);
+    printf("  --ping-interval S   Gửi PING tới client đã đăng nhập mỗi S giây (mặc định: %d, 0 = tắt)\n",
+           PING_INTERVAL_SEC);
+    printf("  --ping-timeout S    Ngắt client không trả PONG sau S giây (mặc định: %d)\n",
+           PING_TIMEOUT_SEC);
+    printf("  --max-protocol N    Version protocol cao nhất cho client hỗ trợ v2 (mặc định: %d, 1 = chỉ text)\n",
+           PROTOCOL_MAX);
+    printf("  --compress-min N    Nén (deflate) body từ N bytes cho client hỗ trợ (mặc định: %d, 0 = tắt)\n",
+           COMPRESS_MIN_DEFAULT);
+    printf("  --compress-stats S  Log tỉ lệ nén và thời gian nén mỗi S giây (mặc định: 0 = khi tắt server)\n");
+    printf("  --offline-fsync     fdatasync mailbox offline sau mỗi batch ghi (mặc định: tắt)\n");
+    printf("  --wal-fsync MS      Trả lời sau khi thay đổi state đã fdatasync, gom commit trong MS ms\n");
+    printf("                      (mặc định: tắt, 0 = gom các commit đến trong lúc fdatasync)\n");
+    printf("  --snapshot-interval S  Snapshot state + cắt WAL mỗi S giây (mặc định: %d, 0 = chỉ khi WAL lớn)\n",
+           SNAPSHOT_INTERVAL_SEC);
+}
+
+/**
+ * Parse command line
+ * Return: 0 nếu hợp lệ, -1 nếu sai cú pháp
+ */
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--epoll") == 0) {
+            server_options.io_mode = IO_MODE_EPOLL;
+        } else if (strcmp(argv[i], "--reuseport") == 0) {
+            server_options.io_mode = IO_MODE_EPOLL;
+            server_options.reuseport = true;
+        } else if (strcmp(argv[i], "--slow-policy") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "drop") == 0) {
+                server_options.slow_policy = SLOW_POLICY_DROP;
+            } else if (strcmp(policy, "divert") == 0) {
+                server_options.slow_policy = SLOW_POLICY_DIVERT;
+            } else if (strcmp(policy, "disconnect") == 0) {
+                server_options.slow_policy = SLOW_POLICY_DISCONNECT;
+            } else {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--slow-bytes") == 0 && i + 1 < argc) {
+            server_options.slow_bytes = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--slow-ms") == 0 && i + 1 < argc) {
+            server_options.slow_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            server_options.io_mode = IO_MODE_URING;
+        } else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+            server_options.io_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            server_options.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--worker-queue") == 0 && i + 1 < argc) {
+            server_options.worker_queue = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            server_options.max_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            server_options.idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frame-timeout") == 0 && i + 1 < argc) {
+            server_options.frame_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--upload-timeout") == 0 && i + 1 < argc) {
+            server_options.upload_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--login-timeout") == 0 && i + 1 < argc) {
+            server_options.login_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ping-interval") == 0 && i + 1 < argc) {
+            server_options.ping_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ping-timeout") == 0 && i + 1 < argc) {
+            server_options.ping_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-protocol") == 0 && i + 1 < argc) {
+            server_options.max_protocol = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress-min") == 0 && i + 1 < argc) {
+            server_options.compress_min = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress-stats") == 0 && i + 1 < argc) {
+            server_options.compress_stats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--offline-fsync") == 0) {
+            server_options.offline_fsync = true;
+        } else if (strcmp(argv[i], "--wal-fsync") == 0 && i + 1 < argc) {
+            server_options.wal_fsync = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc) {
+            server_options.snapshot_interval = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            server_options.port = atoi(argv[i]);
+        } else {
+            return -1;
+        }
+    }
+    
+    if (server_options.io_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server_options.io_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    
+    if (server_options.workers < 0 || server_options.worker_queue <= 0 ||
+        server_options.max_clients <= 0 ||
+        server_options.max_clients > CLIENT_SLAB_CHUNK * CLIENT_SLAB_MAX_CHUNKS ||
+        server_options.idle_timeout < 0 || server_options.frame_timeout < 0 ||
+        server_options.upload_timeout < 0 || server_options.login_timeout < 0 ||
+        server_options.ping_interval < 0 || server_options.ping_timeout <= 0 ||
+        server_options.max_protocol < PROTOCOL_V1 || server_options.max_protocol > PROTOCOL_MAX ||
+        server_options.compress_min < 0 || server_options.compress_stats < 0 ||
+        server_options.wal_fsync < WAL_FSYNC_OFF || server_options.snapshot_interval < 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
 /**
  * Main function
  */
 int main(int argc, char *argv[]) {
+    if (parse_options(argc, argv) < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
     // Initialize network (Windows WSA)
     if (init_network() < 0) {
         fprintf(stderr, "Failed to initialize network\n");
@@ -934,65 +2304,128 @@ int main(int argc, char *argv[]) {
     
     // Setup signal handlers
     signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);  // Client đóng socket giữa chừng -> send() trả EPIPE
     
     // Initialize server state
     init_server_state();
     
-    // Load data từ files
-    load_users_from_file("users.txt");
-    load_groups_from_file("groups.txt");
-    load_friendships_from_file("friendships.txt");
+    // Hot upgrade: process cũ vẫn ghi WAL cho tới khi đóng băng
+    int upgrade_fd = upgrade_inherited_fd();
     
-    // Initialize server socket
-    int port = PORT;
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    // Khôi phục users, groups, friendships: snapshot + WAL
+    if (init_state_store(upgrade_fd >= 0) < 0) {
+        fprintf(stderr, "Failed to recover server state\n");
+        return 1;
+    }
+    if (init_offline_store() < 0) {
+        return 1;
     }
     
-    server_state.server_socket = init_server_socket(port);
+    // Initialize server socket (hot upgrade: nhận listening socket của process cũ)
+    int port = server_options.port;
+    
+    init_hot_upgrade(argv);
+    
+    if (upgrade_fd >= 0) {
+        server_state.server_socket = upgrade_receive_listeners(upgrade_fd);
+        // Process cũ đã đóng băng: đọc nốt phần WAL nó ghi sau lúc khôi phục
+        if (server_state.server_socket >= 0) wal_catch_up();
+    } else {
+        server_state.server_socket = init_server_socket(port);
+    }
     if (server_state.server_socket < 0) {
         fprintf(stderr, "Failed to initialize server socket\n");
         return 1;
     }
     
     printf("[SERVER] Server is running on port %d\n", port);
+    
+    // Timer wheel phải chạy trước khi connection đầu tiên arm timer
+    if (start_timer_wheel() < 0) {
+        fprintf(stderr, "Failed to start timer wheel\n");
+        return 1;
+    }
+    start_compress_stats();
+    if (upgrade_fd < 0) {
+        // Hot upgrade: đợi upgrade_resume_connections (process cũ còn có thể tiếp tục)
+        start_state_snapshots();
+    }
+    
+    // Worker pool phải chạy trước khi I/O thread nhận request
+    if (server_options.workers > 0 && start_worker_pool(server_options.workers) < 0) {
+        fprintf(stderr, "Failed to start worker pool\n");
+        return 1;
+    }
+    
+    if (server_options.io_mode == IO_MODE_EPOLL) {
+        // Reactor threads lo toàn bộ accept/recv/dispatch
+        if (start_reactors(server_state.server_socket, server_options.io_threads) < 0) {
+            fprintf(stderr, "Failed to start epoll reactors\n");
+            return 1;
+        }
+        
+        printf("[SERVER] Epoll mode with %d reactor threads%s\n", server_options.io_threads,
+               server_options.reuseport ? " (SO_REUSEPORT shards)" : "");
+        
+        if (upgrade_fd >= 0) {
+            upgrade_resume_connections(upgrade_fd);
+        }
+        
+        printf("[SERVER] Waiting for connections...\n\n");
+        
+        while (1) {
+            pause();
+            if (upgrade_requested()) run_hot_upgrade();
+        }
+    }
+    
+    if (server_options.io_mode == IO_MODE_URING) {
+        // Mỗi ring có thread riêng, completion lo accept/recv/send
+        if (start_uring_engines(server_state.server_socket, server_options.io_threads) < 0) {
+            fprintf(stderr, "Failed to start io_uring engines\n");
+            return 1;
+        }
+        
+        printf("[SERVER] io_uring mode with %d rings\n", server_options.io_threads);
+        printf("[SERVER] Waiting for connections...\n\n");
+        
+        while (1) {
+            pause();
+            if (upgrade_requested()) run_hot_upgrade();
+        }
+    }
+    
+    if (upgrade_fd >= 0) {
+        upgrade_resume_connections(upgrade_fd);
+    }
+    
     printf("[SERVER] Waiting for connections...\n\n");
     
     // Main loop - accept clients
     while (1) {
-        mutex_lock(&server_state.clients_mutex);
+        if (upgrade_requested()) run_hot_upgrade();
+        
+        ClientConnection *new_client = alloc_client_slot();
         
-        if (server_state.client_count >= MAX_CLIENTS) {
-            mutex_unlock(&server_state.clients_mutex);
+        if (new_client == NULL) {
             printf("[WARNING] Maximum clients reached, waiting...\n");
             sleep(1);
             continue;
         }
         
-        int client_index = server_state.client_count;
-        ClientConnection *new_client = &server_state.clients[client_index];
-        
-        mutex_unlock(&server_state.clients_mutex);
-        
         // Accept new client
         int client_socket = accept_client(server_state.server_socket, new_client);
         
         if (client_socket < 0) {
+            release_client_slot(new_client);
             continue;
         }
         
-        // Create thread cho client
-        mutex_lock(&server_state.clients_mutex);
-        server_state.client_count++;
-        mutex_unlock(&server_state.clients_mutex);
-        
         // Linux pthread
         if (pthread_create(&new_client->thread_id, NULL, client_thread, new_client) != 0) {
             fprintf(stderr, "Failed to create thread\n");
             cleanup_client(new_client);
-            mutex_lock(&server_state.clients_mutex);
-            server_state.client_count--;
-            mutex_unlock(&server_state.clients_mutex);
+            release_client_slot(new_client);
         } else {
             pthread_detach(new_client->thread_id);  // Auto cleanup
         }
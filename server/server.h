@@ -19,18 +19,233 @@ typedef pthread_mutex_t mutex_t;
 #define mutex_lock(m) pthread_mutex_lock(m) 
 #define mutex_unlock(m) pthread_mutex_unlock(m) 
 
+struct Reactor;
+struct UringConn;
+
+// File đang upload dở (mode epoll/io_uring nhận file data bất đồng bộ)
+typedef struct {
+    char from[MAX_USERNAME_LEN];
+    char to[MAX_USERNAME_LEN];
+    char filename[MAX_FILENAME_LEN];
+    char *data;
+    uint32_t size;
+    uint32_t received;
+} FileUpload;
+
+// Frame đã encode (có length header nếu là frame), bất biến sau khi tạo
+// Broadcast/group encode 1 lần rồi xếp cùng 1 frame vào hàng đợi của N connection
+typedef struct SharedFrame {
+    int refs;                   // Atomic, mỗi hàng đợi giữ 1 reference
+    int version;                // Protocol của body (PROTOCOL_V1/PROTOCOL_V2)
+    bool compressed;            // Encoding cho receiver đã thương lượng nén (body có thể vẫn gốc)
+    struct SharedFrame *alt;    // Chuỗi bản encode khác (version/nén), tạo khi có receiver cần (atomic)
+    size_t length;
+    char data[];
+} SharedFrame;
+
+// 1 frame (hoặc 1 khối file data) đang chờ gửi
+typedef struct OutChunk {
+    struct OutChunk *next;
+    SharedFrame *frame;
+    size_t offset;              // Số bytes đã gửi
+    uint64_t queued_ms;         // Thời điểm xếp hàng (monotonic_ms)
+} OutChunk;
+
+// Hàng đợi gửi của 1 connection: frame được append nguyên khối nên
+// không bao giờ xen kẽ, chỉ thread sở hữu (writer/reactor/ring) gửi
 typedef struct {
+    mutex_t lock;               // Khởi tạo 1 lần cho mỗi slot, không bị reset khi tái sử dụng
+    pthread_cond_t idle;        // Báo writer (mode thread) đã ra khỏi sendmsg()
+    pthread_cond_t ready;       // Đánh thức writer (mode thread): có dữ liệu hoặc connection đóng
+    OutChunk *head;
+    OutChunk *tail;
+    size_t bytes;               // Bytes chưa gửi (ghi qua outq_account, đọc atomic)
+    uint64_t oldest_ms;         // Thời điểm xếp hàng của frame cũ nhất, 0 nếu rỗng
+    bool flushing;              // Mode thread: writer đang trong sendmsg() (lock đã nhả)
+    bool want_write;            // Mode epoll: đã bật EPOLLOUT
+    bool backpressure;          // Đã vượt high watermark, chưa xuống dưới low watermark
+    bool slow;                  // Đang bị coi là slow consumer (atomic)
+    uint32_t dropped;           // Frame bị bỏ/chuyển offline trong lần chậm hiện tại (atomic)
+    uint32_t diverted;
+    uint64_t close_ms;          // != 0: shutdown khi gửi hết hàng đợi, thời điểm yêu cầu (atomic)
+} OutQueue;
+
+#define OUTQ_HIGH_WATERMARK (256 * 1024)
+#define OUTQ_LOW_WATERMARK (64 * 1024)
+#define OUTQ_MAX_BYTES (16 * 1024 * 1024)   // Đủ cho 1 file tối đa 10MB
+#define SLOW_CONSUMER_BYTES (12 * 1024 * 1024)  // Mặc định --slow-bytes: lớn hơn 1 file 10MB
+#define SLOW_CONSUMER_MS 5000               // Mặc định --slow-ms
+#define OUTQ_IOV_MAX 64                     // Số chunk tối đa gộp vào 1 sendmsg()
+#define SEND_BATCH_MAX 64                   // Số socket tối đa hoãn flush trong 1 batch
+#define SEND_BATCH_DEADLINE_MS 2            // Frame không bị hoãn quá hạn này
+
+// 1 request đã decode chờ worker pool xử lý
+typedef struct WorkItem {
+    struct WorkItem *next;
+    FileUpload *upload;         // != NULL: lưu/relay file đã nhận xong thay cho msg
+    SharedFrame *frame;         // Frame gốc của msg để relay nguyên bytes, NULL nếu không cần
+    PackedMessage msg;          // Field trỏ vào data, cấp phát cùng item theo độ dài thật
+    char data[];
+} WorkItem;
+
+// Mailbox của 1 actor: request chạy tuần tự theo thứ tự nhận, cả mailbox
+// (không phải từng request) được xếp vào deque của worker
+// - Actor connection (client != NULL): mọi request của 1 user
+// - Actor conversation (client == NULL): tin nhắn của 1 cặp private/1 nhóm
+typedef struct {
+    mutex_t lock;               // Khởi tạo 1 lần cho mỗi slot như outq.lock
+    pthread_cond_t idle;        // Báo mailbox không còn nằm trong worker pool
+    WorkItem *head;
+    WorkItem *tail;
+    struct ClientConnection *client;
+    bool scheduled;             // Đang nằm trong deque hoặc đang được worker chạy
+    bool closed;                // Logout/đóng: bỏ các request còn lại
+} WorkQueue;
+
+#define WORKER_QUEUE_DEPTH 1024             // Mặc định --worker-queue
+#define WORKER_BATCH 16                     // Số request chạy liền cho 1 mailbox trước khi nhường
+#define CONVERSATION_LANES 256              // Số actor conversation, key được hash vào
+
+// Handle ổn định tới 1 connection: (generation << 32) | (index + 1)
+// Slot được tái sử dụng thì generation tăng nên handle cũ không còn khớp
+typedef uint64_t ClientHandle;
+
+#define CLIENT_HANDLE_NONE 0
+#define CLIENT_SLAB_CHUNK 64                // Số slot thêm vào mỗi lần slab mở rộng
+#define CLIENT_SLAB_MAX_CHUNKS 16384        // Giới hạn cứng: 1M connection
+#define MAX_CONNECTIONS_DEFAULT 10000       // Mặc định --max-clients
+
+// Node của timer wheel, nằm sẵn trong struct của owner (arm/cancel O(1))
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **pprev;       // NULL = không nằm trong wheel
+    uint64_t expires;           // Tick hết hạn
+    void (*callback)(struct Timer *timer);
+} Timer;
+
+#define IDLE_TIMEOUT_SEC 300                // Mặc định --idle-timeout (thay SO_RCVTIMEO cũ)
+#define FRAME_TIMEOUT_SEC 30                // Mặc định --frame-timeout
+#define UPLOAD_TIMEOUT_SEC 120              // Mặc định --upload-timeout
+#define LOGIN_TIMEOUT_SEC 60                // Mặc định --login-timeout
+#define PING_INTERVAL_SEC 10                // Mặc định --ping-interval
+#define PING_TIMEOUT_SEC 10                 // Mặc định --ping-timeout
+#define RTT_SAMPLES 32                      // Số RTT gần nhất giữ cho mỗi connection
+
+typedef struct ClientConnection {
     socket_t socket_fd;
     char username[MAX_USERNAME_LEN];
     bool is_authenticated;
+    bool in_use;                // Slot đang được dùng (slot không bị dời chỗ)
     thread_t thread_id;
+    thread_t writer_id;         // Writer thread gửi outq (chỉ mode thread)
+    bool has_writer;
     struct sockaddr_in address;
+    struct Reactor *reactor;    // Reactor sở hữu connection (chỉ mode epoll)
+    struct UringConn *uring;    // Trạng thái io_uring (chỉ mode io_uring)
+    char *rbuf;                 // Dữ liệu đã nhận nhưng chưa đủ 1 frame (epoll/io_uring)
+    size_t rbuf_len;
+    FileUpload *upload;         // != NULL khi đang nhận file data (epoll/io_uring)
+    FrameReader *reader;        // Buffer đọc của client_thread (chỉ mode thread)
+    int shard_slot;             // Vị trí trong bảng connection của shard (mode --reuseport)
+    bool upgrade_parked;        // Mode thread: client_thread đang dừng chờ hot upgrade
+    uint8_t protocol;           // Version gửi cho client (MSG_HELLO), 0 = v1 (atomic)
+    bool compress;              // Client nhận body nén (MSG_HELLO có "deflate", atomic)
+    Timer timer;                // Deadline idle/frame dở/upload/login (server_timers.c)
+    uint64_t connected_ms;
+    uint64_t activity_ms;       // Frame hoàn chỉnh gần nhất, kể cả PING/PONG (atomic)
+    uint64_t request_ms;        // Request gần nhất, không tính heartbeat (atomic)
+    uint64_t upload_since_ms;   // != 0 khi đang nhận file data (atomic)
+    uint64_t stall_since_ms;    // Chỉ timer thread: lần đầu thấy frame dở
+    uint64_t stall_activity_ms;
+    uint64_t ping_sent_ms;      // PING đang chờ PONG, 0 = không có (atomic)
+    uint64_t last_ping_ms;      // Chỉ timer thread
+    uint32_t rtt_samples[RTT_SAMPLES];  // RTT (ms) của các PONG gần nhất, ghi vòng tròn
+    uint32_t rtt_count;         // Tổng số PONG đã đo (atomic)
+    OutQueue outq;              // Từ outq trở xuống không bị alloc_client_slot xóa
+    WorkQueue work;
+    uint32_t slab_index;        // Vị trí cố định trong slab
+    uint32_t generation;        // Tăng mỗi lần slot được trả lại (atomic)
+    int next_free;              // Free list của slab (-1 = hết)
 } ClientConnection;
 
+// ===========================
+// SERVER OPTIONS
+// ===========================
+
+typedef enum {
+    IO_MODE_THREAD = 0,     // Mỗi client 1 thread (mặc định)
+    IO_MODE_EPOLL = 1,      // Edge-triggered epoll reactor
+    IO_MODE_URING = 2       // io_uring: multishot accept/recv + provided buffers
+} IoMode;
+
+// Xử lý client không đọc kịp (slow consumer), các mức tăng dần
+typedef enum {
+    SLOW_POLICY_DROP = 0,       // Bỏ traffic tạm thời (online/offline, typing)
+    SLOW_POLICY_DIVERT = 1,     // + chuyển tin nhắn chat vào offline store
+    SLOW_POLICY_DISCONNECT = 2  // + ngắt kết nối client
+} SlowPolicy;
+
+typedef struct {
+    int port;
+    IoMode io_mode;
+    int io_threads;         // Số reactor/ring thread (mode epoll, io_uring)
+    bool reuseport;         // Mỗi reactor 1 listening socket SO_REUSEPORT + shard riêng
+    SlowPolicy slow_policy;
+    size_t slow_bytes;      // Ngưỡng bytes chờ gửi để coi là slow consumer
+    int slow_ms;            // Ngưỡng thời gian chờ của frame cũ nhất (ms)
+    int workers;            // Số worker thread chạy handler (0 = chạy ngay trên I/O thread)
+    int worker_queue;       // Số request tối đa chờ trong worker pool
+    int max_clients;        // Số connection tối đa (slab mở rộng dần tới mức này)
+    int idle_timeout;       // Giây không có frame nào thì ngắt (0 = tắt)
+    int frame_timeout;      // Giây tối đa 1 frame được nhận dở
+    int upload_timeout;     // Giây tối đa cho 1 lần nhận file data
+    int login_timeout;      // Giây tối đa từ lúc kết nối tới khi đăng nhập
+    int ping_interval;      // Giây giữa 2 lần PING client đã đăng nhập (0 = tắt)
+    int ping_timeout;       // Giây chờ PONG trước khi coi client đã chết
+    int max_protocol;       // Version protocol cao nhất chấp nhận khi MSG_HELLO
+    int compress_min;       // Body từ bao nhiêu bytes thì nén cho client hỗ trợ (0 = tắt nén)
+    int compress_stats;     // Giây giữa 2 lần log counter nén (0 = chỉ log khi tắt server)
+    bool offline_fsync;     // fdatasync mailbox sau mỗi batch của offline writer
+    int wal_fsync;          // Cửa sổ gom fdatasync WAL (ms), -1 = không fdatasync
+    int snapshot_interval;  // Giây giữa 2 lần snapshot state (0 = chỉ khi WAL lớn)
+} ServerOptions;
+
+// Dữ liệu gửi sang shard khác (node của inbox lock-free MPSC)
+typedef struct ShardMessage {
+    struct ShardMessage *next;
+    ClientHandle client;        // Connection đích, handle cũ bị bỏ khi nhận
+    SharedFrame *frame;         // Reference do inbox giữ
+} ShardMessage;
+
+typedef struct Reactor {
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int event_fd;               // Đánh thức reactor khi inbox có dữ liệu
+    int cpu;                    // CPU được pin (-1 nếu không pin)
+    thread_t thread_id;
+    ClientConnection **conns;   // Bảng connection của shard, chỉ reactor thread truy cập
+    int conn_count;
+    int conn_capacity;
+    ShardMessage *inbox_head;   // Chỉ reactor thread (consumer) đọc
+    ShardMessage *inbox_tail;   // Producer xchg vào đây
+    ShardMessage inbox_stub;
+    int inbox_wakeup;           // 1 = đã ghi event_fd, chưa được reactor xử lý
+} Reactor;
+
+#define IO_WAIT_TIMEOUT_MS 30000    // Thời gian chờ tối đa khi socket non-blocking bị đầy/rỗng
+#define REACTOR_MAX_EVENTS 256
+#define CLIENT_RBUF_SIZE (FRAME_HEADER_SIZE + BUFFER_SIZE)
+
 typedef struct {
     socket_t server_socket;
-    ClientConnection clients[MAX_CLIENTS];
-    int client_count;
+    ClientConnection *client_chunks[CLIENT_SLAB_MAX_CHUNKS];  // Slab: chunk không bao giờ bị dời/giải phóng
+    int client_capacity;            // Số slot đã cấp phát
+    int client_count;               // High-water mark của slot, slot trống có in_use = false
+    int client_free;                // Đầu free list (-1 = phải mở rộng slab)
+    ClientConnection **fd_table;    // socket fd -> connection, tra cứu O(1)
+    int fd_table_size;
+    mutex_t fd_mutex;               // Chỉ bảo vệ fd_table (lock lá, không giữ lock khác)
     User users[MAX_CLIENTS];
     int user_count;
     Group groups[MAX_GROUPS];
@@ -38,15 +253,10 @@ typedef struct {
     mutex_t clients_mutex;
     mutex_t users_mutex;
     mutex_t groups_mutex;
-    mutex_t file_mutex;
 } ServerState;
 
-typedef struct {
-    char to[MAX_USERNAME_LEN];
-    Message msg;
-} OfflineMessage;
-
 extern ServerState server_state;
+extern ServerOptions server_options;
 
 // ===========================
 // FUNCTION DECLARATIONS
@@ -55,16 +265,133 @@ extern ServerState server_state;
 // Server core functions
 int init_server_socket(int port);
 int accept_client(int server_socket, ClientConnection *client);
-int recv_message(int socket_fd, char *buffer, size_t buffer_size);
+void configure_client_socket(int client_socket);
+void log_client_connect(const ClientConnection *client);
+ClientConnection *alloc_client_slot(void);
+void release_client_slot(ClientConnection *client);
+ClientConnection *client_slot(int index);
+ClientHandle client_handle(const ClientConnection *client);
+ClientConnection *client_from_handle(ClientHandle handle);
+void attach_client_fd(ClientConnection *client);
+ClientConnection *find_client_by_fd(int socket_fd);
+int client_recv_raw(ClientConnection *client, char *buffer, size_t length);
+int process_client_input(ClientConnection *client);
 int send_message(int socket_fd, const char *message, size_t length);
+int send_raw_data(int socket_fd, const char *data, size_t length);
 int send_message_struct(int socket_fd, const Message *msg);
+int send_packed_message(int socket_fd, const PackedMessage *msg);
+SharedFrame *shared_frame_create(const char *data, size_t length, bool framed);
+SharedFrame *shared_frame_encode(const PackedMessage *msg);
+SharedFrame *shared_frame_original(const MessageView *view);
+void shared_frame_ref(SharedFrame *frame);
+void shared_frame_release(SharedFrame *frame);
+int send_shared_frame(int socket_fd, SharedFrame *frame);
+int send_message_shared(int socket_fd, const PackedMessage *msg, SharedFrame *frame);
+void log_compress_stats(void);
+void start_compress_stats(void);
+int enqueue_client_frame(int socket_fd, SharedFrame *frame);
+int flush_client_output(ClientConnection *client);
+void check_slow_consumer(ClientConnection *client, int socket_fd);
+void close_client_after_drain(ClientConnection *client);
+void outq_account(ClientConnection *client, long delta, uint64_t oldest_ms);
+uint64_t monotonic_ms(void);
+void begin_send_batch(void);
+void end_send_batch(void);
+bool send_batch_defer(int socket_fd);
+int dispatch_message(ClientConnection *client, const PackedMessage *msg, SharedFrame *frame);
 THREAD_RETURN client_thread(void *arg);
 void cleanup_client(ClientConnection *client);
 void cleanup_server(void);
 
+// Epoll reactor
+int start_reactors(int server_socket, int count);
+int reactor_add_client(Reactor *reactor, ClientConnection *client);
+int reactor_route_send(int socket_fd, SharedFrame *frame);
+bool reactor_owns(const ClientConnection *client);
+int reactor_set_writable(ClientConnection *client, bool enable);
+int reactor_adopt_client(ClientConnection *client);
+int reactor_listen_fds(int *fds, int max);
+void reactor_wake_all(void);
+void reactor_drain_inboxes(void);
+
+// Worker pool
+int start_worker_pool(int count);
+int submit_client_request(ClientConnection *client, const MessageView *view);
+int submit_file_upload(ClientConnection *client, FileUpload *upload);
+void detach_client_work(ClientConnection *client);
+int wait_worker_pool_idle(int timeout_ms);
+
+// Timer wheel
+int start_timer_wheel(void);
+void timer_arm(Timer *timer, uint64_t delay_ms);
+void timer_arm_earlier(Timer *timer, uint64_t delay_ms);
+void timer_cancel(Timer *timer);
+void start_client_timer(ClientConnection *client);
+void stop_client_timer(ClientConnection *client);
+void touch_client(ClientConnection *client);
+void client_upload_started(ClientConnection *client);
+void client_upload_finished(ClientConnection *client);
+bool handle_heartbeat(ClientConnection *client, const MessageView *view);
+void log_client_rtt(ClientConnection *client);
+
+// Hot upgrade
+void init_hot_upgrade(char **argv);
+bool upgrade_requested(void);
+void run_hot_upgrade(void);
+bool upgrade_pending(void);
+bool upgrade_sends_blocked(void);
+const int *upgrade_cancel_flag(void);
+void upgrade_park(ClientConnection *client);
+int upgrade_inherited_fd(void);
+int upgrade_receive_listeners(int upgrade_fd);
+int upgrade_take_listener(int index);
+void upgrade_resume_connections(int upgrade_fd);
+
+// State store: users, groups, friendships ghi vào 1 WAL append-only có checksum
+// (state.wal), snapshot định kỳ vào state.snap rồi cắt WAL (server_wal.c)
+#define STATE_WAL_FILE "state.wal"
+#define STATE_WAL_OLD_FILE "state.wal.old"         // WAL trước lần snapshot đang chạy
+#define STATE_SNAPSHOT_FILE "state.snap"
+#define WAL_PAYLOAD_MAX 2048                        // Payload text tối đa của 1 record
+#define WAL_SNAPSHOT_BYTES (4 * 1024 * 1024)        // WAL lớn hơn thì snapshot sớm
+#define WAL_FSYNC_OFF (-1)                          // Mặc định --wal-fsync
+#define SNAPSHOT_INTERVAL_SEC 300                   // Mặc định --snapshot-interval
+
+typedef enum {
+    WAL_USER = 1,               // username|password|last_seen
+    WAL_GROUP_CREATE,           // group|creator|member1,member2,...|created_at
+    WAL_GROUP_JOIN,             // group|username
+    WAL_GROUP_LEAVE,            // group|username
+    WAL_FRIEND                  // user1|user2|pending/accepted/removed
+} WalRecordType;
+
+// Record đã encode dùng để dựng snapshot
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    uint32_t records;
+} WalBuffer;
+
+int init_state_store(bool upgrading);
+void wal_catch_up(void);
+void start_state_snapshots(void);
+void pause_state_snapshots(void);
+void resume_state_snapshots(void);
+void stop_state_store(void);
+uint64_t wal_append(WalRecordType type, const char *format, ...);
+uint64_t wal_append_group(const Group *group);
+void wal_commit(uint64_t lsn);
+int wal_buffer_append(WalBuffer *buffer, WalRecordType type, const char *format, ...);
+
+// io_uring backend
+int start_uring_engines(int server_socket, int count);
+int uring_send_fd(int socket_fd, SharedFrame *frame);
+void uring_flush_fd(int socket_fd);
+void uring_close_after_drain(int socket_fd);
+
 // User management
 int load_users_from_file(const char *filename);
-int save_user_to_file(const char *filename, const User *user);
 int find_user_socket(const char *username);
 int add_online_user(const char *username, int socket_fd);
 int remove_online_user(const char *username);
@@ -72,17 +399,38 @@ int send_online_users_list(int client_socket);
 void send_friend_list_auto(const char *username);
 
 // Message handling
-int broadcast_message(const Message *msg, const char *exclude_user);
-int relay_private_message(const Message *msg);
-int handle_private_chat_start(const Message *msg);
-int handle_private_chat_end(const Message *msg);
-void log_message(const Message *msg);
-
-// Friend management
-void handle_friend_request(Message *msg);
-void handle_friend_accept(Message *msg);
-void handle_friend_reject(Message *msg);
-void handle_friend_remove(Message *msg);
+int broadcast_message(const PackedMessage *msg, const char *exclude_user);
+int relay_private_message(const PackedMessage *msg, SharedFrame *frame);
+int handle_private_chat_start(const PackedMessage *msg);
+int handle_private_chat_end(const PackedMessage *msg);
+void log_message(const PackedMessage *msg);
+
+// Friend management: đồ thị bạn bè trong RAM (server_friends.c), thay đổi ghi vào state WAL
+#define FRIEND_BUCKETS_MIN 64       // Bucket ban đầu của bảng node (gấp đôi khi node > bucket)
+#define FRIEND_EDGES_MIN 4          // Cạnh ban đầu của 1 node
+
+typedef enum {
+    FRIEND_NONE = 0,
+    FRIEND_ACCEPTED,
+    FRIEND_PENDING_OUT,             // User đã gửi lời mời, chờ peer chấp nhận
+    FRIEND_PENDING_IN               // Peer đã gửi lời mời cho user
+} FriendState;
+
+FriendState friend_graph_state(const char *user, const char *peer);
+FriendState friend_graph_request(const char *from, const char *to);
+int friend_graph_accept(const char *requester, const char *accepter);
+int friend_graph_reject(const char *requester, const char *rejecter);
+int friend_graph_remove(const char *user, const char *peer);
+int friend_graph_count(const char *username);
+int friend_graph_list(const char *username, char *list, size_t size);
+int friend_graph_edges(void);
+void friend_graph_apply(const char *user1, const char *user2, const char *status);
+int friend_graph_snapshot(WalBuffer *buffer);
+
+void handle_friend_request(const PackedMessage *msg);
+void handle_friend_accept(const PackedMessage *msg);
+void handle_friend_reject(const PackedMessage *msg);
+void handle_friend_remove(const PackedMessage *msg);
 int send_friends_list(int client_socket, const char *username);
 int send_all_available_groups(int client_socket, const char *username);
 int load_friendships_from_file(const char *filename);
@@ -91,23 +439,46 @@ int load_friendships_from_file(const char *filename);
 int create_group(const char *group_name, const char *creator);
 int create_group_with_friends(const char *group_name, const char *creator, const char *members_list);
 int count_accepted_friends(const char *username);
-int handle_group_invite(const Message *msg);
+int handle_group_invite(const PackedMessage *msg);
 int handle_group_join(const char *group_name, const char *username);
 int handle_group_leave(const char *group_name, const char *username);
-int relay_group_message(const Message *msg);
+int relay_group_message(const PackedMessage *msg);
 int send_user_groups_list(int client_socket, const char *username);
 int load_groups_from_file(const char *filename);
-int save_group_to_file(const char *filename, const Group *group);
-int save_all_groups_to_file(const char *filename);
 
-// Offline messages
-int save_offline_message(const Message *msg);
+// Offline messages: mỗi recipient 1 mailbox offline/<username>.box, mỗi nhóm 1 log
+// offline/<group>.grp lưu tin nhắn nhóm 1 lần + cursor đọc của từng member offline
+#define OFFLINE_DIR "offline"
+#define OFFLINE_LEGACY_FILE "offline_messages.txt"  // Format cũ, chuyển vào mailbox khi khởi động
+#define MAILBOX_MAGIC 0x3258424Du                   // "MBX2"
+#define MAILBOX_MAGIC_V1 0x584F424Du                // "MBOX": record chưa có stamp, chuyển khi khởi động
+#define GROUP_LOG_MAGIC 0x32474C47u                 // "GLG2"
+#define GROUP_LOG_MAGIC_V1 0x474F4C47u              // "GLOG": record chưa có stamp, chuyển khi khởi động
+#define GROUP_LOG_SLOTS 32                          // Cursor mỗi group log (bit trong mask 32-bit)
+#define GROUP_LOG_COMPACT_BYTES (1 << 20)           // Compact khi phần trước start >= 1MB và >= phần còn lại
+#define GROUP_LOG_MAX_BYTES (64 << 20)              // Member chờ quá 64MB: bỏ record cũ nhất của member đó
+#define MAILBOX_LOCKS 64                            // Lock striped theo hash username/tên nhóm
+#define MAILBOX_PATH_LEN (sizeof(OFFLINE_DIR) + MAX_GROUP_NAME_LEN * 3 + 8)
+#define OFFLINE_QUEUE_MAX 65536                     // Record chờ writer tối đa, đầy thì producer chờ
+#define MAILBOX_IOV_MAX 1024                        // iovec mỗi lần pwritev (IOV_MAX của Linux)
+
+int init_offline_store(void);
+void offline_store_sync(void);
+void stop_offline_writer(void);
+int save_offline_message(const PackedMessage *msg);
+int save_group_offline_message(const PackedMessage *msg,
+                               char members[][MAX_USERNAME_LEN], int member_count);
+void drop_group_offline_member(const char *group_name, const char *username);
 int send_offline_messages(int socket_fd, const char *username);
+int count_offline_messages(const char *username);
 
 // File transfer
-int handle_file_transfer(ClientConnection *client, const Message *msg);
-int handle_file_accept(const Message *msg);
-int handle_file_reject(const Message *msg);
+int handle_file_transfer(ClientConnection *client, const PackedMessage *msg);
+int feed_file_upload(ClientConnection *client);
+void free_file_upload(ClientConnection *client);
+void complete_file_upload(FileUpload *upload);
+int handle_file_accept(const PackedMessage *msg);
+int handle_file_reject(const PackedMessage *msg);
 int relay_file(const char *file_path, const char *from, const char *to);
 
 // Logging
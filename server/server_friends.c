@@ -0,0 +1,455 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ===========================
+// FRIENDSHIP GRAPH
+// Đồ thị bạn bè nằm trong RAM: mỗi user 1 node (hash theo username), mỗi node 1 tập
+// cạnh gồm cả accepted và pending - mảng dày để duyệt O(degree) + bảng index open
+// addressing theo peer để tra cạnh O(1). Mỗi thay đổi ghi 1 record WAL_FRIEND
+// user1|user2|status vào state WAL trong lúc giữ write lock (server_wal.c)
+// ===========================
+
+typedef struct FriendNode FriendNode;
+
+typedef struct {
+    FriendNode *peer;
+    FriendState state;          // Nhìn từ phía node sở hữu cạnh
+} FriendEdge;
+
+struct FriendNode {
+    FriendNode *next;           // Chain trong bucket
+    uint32_t hash;
+    char username[MAX_USERNAME_LEN];
+    FriendEdge *edges;          // [0, edge_count) dày, xóa bằng cách dời cạnh cuối vào
+    int32_t *index;             // 2 * edge_capacity slot: vị trí trong edges, -1 = trống
+    int edge_count;
+    int edge_capacity;
+    int accepted;               // Số cạnh FRIEND_ACCEPTED
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    FriendNode **buckets;
+    uint32_t bucket_count;      // Luỹ thừa của 2
+    uint32_t node_count;
+    uint32_t edge_count;        // Số cặp có quan hệ (mỗi cặp 2 cạnh có hướng)
+} friend_graph = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static uint32_t friend_hash(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = username; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+
+    return hash;
+}
+
+static FriendNode *find_node(const char *username) {
+    if (friend_graph.buckets == NULL) return NULL;
+
+    uint32_t hash = friend_hash(username);
+    FriendNode *node = friend_graph.buckets[hash & (friend_graph.bucket_count - 1)];
+    while (node != NULL && (node->hash != hash || strcmp(node->username, username) != 0)) {
+        node = node->next;
+    }
+
+    return node;
+}
+
+/**
+ * Gấp đôi số bucket khi số node vượt số bucket (giữ chain ngắn)
+ */
+static int grow_buckets(void) {
+    uint32_t count = friend_graph.bucket_count > 0 ? friend_graph.bucket_count * 2 : FRIEND_BUCKETS_MIN;
+    FriendNode **buckets = calloc(count, sizeof(FriendNode *));
+    if (buckets == NULL) return -1;
+
+    for (uint32_t i = 0; i < friend_graph.bucket_count; i++) {
+        FriendNode *node = friend_graph.buckets[i];
+        while (node != NULL) {
+            FriendNode *next = node->next;
+            node->next = buckets[node->hash & (count - 1)];
+            buckets[node->hash & (count - 1)] = node;
+            node = next;
+        }
+    }
+
+    free(friend_graph.buckets);
+    friend_graph.buckets = buckets;
+    friend_graph.bucket_count = count;
+    return 0;
+}
+
+static FriendNode *get_node(const char *username) {
+    FriendNode *node = find_node(username);
+    if (node != NULL) return node;
+
+    if (friend_graph.node_count >= friend_graph.bucket_count && grow_buckets() < 0) return NULL;
+
+    node = calloc(1, sizeof(FriendNode));
+    if (node == NULL) return NULL;
+
+    strncpy(node->username, username, MAX_USERNAME_LEN - 1);
+    node->hash = friend_hash(node->username);
+    node->next = friend_graph.buckets[node->hash & (friend_graph.bucket_count - 1)];
+    friend_graph.buckets[node->hash & (friend_graph.bucket_count - 1)] = node;
+    friend_graph.node_count++;
+
+    return node;
+}
+
+/**
+ * Slot trong index của cạnh tới peer, hoặc slot trống nơi cạnh đó sẽ nằm
+ */
+static uint32_t edge_slot(const FriendNode *node, const FriendNode *peer) {
+    uint32_t mask = (uint32_t)node->edge_capacity * 2 - 1;
+    uint32_t slot = peer->hash & mask;
+
+    while (node->index[slot] >= 0 && node->edges[node->index[slot]].peer != peer) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static FriendEdge *find_edge(const FriendNode *node, const FriendNode *peer) {
+    if (node == NULL || peer == NULL || node->edge_count == 0) return NULL;
+
+    int32_t position = node->index[edge_slot(node, peer)];
+    return position >= 0 ? &node->edges[position] : NULL;
+}
+
+/**
+ * Gấp đôi mảng cạnh và dựng lại index
+ */
+static int grow_edges(FriendNode *node) {
+    int capacity = node->edge_capacity > 0 ? node->edge_capacity * 2 : FRIEND_EDGES_MIN;
+    FriendEdge *edges = realloc(node->edges, sizeof(FriendEdge) * capacity);
+    if (edges == NULL) return -1;
+    node->edges = edges;
+
+    int32_t *index = malloc(sizeof(int32_t) * capacity * 2);
+    if (index == NULL) return -1;
+
+    free(node->index);
+    node->index = index;
+    node->edge_capacity = capacity;
+    memset(index, 0xFF, sizeof(int32_t) * capacity * 2);
+
+    for (int i = 0; i < node->edge_count; i++) {
+        index[edge_slot(node, node->edges[i].peer)] = i;
+    }
+
+    return 0;
+}
+
+static void set_edge(FriendNode *node, FriendNode *peer, FriendState state) {
+    FriendEdge *edge = find_edge(node, peer);
+
+    if (edge == NULL) {
+        if (node->edge_count == node->edge_capacity && grow_edges(node) < 0) return;
+
+        node->index[edge_slot(node, peer)] = node->edge_count;
+        edge = &node->edges[node->edge_count++];
+        edge->peer = peer;
+        edge->state = FRIEND_NONE;
+    }
+
+    if (edge->state == FRIEND_ACCEPTED) node->accepted--;
+    if (state == FRIEND_ACCEPTED) node->accepted++;
+    edge->state = state;
+}
+
+/**
+ * Xóa cạnh tới peer: dời cạnh cuối vào chỗ trống, xóa slot index bằng backward shift
+ * (linear probing không cần tombstone)
+ */
+static void remove_edge(FriendNode *node, FriendNode *peer) {
+    if (find_edge(node, peer) == NULL) return;
+
+    uint32_t mask = (uint32_t)node->edge_capacity * 2 - 1;
+    uint32_t hole = edge_slot(node, peer);
+    int32_t position = node->index[hole];
+
+    if (node->edges[position].state == FRIEND_ACCEPTED) node->accepted--;
+
+    for (uint32_t slot = (hole + 1) & mask; node->index[slot] >= 0; slot = (slot + 1) & mask) {
+        uint32_t home = node->edges[node->index[slot]].peer->hash & mask;
+        // Slot chỉ được dời về hole nếu home của nó không nằm trong (hole, slot]
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            node->index[hole] = node->index[slot];
+            hole = slot;
+        }
+    }
+    node->index[hole] = -1;
+
+    int32_t last = --node->edge_count;
+    if (position != last) {
+        node->edges[position] = node->edges[last];
+        node->index[edge_slot(node, node->edges[position].peer)] = position;
+    }
+}
+
+/**
+ * Đặt quan hệ user -> peer (state nhìn từ user), cạnh ngược nhận state đối xứng
+ */
+static void link_users(FriendNode *user, FriendNode *peer, FriendState state) {
+    FriendState reverse = state == FRIEND_PENDING_OUT ? FRIEND_PENDING_IN :
+                          state == FRIEND_PENDING_IN ? FRIEND_PENDING_OUT : state;
+
+    if (find_edge(user, peer) == NULL) friend_graph.edge_count++;
+    set_edge(user, peer, state);
+    set_edge(peer, user, reverse);
+}
+
+static void unlink_users(FriendNode *user, FriendNode *peer) {
+    if (find_edge(user, peer) == NULL) return;
+
+    friend_graph.edge_count--;
+    remove_edge(user, peer);
+    remove_edge(peer, user);
+}
+
+/**
+ * Áp 1 thay đổi user1|user2|status (đang giữ write lock)
+ * pending: user1 gửi lời mời cho user2, accepted, removed: xóa quan hệ
+ */
+static void apply_friendship(const char *user1, const char *user2, const char *status) {
+    if (user1[0] == '\0' || user2[0] == '\0' || strcmp(user1, user2) == 0) return;
+
+    FriendNode *node1 = get_node(user1);
+    FriendNode *node2 = get_node(user2);
+    if (node1 == NULL || node2 == NULL) return;
+
+    if (strcmp(status, "accepted") == 0) {
+        link_users(node1, node2, FRIEND_ACCEPTED);
+    } else if (strcmp(status, "pending") == 0) {
+        link_users(node1, node2, FRIEND_PENDING_OUT);
+    } else if (strcmp(status, "removed") == 0) {
+        unlink_users(node1, node2);
+    }
+}
+
+/**
+ * Replay 1 record WAL_FRIEND khi khôi phục state
+ */
+void friend_graph_apply(const char *user1, const char *user2, const char *status) {
+    pthread_rwlock_wrlock(&friend_graph.lock);
+    apply_friendship(user1, user2, status);
+    pthread_rwlock_unlock(&friend_graph.lock);
+}
+
+/**
+ * Import friendships.txt (format cũ, mỗi dòng user1|user2|status, dòng sau của
+ * cùng 1 cặp thắng) - chỉ dùng khi chuyển sang state WAL lần đầu
+ */
+int load_friendships_from_file(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) return 0;
+
+    pthread_rwlock_wrlock(&friend_graph.lock);
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        FieldView fields[3];
+        if (split_fields(line, strcspn(line, "\r\n"), SCAN_PIPE, fields, 3) != 3) continue;
+
+        char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
+        copy_field(user1, sizeof(user1), fields[0]);
+        copy_field(user2, sizeof(user2), fields[1]);
+        copy_field(status, sizeof(status), fields[2]);
+        status[strcspn(status, " \t")] = '\0';
+
+        apply_friendship(user1, user2, status);
+    }
+    fclose(fp);
+
+    printf("[SERVER] Loaded %u friendships of %u users from %s\n",
+           friend_graph.edge_count, friend_graph.node_count, filename);
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return 0;
+}
+
+/**
+ * Ghi mỗi cặp 1 record vào snapshot: pending từ phía người gửi, accepted từ
+ * username nhỏ hơn
+ */
+int friend_graph_snapshot(WalBuffer *buffer) {
+    int result = 0;
+
+    pthread_rwlock_rdlock(&friend_graph.lock);
+
+    for (uint32_t b = 0; result == 0 && b < friend_graph.bucket_count; b++) {
+        for (FriendNode *node = friend_graph.buckets[b]; result == 0 && node != NULL; node = node->next) {
+            for (int i = 0; result == 0 && i < node->edge_count; i++) {
+                const FriendEdge *edge = &node->edges[i];
+                if (edge->state == FRIEND_PENDING_OUT) {
+                    result = wal_buffer_append(buffer, WAL_FRIEND, "%s|%s|pending",
+                                               node->username, edge->peer->username);
+                } else if (edge->state == FRIEND_ACCEPTED &&
+                           strcmp(node->username, edge->peer->username) < 0) {
+                    result = wal_buffer_append(buffer, WAL_FRIEND, "%s|%s|accepted",
+                                               node->username, edge->peer->username);
+                }
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return result;
+}
+
+/**
+ * Số cặp có quan hệ (accepted + pending)
+ */
+int friend_graph_edges(void) {
+    pthread_rwlock_rdlock(&friend_graph.lock);
+    int count = (int)friend_graph.edge_count;
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return count;
+}
+
+/**
+ * Quan hệ của user với peer - O(1)
+ */
+FriendState friend_graph_state(const char *user, const char *peer) {
+    pthread_rwlock_rdlock(&friend_graph.lock);
+
+    FriendEdge *edge = find_edge(find_node(user), find_node(peer));
+    FriendState state = edge != NULL ? edge->state : FRIEND_NONE;
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return state;
+}
+
+/**
+ * from gửi lời mời cho to nếu 2 người chưa có quan hệ (kiểm tra + tạo trong 1 lần lock)
+ * Return: quan hệ trước đó, FRIEND_NONE = đã tạo lời mời
+ */
+FriendState friend_graph_request(const char *from, const char *to) {
+    pthread_rwlock_wrlock(&friend_graph.lock);
+
+    FriendNode *from_node = get_node(from);
+    FriendNode *to_node = get_node(to);
+    FriendEdge *edge = find_edge(from_node, to_node);
+    FriendState state = edge != NULL ? edge->state : FRIEND_NONE;
+    uint64_t lsn = 0;
+
+    if (state == FRIEND_NONE && from_node != NULL && to_node != NULL) {
+        link_users(from_node, to_node, FRIEND_PENDING_OUT);
+        lsn = wal_append(WAL_FRIEND, "%s|%s|pending", from, to);
+    }
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    wal_commit(lsn);
+    return state;
+}
+
+/**
+ * accepter chấp nhận lời mời requester đã gửi
+ * Return: -1 nếu không có lời mời
+ */
+int friend_graph_accept(const char *requester, const char *accepter) {
+    pthread_rwlock_wrlock(&friend_graph.lock);
+
+    FriendNode *requester_node = find_node(requester);
+    FriendEdge *edge = find_edge(requester_node, find_node(accepter));
+    int result = -1;
+    uint64_t lsn = 0;
+
+    if (edge != NULL && edge->state == FRIEND_PENDING_OUT) {
+        link_users(requester_node, edge->peer, FRIEND_ACCEPTED);
+        lsn = wal_append(WAL_FRIEND, "%s|%s|accepted", requester, accepter);
+        result = 0;
+    }
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    wal_commit(lsn);
+    return result;
+}
+
+/**
+ * Xóa quan hệ user - peer nếu đang ở state (nhìn từ user)
+ * Return: -1 nếu không có quan hệ đó
+ */
+static int friend_graph_unlink(const char *user, const char *peer, FriendState state) {
+    pthread_rwlock_wrlock(&friend_graph.lock);
+
+    FriendNode *user_node = find_node(user);
+    FriendEdge *edge = find_edge(user_node, find_node(peer));
+    int result = -1;
+    uint64_t lsn = 0;
+
+    if (edge != NULL && edge->state == state) {
+        unlink_users(user_node, edge->peer);
+        lsn = wal_append(WAL_FRIEND, "%s|%s|removed", user, peer);
+        result = 0;
+    }
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    wal_commit(lsn);
+    return result;
+}
+
+/**
+ * rejecter từ chối lời mời requester đã gửi
+ */
+int friend_graph_reject(const char *requester, const char *rejecter) {
+    return friend_graph_unlink(requester, rejecter, FRIEND_PENDING_OUT);
+}
+
+/**
+ * Hủy kết bạn (chỉ xóa quan hệ accepted)
+ */
+int friend_graph_remove(const char *user, const char *peer) {
+    return friend_graph_unlink(user, peer, FRIEND_ACCEPTED);
+}
+
+/**
+ * Số bạn bè accepted - O(1)
+ */
+int friend_graph_count(const char *username) {
+    pthread_rwlock_rdlock(&friend_graph.lock);
+
+    FriendNode *node = find_node(username);
+    int count = node != NULL ? node->accepted : 0;
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return count;
+}
+
+/**
+ * Danh sách bạn bè accepted dạng "a,b,c" vào list - O(degree)
+ * Return: số bạn đã ghi (bạn không vừa list bị bỏ)
+ */
+int friend_graph_list(const char *username, char *list, size_t size) {
+    if (size == 0) return 0;
+    list[0] = '\0';
+
+    pthread_rwlock_rdlock(&friend_graph.lock);
+
+    FriendNode *node = find_node(username);
+    size_t length = 0;
+    int count = 0;
+
+    for (int i = 0; node != NULL && i < node->edge_count; i++) {
+        if (node->edges[i].state != FRIEND_ACCEPTED) continue;
+
+        const char *name = node->edges[i].peer->username;
+        size_t name_length = strlen(name);
+        if (length + name_length + (count > 0 ? 1 : 0) >= size) break;
+
+        if (count > 0) list[length++] = ',';
+        memcpy(list + length, name, name_length + 1);
+        length += name_length;
+        count++;
+    }
+
+    pthread_rwlock_unlock(&friend_graph.lock);
+    return count;
+}
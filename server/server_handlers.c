@@ -172,46 +172,8 @@ void send_friend_list_auto(const char *username)
         return;
     }
 
-    char friend_list[BUFFER_SIZE] = "";
-    int count = 0;
-
-    mutex_lock(&server_state.file_mutex);
-    FILE *fp = fopen("friendships.txt", "r");
-    if (fp != NULL)
-    {
-        char line[512];
-        while (fgets(line, sizeof(line), fp))
-        {
-            char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-            if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-            {
-                if (strcmp(status, "accepted") == 0)
-                {
-                    const char *friend_name = NULL;
-                    if (strcmp(user1, username) == 0)
-                    {
-                        friend_name = user2;
-                    }
-                    else if (strcmp(user2, username) == 0)
-                    {
-                        friend_name = user1;
-                    }
-
-                    if (friend_name)
-                    {
-                        if (count > 0)
-                        {
-                            strcat(friend_list, ",");
-                        }
-                        strcat(friend_list, friend_name);
-                        count++;
-                    }
-                }
-            }
-        }
-        fclose(fp);
-    }
-    mutex_unlock(&server_state.file_mutex);
+    char friend_list[BUFFER_SIZE];
+    friend_graph_list(username, friend_list, sizeof(friend_list));
 
     Message response;
     create_response_message(&response, MSG_FRIEND_LIST, "SERVER", username, friend_list);
@@ -224,8 +186,9 @@ void send_friend_list_auto(const char *username)
 
 /**
  * Chuyển tiếp tin nhắn riêng tư
+ * frame: bytes gốc client gửi (shared_frame_original), NULL thì serialize lại msg
  */
-int relay_private_message(const Message *msg)
+int relay_private_message(const PackedMessage *msg, SharedFrame *frame)
 {
     if (msg == NULL)
         return -1;
@@ -256,8 +219,10 @@ int relay_private_message(const Message *msg)
         return 0;
     }
 
-    // Forward message đến receiver
-    int result = send_message_struct(receiver_socket, msg);
+    // Forward message đến receiver: nguyên bytes client gửi nếu có frame gốc
+    // (chỉ encode lại khi receiver dùng protocol version khác)
+    int result = frame != NULL ? send_message_shared(receiver_socket, msg, frame)
+                               : send_packed_message(receiver_socket, msg);
 
     if (result < 0)
     {
@@ -274,7 +239,7 @@ int relay_private_message(const Message *msg)
 /**
  * Thông báo bắt đầu cuộc trò chuyện
  */
-int handle_private_chat_start(const Message *msg)
+int handle_private_chat_start(const PackedMessage *msg)
 {
     if (msg == NULL)
         return -1;
@@ -284,7 +249,7 @@ int handle_private_chat_start(const Message *msg)
     int receiver_socket = find_user_socket(msg->to);
     if (receiver_socket != -1)
     {
-        send_message_struct(receiver_socket, msg);
+        send_packed_message(receiver_socket, msg);
     }
 
     return 0;
@@ -293,7 +258,7 @@ int handle_private_chat_start(const Message *msg)
 /**
  * Thông báo kết thúc cuộc trò chuyện
  */
-int handle_private_chat_end(const Message *msg)
+int handle_private_chat_end(const PackedMessage *msg)
 {
     if (msg == NULL)
         return -1;
@@ -303,7 +268,7 @@ int handle_private_chat_end(const Message *msg)
     int receiver_socket = find_user_socket(msg->to);
     if (receiver_socket != -1)
     {
-        send_message_struct(receiver_socket, msg);
+        send_packed_message(receiver_socket, msg);
     }
 
     return 0;
@@ -321,32 +286,7 @@ int count_accepted_friends(const char *username)
     if (username == NULL)
         return 0;
 
-    int friend_count = 0;
-
-    mutex_lock(&server_state.file_mutex);
-    FILE *fp = fopen("friendships.txt", "r");
-    if (fp != NULL)
-    {
-        char line[512];
-        while (fgets(line, sizeof(line), fp))
-        {
-            char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-            if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-            {
-                if (strcmp(status, "accepted") == 0)
-                {
-                    if ((strcmp(user1, username) == 0 || strcmp(user2, username) == 0))
-                    {
-                        friend_count++;
-                    }
-                }
-            }
-        }
-        fclose(fp);
-    }
-    mutex_unlock(&server_state.file_mutex);
-
-    return friend_count;
+    return friend_graph_count(username);
 }
 
 /**
@@ -401,10 +341,11 @@ int create_group(const char *group_name, const char *creator)
 
     server_state.group_count++;
 
+    uint64_t lsn = wal_append_group(new_group);
+
     mutex_unlock(&server_state.groups_mutex);
 
-    // Lưu vào file
-    save_group_to_file("groups.txt", new_group);
+    wal_commit(lsn);
 
     printf("[GROUP] Created group '%s' by '%s'\n", group_name, creator);
 
@@ -485,13 +426,15 @@ int create_group_with_friends(const char *group_name, const char *creator, const
     new_group->created_at = time(NULL);
     server_state.group_count++;
 
+    int member_count = new_group->member_count;
+    uint64_t lsn = wal_append_group(new_group);
+
     mutex_unlock(&server_state.groups_mutex);
 
-    // Lưu vào file
-    save_group_to_file("groups.txt", new_group);
+    wal_commit(lsn);
 
     printf("[GROUP] Created group '%s' by '%s' with %d members\n",
-           group_name, creator, new_group->member_count);
+           group_name, creator, member_count);
 
     char log_msg[512];
     snprintf(log_msg, sizeof(log_msg), "Group created: %s by %s with members: %s",
@@ -507,7 +450,7 @@ int create_group_with_friends(const char *group_name, const char *creator, const
  * msg->to = người được mời
  * msg->extra = group_name
  */
-int handle_group_invite(const Message *msg)
+int handle_group_invite(const PackedMessage *msg)
 {
     if (msg == NULL)
         return -1;
@@ -571,7 +514,7 @@ int handle_group_invite(const Message *msg)
     int receiver_socket = find_user_socket(invitee);
     if (receiver_socket != -1)
     {
-        send_message_struct(receiver_socket, msg);
+        send_packed_message(receiver_socket, msg);
     }
     else
     {
@@ -642,8 +585,26 @@ int handle_group_join(const char *group_name, const char *username)
     strncpy(group->members[group->member_count], username, MAX_USERNAME_LEN - 1);
     group->member_count++;
 
+    uint64_t lsn = wal_append(WAL_GROUP_JOIN, "%s|%s", group_name, username);
+
+    // Chép danh sách members để thông báo sau khi nhả lock
+    // (send_user_groups_list cũng lock groups_mutex)
+    char members_to_notify[MAX_GROUP_MEMBERS][MAX_USERNAME_LEN];
+    int notify_count = 0;
+    for (int i = 0; i < group->member_count; i++)
+    {
+        if (strcmp(group->members[i], username) != 0)
+        {
+            strncpy(members_to_notify[notify_count], group->members[i], MAX_USERNAME_LEN - 1);
+            members_to_notify[notify_count][MAX_USERNAME_LEN - 1] = '\0';
+            notify_count++;
+        }
+    }
+
     mutex_unlock(&server_state.groups_mutex);
 
+    wal_commit(lsn);
+
     printf("[GROUP] User '%s' joined group '%s'\n", username, group_name);
 
     // Gửi lại group list cho người mới join (để refresh)
@@ -658,22 +619,22 @@ int handle_group_join(const char *group_name, const char *username)
     Message notification;
     create_response_message(&notification, MSG_GROUP_JOIN, "SERVER", "", username);
     strncpy(notification.extra, group_name, MAX_MESSAGE_LEN - 1);
+    PackedMessage packed = message_ref(&notification);
+    SharedFrame *frame = shared_frame_encode(&packed);
 
-    mutex_lock(&server_state.groups_mutex);
-    for (int i = 0; i < group->member_count; i++)
+    for (int i = 0; i < notify_count; i++)
     {
-        if (strcmp(group->members[i], username) != 0)
+        int member_socket = find_user_socket(members_to_notify[i]);
+        if (member_socket != -1)
         {
-            int member_socket = find_user_socket(group->members[i]);
-            if (member_socket != -1)
-            {
-                send_message_struct(member_socket, &notification);
-                // Refresh group list của member
-                send_user_groups_list(member_socket, group->members[i]);
-            }
+            if (frame != NULL)
+                send_message_shared(member_socket, &packed, frame);
+            // Refresh group list của member
+            send_user_groups_list(member_socket, members_to_notify[i]);
         }
     }
-    mutex_unlock(&server_state.groups_mutex);
+
+    shared_frame_release(frame);
 
     return 0;
 }
@@ -753,10 +714,12 @@ int handle_group_leave(const char *group_name, const char *username)
 
     printf("[DEBUG] Group '%s' now has %d members\n", group_name, group->member_count);
 
+    uint64_t lsn = wal_append(WAL_GROUP_LEAVE, "%s|%s", group_name, username);
+
     mutex_unlock(&server_state.groups_mutex);
 
-    // Update file groups.txt
-    save_all_groups_to_file("groups.txt");
+    wal_commit(lsn);
+    drop_group_offline_member(group_name, username);
 
     printf("[GROUP] User '%s' left group '%s'\n", username, group_name);
 
@@ -796,7 +759,7 @@ int handle_group_leave(const char *group_name, const char *username)
 /**
  * Chuyển tiếp tin nhắn nhóm
  */
-int relay_group_message(const Message *msg)
+int relay_group_message(const PackedMessage *msg)
 {
     if (msg == NULL)
         return -1;
@@ -828,11 +791,18 @@ int relay_group_message(const Message *msg)
     }
 
     // Forward đến tất cả members (trừ sender)
-    Message fwd_msg = *msg;
+    PackedMessage fwd_msg = *msg;
     fwd_msg.type = MSG_GROUP_MESSAGE;
-    strncpy(fwd_msg.extra, group_name, sizeof(fwd_msg.extra) - 1);
-    fwd_msg.extra[sizeof(fwd_msg.extra) - 1] = '\0';
+    fwd_msg.extra = group_name;
 
+    // Encode 1 lần cho cả nhóm
+    SharedFrame *frame = shared_frame_encode(&fwd_msg);
+    char offline_members[MAX_GROUP_MEMBERS][MAX_USERNAME_LEN];
+    int offline_count = 0;
+    int online_sockets[MAX_GROUP_MEMBERS];
+    int online_count = 0;
+
+    // Chỉ chụp danh sách member dưới lock, gửi và lưu offline sau khi unlock
     for (int i = 0; i < group->member_count; i++)
     {
         if (strcmp(group->members[i], msg->from) == 0)
@@ -841,19 +811,34 @@ int relay_group_message(const Message *msg)
         }
 
         int member_socket = find_user_socket(group->members[i]);
-        if (member_socket != -1)
+        if (member_socket != -1 && frame != NULL)
         {
-            send_message_struct(member_socket, &fwd_msg);
+            online_sockets[online_count++] = member_socket;
         }
         else
         {
-            // Member offline, save message
-            save_offline_message(&fwd_msg);
+            strncpy(offline_members[offline_count], group->members[i], MAX_USERNAME_LEN - 1);
+            offline_members[offline_count][MAX_USERNAME_LEN - 1] = '\0';
+            offline_count++;
         }
     }
 
     mutex_unlock(&server_state.groups_mutex);
 
+    for (int i = 0; i < online_count; i++)
+    {
+        send_message_shared(online_sockets[i], &fwd_msg, frame);
+    }
+
+    // Member offline: lưu 1 lần vào group log của nhóm (mỗi member 1 cursor đọc).
+    // Ngoài groups_mutex vì hàng đợi offline đầy thì chờ writer
+    if (offline_count > 0)
+    {
+        save_group_offline_message(&fwd_msg, offline_members, offline_count);
+    }
+
+    shared_frame_release(frame);
+
     // Log message
     log_message(msg);
 
@@ -861,18 +846,13 @@ int relay_group_message(const Message *msg)
 }
 
 /**
- * Load groups từ file
+ * Import groups từ file format cũ (chỉ khi chuyển sang state WAL lần đầu)
  */
 int load_groups_from_file(const char *filename)
 {
     FILE *fp = fopen(filename, "r");
     if (fp == NULL)
-    {
-        fp = fopen(filename, "w");
-        if (fp != NULL)
-            fclose(fp);
         return 0;
-    }
 
     mutex_lock(&server_state.groups_mutex);
 
@@ -885,29 +865,31 @@ int load_groups_from_file(const char *filename)
         Group *group = &server_state.groups[server_state.group_count];
 
         // Parse: group_name|creator|member1,member2,...|created_at
-        char *group_name = strtok(line, "|");
-        char *creator = strtok(NULL, "|");
-        char *members_str = strtok(NULL, "|");
-        char *created_str = strtok(NULL, "|\n");
+        FieldView fields[4];
+        int field_count = split_fields(line, strlen(line), SCAN_PIPE, fields, 4);
 
-        if (group_name != NULL && creator != NULL && members_str != NULL)
+        if (field_count >= 3 && fields[0].length > 0 && fields[1].length > 0 &&
+            fields[2].length > 0)
         {
-            strncpy(group->group_name, group_name, MAX_GROUP_NAME_LEN - 1);
-            strncpy(group->creator, creator, MAX_USERNAME_LEN - 1);
+            copy_field(group->group_name, MAX_GROUP_NAME_LEN, fields[0]);
+            copy_field(group->creator, MAX_USERNAME_LEN, fields[1]);
 
             // Parse members
+            FieldView members[MAX_GROUP_MEMBERS];
+            int member_count = split_fields(fields[2].data, fields[2].length, SCAN_COMMA,
+                                            members, MAX_GROUP_MEMBERS);
             group->member_count = 0;
-            char *member = strtok(members_str, ",");
-            while (member != NULL && group->member_count < MAX_GROUP_MEMBERS)
+            for (int i = 0; i < member_count; i++)
             {
-                strncpy(group->members[group->member_count], member, MAX_USERNAME_LEN - 1);
+                if (members[i].length == 0)
+                    continue;
+                copy_field(group->members[group->member_count], MAX_USERNAME_LEN, members[i]);
                 group->member_count++;
-                member = strtok(NULL, ",");
             }
 
-            if (created_str != NULL)
+            if (field_count == 4 && fields[3].length > 0)
             {
-                group->created_at = (time_t)atoll(created_str);
+                group->created_at = (time_t)atoll(fields[3].data);
             }
             else
             {
@@ -925,75 +907,6 @@ int load_groups_from_file(const char *filename)
     return server_state.group_count;
 }
 
-/**
- * Save group vào file
- */
-int save_group_to_file(const char *filename, const Group *group)
-{
-    if (group == NULL)
-        return -1;
-
-    FILE *fp = fopen(filename, "a");
-    if (fp == NULL)
-    {
-        perror("Failed to open groups file");
-        return -1;
-    }
-
-    fprintf(fp, "%s|%s|", group->group_name, group->creator);
-
-    for (int i = 0; i < group->member_count; i++)
-    {
-        fprintf(fp, "%s", group->members[i]);
-        if (i < group->member_count - 1)
-        {
-            fprintf(fp, ",");
-        }
-    }
-
-    fprintf(fp, "|%ld\n", group->created_at);
-    fclose(fp);
-
-    return 0;
-}
-
-/**
- * Save tất cả groups vào file (overwrite toàn bộ file)
- */
-int save_all_groups_to_file(const char *filename)
-{
-    FILE *fp = fopen(filename, "w");
-    if (fp == NULL)
-    {
-        perror("Failed to open groups file for writing");
-        return -1;
-    }
-
-    mutex_lock(&server_state.groups_mutex);
-
-    for (int i = 0; i < server_state.group_count; i++)
-    {
-        Group *group = &server_state.groups[i];
-        fprintf(fp, "%s|%s|", group->group_name, group->creator);
-
-        for (int j = 0; j < group->member_count; j++)
-        {
-            fprintf(fp, "%s", group->members[j]);
-            if (j < group->member_count - 1)
-            {
-                fprintf(fp, ",");
-            }
-        }
-
-        fprintf(fp, "|%ld\n", group->created_at);
-    }
-
-    mutex_unlock(&server_state.groups_mutex);
-    fclose(fp);
-
-    return 0;
-}
-
 /**
  * Gửi danh sách groups của user
  */
@@ -1037,7 +950,7 @@ int send_user_groups_list(int client_socket, const char *username)
 /**
  * Xử lý lời mời kết bạn
  */
-void handle_friend_request(Message *msg)
+void handle_friend_request(const PackedMessage *msg)
 {
     if (msg == NULL)
         return;
@@ -1087,53 +1000,27 @@ void handle_friend_request(Message *msg)
         return;
     }
 
-    // Kiểm tra đã là bạn chưa
-    mutex_lock(&server_state.file_mutex);
-    FILE *fp = fopen("friendships.txt", "r");
-    if (fp != NULL)
+    // Kiểm tra đã là bạn chưa, chưa có quan hệ thì lưu lời mời (cùng 1 lần lock đồ thị)
+    FriendState state = friend_graph_request(from_user, to_user);
+    if (state != FRIEND_NONE)
     {
-        char line[512];
-        while (fgets(line, sizeof(line), fp))
+        Message error_msg;
+        if (state == FRIEND_ACCEPTED)
         {
-            char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-            if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-            {
-                if ((strcmp(user1, from_user) == 0 && strcmp(user2, to_user) == 0) ||
-                    (strcmp(user1, to_user) == 0 && strcmp(user2, from_user) == 0))
-                {
-                    fclose(fp);
-                    mutex_unlock(&server_state.file_mutex);
-
-                    Message error_msg;
-                    if (strcmp(status, "accepted") == 0)
-                    {
-                        create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Already friends");
-                    }
-                    else
-                    {
-                        create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Friend request already sent");
-                    }
-
-                    int from_socket = find_client_socket(from_user);
-                    if (from_socket >= 0)
-                    {
-                        send_message_struct(from_socket, &error_msg);
-                    }
-                    return;
-                }
-            }
+            create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Already friends");
+        }
+        else
+        {
+            create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Friend request already sent");
         }
-        fclose(fp);
-    }
 
-    // Lưu lời mời kết bạn vào file
-    fp = fopen("friendships.txt", "a");
-    if (fp != NULL)
-    {
-        fprintf(fp, "%s|%s|pending\n", from_user, to_user);
-        fclose(fp);
+        int from_socket = find_client_socket(from_user);
+        if (from_socket >= 0)
+        {
+            send_message_struct(from_socket, &error_msg);
+        }
+        return;
     }
-    mutex_unlock(&server_state.file_mutex);
 
     // Gửi notification cho người nhận
     Message notify_msg;
@@ -1160,7 +1047,7 @@ void handle_friend_request(Message *msg)
 /**
  * Xử lý chấp nhận kết bạn
  */
-void handle_friend_accept(Message *msg)
+void handle_friend_accept(const PackedMessage *msg)
 {
     if (msg == NULL)
         return;
@@ -1170,63 +1057,9 @@ void handle_friend_accept(Message *msg)
 
     printf("[FRIEND_ACCEPT] %s accepted friend request from %s\n", from_user, to_user);
 
-    // Đọc file và update status
-    mutex_lock(&server_state.file_mutex);
-
-    FILE *fp = fopen("friendships.txt", "r");
-    FILE *temp = fopen("friendships_temp.txt", "w");
-
-    if (fp == NULL || temp == NULL)
-    {
-        if (fp)
-            fclose(fp);
-        if (temp)
-            fclose(temp);
-        mutex_unlock(&server_state.file_mutex);
-
-        Message error_msg;
-        create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Failed to accept friend request");
-        int from_socket = find_client_socket(from_user);
-        if (from_socket >= 0)
-        {
-            send_message_struct(from_socket, &error_msg);
-        }
-        return;
-    }
-
-    char line[512];
-    int found = 0;
-
-    while (fgets(line, sizeof(line), fp))
-    {
-        char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-        if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-        {
-            if ((strcmp(user1, to_user) == 0 && strcmp(user2, from_user) == 0) &&
-                strcmp(status, "pending") == 0)
-            {
-                // Update status thành accepted
-                fprintf(temp, "%s|%s|accepted\n", user1, user2);
-                found = 1;
-            }
-            else
-            {
-                fputs(line, temp);
-            }
-        }
-    }
-
-    fclose(fp);
-    fclose(temp);
-
-    if (found)
+    // Update pending -> accepted
+    if (friend_graph_accept(to_user, from_user) == 0)
     {
-        remove("friendships.txt");
-        rename("friendships_temp.txt", "friendships.txt");
-
-        printf("[DEBUG] File updated, now unlocking mutex and sending friend lists\n");
-        mutex_unlock(&server_state.file_mutex);
-
         // Gửi danh sách friends mới cho cả 2 người (để auto-refresh)
         int from_socket = find_client_socket(from_user);
         int to_socket = find_client_socket(to_user);
@@ -1265,9 +1098,6 @@ void handle_friend_accept(Message *msg)
     }
     else
     {
-        remove("friendships_temp.txt");
-        mutex_unlock(&server_state.file_mutex);
-
         Message error_msg;
         create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Friend request not found");
         int from_socket = find_client_socket(from_user);
@@ -1281,7 +1111,7 @@ void handle_friend_accept(Message *msg)
 /**
  * Xử lý từ chối kết bạn
  */
-void handle_friend_reject(Message *msg)
+void handle_friend_reject(const PackedMessage *msg)
 {
     if (msg == NULL)
         return;
@@ -1291,59 +1121,9 @@ void handle_friend_reject(Message *msg)
 
     printf("[FRIEND_REJECT] %s rejected friend request from %s\n", from_user, to_user);
 
-    // Xóa lời mời khỏi file
-    mutex_lock(&server_state.file_mutex);
-
-    FILE *fp = fopen("friendships.txt", "r");
-    FILE *temp = fopen("friendships_temp.txt", "w");
-
-    if (fp == NULL || temp == NULL)
+    // Xóa lời mời
+    if (friend_graph_reject(to_user, from_user) == 0)
     {
-        if (fp)
-            fclose(fp);
-        if (temp)
-            fclose(temp);
-        mutex_unlock(&server_state.file_mutex);
-
-        Message error_msg;
-        create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Failed to reject friend request");
-        int from_socket = find_client_socket(from_user);
-        if (from_socket >= 0)
-        {
-            send_message_struct(from_socket, &error_msg);
-        }
-        return;
-    }
-
-    char line[512];
-    int found = 0;
-
-    while (fgets(line, sizeof(line), fp))
-    {
-        char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-        if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-        {
-            if ((strcmp(user1, to_user) == 0 && strcmp(user2, from_user) == 0) &&
-                strcmp(status, "pending") == 0)
-            {
-                // Không ghi dòng này vào temp (xóa)
-                found = 1;
-            }
-            else
-            {
-                fputs(line, temp);
-            }
-        }
-    }
-
-    fclose(fp);
-    fclose(temp);
-
-    if (found)
-    {
-        remove("friendships.txt");
-        rename("friendships_temp.txt", "friendships.txt");
-
         // Thông báo cho người gửi lời mời
         Message notify_msg;
         char notify_content[MAX_MESSAGE_LEN];
@@ -1366,8 +1146,6 @@ void handle_friend_reject(Message *msg)
     }
     else
     {
-        remove("friendships_temp.txt");
-
         Message error_msg;
         create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user, "Friend request not found");
         int from_socket = find_client_socket(from_user);
@@ -1376,14 +1154,12 @@ void handle_friend_reject(Message *msg)
             send_message_struct(from_socket, &error_msg);
         }
     }
-
-    mutex_unlock(&server_state.file_mutex);
 }
 
 /**
  * Xử lý xóa bạn
  */
-void handle_friend_remove(Message *msg)
+void handle_friend_remove(const PackedMessage *msg)
 {
     if (!msg) return;
 
@@ -1395,59 +1171,7 @@ void handle_friend_remove(Message *msg)
 
     printf("[FRIEND_REMOVE] %s wants to remove friend %s\n", from_user, to_user);
 
-    int found = 0;
-
-    mutex_lock(&server_state.file_mutex);
-
-    FILE *fp = fopen("friendships.txt", "r");
-    FILE *temp = fopen("friendships_temp.txt", "w");
-
-    if (!fp || !temp)
-    {
-        if (fp) fclose(fp);
-        if (temp) fclose(temp);
-        mutex_unlock(&server_state.file_mutex);
-
-        Message error_msg;
-        create_response_message(&error_msg, MSG_RESPONSE_ERROR, "SERVER", from_user,
-                                "Failed to remove friend");
-        if (from_socket >= 0) send_message_struct(from_socket, &error_msg);
-        return;
-    }
-
-    char line[512];
-    while (fgets(line, sizeof(line), fp))
-    {
-        char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-        if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-        {
-            if (((strcmp(user1, from_user) == 0 && strcmp(user2, to_user) == 0) ||
-                 (strcmp(user1, to_user) == 0 && strcmp(user2, from_user) == 0)) &&
-                strcmp(status, "accepted") == 0)
-            {
-                found = 1; // skip dòng này
-            }
-            else
-            {
-                fputs(line, temp);
-            }
-        }
-    }
-
-    fclose(fp);
-    fclose(temp);
-
-    if (found)
-    {
-        remove("friendships.txt");
-        rename("friendships_temp.txt", "friendships.txt");
-    }
-    else
-    {
-        remove("friendships_temp.txt");
-    }
-
-    mutex_unlock(&server_state.file_mutex); // ✅ UNLOCK TRƯỚC KHI SEND
+    int found = friend_graph_remove(from_user, to_user) == 0;
 
     if (!found)
     {
@@ -1457,7 +1181,7 @@ void handle_friend_remove(Message *msg)
         return;
     }
 
-    // ✅ giờ mới gửi friend list (không còn deadlock)
+    // Gửi lại friend list cho cả 2 người
     if (from_socket >= 0) send_friends_list(from_socket, from_user);
     if (to_socket   >= 0) send_friends_list(to_socket, to_user);
 
@@ -1492,67 +1216,10 @@ int send_friends_list(int client_socket, const char *username)
     if (username == NULL)
         return -1;
 
-    char friends_list[BUFFER_SIZE] = "";
-    int count = 0;
-
-    mutex_lock(&server_state.file_mutex);
-
-    printf("[DEBUG] Reading friendships.txt for user: %s\n", username);
-
-    FILE *fp = fopen("friendships.txt", "r");
-    if (fp != NULL)
-    {
-        char line[512];
-        int line_num = 0;
-        while (fgets(line, sizeof(line), fp))
-        {
-            line_num++;
-            printf("[DEBUG] Line %d: %s", line_num, line);
-
-            char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
-            if (sscanf(line, "%[^|]|%[^|]|%s", user1, user2, status) == 3)
-            {
-                printf("[DEBUG] Parsed: user1='%s', user2='%s', status='%s'\n", user1, user2, status);
-
-                if (strcmp(status, "accepted") == 0)
-                {
-                    const char *friend_name = NULL;
-                    if (strcmp(user1, username) == 0)
-                    {
-                        friend_name = user2;
-                        printf("[DEBUG] Found friend: %s (user1 match)\n", friend_name);
-                    }
-                    else if (strcmp(user2, username) == 0)
-                    {
-                        friend_name = user1;
-                        printf("[DEBUG] Found friend: %s (user2 match)\n", friend_name);
-                    }
-
-                    if (friend_name != NULL)
-                    {
-                        if (count > 0)
-                        {
-                            strcat(friends_list, ",");
-                        }
-                        strcat(friends_list, friend_name);
-                        count++;
-                    }
-                }
-            }
-            else
-            {
-                printf("[DEBUG] Failed to parse line\n");
-            }
-        }
-        fclose(fp);
-    }
-    else
-    {
-        printf("[DEBUG] Failed to open friendships.txt\n");
-    }
+    char friends_list[BUFFER_SIZE];
+    int count = friend_graph_list(username, friends_list, sizeof(friends_list));
 
     printf("[DEBUG] Total friends found: %d\n", count);
-    mutex_unlock(&server_state.file_mutex);
 
     Message response;
     create_response_message(&response, MSG_FRIEND_LIST, "SERVER", username, friends_list);
@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// ===========================
+// 13. EPOLL REACTOR
+// ===========================
+// Mode --epoll: các reactor dùng chung 1 listening socket, connection chia round-robin
+// Mode --reuseport: mỗi reactor là 1 shard (listening socket SO_REUSEPORT riêng,
+// pin 1 CPU, bảng connection riêng). Gửi tới connection của shard khác đi qua
+// inbox lock-free MPSC của shard đó, chỉ reactor sở hữu mới ghi vào socket
+
+static Reactor *reactors = NULL;
+static int reactor_count = 0;
+static unsigned int next_reactor = 0;
+static __thread Reactor *current_reactor = NULL;   // Reactor của thread hiện tại
+
+/**
+ * Chuyển socket sang non-blocking
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Đóng connection do reactor sở hữu
+ */
+static void reactor_close_client(ClientConnection *client) {
+    printf("[REACTOR] Client socket %d disconnected\n", client->socket_fd);
+
+    Reactor *reactor = client->reactor;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+
+    // Xóa khỏi bảng shard (đổi chỗ với phần tử cuối)
+    if (server_options.reuseport && client->shard_slot >= 0) {
+        ClientConnection *last = reactor->conns[--reactor->conn_count];
+        reactor->conns[client->shard_slot] = last;
+        last->shard_slot = client->shard_slot;
+        reactor->conns[reactor->conn_count] = NULL;
+        client->shard_slot = -1;
+    }
+
+    cleanup_client(client);
+    release_client_slot(client);
+}
+
+/**
+ * Đăng ký connection vào epoll của reactor (edge-triggered)
+ */
+int reactor_add_client(Reactor *reactor, ClientConnection *client) {
+    if (reactor == NULL || client == NULL) return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+
+    client->reactor = reactor;
+    client->shard_slot = -1;
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &ev) < 0) {
+        perror("epoll_ctl(ADD) failed");
+        client->reactor = NULL;
+        return -1;
+    }
+
+    // Mode --reuseport: chỉ chính reactor accept connection của nó
+    if (server_options.reuseport) {
+        if (reactor->conn_count == reactor->conn_capacity) {
+            int capacity = reactor->conn_capacity > 0 ? reactor->conn_capacity * 2
+                                                      : CLIENT_SLAB_CHUNK;
+            ClientConnection **conns = realloc(reactor->conns, capacity * sizeof(*conns));
+            if (conns == NULL) {
+                epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+                client->reactor = NULL;
+                return -1;
+            }
+            reactor->conns = conns;
+            reactor->conn_capacity = capacity;
+        }
+
+        client->shard_slot = reactor->conn_count;
+        reactor->conns[reactor->conn_count++] = client;
+    }
+
+    return 0;
+}
+
+/**
+ * Thread hiện tại có phải reactor sở hữu connection không
+ */
+bool reactor_owns(const ClientConnection *client) {
+    return current_reactor != NULL && client->reactor == current_reactor;
+}
+
+/**
+ * Bật/tắt EPOLLOUT cho connection (caller giữ outq.lock, socket_fd còn hợp lệ)
+ * Bật EPOLLOUT trên socket đang ghi được sẽ sinh event ngay (edge-triggered),
+ * nên thread khác dùng hàm này để đánh thức reactor sở hữu flush hàng đợi gửi
+ */
+int reactor_set_writable(ClientConnection *client, bool enable) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+
+    if (epoll_ctl(client->reactor->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &ev) < 0) {
+        if (errno != ENOENT) perror("epoll_ctl(MOD) failed");  // ENOENT: reactor đang đóng connection
+        return -1;
+    }
+
+    return 0;
+}
+
+// ===========================
+// SHARD INBOX (lock-free MPSC)
+// ===========================
+
+/**
+ * Đẩy message vào inbox (nhiều producer, không lock)
+ */
+static void inbox_push(Reactor *reactor, ShardMessage *msg) {
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    ShardMessage *prev = __atomic_exchange_n(&reactor->inbox_tail, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lấy message ra khỏi inbox (chỉ reactor thread gọi)
+ * Return: NULL nếu inbox rỗng hoặc producer chưa nối xong node
+ */
+static ShardMessage *inbox_pop(Reactor *reactor) {
+    ShardMessage *head = reactor->inbox_head;
+    ShardMessage *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &reactor->inbox_stub) {
+        if (next == NULL) return NULL;
+        reactor->inbox_head = next;
+        head = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        reactor->inbox_head = next;
+        return head;
+    }
+
+    if (head != __atomic_load_n(&reactor->inbox_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    inbox_push(reactor, &reactor->inbox_stub);
+
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        reactor->inbox_head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+/**
+ * Chuyển dữ liệu gửi tới connection thuộc shard khác
+ * Return: 1 nếu đã xếp vào inbox, 0 nếu caller tự gửi trực tiếp, -1 nếu lỗi
+ */
+int reactor_route_send(int socket_fd, SharedFrame *frame) {
+    if (!server_options.reuseport || current_reactor == NULL) return 0;
+
+    ClientConnection *client = find_client_by_fd(socket_fd);
+    Reactor *owner = client != NULL ? client->reactor : NULL;
+
+    if (owner == NULL || owner == current_reactor) return 0;
+
+    // Handle lấy sau khi tra fd: slot vừa được tái sử dụng sẽ không còn khớp fd
+    ClientHandle handle = client_handle(client);
+    if (client->socket_fd != socket_fd) return -1;
+
+    ShardMessage *msg = malloc(sizeof(ShardMessage));
+    if (msg == NULL) return -1;
+
+    msg->client = handle;
+    msg->frame = frame;
+    shared_frame_ref(frame);  // Frame bất biến: chỉ chuyển reference, không copy
+
+    inbox_push(owner, msg);
+
+    // Chỉ ghi event_fd nếu reactor chưa được đánh thức
+    if (__atomic_exchange_n(&owner->inbox_wakeup, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        if (write(owner->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Gửi toàn bộ dữ liệu trong inbox tới connection của shard
+ */
+static void reactor_drain_inbox(Reactor *reactor) {
+    uint64_t value;
+    while (read(reactor->event_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+
+    // Reset cờ TRƯỚC khi drain: producer đến sau sẽ đánh thức lại
+    __atomic_store_n(&reactor->inbox_wakeup, 0, __ATOMIC_RELEASE);
+
+    ShardMessage *msg;
+    while ((msg = inbox_pop(reactor)) != NULL) {
+        // Connection có thể đã đóng (slot tái sử dụng) khi message tới
+        ClientConnection *client = client_from_handle(msg->client);
+
+        if (client != NULL && client->reactor == reactor && client->shard_slot >= 0 &&
+            reactor->conns[client->shard_slot] == client) {
+            enqueue_client_frame(client->socket_fd, msg->frame);
+        }
+
+        shared_frame_release(msg->frame);
+        free(msg);
+    }
+}
+
+/**
+ * Accept tất cả connection đang chờ, chia round-robin cho các reactor
+ */
+static void reactor_accept(Reactor *reactor) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addr_len = sizeof(address);
+        int client_socket = accept4(reactor->listen_fd, (struct sockaddr *)&address,
+                                    &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        ClientConnection *client = alloc_client_slot();
+        if (client == NULL) {
+            printf("[WARNING] Maximum clients reached, rejecting socket %d\n", client_socket);
+            close(client_socket);
+            continue;
+        }
+
+        configure_client_socket(client_socket);
+
+        client->socket_fd = client_socket;
+        client->address = address;
+        client->is_authenticated = false;
+        attach_client_fd(client);
+
+        log_client_connect(client);
+        start_client_timer(client);
+
+        // Shard giữ connection nó accept, mode thường chia round-robin
+        Reactor *owner = reactor;
+        if (!server_options.reuseport) {
+            unsigned int index = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED);
+            owner = &reactors[index % reactor_count];
+        }
+
+        if (reactor_add_client(owner, client) < 0) {
+            cleanup_client(client);
+            release_client_slot(client);
+        }
+    }
+}
+
+/**
+ * Đọc hết dữ liệu đang có trên socket (edge-triggered: đọc đến EAGAIN)
+ * Return: -1 nếu connection cần đóng
+ */
+static int reactor_handle_readable(ClientConnection *client) {
+    if (client->rbuf == NULL) {
+        client->rbuf = malloc(CLIENT_RBUF_SIZE);
+        if (client->rbuf == NULL) return -1;
+        client->rbuf_len = 0;
+    }
+
+    while (1) {
+        size_t space = CLIENT_RBUF_SIZE - client->rbuf_len;
+        if (space == 0) return -1;
+
+        ssize_t bytes = recv(client->socket_fd, client->rbuf + client->rbuf_len, space, 0);
+
+        if (bytes > 0) {
+            client->rbuf_len += bytes;
+            if (process_client_input(client) < 0) return -1;
+            continue;
+        }
+
+        if (bytes == 0) return -1;  // Connection closed
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+        perror("recv() failed");
+        return -1;
+    }
+
+    // Connection idle không giữ buffer
+    if (client->rbuf_len == 0) {
+        free(client->rbuf);
+        client->rbuf = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Event loop của 1 reactor
+ */
+static THREAD_RETURN reactor_thread(void *arg) {
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    current_reactor = reactor;
+
+    if (reactor->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "[REACTOR] Failed to pin reactor %d to CPU %d\n",
+                    reactor->id, reactor->cpu);
+        }
+    }
+
+    printf("[REACTOR] Reactor %d started\n", reactor->id);
+
+    while (1) {
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        // Frame gửi trong cả đợt sự kiện được gộp, flush 1 lần mỗi socket
+        begin_send_batch();
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(reactor);
+                continue;
+            }
+
+            if (events[i].data.ptr == reactor) {
+                reactor_drain_inbox(reactor);
+                continue;
+            }
+
+            ClientConnection *client = (ClientConnection *)events[i].data.ptr;
+            uint32_t mask = events[i].events;
+
+            if ((mask & EPOLLOUT) && flush_client_output(client) < 0) {
+                reactor_close_client(client);
+                continue;
+            }
+
+            if ((mask & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+                reactor_handle_readable(client) < 0) {
+                reactor_close_client(client);
+                continue;
+            }
+
+            // Hàng đợi có thể đã được gửi bớt ở EPOLLOUT hoặc ngay trong handler
+            check_slow_consumer(client, client->socket_fd);
+        }
+
+        end_send_batch();
+
+        // Hot upgrade: dừng sau đợt sự kiện hiện tại (frame dở nằm nguyên trong rbuf)
+        if (upgrade_pending()) {
+            upgrade_park(NULL);
+        }
+    }
+
+    THREAD_RETURN_VALUE;
+}
+
+/**
+ * Mở thêm 1 listening socket SO_REUSEPORT trên cùng port (mode --reuseport)
+ */
+static int reactor_open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror("Shard listen failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Khởi động count reactor thread
+ * Mode thường: tất cả cùng chờ trên listening socket
+ * (EPOLLEXCLUSIVE để mỗi connection chỉ đánh thức 1 reactor)
+ * Mode --reuseport: reactor 0 dùng server_socket, các reactor khác mở socket riêng,
+ * kernel chia connection theo hash 4-tuple
+ */
+int start_reactors(int server_socket, int count) {
+    if (count <= 0) return -1;
+
+    reactors = calloc(count, sizeof(Reactor));
+    if (reactors == NULL) return -1;
+
+    reactor_count = count;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 0; i < count; i++) {
+        Reactor *reactor = &reactors[i];
+        reactor->id = i;
+        reactor->cpu = (server_options.reuseport && cpus > 0) ? (int)(i % cpus) : -1;
+        reactor->listen_fd = server_socket;
+        reactor->inbox_head = &reactor->inbox_stub;
+        reactor->inbox_tail = &reactor->inbox_stub;
+
+        if (server_options.reuseport && i > 0) {
+            // Hot upgrade: dùng lại listening socket của process cũ nếu có
+            reactor->listen_fd = upgrade_take_listener(i);
+            if (reactor->listen_fd < 0) {
+                reactor->listen_fd = reactor_open_listener(server_options.port);
+            }
+            if (reactor->listen_fd < 0) return -1;
+        }
+
+        if (set_nonblocking(reactor->listen_fd) < 0) {
+            perror("Failed to set listening socket non-blocking");
+            return -1;
+        }
+
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (reactor->epoll_fd < 0 || reactor->event_fd < 0) {
+            perror("epoll_create1/eventfd failed");
+            return -1;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = server_options.reuseport ? EPOLLIN : (EPOLLIN | EPOLLEXCLUSIVE);
+        ev.data.ptr = NULL;  // NULL = listening socket
+
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) < 0) {
+            perror("epoll_ctl(listen) failed");
+            return -1;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = reactor;  // reactor = inbox event_fd
+
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &ev) < 0) {
+            perror("epoll_ctl(eventfd) failed");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&reactors[i].thread_id, NULL, reactor_thread, &reactors[i]) != 0) {
+            fprintf(stderr, "Failed to create reactor thread\n");
+            return -1;
+        }
+        pthread_detach(reactors[i].thread_id);
+    }
+
+    return 0;
+}
+
+// ===========================
+// HOT UPGRADE HOOKS
+// ===========================
+
+/**
+ * Nhận connection chuyển từ process cũ (hot upgrade), chia round-robin như accept
+ */
+int reactor_adopt_client(ClientConnection *client) {
+    if (reactor_count == 0 || set_nonblocking(client->socket_fd) < 0) return -1;
+
+    unsigned int index = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED);
+    return reactor_add_client(&reactors[index % reactor_count], client);
+}
+
+/**
+ * Listening socket của các reactor (mode --reuseport mỗi reactor 1 socket)
+ * Return: số fd đã ghi vào fds
+ */
+int reactor_listen_fds(int *fds, int max) {
+    int count = 0;
+
+    for (int i = 0; i < reactor_count && count < max; i++) {
+        if (i > 0 && reactors[i].listen_fd == reactors[0].listen_fd) break;
+        fds[count++] = reactors[i].listen_fd;
+    }
+
+    return count;
+}
+
+/**
+ * Đánh thức mọi reactor (qua event_fd của inbox) để chúng thấy yêu cầu dừng
+ */
+void reactor_wake_all(void) {
+    for (int i = 0; i < reactor_count; i++) {
+        __atomic_store_n(&reactors[i].inbox_wakeup, 1, __ATOMIC_RELEASE);
+        uint64_t one = 1;
+        if (write(reactors[i].event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+/**
+ * Chuyển dữ liệu còn trong inbox vào hàng đợi gửi của connection
+ * Chỉ gọi khi mọi reactor đã dừng (không còn consumer nào khác)
+ */
+void reactor_drain_inboxes(void) {
+    for (int i = 0; i < reactor_count; i++) {
+        reactor_drain_inbox(&reactors[i]);
+    }
+}
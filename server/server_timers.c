@@ -0,0 +1,535 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// ===========================
+// 16. TIMER WHEEL
+// ===========================
+// Timer wheel phân cấp dùng chung cho cả server, chạy trên 1 timer thread riêng.
+// TIMER_WHEEL_LEVELS tầng, mỗi tầng TIMER_WHEEL_SLOTS slot; tầng n chứa timer còn
+// < SLOTS^(n+1) tick. Timer là node nằm sẵn trong struct của owner (intrusive list)
+// nên arm/cancel là O(1) và không cấp phát; timer tầng trên được hạ tầng (cascade)
+// khi tầng dưới quay hết 1 vòng.
+//
+// Mỗi connection có đúng 1 timer cho mọi deadline (idle, frame dở, upload, login,
+// heartbeat). I/O thread chỉ ghi timestamp (activity_ms, upload_since_ms...), không
+// đụng vào wheel; khi timer hết hạn callback tính lại deadline gần nhất, gửi PING
+// nếu tới lượt và arm lại nếu chưa quá hạn.
+
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4                // 64^4 tick * 100ms ~ 19 ngày
+
+static struct {
+    mutex_t lock;
+    pthread_cond_t done;        // Báo callback đang chạy đã xong (cho timer_cancel)
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    Timer *expired;             // Đã hết hạn, chờ timer thread chạy callback
+    Timer *running;             // Timer có callback đang chạy
+    uint64_t tick;              // Tick kế tiếp cần xử lý
+    thread_t thread_id;
+} wheel;
+
+static void timer_link(Timer **head, Timer *timer) {
+    timer->next = *head;
+    if (*head != NULL) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void timer_unlink(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * Đặt timer vào slot theo khoảng cách tới tick hiện tại (giữ wheel.lock)
+ * Timer xa hơn tầng cao nhất nằm ở slot cuối, được đặt lại khi tới lượt
+ */
+static void wheel_insert(Timer *timer) {
+    if (timer->expires < wheel.tick) timer->expires = wheel.tick;
+
+    uint64_t delta = timer->expires - wheel.tick;
+    uint64_t expires = timer->expires;
+    uint64_t span = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= span) expires = wheel.tick + span - 1;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int index = (int)((expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    timer_link(&wheel.slots[level][index], timer);
+}
+
+/**
+ * Hạ toàn bộ timer của 1 slot tầng trên xuống tầng dưới
+ */
+static void wheel_cascade(int level, int index) {
+    Timer *timer = wheel.slots[level][index];
+
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        timer_unlink(timer);
+        wheel_insert(timer);
+        timer = next;
+    }
+}
+
+/**
+ * Xử lý 1 tick: cascade nếu tầng 0 quay hết vòng, chuyển timer hết hạn sang expired
+ */
+static void wheel_advance(void) {
+    uint64_t tick = wheel.tick;
+    int index = (int)(tick & TIMER_WHEEL_MASK);
+
+    if (index == 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int level_index = (int)((tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+            wheel_cascade(level, level_index);
+            if (level_index != 0) break;
+        }
+    }
+
+    Timer *timer = wheel.slots[0][index];
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        timer_unlink(timer);
+        if (timer->expires > tick) {
+            wheel_insert(timer);    // Bị giới hạn ở tầng cao nhất, chưa tới hạn
+        } else {
+            timer_link(&wheel.expired, timer);
+        }
+        timer = next;
+    }
+
+    wheel.tick = tick + 1;
+}
+
+/**
+ * Timer thread: mỗi TIMER_TICK_MS xử lý các tick đã qua rồi chạy callback
+ * Callback chạy ngoài wheel.lock nên được phép arm lại chính timer đó
+ */
+static THREAD_RETURN timer_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep_ms(TIMER_TICK_MS);
+
+        uint64_t now = monotonic_ms() / TIMER_TICK_MS;
+
+        mutex_lock(&wheel.lock);
+        while (wheel.tick <= now) {
+            wheel_advance();
+        }
+
+        Timer *timer;
+        while ((timer = wheel.expired) != NULL) {
+            timer_unlink(timer);
+            wheel.running = timer;
+            mutex_unlock(&wheel.lock);
+
+            timer->callback(timer);
+
+            mutex_lock(&wheel.lock);
+            wheel.running = NULL;
+            pthread_cond_broadcast(&wheel.done);
+        }
+        mutex_unlock(&wheel.lock);
+    }
+
+    THREAD_RETURN_VALUE;
+}
+
+/**
+ * Khởi động timer wheel, gọi trước khi I/O thread arm timer đầu tiên
+ */
+int start_timer_wheel(void) {
+    mutex_init(&wheel.lock, NULL);
+    pthread_cond_init(&wheel.done, NULL);
+    wheel.tick = monotonic_ms() / TIMER_TICK_MS;
+
+    if (pthread_create(&wheel.thread_id, NULL, timer_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to create timer thread\n");
+        return -1;
+    }
+    pthread_detach(wheel.thread_id);
+
+    printf("[TIMER] Timer wheel started: %d levels x %d slots, tick %d ms\n",
+           TIMER_WHEEL_LEVELS, TIMER_WHEEL_SLOTS, TIMER_TICK_MS);
+
+    return 0;
+}
+
+/**
+ * Arm (hoặc arm lại) timer hết hạn sau delay_ms - O(1)
+ */
+void timer_arm(Timer *timer, uint64_t delay_ms) {
+    uint64_t expires = (monotonic_ms() + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    mutex_lock(&wheel.lock);
+    if (timer->pprev != NULL) timer_unlink(timer);
+    timer->expires = expires;
+    wheel_insert(timer);
+    mutex_unlock(&wheel.lock);
+}
+
+/**
+ * Kéo timer đang chờ về sớm hơn nếu delay_ms ngắn hơn deadline hiện tại
+ * Timer đã bị hủy hoặc callback đang chạy thì bỏ qua (callback tự arm lại)
+ */
+void timer_arm_earlier(Timer *timer, uint64_t delay_ms) {
+    uint64_t expires = (monotonic_ms() + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    mutex_lock(&wheel.lock);
+    if (timer->pprev != NULL && expires < timer->expires) {
+        timer_unlink(timer);
+        timer->expires = expires;
+        wheel_insert(timer);
+    }
+    mutex_unlock(&wheel.lock);
+}
+
+/**
+ * Hủy timer - O(1), chờ nếu callback của timer đang chạy
+ * Sau khi trả về callback không còn chạy và timer không còn trong wheel
+ * Không được gọi từ callback của chính timer đó
+ */
+void timer_cancel(Timer *timer) {
+    mutex_lock(&wheel.lock);
+    while (wheel.running == timer) {
+        pthread_cond_wait(&wheel.done, &wheel.lock);
+    }
+    if (timer->pprev != NULL) timer_unlink(timer);
+    mutex_unlock(&wheel.lock);
+}
+
+// ===========================
+// CONNECTION DEADLINES
+// ===========================
+
+/**
+ * Số bytes đã nhận nhưng chưa thành frame hoàn chỉnh (đọc từ timer thread)
+ * Chỉ là ước lượng: giá trị sai tạm thời bị loại vì frame dở phải tồn tại suốt frame_timeout
+ */
+static bool client_has_partial_input(ClientConnection *client) {
+    FrameReader *reader = __atomic_load_n(&client->reader, __ATOMIC_ACQUIRE);
+
+    if (reader != NULL) {
+        size_t end = __atomic_load_n(&reader->end, __ATOMIC_RELAXED);
+        size_t start = __atomic_load_n(&reader->start, __ATOMIC_RELAXED);
+        return end > start;
+    }
+
+    return __atomic_load_n(&client->rbuf_len, __ATOMIC_RELAXED) > 0;
+}
+
+/**
+ * Ngắt connection quá hạn: reader/reactor sở hữu thấy EOF và đóng như bình thường
+ */
+static void expire_client(ClientConnection *client, const char *reason) {
+    mutex_lock(&client->outq.lock);
+    int socket_fd = client->socket_fd;
+    if (client->in_use && socket_fd >= 0) {
+        printf("[TIMER] Socket %d (%s): %s, disconnecting\n",
+               socket_fd, client->username[0] ? client->username : "-", reason);
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+    mutex_unlock(&client->outq.lock);
+}
+
+/**
+ * Gửi PING (timer thread), CONTENT là thời điểm gửi để khớp với PONG
+ */
+static void send_ping(ClientConnection *client, uint64_t now) {
+    int socket_fd = __atomic_load_n(&client->socket_fd, __ATOMIC_RELAXED);
+    if (socket_fd < 0) return;
+
+    Message ping;
+    char token[32];
+    snprintf(token, sizeof(token), "%llu", (unsigned long long)now);
+    create_response_message(&ping, MSG_PING, "SERVER", client->username, token);
+
+    client->last_ping_ms = now;
+    __atomic_store_n(&client->ping_sent_ms, now, __ATOMIC_RELEASE);
+    send_message_struct(socket_fd, &ping);
+}
+
+static void update_deadline(uint64_t deadline, uint64_t *next) {
+    if (deadline < *next) *next = deadline;
+}
+
+/**
+ * Callback timer của connection: kiểm tra mọi deadline, ngắt hoặc arm lại
+ */
+static void client_timer_expired(Timer *timer) {
+    ClientConnection *client = (ClientConnection *)((char *)timer - offsetof(ClientConnection, timer));
+    uint64_t now = monotonic_ms();
+    uint64_t next = UINT64_MAX;
+    uint64_t upload_since = __atomic_load_n(&client->upload_since_ms, __ATOMIC_ACQUIRE);
+    uint64_t activity = __atomic_load_n(&client->activity_ms, __ATOMIC_ACQUIRE);
+    uint64_t request = __atomic_load_n(&client->request_ms, __ATOMIC_ACQUIRE);
+    uint64_t deadline;
+
+    // Hot upgrade đang chuyển connection: không đóng/ping, kiểm tra lại sau
+    if (upgrade_pending()) {
+        timer_arm(timer, 1000);
+        return;
+    }
+
+    // Bị kick: chờ gửi nốt hàng đợi, client không đọc thì ngắt sau slow_ms
+    uint64_t close_ms = __atomic_load_n(&client->outq.close_ms, __ATOMIC_ACQUIRE);
+    if (close_ms != 0) {
+        deadline = close_ms + (uint64_t)server_options.slow_ms;
+        if (now >= deadline) {
+            expire_client(client, "output not drained before close");
+        } else {
+            timer_arm(timer, deadline - now);
+        }
+        return;
+    }
+
+    // File data: deadline cho cả lần upload, thay cho idle/frame timeout
+    if (upload_since != 0 && server_options.upload_timeout > 0) {
+        deadline = upload_since + (uint64_t)server_options.upload_timeout * 1000;
+        if (now >= deadline) {
+            expire_client(client, "upload timeout");
+            return;
+        }
+        update_deadline(deadline, &next);
+    }
+
+    // Kết nối nhưng không đăng nhập (session treo)
+    if (server_options.login_timeout > 0 &&
+        !__atomic_load_n(&client->is_authenticated, __ATOMIC_RELAXED)) {
+        deadline = client->connected_ms + (uint64_t)server_options.login_timeout * 1000;
+        if (now >= deadline) {
+            expire_client(client, "login timeout");
+            return;
+        }
+        update_deadline(deadline, &next);
+    }
+
+    if (upload_since == 0 && server_options.idle_timeout > 0) {
+        deadline = request + (uint64_t)server_options.idle_timeout * 1000;
+        if (now >= deadline) {
+            expire_client(client, "idle timeout");
+            return;
+        }
+        update_deadline(deadline, &next);
+    }
+
+    // Frame dở: có bytes chưa thành frame và không có frame mới nào từ lần thấy đầu tiên
+    if (upload_since == 0 && server_options.frame_timeout > 0) {
+        uint64_t frame_ms = (uint64_t)server_options.frame_timeout * 1000;
+
+        if (client_has_partial_input(client)) {
+            if (client->stall_since_ms == 0 || client->stall_activity_ms != activity) {
+                client->stall_since_ms = now;
+                client->stall_activity_ms = activity;
+            }
+            deadline = client->stall_since_ms + frame_ms;
+            if (now >= deadline) {
+                expire_client(client, "stalled mid-frame");
+                return;
+            }
+            update_deadline(deadline, &next);
+        } else {
+            client->stall_since_ms = 0;
+        }
+
+        // Lấy mẫu định kỳ để thấy frame dở mới
+        update_deadline(now + (frame_ms + 1) / 2, &next);
+    }
+
+    // Heartbeat: PING mỗi ping_interval, không có PONG sau ping_timeout thì coi là chết
+    if (upload_since == 0 && server_options.ping_interval > 0 &&
+        __atomic_load_n(&client->is_authenticated, __ATOMIC_RELAXED)) {
+        uint64_t sent = __atomic_load_n(&client->ping_sent_ms, __ATOMIC_ACQUIRE);
+
+        if (sent != 0) {
+            deadline = sent + (uint64_t)server_options.ping_timeout * 1000;
+            if (now >= deadline) {
+                expire_client(client, "heartbeat timeout");
+                return;
+            }
+        } else {
+            deadline = client->last_ping_ms + (uint64_t)server_options.ping_interval * 1000;
+            if (now >= deadline) {
+                send_ping(client, now);
+                deadline = now + (uint64_t)server_options.ping_timeout * 1000;
+            }
+        }
+        update_deadline(deadline, &next);
+    }
+
+    if (next != UINT64_MAX) {
+        timer_arm(timer, next - now);
+    }
+}
+
+/**
+ * Bắt đầu theo dõi deadline của connection mới (sau attach_client_fd)
+ */
+void start_client_timer(ClientConnection *client) {
+    uint64_t now = monotonic_ms();
+
+    client->connected_ms = now;
+    client->stall_since_ms = 0;
+    client->last_ping_ms = now;
+    __atomic_store_n(&client->activity_ms, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->request_ms, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->upload_since_ms, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->ping_sent_ms, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->rtt_count, 0, __ATOMIC_RELEASE);
+    client->timer.callback = client_timer_expired;
+
+    // Lần kiểm tra đầu tiên: deadline ngắn nhất đang bật
+    int timeouts[] = { server_options.frame_timeout, server_options.login_timeout,
+                       server_options.idle_timeout, server_options.upload_timeout,
+                       server_options.ping_interval };
+    int shortest = 0;
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        if (timeouts[i] > 0 && (shortest == 0 || timeouts[i] < shortest)) {
+            shortest = timeouts[i];
+        }
+    }
+
+    if (shortest > 0) {
+        timer_arm(&client->timer, (uint64_t)shortest * 1000 / 2);
+    }
+}
+
+/**
+ * Ngừng theo dõi (đầu cleanup_client, không giữ lock nào)
+ */
+void stop_client_timer(ClientConnection *client) {
+    if (client->timer.callback == NULL) return;
+    timer_cancel(&client->timer);
+}
+
+/**
+ * I/O thread gọi sau mỗi frame hoàn chỉnh
+ */
+void touch_client(ClientConnection *client) {
+    uint64_t now = monotonic_ms();
+    __atomic_store_n(&client->activity_ms, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->request_ms, now, __ATOMIC_RELEASE);
+}
+
+/**
+ * Đánh dấu bắt đầu/kết thúc nhận file data (deadline upload)
+ */
+void client_upload_started(ClientConnection *client) {
+    __atomic_store_n(&client->upload_since_ms, monotonic_ms(), __ATOMIC_RELEASE);
+}
+
+void client_upload_finished(ClientConnection *client) {
+    // Idle tính lại từ lúc upload xong; PING gửi trong lúc upload có thể nhận PONG
+    // muộn nên được bỏ, timer gửi PING mới ở lần kế tiếp
+    touch_client(client);
+    __atomic_store_n(&client->ping_sent_ms, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&client->upload_since_ms, 0, __ATOMIC_RELEASE);
+}
+
+// ===========================
+// HEARTBEAT & RTT
+// ===========================
+
+static int compare_rtt(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Percentile RTT trên RTT_SAMPLES PONG gần nhất
+ * Return: số mẫu (0 nếu chưa đo được lần nào)
+ */
+static int client_rtt_percentiles(ClientConnection *client, uint32_t *p50, uint32_t *p90,
+                                  uint32_t *p99) {
+    uint32_t count = __atomic_load_n(&client->rtt_count, __ATOMIC_ACQUIRE);
+    int samples = count < RTT_SAMPLES ? (int)count : RTT_SAMPLES;
+    if (samples == 0) return 0;
+
+    uint32_t sorted[RTT_SAMPLES];
+    memcpy(sorted, client->rtt_samples, samples * sizeof(uint32_t));
+    qsort(sorted, samples, sizeof(uint32_t), compare_rtt);
+
+    *p50 = sorted[(samples - 1) * 50 / 100];
+    *p90 = sorted[(samples - 1) * 90 / 100];
+    *p99 = sorted[(samples - 1) * 99 / 100];
+    return samples;
+}
+
+/**
+ * Xử lý PING/PONG trên I/O thread nhận frame (không qua worker pool nên
+ * RTT không tính thời gian chờ handler)
+ * - PING của client: trả PONG cùng token, EXTRA là RTT server đo được
+ * - PONG của client: khớp token với PING đang chờ rồi ghi RTT
+ * Return: true nếu view là heartbeat và đã được xử lý
+ */
+bool handle_heartbeat(ClientConnection *client, const MessageView *view) {
+    uint64_t now = monotonic_ms();
+
+    if (view->type == MSG_PING) {
+        Message ping;
+        message_from_view(view, &ping);
+
+        Message pong;
+        create_response_message(&pong, MSG_PONG, "SERVER", ping.from, ping.content);
+
+        uint32_t p50, p90, p99;
+        int samples = client_rtt_percentiles(client, &p50, &p90, &p99);
+        if (samples > 0) {
+            snprintf(pong.extra, sizeof(pong.extra), "p50=%ums p90=%ums p99=%ums n=%d",
+                     p50, p90, p99, samples);
+        }
+        send_message_struct(client->socket_fd, &pong);
+    } else if (view->type == MSG_PONG) {
+        char content[32];
+        size_t length = view->content.length < sizeof(content) - 1 ?
+                        view->content.length : sizeof(content) - 1;
+        memcpy(content, view->content.data, length);
+        content[length] = '\0';
+        uint64_t token = strtoull(content, NULL, 10);
+
+        // PONG cũ hoặc token lạ bị bỏ qua
+        if (token != 0 && token <= now &&
+            __atomic_compare_exchange_n(&client->ping_sent_ms, &token, 0, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            uint32_t count = client->rtt_count;
+            client->rtt_samples[count % RTT_SAMPLES] = (uint32_t)(now - token);
+            __atomic_store_n(&client->rtt_count, count + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        return false;
+    }
+
+    __atomic_store_n(&client->activity_ms, now, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Ghi RTT percentile của connection vào log khi đóng
+ */
+void log_client_rtt(ClientConnection *client) {
+    if (client->socket_fd < 0) return;  // Slot đã đóng trước đó
+
+    uint32_t p50, p90, p99;
+    int samples = client_rtt_percentiles(client, &p50, &p90, &p99);
+    if (samples == 0) return;
+
+    printf("[PING] Socket %d (%s): RTT p50 %u ms, p90 %u ms, p99 %u ms over %d samples\n",
+           client->socket_fd, client->username, p50, p90, p99, samples);
+}
@@ -0,0 +1,745 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+// ===========================
+// 17. HOT UPGRADE
+// ===========================
+// SIGUSR2: process cũ fork + exec lại binary theo argv[0] (bản vừa deploy) với
+// CHAT_UPGRADE_FD trỏ vào 1 đầu socketpair AF_UNIX. Khi process mới báo sẵn sàng,
+// process cũ đóng băng I/O: I/O thread dừng ở ranh giới frame, worker chạy hết
+// request đã nhận. Sau đó listening socket và từng client socket được gửi qua
+// SCM_RIGHTS kèm username, trạng thái đăng nhập, phần frame nhận dở và dữ liệu
+// chưa gửi. Process mới nhận connection như đã đăng nhập sẵn rồi trả ack, process
+// cũ thoát ngay (không logout, không đóng connection từ phía server).
+//
+// Không chuyển: connection đang upload file dở và connection mode thread không
+// dừng kịp trước UPGRADE_PARK_TIMEOUT_MS (bị đóng khi process cũ thoát).
+// Mode io_uring chưa hỗ trợ vì recv multishot/send đang chạy trong kernel.
+
+#define UPGRADE_ENV "CHAT_UPGRADE_FD"
+#define UPGRADE_FD 3                        // fd của socketpair trong process mới
+#define UPGRADE_MAGIC 0x43485503u           // "CHU" + layout UpgradeRecord (đổi khi thêm field)
+#define UPGRADE_MAX_LISTENERS 256
+#define UPGRADE_READY_TIMEOUT_MS 30000      // Process mới load dữ liệu rồi báo sẵn sàng
+#define UPGRADE_PARK_TIMEOUT_MS 3000        // I/O thread dừng ở ranh giới frame
+#define UPGRADE_DRAIN_TIMEOUT_MS 10000      // Worker chạy hết request đã nhận
+
+typedef struct {
+    uint32_t magic;
+    uint32_t listen_count;      // Số listening socket đi kèm (SCM_RIGHTS)
+} UpgradeHeader;
+
+typedef struct {
+    char username[MAX_USERNAME_LEN];
+    struct sockaddr_in address;
+    uint32_t authenticated;
+    uint32_t protocol;          // Version đã thương lượng (MSG_HELLO)
+    uint32_t compress;          // Client nhận body nén (MSG_HELLO)
+    uint32_t input_len;         // Bytes đã nhận chưa xử lý (frame dở), theo sau bản ghi
+    uint32_t output_len;        // Bytes chưa gửi, theo sau phần input
+    uint32_t last;              // 1 = bản ghi kết thúc, không có socket
+} UpgradeRecord;
+
+static volatile sig_atomic_t upgrade_signal = 0;
+static int upgrade_frozen = 0;          // I/O thread phải dừng (atomic)
+static int upgrade_committed = 0;       // Đã bắt đầu chuyển socket: process cũ ngừng gửi (atomic)
+static char **server_argv = NULL;
+
+static mutex_t upgrade_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upgrade_cond = PTHREAD_COND_INITIALIZER;
+static int parked_threads = 0;
+
+static int inherited_listeners[UPGRADE_MAX_LISTENERS];
+static int inherited_count = 0;
+
+static void upgrade_signal_handler(int signum) {
+    (void)signum;
+    upgrade_signal = 1;
+}
+
+// SIGUSR1 chỉ để ngắt recv() của client_thread (EINTR)
+static void wake_signal_handler(int signum) {
+    (void)signum;
+}
+
+/**
+ * Lưu argv để exec lại và cài signal handler (không SA_RESTART: accept()/pause()
+ * của main thread và recv() của client_thread trả EINTR)
+ */
+void init_hot_upgrade(char **argv) {
+    server_argv = argv;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+
+    action.sa_handler = upgrade_signal_handler;
+    sigaction(SIGUSR2, &action, NULL);
+
+    action.sa_handler = wake_signal_handler;
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+bool upgrade_requested(void) {
+    return upgrade_signal != 0;
+}
+
+bool upgrade_pending(void) {
+    return __atomic_load_n(&upgrade_frozen, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool upgrade_sends_blocked(void) {
+    return __atomic_load_n(&upgrade_committed, __ATOMIC_ACQUIRE) != 0;
+}
+
+const int *upgrade_cancel_flag(void) {
+    return &upgrade_frozen;
+}
+
+/**
+ * I/O thread dừng tại đây tới khi upgrade xong (process thoát) hoặc bị hủy
+ * client != NULL: client_thread của connection đó (mode thread)
+ */
+void upgrade_park(ClientConnection *client) {
+    mutex_lock(&upgrade_mutex);
+    if (client != NULL) client->upgrade_parked = true;
+    parked_threads++;
+    pthread_cond_broadcast(&upgrade_cond);
+
+    while (__atomic_load_n(&upgrade_frozen, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&upgrade_cond, &upgrade_mutex);
+    }
+
+    parked_threads--;
+    if (client != NULL) client->upgrade_parked = false;
+    mutex_unlock(&upgrade_mutex);
+}
+
+// ===========================
+// UNIX SOCKET I/O
+// ===========================
+
+static int write_all(int fd, const void *data, size_t length) {
+    const char *ptr = data;
+
+    while (length > 0) {
+        ssize_t bytes = send(fd, ptr, length, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+        ptr += bytes;
+        length -= bytes;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t length) {
+    char *ptr = data;
+
+    while (length > 0) {
+        ssize_t bytes = recv(fd, ptr, length, 0);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+        ptr += bytes;
+        length -= bytes;
+    }
+
+    return 0;
+}
+
+/**
+ * Gửi data kèm các fd (SCM_RIGHTS gắn vào byte đầu tiên)
+ */
+static int send_with_fds(int fd, const void *data, size_t length, const int *fds, int fd_count) {
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    struct iovec iov = { (void *)data, length };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    ssize_t bytes;
+    do {
+        bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes < 0) return -1;
+    if ((size_t)bytes < length) {
+        return write_all(fd, (const char *)data + bytes, length - bytes);
+    }
+    return 0;
+}
+
+/**
+ * Nhận đúng length bytes, fd đi kèm byte đầu tiên được ghi vào fds
+ * Return: số fd nhận được, -1 nếu lỗi
+ */
+static int recv_with_fds(int fd, void *data, size_t length, int *fds, int max_fds) {
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    struct iovec iov = { data, length };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes;
+    do {
+        bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes <= 0) return -1;
+
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        int received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < received; i++) {
+            if (count < max_fds) {
+                fds[count++] = passed[i];
+            } else {
+                close(passed[i]);
+            }
+        }
+    }
+
+    if ((size_t)bytes < length &&
+        read_all(fd, (char *)data + bytes, length - bytes) < 0) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        return -1;
+    }
+
+    return count;
+}
+
+static int wait_readable(int fd, int timeout_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready;
+}
+
+// ===========================
+// OLD PROCESS: HANDOFF
+// ===========================
+
+/**
+ * fork + exec binary mới, fd UPGRADE_FD của nó là đầu kia của socketpair
+ * Return: pid, -1 nếu lỗi
+ */
+static pid_t spawn_successor(int child_end) {
+    // Chuẩn bị envp trước fork: sau fork chỉ dùng hàm async-signal-safe
+    extern char **environ;
+    int env_count = 0;
+    while (environ[env_count] != NULL) env_count++;
+
+    char **envp = calloc(env_count + 2, sizeof(char *));
+    if (envp == NULL) return -1;
+
+    static char upgrade_env[] = UPGRADE_ENV "=3";
+    int n = 0;
+    envp[n++] = upgrade_env;
+    for (int i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n] = NULL;
+
+    int max_fd = server_state.fd_table_size > 0 ? server_state.fd_table_size : 65536;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (child_end != UPGRADE_FD) {
+            dup2(child_end, UPGRADE_FD);    // Bản sao từ dup2 không có FD_CLOEXEC
+        } else {
+            fcntl(UPGRADE_FD, F_SETFD, 0);
+        }
+
+        // Client socket mode thread không có CLOEXEC: không để process mới giữ nhầm
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, UPGRADE_FD + 1, ~0U, 0) != 0)
+#endif
+        {
+            for (int fd = UPGRADE_FD + 1; fd < max_fd; fd++) close(fd);
+        }
+
+        execvpe(server_argv[0], server_argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    return pid;
+}
+
+/**
+ * Chờ I/O thread dừng ở ranh giới frame
+ * Return: -1 nếu reactor không dừng kịp (mode thread: connection chưa dừng bị bỏ qua)
+ */
+static int freeze_io_threads(void) {
+    __atomic_store_n(&upgrade_frozen, 1, __ATOMIC_RELEASE);
+    uint64_t deadline = monotonic_ms() + UPGRADE_PARK_TIMEOUT_MS;
+
+    if (server_options.io_mode == IO_MODE_EPOLL) {
+        reactor_wake_all();
+
+        mutex_lock(&upgrade_mutex);
+        while (parked_threads < server_options.io_threads && monotonic_ms() < deadline) {
+            mutex_unlock(&upgrade_mutex);
+            sleep_ms(5);
+            mutex_lock(&upgrade_mutex);
+        }
+        int parked = parked_threads;
+        mutex_unlock(&upgrade_mutex);
+
+        return parked == server_options.io_threads ? 0 : -1;
+    }
+
+    // Mode thread: SIGUSR1 ngắt recv(), gửi lại định kỳ cho thread chưa dừng
+    // (tín hiệu tới trước khi thread vào recv() thì bị lỡ)
+    while (monotonic_ms() < deadline) {
+        int running = 0;
+
+        mutex_lock(&server_state.clients_mutex);
+        for (int i = 0; i < server_state.client_count; i++) {
+            ClientConnection *client = client_slot(i);
+            if (!client->in_use || client->socket_fd < 0 ||
+                __atomic_load_n(&client->upgrade_parked, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            running++;
+            pthread_kill(client->thread_id, SIGUSR1);
+        }
+        mutex_unlock(&server_state.clients_mutex);
+
+        if (running == 0) break;
+        sleep_ms(20);
+    }
+
+    return 0;
+}
+
+/**
+ * Hủy upgrade: I/O thread chạy tiếp như chưa có gì xảy ra
+ */
+static void thaw_io_threads(void) {
+    __atomic_store_n(&upgrade_committed, 0, __ATOMIC_RELEASE);
+
+    mutex_lock(&upgrade_mutex);
+    __atomic_store_n(&upgrade_frozen, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&upgrade_cond);
+    mutex_unlock(&upgrade_mutex);
+}
+
+/**
+ * Gửi 1 connection: bản ghi + socket, frame nhận dở, dữ liệu chưa gửi
+ * Caller giữ clients_mutex, I/O thread sở hữu connection đã dừng
+ * Return: 1 nếu đã gửi, 0 nếu bỏ qua, -1 nếu lỗi socketpair
+ */
+static int send_connection(int upgrade_fd, ClientConnection *client) {
+    if (!client->in_use || client->socket_fd < 0 || client->upload != NULL) return 0;
+    if (server_options.io_mode == IO_MODE_THREAD &&
+        !__atomic_load_n(&client->upgrade_parked, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    UpgradeRecord record;
+    memset(&record, 0, sizeof(record));
+    strncpy(record.username, client->username, MAX_USERNAME_LEN - 1);
+    record.address = client->address;
+    record.authenticated = client->is_authenticated ? 1 : 0;
+    record.protocol = client->protocol;
+    record.compress = client->compress;
+
+    const char *input = NULL;
+    if (client->reader != NULL) {
+        input = client->reader->data + client->reader->start;
+        record.input_len = (uint32_t)(client->reader->end - client->reader->start);
+    } else if (client->rbuf != NULL) {
+        input = client->rbuf;
+        record.input_len = (uint32_t)client->rbuf_len;
+    }
+
+    // Chờ writer đang gửi (đã nhả lock trong lúc send) để không gửi trùng bytes
+    OutQueue *queue = &client->outq;
+    mutex_lock(&queue->lock);
+    while (queue->flushing) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    }
+
+    for (OutChunk *chunk = queue->head; chunk != NULL; chunk = chunk->next) {
+        record.output_len += (uint32_t)(chunk->frame->length - chunk->offset);
+    }
+
+    int result = send_with_fds(upgrade_fd, &record, sizeof(record), &client->socket_fd, 1);
+    if (result == 0 && record.input_len > 0) {
+        result = write_all(upgrade_fd, input, record.input_len);
+    }
+    for (OutChunk *chunk = queue->head; chunk != NULL && result == 0; chunk = chunk->next) {
+        result = write_all(upgrade_fd, chunk->frame->data + chunk->offset,
+                           chunk->frame->length - chunk->offset);
+    }
+    mutex_unlock(&queue->lock);
+
+    return result == 0 ? 1 : -1;
+}
+
+/**
+ * Chuyển toàn bộ listening socket và connection sang process mới
+ * Return: số connection đã chuyển, -1 nếu lỗi
+ */
+static int hand_off(int upgrade_fd) {
+    int listeners[UPGRADE_MAX_LISTENERS];
+    int listen_count = 1;
+    listeners[0] = server_state.server_socket;
+
+    if (server_options.io_mode == IO_MODE_EPOLL) {
+        listen_count = reactor_listen_fds(listeners, UPGRADE_MAX_LISTENERS);
+    }
+
+    UpgradeHeader header = { UPGRADE_MAGIC, (uint32_t)listen_count };
+    if (send_with_fds(upgrade_fd, &header, sizeof(header), listeners, listen_count) < 0) {
+        return -1;
+    }
+
+    int sent = 0;
+    int skipped = 0;
+
+    mutex_lock(&server_state.clients_mutex);
+    for (int i = 0; i < server_state.client_count; i++) {
+        ClientConnection *client = client_slot(i);
+        if (!client->in_use) continue;
+
+        int result = send_connection(upgrade_fd, client);
+        if (result < 0) {
+            sent = -1;
+            break;
+        }
+        if (result > 0) {
+            sent++;
+        } else if (client->socket_fd >= 0) {
+            skipped++;
+        }
+    }
+    mutex_unlock(&server_state.clients_mutex);
+
+    if (sent < 0) return -1;
+
+    UpgradeRecord last;
+    memset(&last, 0, sizeof(last));
+    last.last = 1;
+    if (write_all(upgrade_fd, &last, sizeof(last)) < 0) return -1;
+
+    if (skipped > 0) {
+        printf("[UPGRADE] %d connections not handed off (upload in progress or busy)\n", skipped);
+    }
+
+    return sent;
+}
+
+/**
+ * Main thread xử lý SIGUSR2: chuyển server sang binary mới
+ * Chỉ trả về nếu upgrade thất bại (server tiếp tục chạy bình thường)
+ */
+void run_hot_upgrade(void) {
+    upgrade_signal = 0;
+
+    if (server_options.io_mode == IO_MODE_URING) {
+        printf("[UPGRADE] Hot upgrade is not supported in io_uring mode\n");
+        return;
+    }
+
+    printf("[UPGRADE] Starting new server binary '%s'\n", server_argv[0]);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("[UPGRADE] socketpair failed");
+        return;
+    }
+
+    // Process mới replay state.wal rồi đọc tiếp từ offset đó: không snapshot (đổi
+    // tên WAL) cho tới khi handoff xong hoặc bị hủy
+    pause_state_snapshots();
+
+    fflush(stdout);
+    pid_t pid = spawn_successor(pair[1]);
+    close(pair[1]);
+
+    if (pid < 0) {
+        perror("[UPGRADE] fork failed");
+        close(pair[0]);
+        resume_state_snapshots();
+        return;
+    }
+
+    // Process mới báo sẵn sàng (đã load dữ liệu) trước khi đóng băng
+    char ready = 0;
+    if (wait_readable(pair[0], UPGRADE_READY_TIMEOUT_MS) <= 0 ||
+        read_all(pair[0], &ready, 1) < 0 || ready != 'R') {
+        printf("[UPGRADE] New process did not become ready, aborting\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(pair[0]);
+        resume_state_snapshots();
+        return;
+    }
+
+    uint64_t started = monotonic_ms();
+
+    if (freeze_io_threads() < 0 ||
+        (server_options.workers > 0 && wait_worker_pool_idle(UPGRADE_DRAIN_TIMEOUT_MS) < 0)) {
+        printf("[UPGRADE] I/O threads did not quiesce, aborting\n");
+        thaw_io_threads();
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(pair[0]);
+        resume_state_snapshots();
+        return;
+    }
+
+    if (server_options.reuseport) {
+        reactor_drain_inboxes();
+    }
+    
+    // Process mới đọc mailbox khi user đăng nhập: offline message phải ghi xong
+    offline_store_sync();
+
+    // Từ đây process cũ không ghi thêm gì vào socket đã chuyển
+    __atomic_store_n(&upgrade_committed, 1, __ATOMIC_RELEASE);
+
+    int sent = hand_off(pair[0]);
+    char ack = 0;
+
+    if (sent >= 0 && wait_readable(pair[0], UPGRADE_READY_TIMEOUT_MS) > 0 &&
+        read_all(pair[0], &ack, 1) == 0 && ack == 'A') {
+        printf("[UPGRADE] Handed off %d connections to pid %d in %llu ms, exiting\n",
+               sent, (int)pid, (unsigned long long)(monotonic_ms() - started));
+        log_server_event("SERVER_UPGRADE", "Handed off to new process");
+        offline_store_sync();
+        fflush(NULL);
+        _exit(0);
+    }
+
+    printf("[UPGRADE] Handoff failed, resuming (messages sent during the handoff were dropped)\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(pair[0]);
+    thaw_io_threads();
+    resume_state_snapshots();
+}
+
+// ===========================
+// NEW PROCESS: RESUME
+// ===========================
+
+/**
+ * fd socketpair nếu process được khởi động bởi hot upgrade
+ * Return: -1 nếu khởi động bình thường
+ */
+int upgrade_inherited_fd(void) {
+    const char *value = getenv(UPGRADE_ENV);
+    if (value == NULL) return -1;
+
+    int fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Báo sẵn sàng cho process cũ rồi nhận các listening socket
+ * Return: listening socket chính (server_socket), -1 nếu lỗi
+ */
+int upgrade_receive_listeners(int upgrade_fd) {
+    char ready = 'R';
+    if (write_all(upgrade_fd, &ready, 1) < 0) return -1;
+
+    UpgradeHeader header;
+    int count = recv_with_fds(upgrade_fd, &header, sizeof(header),
+                              inherited_listeners, UPGRADE_MAX_LISTENERS);
+
+    if (count <= 0 || header.magic != UPGRADE_MAGIC || (uint32_t)count != header.listen_count) {
+        fprintf(stderr, "[UPGRADE] Invalid handoff header\n");
+        for (int i = 0; i < count; i++) close(inherited_listeners[i]);
+        return -1;
+    }
+
+    inherited_count = count;
+    printf("[UPGRADE] Inherited %d listening sockets\n", count);
+
+    return inherited_listeners[0];
+}
+
+/**
+ * Lấy listening socket thứ index của process cũ (mode --reuseport)
+ * Return: -1 nếu không có
+ */
+int upgrade_take_listener(int index) {
+    if (index <= 0 || index >= inherited_count || inherited_listeners[index] < 0) return -1;
+
+    int fd = inherited_listeners[index];
+    inherited_listeners[index] = -1;
+    return fd;
+}
+
+/**
+ * Nhận 1 connection của process cũ vào I/O mode hiện tại
+ */
+static void adopt_connection(const UpgradeRecord *record, int socket_fd, char *input,
+                             char *output) {
+    ClientConnection *client = alloc_client_slot();
+    if (client == NULL) {
+        printf("[UPGRADE] Maximum clients reached, dropping socket %d\n", socket_fd);
+        close(socket_fd);
+        free(input);
+        return;
+    }
+
+    client->socket_fd = socket_fd;
+    client->address = record->address;
+    client->is_authenticated = record->authenticated != 0;
+    client->protocol = record->protocol <= PROTOCOL_MAX ? (uint8_t)record->protocol : PROTOCOL_V1;
+    client->compress = record->compress != 0;
+    strncpy(client->username, record->username, MAX_USERNAME_LEN - 1);
+    client->rbuf = input;
+    client->rbuf_len = record->input_len;
+    attach_client_fd(client);
+    start_client_timer(client);
+
+    if (client->is_authenticated) {
+        add_online_user(client->username, socket_fd);
+    }
+
+    // Dữ liệu chưa gửi của process cũ đi trước mọi reply mới
+    if (record->output_len > 0) {
+        SharedFrame *frame = shared_frame_create(output, record->output_len, false);
+        if (frame != NULL) {
+            enqueue_client_frame(socket_fd, frame);
+            shared_frame_release(frame);
+        }
+    }
+
+    printf("[UPGRADE] Resumed socket %d (%s), %u bytes pending input, %u bytes pending output\n",
+           socket_fd, client->username[0] ? client->username : "-",
+           record->input_len, record->output_len);
+
+    if (server_options.io_mode == IO_MODE_THREAD) {
+        // client_thread nạp rbuf vào FrameReader
+        if (pthread_create(&client->thread_id, NULL, client_thread, client) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            cleanup_client(client);
+            release_client_slot(client);
+        } else {
+            pthread_detach(client->thread_id);
+        }
+        return;
+    }
+
+    // Mode epoll: frame hoàn chỉnh còn trong rbuf được xử lý trước khi reactor nhận
+    begin_send_batch();
+    int result = process_client_input(client);
+    end_send_batch();
+
+    if (result < 0 || reactor_adopt_client(client) < 0) {
+        cleanup_client(client);
+        release_client_slot(client);
+    }
+}
+
+/**
+ * Nhận toàn bộ connection của process cũ (sau khi I/O thread đã chạy), gửi ack
+ */
+void upgrade_resume_connections(int upgrade_fd) {
+    int resumed = 0;
+    bool ok = true;
+
+    while (1) {
+        UpgradeRecord record;
+        int socket_fd = -1;
+        int count = recv_with_fds(upgrade_fd, &record, sizeof(record), &socket_fd, 1);
+
+        if (count < 0) {
+            ok = false;
+            break;
+        }
+        if (record.last) break;
+
+        if (count != 1 || record.input_len > FRAME_READER_SIZE ||
+            record.output_len > OUTQ_MAX_BYTES) {
+            fprintf(stderr, "[UPGRADE] Invalid connection record\n");
+            if (count == 1) close(socket_fd);
+            ok = false;
+            break;
+        }
+        record.username[MAX_USERNAME_LEN - 1] = '\0';
+
+        size_t capacity = record.input_len > CLIENT_RBUF_SIZE ? record.input_len : CLIENT_RBUF_SIZE;
+        char *input = malloc(capacity);
+        char *output = record.output_len > 0 ? malloc(record.output_len) : NULL;
+
+        if (input == NULL || (record.output_len > 0 && output == NULL) ||
+            read_all(upgrade_fd, input, record.input_len) < 0 ||
+            read_all(upgrade_fd, output, record.output_len) < 0) {
+            free(input);
+            free(output);
+            close(socket_fd);
+            ok = false;
+            break;
+        }
+
+        adopt_connection(&record, socket_fd, input, output);
+        free(output);
+        resumed++;
+    }
+
+    // Listening socket thừa (process mới ít reactor hơn) phải đóng để kernel không
+    // chia connection mới vào socket không ai accept
+    for (int i = 1; i < inherited_count; i++) {
+        if (inherited_listeners[i] >= 0) {
+            close(inherited_listeners[i]);
+            inherited_listeners[i] = -1;
+        }
+    }
+
+    if (ok) {
+        char ack = 'A';
+        write_all(upgrade_fd, &ack, 1);
+        printf("[UPGRADE] Resumed %d connections from previous process\n", resumed);
+        log_server_event("SERVER_UPGRADE", "Resumed connections from previous process");
+    } else {
+        fprintf(stderr, "[UPGRADE] Handoff stream broken after %d connections\n", resumed);
+    }
+
+    close(upgrade_fd);
+
+    // Process cũ đã nhận ack và thoát, không còn ghi vào WAL
+    start_state_snapshots();
+}
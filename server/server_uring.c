@@ -0,0 +1,845 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+// ===========================
+// 14. IO_URING BACKEND
+// ===========================
+// Mỗi engine = 1 ring + 1 thread:
+// - Multishot accept trên listening socket (dùng chung giữa các engine)
+// - Multishot recv với provided buffer ring, data được copy vào rbuf
+//   rồi đi qua process_client_input() như mode epoll
+// - Các frame gửi cho cùng 1 connection được submit thành chuỗi SQE
+//   liên kết (IOSQE_IO_LINK), mỗi lúc chỉ 1 chuỗi chạy để giữ thứ tự
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUF_COUNT 256          // Số buffer trong provided buffer ring (lũy thừa 2)
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_MAX_CHAIN 64           // Số SQE tối đa trong 1 chuỗi send
+
+typedef enum {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_RELEASE
+} UringOpType;
+
+typedef struct UringOp {
+    UringOpType type;
+    struct UringConn *conn;
+} UringOp;
+
+typedef struct UringSend {
+    struct UringSend *next;
+    SharedFrame *frame;
+    uint64_t queued_ms;
+} UringSend;
+
+typedef struct UringEngine {
+    int id;
+    int ring_fd;
+    thread_t thread_id;
+
+    // Submission queue (bảo vệ bởi sq_mutex, mọi thread đều có thể submit)
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned sq_to_submit;
+    struct io_uring_sqe *sqes;
+    mutex_t sq_mutex;
+
+    // Completion queue (chỉ thread của engine đọc)
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffer ring
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+
+    UringOp accept_op;
+} UringEngine;
+
+typedef struct UringConn {
+    UringOp recv_op;
+    UringOp send_op;
+    UringOp release_op;
+    UringEngine *engine;
+    ClientConnection *client;
+    int refs;                        // recv đang armed + chuỗi send đang chạy + sender tạm thời
+    bool closing;
+    bool send_error;
+    UringSend *pending_head;         // Chưa submit
+    UringSend *pending_tail;
+    UringSend *inflight;             // Chuỗi đang chạy trong kernel
+    int inflight_sqes;
+} UringConn;
+
+static UringEngine *engines = NULL;
+static int engine_count = 0;
+static int listen_socket = -1;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// ===========================
+// RING PRIMITIVES
+// ===========================
+
+/**
+ * Lấy 1 SQE trống (phải giữ sq_mutex)
+ */
+static struct io_uring_sqe *uring_get_sqe(UringEngine *engine) {
+    unsigned head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+
+    if (engine->sq_local_tail - head >= engine->sq_entries) {
+        return NULL;
+    }
+
+    unsigned index = engine->sq_local_tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    engine->sq_array[index] = index;
+    engine->sq_local_tail++;
+    engine->sq_to_submit++;
+
+    return sqe;
+}
+
+/**
+ * Submit các SQE đã chuẩn bị (phải giữ sq_mutex)
+ */
+static int uring_submit(UringEngine *engine) {
+    __atomic_store_n(engine->sq_tail, engine->sq_local_tail, __ATOMIC_RELEASE);
+
+    while (engine->sq_to_submit > 0) {
+        int ret = sys_io_uring_enter(engine->ring_fd, engine->sq_to_submit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter(submit) failed");
+            return -1;
+        }
+        engine->sq_to_submit -= ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Lấy SQE cho 1 request (hoặc SQE đầu của 1 chuỗi): SQ đầy thì submit các SQE đang chờ
+ * cho kernel (kernel lấy chúng ngay trong io_uring_enter) rồi thử lại
+ * Return: NULL nếu vẫn đầy (ring lỗi)
+ */
+static struct io_uring_sqe *uring_get_sqe_flush(UringEngine *engine) {
+    struct io_uring_sqe *sqe = uring_get_sqe(engine);
+
+    if (sqe == NULL && uring_submit(engine) == 0) {
+        sqe = uring_get_sqe(engine);
+    }
+
+    return sqe;
+}
+
+/**
+ * Trả buffer về provided buffer ring (chỉ thread của engine gọi)
+ */
+static void uring_recycle_buffer(UringEngine *engine, unsigned short bid) {
+    struct io_uring_buf_ring *ring = engine->buf_ring;
+    unsigned short tail = ring->tail;
+    struct io_uring_buf *buf = &ring->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long)(engine->buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static void uring_arm_accept(UringEngine *engine) {
+    mutex_lock(&engine->sq_mutex);
+
+    struct io_uring_sqe *sqe = uring_get_sqe_flush(engine);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_socket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = (unsigned long)&engine->accept_op;
+        uring_submit(engine);
+    } else {
+        fprintf(stderr, "[URING] Engine %d: submission queue full, accept not armed\n", engine->id);
+    }
+
+    mutex_unlock(&engine->sq_mutex);
+}
+
+static void uring_conn_close(UringConn *conn);
+static void uring_conn_put(UringConn *conn);
+
+/**
+ * Arm recv multishot (thread của engine gọi); không lấy được SQE thì đóng connection
+ * vì không còn completion nào nhả reference của recv
+ */
+static void uring_arm_recv(UringConn *conn) {
+    UringEngine *engine = conn->engine;
+
+    mutex_lock(&engine->sq_mutex);
+
+    struct io_uring_sqe *sqe = uring_get_sqe_flush(engine);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->client->socket_fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = (unsigned long)&conn->recv_op;
+        uring_submit(engine);
+    }
+
+    mutex_unlock(&engine->sq_mutex);
+
+    if (sqe == NULL) {
+        fprintf(stderr, "[URING] Submission queue full, closing socket %d\n",
+                conn->client->socket_fd);
+        uring_conn_close(conn);
+        uring_conn_put(conn);
+    }
+}
+
+// ===========================
+// CONNECTION LIFETIME
+// ===========================
+
+static void uring_free_sends(UringSend *send) {
+    while (send != NULL) {
+        UringSend *next = send->next;
+        shared_frame_release(send->frame);
+        free(send);
+        send = next;
+    }
+}
+
+/**
+ * Giải phóng connection (chỉ thread của engine gọi)
+ */
+static void uring_conn_destroy(UringConn *conn) {
+    ClientConnection *client = conn->client;
+
+    printf("[URING] Client socket %d disconnected\n", client->socket_fd);
+
+    uring_free_sends(conn->pending_head);
+    uring_free_sends(conn->inflight);
+
+    // Gỡ liên kết dưới fd_mutex để uring_send_fd() không lấy được reference mới
+    mutex_lock(&server_state.fd_mutex);
+    client->uring = NULL;
+    mutex_unlock(&server_state.fd_mutex);
+
+    cleanup_client(client);
+    release_client_slot(client);
+    free(conn);
+}
+
+/**
+ * Nhả 1 reference từ thread của engine
+ */
+static void uring_conn_put(UringConn *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        uring_conn_destroy(conn);
+    }
+}
+
+/**
+ * Nhả 1 reference từ thread khác: caller có thể đang giữ clients_mutex
+ * nên reference cuối được chuyển về engine qua 1 NOP
+ */
+static void uring_conn_put_remote(UringConn *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    UringEngine *engine = conn->engine;
+
+    mutex_lock(&engine->sq_mutex);
+    struct io_uring_sqe *sqe = uring_get_sqe_flush(engine);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = (unsigned long)&conn->release_op;
+        uring_submit(engine);
+    } else {
+        fprintf(stderr, "[URING] Submission queue full, socket %d not released\n",
+                conn->client->socket_fd);
+    }
+    mutex_unlock(&engine->sq_mutex);
+}
+
+/**
+ * Đánh dấu connection đang đóng; shutdown socket để recv multishot
+ * và các send đang chạy kết thúc
+ */
+static void uring_conn_close(UringConn *conn) {
+    mutex_lock(&conn->engine->sq_mutex);
+    if (!conn->closing) {
+        conn->closing = true;
+        shutdown(conn->client->socket_fd, SHUT_RDWR);
+    }
+    mutex_unlock(&conn->engine->sq_mutex);
+}
+
+// ===========================
+// SEND PATH
+// ===========================
+
+/**
+ * Submit các frame đang chờ thành 1 chuỗi SQE liên kết (phải giữ sq_mutex)
+ */
+static void uring_submit_chain(UringConn *conn) {
+    UringEngine *engine = conn->engine;
+    UringSend *chain_tail = NULL;
+    int count = 0;
+
+    while (conn->pending_head != NULL && count < URING_MAX_CHAIN) {
+        // Chỉ flush trước SQE đầu: chuỗi đang dựng dở không được submit
+        struct io_uring_sqe *sqe = count == 0 ? uring_get_sqe_flush(engine) : uring_get_sqe(engine);
+        if (sqe == NULL) break;
+
+        UringSend *send = conn->pending_head;
+        conn->pending_head = send->next;
+        if (conn->pending_head == NULL) conn->pending_tail = NULL;
+        send->next = NULL;
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->client->socket_fd;
+        sqe->addr = (unsigned long)send->frame->data;
+        sqe->len = (unsigned)send->frame->length;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long)&conn->send_op;
+
+        if (chain_tail == NULL) {
+            conn->inflight = send;
+        } else {
+            chain_tail->next = send;
+        }
+        chain_tail = send;
+        count++;
+    }
+
+    if (count == 0) {
+        // Không submit được frame nào: không có completion để thử lại, đóng connection
+        if (conn->pending_head != NULL && !conn->closing) {
+            fprintf(stderr, "[URING] Submission queue full, closing socket %d\n",
+                    conn->client->socket_fd);
+            conn->closing = true;
+            shutdown(conn->client->socket_fd, SHUT_RDWR);
+        }
+        return;
+    }
+
+    // SQE cuối cùng kết thúc chuỗi
+    unsigned last = (engine->sq_local_tail - 1) & *engine->sq_mask;
+    engine->sqes[last].flags &= ~IOSQE_IO_LINK;
+
+    conn->inflight_sqes = count;
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL);
+
+    uring_submit(engine);
+}
+
+/**
+ * Lấy reference tới connection có socket_fd qua fd_table, NULL nếu không còn
+ * (fd_mutex là lock lá: gọi được cả khi caller đang giữ lock khác)
+ */
+static UringConn *uring_conn_get(int socket_fd) {
+    UringConn *conn = NULL;
+
+    mutex_lock(&server_state.fd_mutex);
+    if (socket_fd >= 0 && socket_fd < server_state.fd_table_size &&
+        server_state.fd_table[socket_fd] != NULL) {
+        conn = server_state.fd_table[socket_fd]->uring;
+        if (conn != NULL) {
+            int refs = __atomic_load_n(&conn->refs, __ATOMIC_ACQUIRE);
+            while (refs > 0 &&
+                   !__atomic_compare_exchange_n(&conn->refs, &refs, refs + 1, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            }
+            if (refs == 0) conn = NULL;
+        }
+    }
+    mutex_unlock(&server_state.fd_mutex);
+
+    return conn;
+}
+
+/**
+ * Xếp frame tới connection có socket_fd qua io_uring (hàng đợi lấy 1 reference)
+ * Trong send batch, submit được hoãn tới end_send_batch() để gộp frame vào 1 chuỗi SQE
+ * Return: 0 nếu đã xếp hàng, -1 nếu connection không còn
+ */
+int uring_send_fd(int socket_fd, SharedFrame *frame) {
+    if (frame == NULL) return -1;
+
+    UringConn *conn = uring_conn_get(socket_fd);
+    if (conn == NULL) return -1;
+
+    size_t total = frame->length;
+    UringSend *send = malloc(sizeof(UringSend));
+    if (send == NULL) {
+        uring_conn_put_remote(conn);
+        return -1;
+    }
+
+    send->next = NULL;
+    send->frame = frame;
+    send->queued_ms = monotonic_ms();
+
+    int result = 0;
+
+    mutex_lock(&conn->engine->sq_mutex);
+
+    OutQueue *queue = &conn->client->outq;
+
+    if (conn->closing || __atomic_load_n(&queue->close_ms, __ATOMIC_ACQUIRE) != 0) {
+        free(send);
+        result = -1;
+    } else if (queue->bytes + total > OUTQ_MAX_BYTES) {
+        printf("[BACKPRESSURE] Socket %d (%s): output queue full, dropping %zu bytes\n",
+               socket_fd, conn->client->username, total);
+        free(send);
+        result = -1;
+    } else {
+        shared_frame_ref(frame);
+        if (conn->pending_tail == NULL) {
+            conn->pending_head = send;
+        } else {
+            conn->pending_tail->next = send;
+        }
+        conn->pending_tail = send;
+
+        UringSend *oldest = conn->inflight != NULL ? conn->inflight : conn->pending_head;
+        outq_account(conn->client, (long)total, oldest->queued_ms);
+
+        bool defer = send->queued_ms - oldest->queued_ms < SEND_BATCH_DEADLINE_MS &&
+                     send_batch_defer(socket_fd);
+
+        if (conn->inflight == NULL && !defer) {
+            uring_submit_chain(conn);
+        }
+    }
+
+    mutex_unlock(&conn->engine->sq_mutex);
+
+    uring_conn_put_remote(conn);
+    return result;
+}
+
+/**
+ * Submit các frame đang chờ của socket_fd (gọi từ end_send_batch())
+ */
+void uring_flush_fd(int socket_fd) {
+    UringConn *conn = uring_conn_get(socket_fd);
+    if (conn == NULL) return;
+
+    mutex_lock(&conn->engine->sq_mutex);
+    if (!conn->closing && conn->inflight == NULL) {
+        uring_submit_chain(conn);
+    }
+    mutex_unlock(&conn->engine->sq_mutex);
+
+    uring_conn_put_remote(conn);
+}
+
+/**
+ * Đóng connection khi các frame đã xếp hàng gửi xong (outq.close_ms đã được đặt):
+ * chưa có gì chờ thì đóng ngay, ngược lại uring_handle_send() đóng khi hết chuỗi
+ */
+void uring_close_after_drain(int socket_fd) {
+    UringConn *conn = uring_conn_get(socket_fd);
+    if (conn == NULL) return;
+
+    mutex_lock(&conn->engine->sq_mutex);
+    if (!conn->closing && conn->inflight == NULL) {
+        if (conn->pending_head == NULL) {
+            conn->closing = true;
+            shutdown(conn->client->socket_fd, SHUT_RDWR);
+        } else {
+            uring_submit_chain(conn);
+        }
+    }
+    mutex_unlock(&conn->engine->sq_mutex);
+
+    uring_conn_put_remote(conn);
+}
+
+// ===========================
+// COMPLETION HANDLERS
+// ===========================
+
+static void uring_handle_accept(UringEngine *engine, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(engine);  // Multishot kết thúc, arm lại
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED) {
+            fprintf(stderr, "[URING] Accept failed: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int client_socket = cqe->res;
+
+    ClientConnection *client = alloc_client_slot();
+    if (client == NULL) {
+        printf("[WARNING] Maximum clients reached, rejecting socket %d\n", client_socket);
+        close(client_socket);
+        return;
+    }
+
+    UringConn *conn = calloc(1, sizeof(UringConn));
+    if (conn == NULL) {
+        close(client_socket);
+        release_client_slot(client);
+        return;
+    }
+
+    configure_client_socket(client_socket);
+
+    socklen_t addr_len = sizeof(client->address);
+    getpeername(client_socket, (struct sockaddr *)&client->address, &addr_len);
+
+    conn->recv_op.type = URING_OP_RECV;
+    conn->recv_op.conn = conn;
+    conn->send_op.type = URING_OP_SEND;
+    conn->send_op.conn = conn;
+    conn->release_op.type = URING_OP_RELEASE;
+    conn->release_op.conn = conn;
+    conn->engine = engine;
+    conn->client = client;
+    conn->refs = 1;  // recv multishot
+
+    client->socket_fd = client_socket;
+    client->is_authenticated = false;
+    client->uring = conn;
+    attach_client_fd(client);
+
+    log_client_connect(client);
+    start_client_timer(client);
+
+    uring_arm_recv(conn);
+}
+
+/**
+ * Copy dữ liệu từ provided buffer vào rbuf rồi xử lý frame
+ * Return: -1 nếu connection cần đóng
+ */
+static int uring_feed_client(ClientConnection *client, const char *data, size_t length) {
+    while (length > 0) {
+        if (client->rbuf == NULL) {
+            client->rbuf = malloc(CLIENT_RBUF_SIZE);
+            if (client->rbuf == NULL) return -1;
+            client->rbuf_len = 0;
+        }
+
+        size_t space = CLIENT_RBUF_SIZE - client->rbuf_len;
+        if (space == 0) return -1;
+
+        size_t take = length < space ? length : space;
+        memcpy(client->rbuf + client->rbuf_len, data, take);
+        client->rbuf_len += take;
+        data += take;
+        length -= take;
+
+        if (process_client_input(client) < 0) return -1;
+    }
+
+    // Connection idle không giữ buffer
+    if (client->rbuf != NULL && client->rbuf_len == 0) {
+        free(client->rbuf);
+        client->rbuf = NULL;
+    }
+
+    return 0;
+}
+
+static void uring_handle_recv(UringEngine *engine, UringConn *conn,
+                              const struct io_uring_cqe *cqe) {
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (cqe->res > 0 && has_buffer && !conn->closing) {
+        const char *data = engine->buf_base + (size_t)bid * URING_BUF_SIZE;
+        if (uring_feed_client(conn->client, data, (size_t)cqe->res) < 0) {
+            uring_conn_close(conn);
+        }
+    }
+
+    if (has_buffer) {
+        uring_recycle_buffer(engine, bid);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+
+    // Multishot recv kết thúc: hết buffer thì arm lại, còn lại là đóng
+    if (cqe->res == -ENOBUFS && !conn->closing) {
+        uring_arm_recv(conn);
+        return;
+    }
+
+    uring_conn_close(conn);
+    uring_conn_put(conn);
+}
+
+static void uring_handle_send(UringConn *conn, const struct io_uring_cqe *cqe) {
+    UringEngine *engine = conn->engine;
+    bool chain_done = false;
+
+    mutex_lock(&engine->sq_mutex);
+
+    if (cqe->res < 0) {
+        conn->send_error = true;
+    }
+
+    conn->inflight_sqes--;
+    if (conn->inflight_sqes == 0) {
+        long sent = 0;
+        for (UringSend *send = conn->inflight; send != NULL; send = send->next) {
+            sent += (long)send->frame->length;
+        }
+        uring_free_sends(conn->inflight);
+        conn->inflight = NULL;
+        chain_done = true;
+
+        outq_account(conn->client, -sent,
+                     conn->pending_head != NULL ? conn->pending_head->queued_ms : 0);
+
+        // Lỗi gửi, hoặc đã gửi hết sau close_client_after_drain()
+        bool drained = conn->pending_head == NULL &&
+                       __atomic_load_n(&conn->client->outq.close_ms, __ATOMIC_ACQUIRE) != 0;
+        if ((conn->send_error || drained) && !conn->closing) {
+            conn->closing = true;
+            shutdown(conn->client->socket_fd, SHUT_RDWR);
+        }
+
+        if (!conn->closing && conn->pending_head != NULL) {
+            uring_submit_chain(conn);
+        }
+    }
+
+    ClientConnection *client = conn->client;
+    int socket_fd = client->socket_fd;
+    bool check_slow = chain_done && !conn->closing;
+
+    mutex_unlock(&engine->sq_mutex);
+
+    if (check_slow) {
+        check_slow_consumer(client, socket_fd);
+    }
+
+    if (chain_done) {
+        uring_conn_put(conn);
+    }
+}
+
+/**
+ * Vòng lặp completion của 1 engine
+ */
+static THREAD_RETURN uring_engine_thread(void *arg) {
+    UringEngine *engine = (UringEngine *)arg;
+
+    printf("[URING] Engine %d started\n", engine->id);
+
+    uring_arm_accept(engine);
+
+    while (1) {
+        int ret = sys_io_uring_enter(engine->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+            perror("io_uring_enter(wait) failed");
+            break;
+        }
+
+        unsigned head = *engine->cq_head;
+
+        begin_send_batch();
+
+        while (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = engine->cqes[head & *engine->cq_mask];
+            head++;
+            __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+
+            UringOp *op = (UringOp *)(unsigned long)cqe.user_data;
+            if (op == NULL) continue;
+
+            switch (op->type) {
+                case URING_OP_ACCEPT:
+                    uring_handle_accept(engine, &cqe);
+                    break;
+                case URING_OP_RECV:
+                    uring_handle_recv(engine, op->conn, &cqe);
+                    break;
+                case URING_OP_SEND:
+                    uring_handle_send(op->conn, &cqe);
+                    break;
+                case URING_OP_RELEASE:
+                    uring_conn_destroy(op->conn);
+                    break;
+            }
+        }
+
+        end_send_batch();
+    }
+
+    THREAD_RETURN_VALUE;
+}
+
+// ===========================
+// SETUP
+// ===========================
+
+/**
+ * Tạo ring, map SQ/CQ và đăng ký provided buffer ring
+ */
+static int uring_engine_init(UringEngine *engine, int id) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    engine->id = id;
+    engine->ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    if (engine->ring_fd < 0) {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+    if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        engine->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap(SQ ring) failed");
+        return -1;
+    }
+
+    char *cq_ptr = sq_ptr;
+    if (!single_mmap) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      engine->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap(CQ ring) failed");
+            return -1;
+        }
+    }
+
+    engine->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        perror("mmap(SQEs) failed");
+        return -1;
+    }
+
+    engine->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    engine->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    engine->sq_entries = params.sq_entries;
+    engine->sq_local_tail = *engine->sq_tail;
+
+    engine->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    // Provided buffer ring: kernel tự chọn buffer cho mỗi lần recv
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    engine->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    engine->buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (engine->buf_ring == MAP_FAILED || engine->buf_base == NULL) {
+        fprintf(stderr, "[URING] Failed to allocate buffer ring\n");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)engine->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (sys_io_uring_register(engine->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(PBUF_RING) failed");
+        return -1;
+    }
+
+    engine->buf_ring->tail = 0;
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+        uring_recycle_buffer(engine, bid);
+    }
+
+    mutex_init(&engine->sq_mutex, NULL);
+    engine->accept_op.type = URING_OP_ACCEPT;
+    engine->accept_op.conn = NULL;
+
+    return 0;
+}
+
+/**
+ * Khởi động count io_uring engine, mỗi engine 1 thread
+ */
+int start_uring_engines(int server_socket, int count) {
+    if (count <= 0) return -1;
+
+    engines = calloc(count, sizeof(UringEngine));
+    if (engines == NULL) return -1;
+
+    listen_socket = server_socket;
+    engine_count = count;
+
+    for (int i = 0; i < count; i++) {
+        if (uring_engine_init(&engines[i], i) < 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&engines[i].thread_id, NULL, uring_engine_thread, &engines[i]) != 0) {
+            fprintf(stderr, "Failed to create io_uring thread\n");
+            return -1;
+        }
+        pthread_detach(engines[i].thread_id);
+    }
+
+    return 0;
+}
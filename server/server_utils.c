@@ -9,186 +9,1448 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <dirent.h>
 
 // ===========================
 // 7. OFFLINE MESSAGES
 // ===========================
 
+// Mailbox của 1 recipient: [MailboxHeader][record]..., record = [8B stamp][4B length][body v2]
+// (cùng format frame nên CONTENT chứa '|' không làm lệch field như file text cũ).
+// stamp là thời điểm server nhận message (ns, tăng nghiêm ngặt), dùng để trộn mailbox
+// với group log theo đúng thứ tự đến thay vì TIME do client gửi.
+// header.end là điểm commit: record ghi dở sau end (crash giữa chừng) bị bỏ qua và
+// ghi đè ở lần append sau. [start, end) là các record chưa gửi
+typedef struct {
+    uint32_t magic;
+    uint32_t count;             // Số message chưa gửi
+    uint64_t start;             // Offset record đầu tiên chưa gửi
+    uint64_t end;               // Offset sau record cuối cùng đã commit
+} MailboxHeader;
+
+// Group log của 1 nhóm: [GroupLogHeader][record]..., record = [4B mask][8B stamp][4B length]
+// [body v2].
+// Tin nhắn nhóm chỉ lưu 1 lần dù bao nhiêu member offline: bit i của mask = member ở
+// slot i cần nhận record. Slot được cấp khi member có record chờ đầu tiên (cursor =
+// offset record đó) và giải phóng khi member đọc hết lúc đăng nhập; log được cắt về
+// header rỗng khi không còn slot nào. Phần trước start được bỏ bằng cách compact
+// (chép [start, end) sang file mới) nên 1 member offline lâu chỉ giữ phần nó chưa đọc,
+// và phần đó bị giới hạn bởi GROUP_LOG_MAX_BYTES
+typedef struct {
+    char username[MAX_USERNAME_LEN];    // "" = slot trống
+    uint32_t pending;                   // Số record chờ member này
+    uint64_t cursor;                    // Offset record đầu tiên member chưa đọc
+} GroupCursor;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t members;           // Số slot đang dùng
+    uint64_t start;             // Cursor nhỏ nhất, phần trước start không member nào cần
+    uint64_t end;               // Offset sau record cuối cùng đã commit
+    uint64_t base;              // Bytes đã bỏ khi compact/cắt: offset + base không đổi qua compact
+    GroupCursor cursors[GROUP_LOG_SLOTS];
+} GroupLogHeader;
+
+static mutex_t mailbox_locks[MAILBOX_LOCKS];
+
+/**
+ * Lock của mailbox/group log (striped theo hash username hoặc tên nhóm, FNV-1a)
+ */
+static mutex_t *mailbox_lock(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = username; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    
+    return &mailbox_locks[hash % MAILBOX_LOCKS];
+}
+
+/**
+ * Đường dẫn mailbox (offline/<username>.box) hoặc group log (offline/<group>.grp),
+ * ký tự ngoài [A-Za-z0-9_-] được escape thành %XX để tên không thể trỏ ra ngoài thư mục
+ */
+static void mailbox_path(const char *name, const char *suffix, char *path, size_t size) {
+    size_t n = (size_t)snprintf(path, size, "%s/", OFFLINE_DIR);
+    
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        if (n + 8 >= size) break;
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+            (*p >= '0' && *p <= '9') || *p == '_' || *p == '-') {
+            path[n++] = (char)*p;
+        } else {
+            n += (size_t)snprintf(path + n, size - n, "%%%02X", *p);
+        }
+    }
+    
+    snprintf(path + n, size - n, "%s", suffix);
+}
+
+/**
+ * Đọc header, file rỗng (mailbox mới) được coi như header trống
+ * Return: -1 nếu header hỏng
+ */
+static int mailbox_read_header(int fd, MailboxHeader *header) {
+    ssize_t n = pread(fd, header, sizeof(MailboxHeader), 0);
+    
+    if (n == 0) {
+        header->magic = MAILBOX_MAGIC;
+        header->count = 0;
+        header->start = sizeof(MailboxHeader);
+        header->end = sizeof(MailboxHeader);
+        return 0;
+    }
+    
+    if (n != (ssize_t)sizeof(MailboxHeader) || header->magic != MAILBOX_MAGIC ||
+        header->start < sizeof(MailboxHeader) || header->start > header->end) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int mailbox_write_header(int fd, const MailboxHeader *header) {
+    ssize_t n = pwrite(fd, header, sizeof(MailboxHeader), 0);
+    return n == (ssize_t)sizeof(MailboxHeader) ? 0 : -1;
+}
+
+/**
+ * Ghi iov liên tiếp từ offset, mỗi lần pwritev tối đa MAILBOX_IOV_MAX iovec
+ */
+static int pwrite_records(int fd, struct iovec *iov, int iov_count, off_t offset) {
+    for (int i = 0; i < iov_count; i += MAILBOX_IOV_MAX) {
+        int chunk = iov_count - i < MAILBOX_IOV_MAX ? iov_count - i : MAILBOX_IOV_MAX;
+        size_t chunk_bytes = 0;
+        for (int k = 0; k < chunk; k++) chunk_bytes += iov[i + k].iov_len;
+        
+        if (pwritev(fd, iov + i, chunk, offset) != (ssize_t)chunk_bytes) return -1;
+        offset += (off_t)chunk_bytes;
+    }
+    
+    return 0;
+}
+
+/**
+ * Append count record (iov) vào mailbox của username - 1 lần ghi cho cả batch
+ * Ghi record trước, header sau: header chỉ trỏ tới record đã ghi xong. Với
+ * --offline-fsync, record được fdatasync trước khi header trỏ tới
+ */
+static int mailbox_append(const char *username, struct iovec *iov, int iov_count,
+                          size_t total, uint32_t count) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(username, ".box", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(username);
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        mutex_unlock(lock);
+        perror("Failed to open mailbox");
+        return -1;
+    }
+    
+    MailboxHeader header;
+    int result = mailbox_read_header(fd, &header);
+    if (result == 0) result = pwrite_records(fd, iov, iov_count, (off_t)header.end);
+    
+    if (result == 0 && server_options.offline_fsync && fdatasync(fd) < 0) result = -1;
+    
+    if (result == 0) {
+        header.end += total;
+        header.count += count;
+        result = mailbox_write_header(fd, &header);
+        if (result == 0 && server_options.offline_fsync && fdatasync(fd) < 0) result = -1;
+    }
+    
+    close(fd);
+    mutex_unlock(lock);
+    
+    if (result < 0) {
+        fprintf(stderr, "[ERROR] Failed to append mailbox %s\n", path);
+    }
+    
+    return result;
+}
+
+/**
+ * Đọc header group log, file rỗng (log mới) được coi như header không có slot nào
+ * Return: -1 nếu header hỏng
+ */
+static int group_log_read_header(int fd, GroupLogHeader *header) {
+    ssize_t n = pread(fd, header, sizeof(GroupLogHeader), 0);
+    
+    if (n == 0) {
+        memset(header, 0, sizeof(*header));
+        header->magic = GROUP_LOG_MAGIC;
+        header->start = sizeof(GroupLogHeader);
+        header->end = sizeof(GroupLogHeader);
+        return 0;
+    }
+    
+    if (n != (ssize_t)sizeof(GroupLogHeader) || header->magic != GROUP_LOG_MAGIC ||
+        header->start < sizeof(GroupLogHeader) || header->start > header->end) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Slot của username trong group log ("" tìm slot trống)
+ * Return: -1 nếu không có
+ */
+static int group_log_slot(const GroupLogHeader *header, const char *username) {
+    for (int i = 0; i < GROUP_LOG_SLOTS; i++) {
+        if (strncmp(header->cursors[i].username, username, MAX_USERNAME_LEN) == 0) return i;
+    }
+    
+    return -1;
+}
+
+/**
+ * Chép [start, end) sang <path>.tmp với offset dời về ngay sau header rồi rename
+ * đè log cũ (caller giữ lock của log, fd cũ chỉ còn để close)
+ */
+static int group_log_compact(const char *path, int fd, GroupLogHeader *header) {
+    char tmp_path[MAILBOX_PATH_LEN + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0) {
+        perror("Failed to create compacted group log");
+        return -1;
+    }
+    
+    uint64_t shift = header->start - sizeof(GroupLogHeader);
+    GroupLogHeader compacted = *header;
+    compacted.start -= shift;
+    compacted.end -= shift;
+    compacted.base += shift;
+    for (int i = 0; i < GROUP_LOG_SLOTS; i++) {
+        if (compacted.cursors[i].username[0] != '\0') compacted.cursors[i].cursor -= shift;
+    }
+    
+    char buffer[65536];
+    uint64_t offset = header->start;
+    int result = 0;
+    
+    while (result == 0 && offset < header->end) {
+        size_t chunk = header->end - offset < sizeof(buffer) ? (size_t)(header->end - offset)
+                                                             : sizeof(buffer);
+        if (pread(fd, buffer, chunk, (off_t)offset) != (ssize_t)chunk ||
+            pwrite(out, buffer, chunk, (off_t)(offset - shift)) != (ssize_t)chunk) {
+            result = -1;
+        }
+        offset += chunk;
+    }
+    
+    if (result == 0 &&
+        pwrite(out, &compacted, sizeof(compacted), 0) != (ssize_t)sizeof(compacted)) {
+        result = -1;
+    }
+    if (result == 0 && server_options.offline_fsync && fdatasync(out) < 0) result = -1;
+    close(out);
+    
+    if (result == 0 && rename(tmp_path, path) < 0) result = -1;
+    
+    if (result < 0) {
+        perror("Failed to compact group log");
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    printf("[OFFLINE] Compacted group log %s: %llu -> %llu bytes\n", path,
+           (unsigned long long)header->end, (unsigned long long)compacted.end);
+    *header = compacted;
+    return 0;
+}
+
+/**
+ * Tính lại start (cursor nhỏ nhất) rồi ghi header; không còn member nào chờ thì
+ * cắt log về header rỗng (sau khi header đã trỏ về đầu), phần trước start đủ lớn
+ * thì compact
+ */
+static int group_log_write_header(const char *path, int fd, GroupLogHeader *header) {
+    header->members = 0;
+    header->start = header->end;
+    
+    for (int i = 0; i < GROUP_LOG_SLOTS; i++) {
+        if (header->cursors[i].username[0] == '\0') continue;
+        header->members++;
+        if (header->cursors[i].cursor < header->start) header->start = header->cursors[i].cursor;
+    }
+    
+    bool empty = header->members == 0 && header->end > sizeof(GroupLogHeader);
+    if (header->members == 0) {
+        header->base += header->end - sizeof(GroupLogHeader);
+        header->start = sizeof(GroupLogHeader);
+        header->end = sizeof(GroupLogHeader);
+    }
+    
+    // Chép phần còn lại tốn không quá phần được bỏ (amortized O(1) mỗi byte ghi)
+    uint64_t dead = header->start - sizeof(GroupLogHeader);
+    if (dead >= GROUP_LOG_COMPACT_BYTES && dead >= header->end - header->start &&
+        group_log_compact(path, fd, header) == 0) {
+        return 0;
+    }
+    
+    if (pwrite(fd, header, sizeof(GroupLogHeader), 0) != (ssize_t)sizeof(GroupLogHeader)) {
+        return -1;
+    }
+    
+    if (empty && ftruncate(fd, (off_t)sizeof(GroupLogHeader)) < 0) {
+        perror("Failed to truncate group log");
+    }
+    
+    return 0;
+}
+
+/**
+ * Giới hạn phần member chưa đọc: khi [start, end) vượt GROUP_LOG_MAX_BYTES, cursor cũ
+ * được dời tới record đầu tiên trong 3/4 giới hạn (không trim lại ở mỗi lần append),
+ * các record cũ hơn của member đó bị bỏ (member offline lâu không giữ log của cả nhóm mãi)
+ */
+static void group_log_trim(const char *path, int fd, GroupLogHeader *header) {
+    if (header->end - header->start <= GROUP_LOG_MAX_BYTES) return;
+    
+    uint64_t limit = header->end - GROUP_LOG_MAX_BYTES / 4 * 3;
+    uint32_t dropped[GROUP_LOG_SLOTS] = {0};
+    uint64_t offset = header->start;
+    
+    // Chỉ đọc prefix [mask][stamp][length] của từng record
+    while (offset < limit) {
+        char prefix[sizeof(uint32_t) + sizeof(uint64_t) + FRAME_HEADER_SIZE];
+        uint32_t mask;
+        uint32_t body_length;
+        
+        if (pread(fd, prefix, sizeof(prefix), (off_t)offset) != (ssize_t)sizeof(prefix)) return;
+        memcpy(&mask, prefix, sizeof(uint32_t));
+        memcpy(&body_length, prefix + sizeof(uint32_t) + sizeof(uint64_t), FRAME_HEADER_SIZE);
+        body_length = ntohl(body_length);
+        if (body_length == 0 || body_length > BUFFER_SIZE) return;  // Log hỏng: giữ nguyên
+        
+        for (int i = 0; i < GROUP_LOG_SLOTS; i++) {
+            if ((mask & (1u << i)) && header->cursors[i].username[0] != '\0' &&
+                header->cursors[i].cursor <= offset) {
+                dropped[i]++;
+            }
+        }
+        offset += sizeof(prefix) + body_length;
+    }
+    
+    for (int i = 0; i < GROUP_LOG_SLOTS; i++) {
+        GroupCursor *cursor = &header->cursors[i];
+        if (cursor->username[0] == '\0' || cursor->cursor >= offset) continue;
+        
+        printf("[OFFLINE] Group log %s: dropped %u oldest messages of '%s' (over %d bytes)\n",
+               path, dropped[i], cursor->username, GROUP_LOG_MAX_BYTES);
+        cursor->cursor = offset;
+        cursor->pending = cursor->pending > dropped[i] ? cursor->pending - dropped[i] : 0;
+        if (cursor->cursor >= header->end) {
+            memset(cursor, 0, sizeof(*cursor));
+        }
+    }
+}
+
+// ===========================
+// OFFLINE WRITER (GROUP COMMIT)
+// Handler chỉ encode record và xếp hàng rồi trả về ngay; 1 writer thread lấy hết
+// record đang chờ mỗi lượt, gom theo mailbox/group log và ghi mỗi file 1 lần (pwritev),
+// fsync (nếu bật) 1 lần cho mỗi file trong batch. Record đến trong lúc đang
+// commit tự gom vào batch sau
+// ===========================
+
+// Record chờ ghi: [8B stamp][4B length][body v2] như trong mailbox. Tin nhắn nhóm
+// (member_count > 0) kèm tên các member offline ngay sau frame. Record nằm trong
+// arena của batch đang gom, writer giải phóng cả arena sau khi ghi xong batch
+typedef struct OfflineRecord {
+    struct OfflineRecord *next;
+    uint64_t seq;
+    size_t length;
+    int member_count;
+    char to[MAX_GROUP_NAME_LEN];    // Recipient, hoặc tên nhóm nếu member_count > 0
+    char data[];
+} OfflineRecord;
+
+static char (*offline_record_members(OfflineRecord *record))[MAX_USERNAME_LEN] {
+    return (char (*)[MAX_USERNAME_LEN])(record->data + record->length);
+}
+
+static struct {
+    mutex_t lock;
+    pthread_cond_t ready;       // Có record mới hoặc phải dừng
+    pthread_cond_t space;       // Hàng đợi bớt đầy
+    pthread_cond_t committed;   // 1 batch vừa ghi xong
+    OfflineRecord *head;
+    OfflineRecord *tail;
+    Arena arena;                // Bộ nhớ của các record đang chờ
+    int queued;
+    uint64_t next_seq;          // seq của record xếp hàng tiếp theo
+    uint64_t committed_seq;     // Mọi record có seq < committed_seq đã ghi xong
+    uint64_t last_stamp;        // stamp của record xếp hàng gần nhất
+    bool running;
+    bool stop;
+    thread_t thread_id;
+} offline_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+    .arena = { NULL, ARENA_BLOCK_SIZE },
+};
+
+/**
+ * Append count tin nhắn của cùng 1 nhóm vào group log - mỗi record ghi 1 lần với mask
+ * các member offline. Tên member đã có slot được xóa khỏi record sau khi ghi xong;
+ * member còn lại (hết slot, ghi lỗi) được commit_offline_run ghi vào mailbox riêng
+ */
+static int group_log_append(OfflineRecord **records, int count) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(records[0]->to, ".grp", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(records[0]->to);
+    uint32_t *masks = malloc(sizeof(uint32_t) * count);
+    struct iovec *iov = malloc(sizeof(struct iovec) * count * 2);
+    
+    if (masks == NULL || iov == NULL) {
+        free(masks);
+        free(iov);
+        return -1;
+    }
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        mutex_unlock(lock);
+        free(masks);
+        free(iov);
+        perror("Failed to open group log");
+        return -1;
+    }
+    
+    GroupLogHeader header;
+    int result = group_log_read_header(fd, &header);
+    int iov_count = 0;
+    size_t total = 0;
+    
+    for (int i = 0; result == 0 && i < count; i++) {
+        char (*members)[MAX_USERNAME_LEN] = offline_record_members(records[i]);
+        masks[i] = 0;
+        
+        for (int m = 0; m < records[i]->member_count; m++) {
+            int slot = group_log_slot(&header, members[m]);
+            if (slot < 0) {
+                slot = group_log_slot(&header, "");
+                if (slot < 0) continue;
+                
+                // Record chờ đầu tiên của member: cursor bắt đầu từ record này
+                GroupCursor *cursor = &header.cursors[slot];
+                memset(cursor, 0, sizeof(*cursor));
+                strncpy(cursor->username, members[m], MAX_USERNAME_LEN - 1);
+                cursor->cursor = header.end + total;
+            }
+            header.cursors[slot].pending++;
+            masks[i] |= 1u << slot;
+        }
+        
+        if (masks[i] == 0) continue;
+        
+        iov[iov_count].iov_base = &masks[i];
+        iov[iov_count].iov_len = sizeof(uint32_t);
+        iov[iov_count + 1].iov_base = records[i]->data;
+        iov[iov_count + 1].iov_len = records[i]->length;
+        iov_count += 2;
+        total += sizeof(uint32_t) + records[i]->length;
+    }
+    
+    if (result == 0) result = pwrite_records(fd, iov, iov_count, (off_t)header.end);
+    if (result == 0 && server_options.offline_fsync && fdatasync(fd) < 0) result = -1;
+    
+    if (result == 0) {
+        header.end += total;
+        group_log_trim(path, fd, &header);
+        result = group_log_write_header(path, fd, &header);
+        if (result == 0 && server_options.offline_fsync && fdatasync(fd) < 0) result = -1;
+    }
+    
+    close(fd);
+    mutex_unlock(lock);
+    
+    // Member đã nằm trong mask không cần ghi thêm vào mailbox riêng
+    for (int i = 0; result == 0 && i < count; i++) {
+        char (*members)[MAX_USERNAME_LEN] = offline_record_members(records[i]);
+        for (int m = 0; m < records[i]->member_count; m++) {
+            int slot = group_log_slot(&header, members[m]);
+            if (slot >= 0 && (masks[i] & (1u << slot)) != 0) members[m][0] = '\0';
+        }
+    }
+    
+    free(masks);
+    free(iov);
+    
+    if (result < 0) {
+        fprintf(stderr, "[ERROR] Failed to append group log %s\n", path);
+    }
+    
+    return result;
+}
+
+/**
+ * Thứ tự trong batch: mailbox trước group log, theo tên file, giữ thứ tự xếp hàng
+ * trong cùng file
+ */
+static int compare_offline_target(const OfflineRecord *x, const OfflineRecord *y) {
+    int order = (x->member_count > 0) - (y->member_count > 0);
+    if (order != 0) return order;
+    return strcmp(x->to, y->to);
+}
+
+static int compare_offline_record(const void *a, const void *b) {
+    const OfflineRecord *x = *(OfflineRecord *const *)a;
+    const OfflineRecord *y = *(OfflineRecord *const *)b;
+    
+    int order = compare_offline_target(x, y);
+    if (order != 0) return order;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
+
+/**
+ * Ghi count record cùng đích (1 mailbox hoặc 1 group log), iov đủ chỗ cho count phần tử
+ * Return: số record ghi lỗi
+ */
+static int commit_offline_run(OfflineRecord **run, int count, struct iovec *iov) {
+    if (run[0]->member_count == 0) {
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = run[i]->data;
+            iov[i].iov_len = run[i]->length;
+            total += run[i]->length;
+        }
+        
+        return mailbox_append(run[0]->to, iov, count, total, (uint32_t)count) < 0 ? count : 0;
+    }
+    
+    int failed = 0;
+    group_log_append(run, count);
+    
+    // Fallback fan-out-on-write cho member không ghi được vào group log
+    for (int i = 0; i < count; i++) {
+        char (*members)[MAX_USERNAME_LEN] = offline_record_members(run[i]);
+        bool ok = true;
+        
+        for (int m = 0; m < run[i]->member_count; m++) {
+            if (members[m][0] == '\0') continue;
+            struct iovec single = { run[i]->data, run[i]->length };
+            if (mailbox_append(members[m], &single, 1, run[i]->length, 1) < 0) ok = false;
+        }
+        
+        if (!ok) failed++;
+    }
+    
+    return failed;
+}
+
+/**
+ * Ghi 1 batch (danh sách liên kết count record) vào các mailbox/group log
+ * (record thuộc arena của batch, caller giải phóng)
+ */
+static void commit_offline_batch(OfflineRecord *batch, int count) {
+    uint64_t started = monotonic_ms();
+    OfflineRecord **records = malloc(sizeof(OfflineRecord *) * count);
+    struct iovec *iov = malloc(sizeof(struct iovec) * count);
+    int mailboxes = 0;
+    int failed = 0;
+    
+    if (records == NULL || iov == NULL) {
+        // Không đủ bộ nhớ để gom: ghi từng record theo thứ tự xếp hàng
+        for (OfflineRecord *record = batch; record != NULL; record = record->next) {
+            struct iovec single;
+            failed += commit_offline_run(&record, 1, &single);
+            mailboxes++;
+        }
+    } else {
+        int n = 0;
+        for (OfflineRecord *record = batch; record != NULL; record = record->next) {
+            records[n++] = record;
+        }
+        qsort(records, count, sizeof(OfflineRecord *), compare_offline_record);
+        
+        for (int i = 0; i < count; ) {
+            int j = i + 1;
+            while (j < count && compare_offline_target(records[j], records[i]) == 0) j++;
+            
+            failed += commit_offline_run(records + i, j - i, iov);
+            mailboxes++;
+            i = j;
+        }
+    }
+    
+    free(records);
+    free(iov);
+    
+    printf("[OFFLINE] Committed %d messages to %d mailboxes in %llu ms%s\n",
+           count - failed, mailboxes, (unsigned long long)(monotonic_ms() - started),
+           failed > 0 ? " (some failed)" : "");
+}
+
+static THREAD_RETURN offline_writer_thread(void *arg) {
+    (void)arg;
+    
+    mutex_lock(&offline_writer.lock);
+    
+    while (1) {
+        while (offline_writer.head == NULL && !offline_writer.stop) {
+            pthread_cond_wait(&offline_writer.ready, &offline_writer.lock);
+        }
+        if (offline_writer.head == NULL) break;
+        
+        // Lấy cả hàng đợi (và arena chứa nó) làm 1 batch
+        OfflineRecord *batch = offline_writer.head;
+        Arena arena = offline_writer.arena;
+        int count = offline_writer.queued;
+        uint64_t last_seq = offline_writer.tail->seq;
+        offline_writer.head = NULL;
+        offline_writer.tail = NULL;
+        offline_writer.queued = 0;
+        arena_init(&offline_writer.arena, ARENA_BLOCK_SIZE);
+        pthread_cond_broadcast(&offline_writer.space);
+        mutex_unlock(&offline_writer.lock);
+        
+        commit_offline_batch(batch, count);
+        arena_free(&arena);
+        
+        mutex_lock(&offline_writer.lock);
+        offline_writer.committed_seq = last_seq + 1;
+        pthread_cond_broadcast(&offline_writer.committed);
+    }
+    
+    mutex_unlock(&offline_writer.lock);
+    THREAD_RETURN_VALUE;
+}
+
+static int start_offline_writer(void) {
+    offline_writer.stop = false;
+    
+    if (pthread_create(&offline_writer.thread_id, NULL, offline_writer_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to create offline writer thread\n");
+        return -1;
+    }
+    
+    offline_writer.running = true;
+    return 0;
+}
+
+/**
+ * Chờ mọi record đã xếp hàng trước lúc gọi được ghi xong vào mailbox
+ */
+void offline_store_sync(void) {
+    mutex_lock(&offline_writer.lock);
+    
+    uint64_t target = offline_writer.next_seq;
+    while (offline_writer.running && offline_writer.committed_seq < target) {
+        pthread_cond_wait(&offline_writer.committed, &offline_writer.lock);
+    }
+    
+    mutex_unlock(&offline_writer.lock);
+}
+
+/**
+ * Ghi hết hàng đợi rồi dừng writer (khi tắt server); sau đó ghi đồng bộ
+ */
+void stop_offline_writer(void) {
+    mutex_lock(&offline_writer.lock);
+    if (!offline_writer.running) {
+        mutex_unlock(&offline_writer.lock);
+        return;
+    }
+    offline_writer.stop = true;
+    pthread_cond_signal(&offline_writer.ready);
+    mutex_unlock(&offline_writer.lock);
+    
+    pthread_join(offline_writer.thread_id, NULL);
+    
+    mutex_lock(&offline_writer.lock);
+    offline_writer.running = false;
+    pthread_cond_broadcast(&offline_writer.committed);
+    pthread_cond_broadcast(&offline_writer.space);
+    mutex_unlock(&offline_writer.lock);
+}
+
+/**
+ * Stamp thời điểm đến cho record mới (caller giữ offline_writer.lock): ns theo đồng hồ
+ * thực, tăng nghiêm ngặt nên không trùng và vẫn tăng qua các lần khởi động lại
+ */
+static uint64_t next_offline_stamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    
+    uint64_t stamp = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    if (stamp <= offline_writer.last_stamp) stamp = offline_writer.last_stamp + 1;
+    offline_writer.last_stamp = stamp;
+    
+    return stamp;
+}
+
+/**
+ * Tạo record chờ ghi trong arena từ body đã encode, kèm member_count tên member sau frame
+ */
+static OfflineRecord *create_offline_record(Arena *arena, uint64_t stamp, const PackedMessage *msg,
+                                            const char *body, int len,
+                                            char members[][MAX_USERNAME_LEN], int member_count) {
+    size_t prefix = sizeof(uint64_t) + FRAME_HEADER_SIZE;
+    OfflineRecord *record = arena_alloc(arena, sizeof(OfflineRecord) + prefix + (size_t)len +
+                                        (size_t)member_count * MAX_USERNAME_LEN);
+    if (record == NULL) return NULL;
+    
+    uint32_t length = htonl((uint32_t)len);
+    memcpy(record->data, &stamp, sizeof(uint64_t));
+    memcpy(record->data + sizeof(uint64_t), &length, FRAME_HEADER_SIZE);
+    memcpy(record->data + prefix, body, (size_t)len);
+    record->length = prefix + (size_t)len;
+    record->member_count = member_count;
+    record->next = NULL;
+    strncpy(record->to, msg->to, MAX_GROUP_NAME_LEN - 1);
+    record->to[MAX_GROUP_NAME_LEN - 1] = '\0';
+    if (member_count > 0) {
+        memcpy(offline_record_members(record), members, (size_t)member_count * MAX_USERNAME_LEN);
+    }
+    
+    return record;
+}
+
+/**
+ * Encode msg (ngoài lock) rồi xếp record cho writer, record được copy vào arena của
+ * batch đang gom (writer chưa chạy/đã dừng thì ghi đồng bộ)
+ */
+static int enqueue_offline_record(const PackedMessage *msg,
+                                  char members[][MAX_USERNAME_LEN], int member_count) {
+    char body[BUFFER_SIZE];
+    int len = encode_packed_message(msg, PROTOCOL_V2, body, sizeof(body));
+    if (len < 0) {
+        fprintf(stderr, "[ERROR] Failed to serialize offline message\n");
+        return -1;
+    }
+    
+    mutex_lock(&offline_writer.lock);
+    
+    if (!offline_writer.running || offline_writer.stop) {
+        uint64_t stamp = next_offline_stamp();
+        mutex_unlock(&offline_writer.lock);
+        Arena arena;
+        arena_init(&arena, 0);
+        OfflineRecord *single = create_offline_record(&arena, stamp, msg, body, len,
+                                                      members, member_count);
+        struct iovec iov;
+        int failed = single != NULL ? commit_offline_run(&single, 1, &iov) : 1;
+        arena_free(&arena);
+        return failed > 0 ? -1 : 0;
+    }
+    
+    // Hàng đợi đầy: producer chờ writer (backpressure thay vì dùng hết bộ nhớ)
+    while (offline_writer.queued >= OFFLINE_QUEUE_MAX && offline_writer.running) {
+        pthread_cond_wait(&offline_writer.space, &offline_writer.lock);
+    }
+    
+    OfflineRecord *record = create_offline_record(&offline_writer.arena, next_offline_stamp(),
+                                                  msg, body, len, members, member_count);
+    if (record == NULL) {
+        mutex_unlock(&offline_writer.lock);
+        return -1;
+    }
+    
+    record->seq = offline_writer.next_seq++;
+    if (offline_writer.tail != NULL) {
+        offline_writer.tail->next = record;
+    } else {
+        offline_writer.head = record;
+    }
+    offline_writer.tail = record;
+    
+    // Writer chỉ ngủ khi hàng đợi rỗng: record sau đó tự vào batch kế tiếp
+    if (offline_writer.queued++ == 0) {
+        pthread_cond_signal(&offline_writer.ready);
+    }
+    
+    mutex_unlock(&offline_writer.lock);
+    
+    return 0;
+}
+
+/**
+ * Lưu tin nhắn offline cho msg->to: encode rồi xếp hàng cho writer, trả về ngay
+ * (record được ghi ở batch kế tiếp; offline_store_sync() chờ tới khi ghi xong)
+ */
+int save_offline_message(const PackedMessage *msg) {
+    if (msg == NULL || msg->to[0] == '\0') return -1;
+    
+    if (enqueue_offline_record(msg, NULL, 0) < 0) return -1;
+    
+    printf("[OFFLINE] Queued message for '%s' from '%s'\n", msg->to, msg->from);
+    
+    return 0;
+}
+
+/**
+ * Lưu tin nhắn nhóm (msg->to = tên nhóm) cho các member offline: 1 record trong group
+ * log của nhóm thay vì 1 bản trong mailbox của từng member
+ */
+int save_group_offline_message(const PackedMessage *msg,
+                               char members[][MAX_USERNAME_LEN], int member_count) {
+    if (msg == NULL || msg->to[0] == '\0' || member_count <= 0) return -1;
+    if (member_count > MAX_GROUP_MEMBERS) member_count = MAX_GROUP_MEMBERS;
+    
+    if (enqueue_offline_record(msg, members, member_count) < 0) return -1;
+    
+    printf("[OFFLINE] Queued group message for %d members of '%s' from '%s'\n",
+           member_count, msg->to, msg->from);
+    
+    return 0;
+}
+
+// Nguồn offline của 1 user khi đăng nhập: mailbox riêng hoặc phần chưa đọc của 1 group log
+typedef struct {
+    char name[MAX_GROUP_NAME_LEN];  // Tên nhóm, "" = mailbox riêng
+    char *data;                     // Bytes [read_from, read_end) của file
+    size_t size;
+    size_t offset;
+    uint64_t read_from;
+    uint64_t read_end;
+    uint32_t bit;                   // Bit slot của user trong mask (group log), 0 = mailbox
+    uint32_t records;               // Record của user đã đọc qua
+    uint64_t stamp;                 // stamp của record kế tiếp
+    MessageView view;               // Record kế tiếp, hợp lệ khi has_next
+    bool has_next;
+} OfflineSource;
+
+/**
+ * Tên các nhóm user là member, ghi vào sources[i].name
+ * Return: số nhóm
+ */
+static int collect_user_groups(const char *username, OfflineSource *sources) {
+    int count = 0;
+    
+    mutex_lock(&server_state.groups_mutex);
+    
+    for (int i = 0; i < server_state.group_count && count < MAX_GROUPS; i++) {
+        Group *group = &server_state.groups[i];
+        for (int j = 0; j < group->member_count; j++) {
+            if (strcmp(group->members[j], username) == 0) {
+                strncpy(sources[count].name, group->group_name, MAX_GROUP_NAME_LEN - 1);
+                sources[count].name[MAX_GROUP_NAME_LEN - 1] = '\0';
+                count++;
+                break;
+            }
+        }
+    }
+    
+    mutex_unlock(&server_state.groups_mutex);
+    return count;
+}
+
+/**
+ * Đọc phần chưa gửi [start, end) của mailbox riêng
+ */
+static void load_mailbox_source(const char *username, OfflineSource *source) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(username, ".box", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(username);
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        // Chưa từng có offline message
+        mutex_unlock(lock);
+        return;
+    }
+    
+    MailboxHeader header;
+    if (mailbox_read_header(fd, &header) == 0 && header.count > 0) {
+        source->size = (size_t)(header.end - header.start);
+        source->data = malloc(source->size);
+        if (source->data == NULL ||
+            pread(fd, source->data, source->size, (off_t)header.start) != (ssize_t)source->size) {
+            free(source->data);
+            source->data = NULL;
+        } else {
+            source->read_from = header.start;
+            source->read_end = header.end;
+        }
+    }
+    
+    close(fd);
+    mutex_unlock(lock);
+}
+
+/**
+ * Đọc phần group log từ cursor của username tới end (nếu user có slot)
+ */
+static void load_group_source(const char *username, OfflineSource *source) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(source->name, ".grp", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(source->name);
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        mutex_unlock(lock);
+        return;
+    }
+    
+    GroupLogHeader header;
+    int slot = -1;
+    if (group_log_read_header(fd, &header) == 0) {
+        slot = group_log_slot(&header, username);
+    }
+    
+    // read_from/read_end tính cả base: log có thể bị compact trước release_group_source
+    if (slot >= 0 && header.cursors[slot].cursor <= header.end) {
+        uint64_t cursor = header.cursors[slot].cursor;
+        source->read_from = cursor + header.base;
+        source->read_end = header.end + header.base;
+        source->size = (size_t)(header.end - cursor);
+        source->data = malloc(source->size > 0 ? source->size : 1);
+        if (source->data == NULL ||
+            pread(fd, source->data, source->size, (off_t)cursor) != (ssize_t)source->size) {
+            free(source->data);
+            source->data = NULL;
+        } else {
+            source->bit = 1u << slot;
+        }
+    }
+    
+    close(fd);
+    mutex_unlock(lock);
+}
+
 /**
- * Lưu tin nhắn offline
- * Format: TO|FROM|TYPE|CONTENT|TIMESTAMP|EXTRA
+ * Chuyển tới record kế tiếp của source dành cho user (group log bỏ qua record có
+ * mask không chứa bit của user)
  */
-int save_offline_message(const Message *msg) {
-    if (msg == NULL) return -1;
-    
-    FILE *fp = fopen("offline_messages.txt", "a");
-    if (fp == NULL) {
-        perror("Failed to open offline_messages.txt");
-        return -1;
+static void offline_source_next(OfflineSource *source) {
+    source->has_next = false;
+    
+    while (source->data != NULL && source->offset < source->size) {
+        const char *p = source->data + source->offset;
+        size_t left = source->size - source->offset;
+        size_t mask_size = source->bit != 0 ? sizeof(uint32_t) : 0;
+        size_t prefix = mask_size + sizeof(uint64_t);
+        uint32_t mask = 0;
+        uint32_t body_length;
+        
+        if (left < prefix) return;
+        if (mask_size > 0) memcpy(&mask, p, sizeof(uint32_t));
+        if (frame_peek(p + prefix, left - prefix, BUFFER_SIZE, &body_length) != 1) return;
+        
+        source->offset += prefix + FRAME_HEADER_SIZE + body_length;
+        if (mask_size > 0 && (mask & source->bit) == 0) continue;
+        
+        source->records++;
+        memcpy(&source->stamp, p + mask_size, sizeof(uint64_t));
+        if (parse_message_view(p + prefix + FRAME_HEADER_SIZE, body_length, &source->view) == 0) {
+            source->has_next = true;
+            return;
+        }
+    }
+}
+
+/**
+ * Bỏ phần mailbox đã gửi: dời start (O(1)), mailbox hết thì cắt về header rỗng.
+ * Message đến trong lúc gửi nằm sau read_end nên được giữ lại
+ */
+static void release_mailbox_source(const char *username, const OfflineSource *source) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(username, ".box", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(username);
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        MailboxHeader header;
+        if (mailbox_read_header(fd, &header) == 0 && source->read_end >= header.start &&
+            source->read_end <= header.end) {
+            header.start = source->read_end;
+            header.count = header.count > source->records ? header.count - source->records : 0;
+            
+            if (header.start == header.end) {
+                header.count = 0;
+                header.start = sizeof(MailboxHeader);
+                header.end = sizeof(MailboxHeader);
+                if (ftruncate(fd, (off_t)sizeof(MailboxHeader)) < 0) {
+                    perror("Failed to truncate mailbox");
+                }
+            }
+            mailbox_write_header(fd, &header);
+        }
+        close(fd);
     }
     
-    fprintf(fp, "%s|%s|%d|%s|%s|%s\n",
-            msg->to,
-            msg->from,
-            msg->type,
-            msg->content,
-            msg->timestamp,
-            msg->extra);
+    mutex_unlock(lock);
+}
+
+/**
+ * Dời cursor của user tới read_end; đọc hết thì giải phóng slot (log hết member
+ * chờ thì được cắt)
+ */
+static void release_group_source(const char *username, const OfflineSource *source) {
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(source->name, ".grp", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(source->name);
     
-    fclose(fp);
+    mutex_lock(lock);
     
-    printf("[OFFLINE] Saved message for '%s' from '%s'\n", msg->to, msg->from);
+    int fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        GroupLogHeader header;
+        int slot = group_log_read_header(fd, &header) == 0 ? group_log_slot(&header, username) : -1;
+        
+        // Cursor có thể đã bị group_log_trim dời lên trong lúc gửi, vẫn nằm trong phần đã đọc
+        uint64_t position = slot >= 0 ? header.cursors[slot].cursor + header.base : 0;
+        if (slot >= 0 && position >= source->read_from && position <= source->read_end) {
+            GroupCursor *cursor = &header.cursors[slot];
+            cursor->cursor = source->read_end - header.base;
+            cursor->pending = cursor->pending > source->records ? cursor->pending - source->records : 0;
+            if (cursor->cursor >= header.end) {
+                memset(cursor, 0, sizeof(*cursor));
+            }
+            group_log_write_header(path, fd, &header);
+        }
+        close(fd);
+    }
     
-    return 0;
+    mutex_unlock(lock);
 }
 
 /**
- * Gửi tất cả offline messages cho user
+ * Gửi tất cả offline messages cho user: mailbox riêng trộn với phần chưa đọc của
+ * group log các nhóm user là member, theo stamp lúc server nhận message (bằng nhau thì
+ * mailbox trước) - O(số message của user + phần group log từ cursor)
+ * Chỉ dời start/cursor sau khi đã xếp hàng gửi
  */
 int send_offline_messages(int socket_fd, const char *username) {
     if (username == NULL) return -1;
     
-    FILE *fp = fopen("offline_messages.txt", "r");
-    if (fp == NULL) {
-        // File không tồn tại hoặc không có offline messages
-        return 0;
+    // Message đã xếp hàng cho writer phải nằm trong mailbox/group log trước khi đọc
+    offline_store_sync();
+    
+    OfflineSource *sources = calloc(MAX_GROUPS + 1, sizeof(OfflineSource));
+    if (sources == NULL) return -1;
+    
+    // sources[0] = mailbox riêng, sau đó là các nhóm
+    int source_count = 1 + collect_user_groups(username, sources + 1);
+    
+    load_mailbox_source(username, &sources[0]);
+    for (int i = 1; i < source_count; i++) {
+        load_group_source(username, &sources[i]);
     }
     
-    // Đọc tất cả messages
-    char line[BUFFER_SIZE];
-    Message *messages = malloc(sizeof(Message) * 1000);  // Max 1000 messages
-    int msg_count = 0;
+    for (int i = 0; i < source_count; i++) {
+        offline_source_next(&sources[i]);
+    }
     
-    while (fgets(line, sizeof(line), fp) != NULL && msg_count < 1000) {
-        char to[MAX_USERNAME_LEN];
-        char from[MAX_USERNAME_LEN];
-        int type;
-        char content[MAX_MESSAGE_LEN];
-        char timestamp[32];
-        char extra[MAX_MESSAGE_LEN];
-        
-        // Parse line
-        char *token = strtok(line, "|");
-        if (token == NULL) continue;
-        strncpy(to, token, MAX_USERNAME_LEN - 1);
-        
-        token = strtok(NULL, "|");
-        if (token == NULL) continue;
-        strncpy(from, token, MAX_USERNAME_LEN - 1);
-        
-        token = strtok(NULL, "|");
-        if (token == NULL) continue;
-        type = atoi(token);
-        
-        token = strtok(NULL, "|");
-        if (token == NULL) continue;
-        strncpy(content, token, MAX_MESSAGE_LEN - 1);
-        
-        token = strtok(NULL, "|");
-        if (token == NULL) continue;
-        strncpy(timestamp, token, 31);
-        
-        token = strtok(NULL, "|\n");
-        if (token != NULL) {
-            strncpy(extra, token, MAX_MESSAGE_LEN - 1);
-        } else {
-            extra[0] = '\0';
+    // Merge k nguồn, mỗi record pack ra storage tạm rồi encode theo client
+    int msg_count = 0;
+    int group_count = 0;
+    
+    while (1) {
+        OfflineSource *next = NULL;
+        for (int i = 0; i < source_count; i++) {
+            if (sources[i].has_next &&
+                (next == NULL || sources[i].stamp < next->stamp)) {
+                next = &sources[i];
+            }
         }
+        if (next == NULL) break;
         
-        // Kiểm tra xem message có dành cho user này không
-        if (strcmp(to, username) == 0) {
-            Message *msg = &messages[msg_count];
-            msg->type = type;
-            strncpy(msg->from, from, MAX_USERNAME_LEN - 1);
-            strncpy(msg->to, to, MAX_USERNAME_LEN - 1);
-            strncpy(msg->content, content, MAX_MESSAGE_LEN - 1);
-            strncpy(msg->timestamp, timestamp, 31);
-            strncpy(msg->extra, extra, MAX_MESSAGE_LEN - 1);
-            msg_count++;
-        }
+        char storage[sizeof(Message)];
+        PackedMessage msg;
+        pack_message_view(&next->view, &msg, storage);
+        send_packed_message(socket_fd, &msg);
+        msg_count++;
+        if (next != &sources[0]) group_count++;
+        
+        offline_source_next(next);
     }
     
-    fclose(fp);
+    printf("[OFFLINE] Sent %d offline messages to '%s' (%d from group logs)\n",
+           msg_count, username, group_count);
     
-    // Gửi các messages cho user
-    printf("[OFFLINE] Sending %d offline messages to '%s'\n", msg_count, username);
-    
-    for (int i = 0; i < msg_count; i++) {
-        send_message_struct(socket_fd, &messages[i]);
-    }
-    
-    free(messages);
-    
-    // Xóa các messages đã gửi khỏi file
-    // (Đọc lại file, skip các messages đã gửi, ghi lại)
-    if (msg_count > 0) {
-        fp = fopen("offline_messages.txt", "r");
-        FILE *temp_fp = fopen("offline_messages_temp.txt", "w");
-        
-        if (fp != NULL && temp_fp != NULL) {
-            while (fgets(line, sizeof(line), fp) != NULL) {
-                char to[MAX_USERNAME_LEN];
-                char *token = strtok(line, "|");
-                if (token != NULL) {
-                    strncpy(to, token, MAX_USERNAME_LEN - 1);
-                    
-                    // Nếu không phải message của user này, giữ lại
-                    if (strcmp(to, username) != 0) {
-                        // Phải đọc lại line vì strtok đã modify
-                        fseek(fp, -(strlen(line) + 1), SEEK_CUR);
-                        fgets(line, sizeof(line), fp);
-                        fprintf(temp_fp, "%s", line);
-                    }
-                }
-            }
-            
-            fclose(fp);
-            fclose(temp_fp);
-            
-            // Replace file
-            remove("offline_messages.txt");
-            rename("offline_messages_temp.txt", "offline_messages.txt");
+    for (int i = 0; i < source_count; i++) {
+        if (sources[i].data == NULL) continue;
+        
+        if (i == 0) {
+            release_mailbox_source(username, &sources[i]);
+        } else {
+            release_group_source(username, &sources[i]);
         }
+        free(sources[i].data);
     }
     
+    free(sources);
+    
     return msg_count;
 }
 
 /**
- * Đếm số lượng offline messages
+ * Đếm số offline messages của user - O(số nhóm), chỉ đọc header mailbox và group log
  */
 int count_offline_messages(const char *username) {
     if (username == NULL) return 0;
     
-    FILE *fp = fopen("offline_messages.txt", "r");
-    if (fp == NULL) return 0;
+    offline_store_sync();
+    
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(username, ".box", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(username);
+    
+    mutex_lock(lock);
     
     int count = 0;
-    char line[BUFFER_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        MailboxHeader header;
+        if (mailbox_read_header(fd, &header) == 0) {
+            count = (int)header.count;
+        }
+        close(fd);
+    }
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        char to[MAX_USERNAME_LEN];
-        char *token = strtok(line, "|");
-        if (token != NULL) {
-            strncpy(to, token, MAX_USERNAME_LEN - 1);
-            if (strcmp(to, username) == 0) {
-                count++;
-            }
+    mutex_unlock(lock);
+    
+    OfflineSource *groups = calloc(MAX_GROUPS, sizeof(OfflineSource));
+    if (groups == NULL) return count;
+    int group_count = collect_user_groups(username, groups);
+    
+    for (int i = 0; i < group_count; i++) {
+        mailbox_path(groups[i].name, ".grp", path, sizeof(path));
+        lock = mailbox_lock(groups[i].name);
+        
+        mutex_lock(lock);
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            GroupLogHeader header;
+            int slot = group_log_read_header(fd, &header) == 0 ? group_log_slot(&header, username) : -1;
+            if (slot >= 0) count += (int)header.cursors[slot].pending;
+            close(fd);
         }
+        mutex_unlock(lock);
     }
     
-    fclose(fp);
+    free(groups);
     return count;
 }
 
+/**
+ * Bỏ slot của username trong group log khi rời nhóm (không còn nhận tin nhắn nhóm,
+ * log không bị giữ lại vì cursor của member cũ)
+ */
+void drop_group_offline_member(const char *group_name, const char *username) {
+    if (group_name == NULL || username == NULL) return;
+    
+    // Tin nhắn xếp hàng trước lúc rời nhóm phải nằm trong log trước khi bỏ slot
+    offline_store_sync();
+    
+    char path[MAILBOX_PATH_LEN];
+    mailbox_path(group_name, ".grp", path, sizeof(path));
+    mutex_t *lock = mailbox_lock(group_name);
+    
+    mutex_lock(lock);
+    
+    int fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        GroupLogHeader header;
+        int slot = group_log_read_header(fd, &header) == 0 ? group_log_slot(&header, username) : -1;
+        
+        if (slot >= 0) {
+            printf("[OFFLINE] Dropped %u pending messages of '%s' in group log '%s'\n",
+                   header.cursors[slot].pending, username, group_name);
+            memset(&header.cursors[slot], 0, sizeof(GroupCursor));
+            group_log_write_header(path, fd, &header);
+        }
+        close(fd);
+    }
+    
+    mutex_unlock(lock);
+}
+
+/**
+ * Cắt 1 dòng offline_messages.txt (format cũ) thành view (field trỏ vào line)
+ * Format: TO|FROM|TYPE|CONTENT|TIMESTAMP|EXTRA
+ * Return: -1 nếu dòng thiếu field
+ */
+static int parse_offline_line(const char *line, MessageView *view) {
+    FieldView fields[6];
+    size_t length = strcspn(line, "\r\n");
+    int field_count = split_fields(line, length, SCAN_PIPE, fields, 6);
+    
+    // EXTRA có thể thiếu
+    if (field_count < 5 || fields[0].length == 0) return -1;
+    
+    memset(view, 0, sizeof(*view));
+    view->raw = line;
+    view->raw_length = length;
+    view->version = PROTOCOL_V1;
+    view->to = fields[0];
+    view->from = fields[1];
+    view->type = (MessageType)atoi(fields[2].data);
+    view->content = fields[3];
+    view->timestamp = fields[4];
+    if (field_count == 6) view->extra = fields[5];
+    
+    return 0;
+}
+
+/**
+ * stamp cho record format cũ: TIME của message (khóa trộn của format cũ), tăng nghiêm
+ * ngặt sau stamp trước đó trong cùng file để giữ thứ tự đã lưu
+ */
+static uint64_t legacy_record_stamp(const char *body, uint32_t body_length, uint64_t previous) {
+    MessageView view;
+    char timestamp[32] = "";
+    struct tm tm;
+    uint64_t stamp = 0;
+    
+    if (parse_message_view(body, body_length, &view) == 0 &&
+        view.timestamp.length < sizeof(timestamp)) {
+        memcpy(timestamp, view.timestamp.data, view.timestamp.length);
+        timestamp[view.timestamp.length] = '\0';
+    }
+    
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(timestamp, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        time_t seconds = mktime(&tm);
+        if (seconds > 0) stamp = (uint64_t)seconds * 1000000000ull;
+    }
+    
+    return stamp > previous ? stamp : previous + 1;
+}
+
+/**
+ * Chuyển 1 mailbox/group log format cũ (record chưa có stamp) sang format hiện tại:
+ * chép [start, end) sang <path>.tmp, chèn stamp theo TIME vào mỗi record (thứ tự trộn
+ * như format cũ), dời cursor theo rồi rename đè file cũ
+ * Return: 1 nếu đã chuyển, 0 nếu file không phải format cũ, -1 nếu lỗi (giữ file cũ)
+ */
+static int upgrade_offline_file(const char *path, bool group) {
+    union {
+        MailboxHeader mailbox;
+        GroupLogHeader group;
+    } header;
+    size_t header_size = group ? sizeof(GroupLogHeader) : sizeof(MailboxHeader);
+    uint32_t *magic = group ? &header.group.magic : &header.mailbox.magic;
+    uint64_t *start = group ? &header.group.start : &header.mailbox.start;
+    uint64_t *end = group ? &header.group.end : &header.mailbox.end;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    
+    if (pread(fd, &header, header_size, 0) != (ssize_t)header_size ||
+        *magic != (group ? GROUP_LOG_MAGIC_V1 : MAILBOX_MAGIC_V1) ||
+        *start < header_size || *start > *end) {
+        close(fd);
+        return 0;
+    }
+    
+    size_t size = (size_t)(*end - *start);
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL || pread(fd, data, size, (off_t)*start) != (ssize_t)size) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    
+    char tmp_path[MAILBOX_PATH_LEN + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int result = out < 0 ? -1 : 0;
+    
+    // Cursor trỏ vào đầu record (hoặc end) nên được dời theo offset mới của record đó
+    uint64_t cursors[GROUP_LOG_SLOTS];
+    for (int i = 0; i < GROUP_LOG_SLOTS; i++) cursors[i] = UINT64_MAX;
+    
+    size_t mask_size = group ? sizeof(uint32_t) : 0;
+    uint64_t stamp = 0;
+    uint64_t written = header_size;
+    size_t offset = 0;
+    
+    while (result == 0) {
+        for (int i = 0; group && i < GROUP_LOG_SLOTS; i++) {
+            if (header.group.cursors[i].cursor == *start + offset) cursors[i] = written;
+        }
+        
+        uint32_t body_length;
+        if (offset + mask_size > size ||
+            frame_peek(data + offset + mask_size, size - offset - mask_size, BUFFER_SIZE,
+                       &body_length) != 1) {
+            break;
+        }
+        
+        size_t frame = FRAME_HEADER_SIZE + body_length;
+        stamp = legacy_record_stamp(data + offset + mask_size + FRAME_HEADER_SIZE, body_length,
+                                    stamp);
+        struct iovec iov[3] = {
+            { data + offset, mask_size },
+            { &stamp, sizeof(stamp) },
+            { data + offset + mask_size, frame },
+        };
+        if (pwrite_records(out, iov, 3, (off_t)written) < 0) result = -1;
+        
+        offset += mask_size + frame;
+        written += mask_size + sizeof(stamp) + frame;
+    }
+    
+    // Phần hỏng ở cuối (sau record hợp lệ cuối cùng) bị bỏ; start của group log = cursor nhỏ nhất
+    *magic = group ? GROUP_LOG_MAGIC : MAILBOX_MAGIC;
+    *start = group ? written : header_size;
+    *end = written;
+    for (int i = 0; group && i < GROUP_LOG_SLOTS; i++) {
+        GroupCursor *cursor = &header.group.cursors[i];
+        if (cursor->username[0] == '\0') continue;
+        cursor->cursor = cursors[i] != UINT64_MAX ? cursors[i] : written;
+        if (cursor->cursor < *start) *start = cursor->cursor;
+    }
+    
+    free(data);
+    
+    if (result == 0 && pwrite(out, &header, header_size, 0) != (ssize_t)header_size) result = -1;
+    if (result == 0 && server_options.offline_fsync && fdatasync(out) < 0) result = -1;
+    if (out >= 0) close(out);
+    if (result == 0 && rename(tmp_path, path) < 0) result = -1;
+    
+    if (result < 0) {
+        perror("Failed to convert offline file");
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    return 1;
+}
+
+/**
+ * Chuyển mọi mailbox/group log format cũ trong OFFLINE_DIR (trước khi writer chạy)
+ */
+static void upgrade_offline_store(void) {
+    DIR *dir = opendir(OFFLINE_DIR);
+    if (dir == NULL) return;
+    
+    struct dirent *entry;
+    int converted = 0;
+    
+    while ((entry = readdir(dir)) != NULL) {
+        size_t n = strlen(entry->d_name);
+        if (n < 5 || n + sizeof(OFFLINE_DIR) >= MAILBOX_PATH_LEN) continue;
+        
+        bool box = strcmp(entry->d_name + n - 4, ".box") == 0;
+        bool grp = strcmp(entry->d_name + n - 4, ".grp") == 0;
+        if (!box && !grp) continue;
+        
+        char path[MAILBOX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", OFFLINE_DIR, entry->d_name);
+        if (upgrade_offline_file(path, grp) > 0) converted++;
+    }
+    
+    closedir(dir);
+    
+    if (converted > 0) {
+        printf("[OFFLINE] Converted %d mailboxes/group logs to the stamped record format\n",
+               converted);
+    }
+}
+
+/**
+ * Khởi tạo offline store: lock, thư mục mailbox, chuyển offline_messages.txt cũ
+ * (nếu có) vào mailbox của từng recipient rồi đổi tên file cũ thành *.migrated
+ */
+int init_offline_store(void) {
+    for (int i = 0; i < MAILBOX_LOCKS; i++) {
+        mutex_init(&mailbox_locks[i], NULL);
+    }
+    
+    if (mkdir(OFFLINE_DIR, 0700) < 0 && errno != EEXIST) {
+        perror("Failed to create offline directory");
+        return -1;
+    }
+    
+    upgrade_offline_store();
+    
+    if (start_offline_writer() < 0) return -1;
+    
+    FILE *fp = fopen(OFFLINE_LEGACY_FILE, "r");
+    if (fp == NULL) return 0;
+    
+    char line[BUFFER_SIZE * 2];
+    int migrated = 0;
+    
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        MessageView view;
+        if (parse_offline_line(line, &view) < 0) continue;
+        
+        char storage[sizeof(Message)];
+        PackedMessage msg;
+        pack_message_view(&view, &msg, storage);
+        if (save_offline_message(&msg) == 0) migrated++;
+    }
+    
+    fclose(fp);
+    
+    // Chỉ đổi tên file cũ khi mọi message đã nằm trong mailbox
+    offline_store_sync();
+    rename(OFFLINE_LEGACY_FILE, OFFLINE_LEGACY_FILE ".migrated");
+    
+    printf("[OFFLINE] Migrated %d messages from %s to %s/\n",
+           migrated, OFFLINE_LEGACY_FILE, OFFLINE_DIR);
+    return 0;
+}
+
 // ===========================
 // 8. FILE TRANSFER
 // ===========================
 
+/**
+ * Lưu file đã nhận đủ vào temp/ rồi chuyển tiếp cho receiver
+ */
+static int store_and_relay_file(const char *from, const char *filename, const char *receiver,
+                                const char *file_data, uint32_t file_size) {
+    // Tạo thư mục temp nếu chưa có
+    struct stat st = {0};
+    if (stat("temp", &st) == -1) {
+        mkdir("temp", 0700);
+    }
+    
+    // Lưu file vào temp/
+    char temp_path[512];
+    snprintf(temp_path, sizeof(temp_path), "temp/%s_%s_%ld",
+             from, filename, time(NULL));
+    
+    FILE *fp = fopen(temp_path, "wb");
+    if (fp == NULL) {
+        perror("Failed to save file");
+        return -1;
+    }
+    
+    fwrite(file_data, 1, file_size, fp);
+    fclose(fp);
+    
+    printf("[FILE] Saved file to '%s'\n", temp_path);
+    
+    // Chuyển tiếp thông báo file đến receiver
+    return relay_file(temp_path, from, receiver);
+}
+
 /**
  * Xử lý nhận file từ sender
  */
-int handle_file_transfer(ClientConnection *client, const Message *msg) {
+int handle_file_transfer(ClientConnection *client, const PackedMessage *msg) {
     if (client == NULL || msg == NULL) return -1;
     
     // msg->extra chứa filename
@@ -211,51 +1473,96 @@ int handle_file_transfer(ClientConnection *client, const Message *msg) {
         return -1;
     }
     
-    // Tạo thư mục temp nếu chưa có
-    struct stat st = {0};
-    if (stat("temp", &st) == -1) {
-        mkdir("temp", 0700);
-    }
-    
     // Nhận file data
-    char *file_data = malloc(file_size);
+    char *file_data = malloc(file_size > 0 ? file_size : 1);
     if (file_data == NULL) {
         perror("Failed to allocate memory for file");
         return -1;
     }
     
-    // Đọc file data từ socket
-    uint32_t total_received = 0;
-    while (total_received < file_size) {
-        int bytes = recv(client->socket_fd, file_data + total_received,
-                        file_size - total_received, 0);
-        if (bytes <= 0) {
+    // Mode epoll/io_uring: file data đến dần qua rbuf, không chặn I/O thread
+    if (client->reactor != NULL || client->uring != NULL) {
+        FileUpload *upload = calloc(1, sizeof(FileUpload));
+        if (upload == NULL) {
             free(file_data);
             return -1;
         }
-        total_received += bytes;
+        
+        strncpy(upload->from, msg->from, MAX_USERNAME_LEN - 1);
+        strncpy(upload->to, receiver, MAX_USERNAME_LEN - 1);
+        strncpy(upload->filename, filename, MAX_FILENAME_LEN - 1);
+        upload->data = file_data;
+        upload->size = file_size;
+        upload->received = 0;
+        client->upload = upload;
+        client_upload_started(client);
+        
+        return 0;  // process_client_input() gọi feed_file_upload()
     }
     
-    // Lưu file vào temp/
-    char temp_path[512];
-    snprintf(temp_path, sizeof(temp_path), "temp/%s_%s_%ld",
-             msg->from, filename, time(NULL));
-    
-    FILE *fp = fopen(temp_path, "wb");
-    if (fp == NULL) {
-        perror("Failed to save file");
+    // Mode thread: đọc file data trực tiếp từ socket
+    client_upload_started(client);
+    if (client_recv_raw(client, file_data, file_size) < 0) {
         free(file_data);
         return -1;
     }
+    client_upload_finished(client);
     
-    fwrite(file_data, 1, file_size, fp);
-    fclose(fp);
+    int result = store_and_relay_file(msg->from, filename, receiver, file_data, file_size);
     free(file_data);
     
-    printf("[FILE] Saved file to '%s'\n", temp_path);
+    return result;
+}
+
+/**
+ * Lấy file data đang chờ trong rbuf vào upload hiện tại
+ * Khi nhận đủ thì lưu và chuyển tiếp file
+ * Return: -1 nếu lỗi, 0 nếu OK (client->upload == NULL khi đã xong)
+ */
+int feed_file_upload(ClientConnection *client) {
+    FileUpload *upload = client->upload;
+    if (upload == NULL) return 0;
+    
+    size_t remaining = upload->size - upload->received;
+    size_t take = client->rbuf_len < remaining ? client->rbuf_len : remaining;
+    
+    if (take > 0) {
+        memcpy(upload->data + upload->received, client->rbuf, take);
+        memmove(client->rbuf, client->rbuf + take, client->rbuf_len - take);
+        client->rbuf_len -= take;
+        upload->received += take;
+    }
     
-    // Chuyển tiếp thông báo file đến receiver
-    return relay_file(temp_path, msg->from, receiver);
+    if (upload->received < upload->size) {
+        return 0;
+    }
+    
+    // Lưu/chuyển tiếp trên worker pool (nếu bật), sau các request trước đó
+    client->upload = NULL;
+    client_upload_finished(client);
+    return submit_file_upload(client, upload);
+}
+
+/**
+ * Lưu và chuyển tiếp file đã nhận đủ rồi giải phóng upload
+ * Lỗi lưu/chuyển tiếp file không làm đóng connection của sender
+ */
+void complete_file_upload(FileUpload *upload) {
+    store_and_relay_file(upload->from, upload->filename, upload->to,
+                         upload->data, upload->size);
+    free(upload->data);
+    free(upload);
+}
+
+/**
+ * Hủy upload đang dở (connection đóng giữa chừng)
+ */
+void free_file_upload(ClientConnection *client) {
+    if (client == NULL || client->upload == NULL) return;
+    
+    free(client->upload->data);
+    free(client->upload);
+    client->upload = NULL;
 }
 
 /**
@@ -281,7 +1588,8 @@ int relay_file(const char *filepath, const char *from, const char *to) {
         Message offline_msg;
         create_response_message(&offline_msg, MSG_FILE_SEND, from, to, filepath);
         strncpy(offline_msg.extra, filename, MAX_MESSAGE_LEN - 1);
-        save_offline_message(&offline_msg);
+        PackedMessage packed = message_ref(&offline_msg);
+        save_offline_message(&packed);
         
         return 0;
     }
@@ -317,7 +1625,7 @@ int relay_file(const char *filepath, const char *from, const char *to) {
     send_message_struct(receiver_socket, &file_msg);
     
     // Gửi file data
-    send(receiver_socket, file_data, file_size, 0);
+    send_raw_data(receiver_socket, file_data, file_size);
     
     free(file_data);
     
@@ -334,7 +1642,7 @@ int relay_file(const char *filepath, const char *from, const char *to) {
 /**
  * Xử lý chấp nhận nhận file
  */
-int handle_file_accept(const Message *msg) {
+int handle_file_accept(const PackedMessage *msg) {
     if (msg == NULL) return -1;
     
     printf("[FILE] User '%s' accepted file from '%s'\n", msg->from, msg->to);
@@ -354,7 +1662,7 @@ int handle_file_accept(const Message *msg) {
 /**
  * Xử lý từ chối nhận file
  */
-int handle_file_reject(const Message *msg) {
+int handle_file_reject(const PackedMessage *msg) {
     if (msg == NULL) return -1;
     
     printf("[FILE] User '%s' rejected file from '%s'\n", msg->from, msg->to);
@@ -373,49 +1681,9 @@ int handle_file_reject(const Message *msg) {
 
 // ===========================
 // 9. FRIEND MANAGEMENT
+// Đồ thị bạn bè và friendships.txt: server_friends.c
 // ===========================
 
-/**
- * Load friendships từ file
- */
-int load_friendships_from_file(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
-        fp = fopen(filename, "w");
-        if (fp != NULL) fclose(fp);
-        return 0;
-    }
-    
-    fclose(fp);
-    printf("[SERVER] Loaded friendships from %s\n", filename);
-    return 0;
-}
-
-/**
- * Save friendship vào file
- */
-int save_friendship_to_file(const char *filename, const Friendship *friendship) {
-    if (friendship == NULL) return -1;
-    
-    FILE *fp = fopen(filename, "a");
-    if (fp == NULL) {
-        perror("Failed to open friendships file");
-        return -1;
-    }
-    
-    fprintf(fp, "%s|%s|%d|%ld\n",
-            friendship->user1,
-            friendship->user2,
-            friendship->status,
-            friendship->created_at);
-    
-    fclose(fp);
-    return 0;
-}
-
-/**
- * Gửi lời mời kết bạn
- */
 // ===========================
 // 10. UTILITY FUNCTIONS
 // ===========================
@@ -423,24 +1691,55 @@ int save_friendship_to_file(const char *filename, const Friendship *friendship)
 /**
  * Broadcast message đến tất cả clients (trừ sender)
  */
-int broadcast_message(const Message *msg, const char *exclude_username) {
+int broadcast_message(const PackedMessage *msg, const char *exclude_username) {
     if (msg == NULL) return -1;
     
+    // Chỉ giữ clients_mutex khi lấy danh sách socket, gửi sau khi nhả lock
+    int *targets = NULL;
+    int target_count = 0;
+    
     mutex_lock(&server_state.clients_mutex);
     
+    if (server_state.client_count > 0) {
+        targets = malloc(server_state.client_count * sizeof(int));
+        if (targets == NULL) {
+            mutex_unlock(&server_state.clients_mutex);
+            return -1;
+        }
+    }
+    
     for (int i = 0; i < server_state.client_count; i++) {
-        ClientConnection *client = &server_state.clients[i];
+        ClientConnection *client = client_slot(i);
         
         if (client->is_authenticated && client->socket_fd > 0) {
             if (exclude_username == NULL || 
                 strcmp(client->username, exclude_username) != 0) {
-                send_message_struct(client->socket_fd, msg);
+                targets[target_count++] = client->socket_fd;
             }
         }
     }
     
     mutex_unlock(&server_state.clients_mutex);
     
+    if (target_count == 0) {
+        free(targets);
+        return 0;
+    }
+    
+    // Serialize 1 lần, mỗi receiver chỉ xếp thêm 1 reference vào hàng đợi
+    SharedFrame *frame = shared_frame_encode(msg);
+    if (frame == NULL) {
+        free(targets);
+        return -1;
+    }
+    
+    for (int i = 0; i < target_count; i++) {
+        send_message_shared(targets[i], msg, frame);
+    }
+    
+    shared_frame_release(frame);
+    free(targets);
+    
     return 0;
 }
 
@@ -453,9 +1752,9 @@ ClientConnection *find_client_by_username(const char *username) {
     mutex_lock(&server_state.clients_mutex);
     
     for (int i = 0; i < server_state.client_count; i++) {
-        if (server_state.clients[i].is_authenticated &&
-            strcmp(server_state.clients[i].username, username) == 0) {
-            ClientConnection *client = &server_state.clients[i];
+        ClientConnection *client = client_slot(i);
+        if (client->is_authenticated &&
+            strcmp(client->username, username) == 0) {
             mutex_unlock(&server_state.clients_mutex);
             return client;
         }
@@ -472,8 +1771,8 @@ ClientConnection *find_client_by_socket(int socket_fd) {
     mutex_lock(&server_state.clients_mutex);
     
     for (int i = 0; i < server_state.client_count; i++) {
-        if (server_state.clients[i].socket_fd == socket_fd) {
-            ClientConnection *client = &server_state.clients[i];
+        ClientConnection *client = client_slot(i);
+        if (client->socket_fd == socket_fd) {
             mutex_unlock(&server_state.clients_mutex);
             return client;
         }
@@ -500,7 +1799,7 @@ void log_server_event(const char *event, const char *details) {
 /**
  * Log message
  */
-void log_message(const Message *msg) {
+void log_message(const PackedMessage *msg) {
     if (msg == NULL) return;
     
     FILE *fp = fopen("messages.log", "a");
@@ -0,0 +1,860 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// ===========================
+// 18. STATE STORE (WAL + SNAPSHOT)
+// ===========================
+// Users, groups và friendships được ghi vào 1 WAL append-only chung (state.wal):
+// mỗi thay đổi là 1 record [len][crc32][lsn][type][payload text "a|b|c"], append
+// 1 lần write() trong lúc handler còn giữ lock của dữ liệu đó (thứ tự record = thứ tự
+// thay đổi). Mọi record là phép gán theo key (user, nhóm, member của nhóm, cặp bạn
+// bè) nên replay lại record đã có trong snapshot không làm sai state.
+//
+// Snapshot thread (định kỳ --snapshot-interval hoặc khi WAL vượt WAL_SNAPSHOT_BYTES)
+// đổi tên state.wal -> state.wal.old, mở state.wal mới, chụp state dưới lock của
+// từng phần rồi ghi state.snap (file tạm + fsync + rename) và xóa state.wal.old.
+// Khởi động: load state.snap, replay record có lsn > lsn của snapshot trong
+// state.wal.old (nếu snapshot trước bị dừng giữa chừng) rồi state.wal; record cuối
+// ghi dở (crash giữa write) bị cắt bỏ.
+//
+// --wal-fsync MS: handler chờ record được fdatasync (wal_commit) trước khi trả lời.
+// Syncer thread gom mọi record đã append trong lúc fdatasync trước đang chạy (và
+// thêm MS ms nếu MS > 0) vào 1 lần fdatasync.
+
+#define STATE_SNAPSHOT_TEMP STATE_SNAPSHOT_FILE ".tmp"
+#define SNAPSHOT_MAGIC 0x50414E53u          // "SNAP"
+#define WAL_HEADER_SIZE 17                  // 4B len + 4B crc32 + 8B lsn + 1B type
+
+typedef struct {
+    uint32_t magic;
+    uint32_t records;
+    uint64_t lsn;               // Record có lsn <= lsn này đã nằm trong snapshot
+} SnapshotHeader;
+
+static struct {
+    mutex_t lock;
+    pthread_cond_t sync_wake;   // Có commit chờ fdatasync / dừng syncer
+    pthread_cond_t synced;      // synced_lsn tăng
+    pthread_cond_t snapshot_wake;
+    pthread_cond_t snapshot_done;
+    int fd;                     // state.wal, O_APPEND
+    uint64_t next_lsn;
+    uint64_t bytes;             // Kích thước state.wal (record hoàn chỉnh)
+    uint64_t old_lsn;           // lsn cuối trong state.wal.old
+    bool has_old;               // state.wal.old còn tồn tại (snapshot chưa xong)
+    uint64_t sync_requested;    // lsn lớn nhất đang có commit chờ
+    uint64_t synced_lsn;
+    uint64_t appended;          // Thống kê: record đã append / số lần fdatasync
+    uint64_t syncs;
+    bool syncer_running;
+    bool stop_syncer;
+    thread_t syncer_id;
+    bool snapshot_started;
+    bool snapshot_wanted;
+    bool snapshot_running;
+    bool stop_snapshots;
+    int paused;                 // Hot upgrade: không đổi tên file WAL
+    thread_t snapshot_id;
+    Timer timer;
+} store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sync_wake = PTHREAD_COND_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+    .snapshot_wake = PTHREAD_COND_INITIALIZER,
+    .snapshot_done = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .next_lsn = 1,
+};
+
+// ===========================
+// RECORD ENCODING
+// ===========================
+
+static int write_full(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/**
+ * Điền header cho record có payload length bytes nằm sau WAL_HEADER_SIZE
+ */
+static void encode_record(char *record, uint32_t length, uint64_t lsn, WalRecordType type) {
+    uint8_t type_byte = (uint8_t)type;
+    memcpy(record + 8, &lsn, sizeof(lsn));
+    record[16] = (char)type_byte;
+
+    uint32_t crc = (uint32_t)crc32(0L, (const Bytef *)record + 8, length + WAL_HEADER_SIZE - 8);
+    memcpy(record, &length, sizeof(length));
+    memcpy(record + 4, &crc, sizeof(crc));
+}
+
+/**
+ * Format payload vào record + WAL_HEADER_SIZE
+ * Return: độ dài payload, -1 nếu vượt WAL_PAYLOAD_MAX
+ */
+static int format_payload(char *record, const char *format, va_list args) {
+    int length = vsnprintf(record + WAL_HEADER_SIZE, WAL_PAYLOAD_MAX, format, args);
+    if (length < 0 || length >= WAL_PAYLOAD_MAX) {
+        fprintf(stderr, "[STATE] Record payload too large\n");
+        return -1;
+    }
+
+    return length;
+}
+
+/**
+ * Thêm 1 record (lsn 0) vào buffer snapshot
+ */
+int wal_buffer_append(WalBuffer *buffer, WalRecordType type, const char *format, ...) {
+    if (buffer->length + WAL_HEADER_SIZE + WAL_PAYLOAD_MAX > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 64 * 1024;
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) return -1;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    char *record = buffer->data + buffer->length;
+    va_list args;
+    va_start(args, format);
+    int length = format_payload(record, format, args);
+    va_end(args);
+    if (length < 0) return -1;
+
+    encode_record(record, (uint32_t)length, 0, type);
+    buffer->length += WAL_HEADER_SIZE + (size_t)length;
+    buffer->records++;
+    return 0;
+}
+
+/**
+ * Thành viên nhóm dạng "a,b,c"
+ */
+static void format_members(const Group *group, char *list, size_t size) {
+    size_t length = 0;
+    list[0] = '\0';
+
+    for (int i = 0; i < group->member_count && length < size; i++) {
+        int n = snprintf(list + length, size - length, "%s%s", i > 0 ? "," : "", group->members[i]);
+        if (n < 0) break;
+        length += (size_t)n;
+    }
+}
+
+// ===========================
+// APPEND & COMMIT
+// ===========================
+
+/**
+ * Append 1 thay đổi vào WAL - gọi trong lúc còn giữ lock của dữ liệu vừa đổi
+ * Return: lsn của record (cho wal_commit), 0 nếu ghi lỗi
+ */
+uint64_t wal_append(WalRecordType type, const char *format, ...) {
+    char record[WAL_HEADER_SIZE + WAL_PAYLOAD_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = format_payload(record, format, args);
+    va_end(args);
+    if (length < 0) return 0;
+
+    size_t total = WAL_HEADER_SIZE + (size_t)length;
+
+    mutex_lock(&store.lock);
+
+    uint64_t lsn = store.next_lsn;
+    encode_record(record, (uint32_t)length, lsn, type);
+
+    if (store.fd < 0 || write_full(store.fd, record, total) < 0) {
+        perror("[STATE] Failed to append WAL record");
+        // Bỏ phần record ghi dở để record sau không nằm sau 1 record hỏng
+        if (store.fd >= 0 && ftruncate(store.fd, (off_t)store.bytes) < 0) {
+            perror("[STATE] Failed to truncate WAL");
+        }
+        mutex_unlock(&store.lock);
+        return 0;
+    }
+
+    store.next_lsn++;
+    store.bytes += total;
+    store.appended++;
+
+    if (store.bytes >= WAL_SNAPSHOT_BYTES && !store.snapshot_wanted) {
+        store.snapshot_wanted = true;
+        pthread_cond_signal(&store.snapshot_wake);
+    }
+
+    mutex_unlock(&store.lock);
+    return lsn;
+}
+
+/**
+ * Append nhóm (tên, creator, toàn bộ member) - tạo nhóm
+ */
+uint64_t wal_append_group(const Group *group) {
+    char members[MAX_GROUP_MEMBERS * MAX_USERNAME_LEN];
+    format_members(group, members, sizeof(members));
+
+    return wal_append(WAL_GROUP_CREATE, "%s|%s|%s|%ld", group->group_name, group->creator,
+                      members, (long)group->created_at);
+}
+
+/**
+ * Chờ record lsn được fdatasync (--wal-fsync) - gọi sau khi đã nhả lock dữ liệu
+ */
+void wal_commit(uint64_t lsn) {
+    if (lsn == 0 || server_options.wal_fsync < 0) return;
+
+    mutex_lock(&store.lock);
+
+    if (lsn > store.sync_requested) {
+        store.sync_requested = lsn;
+        pthread_cond_signal(&store.sync_wake);
+    }
+    while (store.syncer_running && store.synced_lsn < lsn) {
+        pthread_cond_wait(&store.synced, &store.lock);
+    }
+
+    mutex_unlock(&store.lock);
+}
+
+static THREAD_RETURN wal_syncer_thread(void *arg) {
+    (void)arg;
+
+    mutex_lock(&store.lock);
+
+    while (1) {
+        while (!store.stop_syncer && store.sync_requested <= store.synced_lsn) {
+            pthread_cond_wait(&store.sync_wake, &store.lock);
+        }
+        if (store.sync_requested <= store.synced_lsn) break;
+
+        // Cửa sổ gom: commit đến trong lúc chờ đi chung lần fdatasync này
+        if (server_options.wal_fsync > 0 && !store.stop_syncer) {
+            mutex_unlock(&store.lock);
+            sleep_ms(server_options.wal_fsync);
+            mutex_lock(&store.lock);
+        }
+
+        // dup: snapshot có thể đổi file WAL trong lúc fdatasync, record <= target
+        // vẫn nằm trong file cũ
+        uint64_t target = store.next_lsn - 1;
+        int fd = store.fd >= 0 ? dup(store.fd) : -1;
+        mutex_unlock(&store.lock);
+
+        if (fd >= 0) {
+            if (fdatasync(fd) < 0) perror("[STATE] WAL fdatasync failed");
+            close(fd);
+        }
+
+        mutex_lock(&store.lock);
+        if (target > store.synced_lsn) store.synced_lsn = target;
+        store.syncs++;
+        pthread_cond_broadcast(&store.synced);
+    }
+
+    mutex_unlock(&store.lock);
+    THREAD_RETURN_VALUE;
+}
+
+// ===========================
+// REPLAY
+// ===========================
+
+static Group *find_group(const char *group_name) {
+    for (int i = 0; i < server_state.group_count; i++) {
+        if (strcmp(server_state.groups[i].group_name, group_name) == 0) {
+            return &server_state.groups[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void apply_user(FieldView *fields, int count) {
+    if (count < 2 || fields[0].length == 0 || fields[1].length == 0) return;
+
+    char username[MAX_USERNAME_LEN];
+    copy_field(username, sizeof(username), fields[0]);
+
+    mutex_lock(&server_state.users_mutex);
+
+    User *user = NULL;
+    for (int i = 0; i < server_state.user_count; i++) {
+        if (strcmp(server_state.users[i].username, username) == 0) {
+            user = &server_state.users[i];
+            break;
+        }
+    }
+    if (user == NULL && server_state.user_count < MAX_CLIENTS) {
+        user = &server_state.users[server_state.user_count++];
+        memset(user, 0, sizeof(*user));
+        strcpy(user->username, username);
+        user->socket_fd = -1;
+    }
+
+    if (user != NULL) {
+        copy_field(user->password, MAX_PASSWORD_LEN, fields[1]);
+        user->last_seen = count >= 3 ? (time_t)atoll(fields[2].data) : time(NULL);
+    }
+
+    mutex_unlock(&server_state.users_mutex);
+}
+
+static void apply_group_create(FieldView *fields, int count) {
+    if (count < 3 || fields[0].length == 0) return;
+
+    char group_name[MAX_GROUP_NAME_LEN];
+    copy_field(group_name, sizeof(group_name), fields[0]);
+
+    mutex_lock(&server_state.groups_mutex);
+
+    Group *group = find_group(group_name);
+    if (group == NULL && server_state.group_count < MAX_GROUPS) {
+        group = &server_state.groups[server_state.group_count++];
+        memset(group, 0, sizeof(*group));
+        strcpy(group->group_name, group_name);
+    }
+
+    if (group != NULL) {
+        copy_field(group->creator, MAX_USERNAME_LEN, fields[1]);
+
+        FieldView members[MAX_GROUP_MEMBERS];
+        int member_count = split_fields(fields[2].data, fields[2].length, SCAN_COMMA,
+                                        members, MAX_GROUP_MEMBERS);
+        group->member_count = 0;
+        for (int i = 0; i < member_count; i++) {
+            if (members[i].length == 0) continue;
+            copy_field(group->members[group->member_count++], MAX_USERNAME_LEN, members[i]);
+        }
+
+        group->created_at = count >= 4 ? (time_t)atoll(fields[3].data) : time(NULL);
+    }
+
+    mutex_unlock(&server_state.groups_mutex);
+}
+
+static void apply_group_member(FieldView *fields, int count, bool join) {
+    if (count < 2 || fields[0].length == 0 || fields[1].length == 0) return;
+
+    char group_name[MAX_GROUP_NAME_LEN], username[MAX_USERNAME_LEN];
+    copy_field(group_name, sizeof(group_name), fields[0]);
+    copy_field(username, sizeof(username), fields[1]);
+
+    mutex_lock(&server_state.groups_mutex);
+
+    Group *group = find_group(group_name);
+    int found = -1;
+    for (int i = 0; group != NULL && i < group->member_count; i++) {
+        if (strcmp(group->members[i], username) == 0) {
+            found = i;
+            break;
+        }
+    }
+
+    if (group != NULL && join && found < 0 && group->member_count < MAX_GROUP_MEMBERS) {
+        strcpy(group->members[group->member_count++], username);
+    } else if (group != NULL && !join && found >= 0) {
+        for (int i = found; i < group->member_count - 1; i++) {
+            strcpy(group->members[i], group->members[i + 1]);
+        }
+        group->member_count--;
+    }
+
+    mutex_unlock(&server_state.groups_mutex);
+}
+
+static void apply_friend(FieldView *fields, int count) {
+    if (count < 3 || fields[0].length == 0 || fields[1].length == 0) return;
+
+    char user1[MAX_USERNAME_LEN], user2[MAX_USERNAME_LEN], status[20];
+    copy_field(user1, sizeof(user1), fields[0]);
+    copy_field(user2, sizeof(user2), fields[1]);
+    copy_field(status, sizeof(status), fields[2]);
+
+    friend_graph_apply(user1, user2, status);
+}
+
+/**
+ * Áp 1 record vào state (payload đã kết thúc bằng '\0')
+ */
+static void apply_record(WalRecordType type, const char *payload, size_t length) {
+    FieldView fields[4];
+    int count = split_fields(payload, length, SCAN_PIPE, fields, 4);
+
+    switch (type) {
+        case WAL_USER:
+            apply_user(fields, count);
+            break;
+        case WAL_GROUP_CREATE:
+            apply_group_create(fields, count);
+            break;
+        case WAL_GROUP_JOIN:
+            apply_group_member(fields, count, true);
+            break;
+        case WAL_GROUP_LEAVE:
+            apply_group_member(fields, count, false);
+            break;
+        case WAL_FRIEND:
+            apply_friend(fields, count);
+            break;
+        default:
+            fprintf(stderr, "[STATE] Unknown record type %d\n", (int)type);
+            break;
+    }
+}
+
+/**
+ * Replay record từ offset tới record hỏng/ghi dở đầu tiên hoặc hết file,
+ * bỏ qua record có lsn <= skip_lsn (đã nằm trong snapshot)
+ * Return: offset ngay sau record hợp lệ cuối; *max_lsn, *applied được cập nhật
+ */
+static uint64_t replay_records(int fd, uint64_t offset, uint64_t skip_lsn,
+                               uint64_t *max_lsn, int *applied) {
+    char record[WAL_HEADER_SIZE + WAL_PAYLOAD_MAX + 1];
+
+    while (1) {
+        if (pread(fd, record, WAL_HEADER_SIZE, (off_t)offset) != WAL_HEADER_SIZE) break;
+
+        uint32_t length, crc;
+        uint64_t lsn;
+        memcpy(&length, record, sizeof(length));
+        memcpy(&crc, record + 4, sizeof(crc));
+        memcpy(&lsn, record + 8, sizeof(lsn));
+
+        if (length >= WAL_PAYLOAD_MAX ||
+            pread(fd, record + WAL_HEADER_SIZE, length, (off_t)(offset + WAL_HEADER_SIZE)) != (ssize_t)length ||
+            (uint32_t)crc32(0L, (const Bytef *)record + 8, length + WAL_HEADER_SIZE - 8) != crc) {
+            break;
+        }
+
+        record[WAL_HEADER_SIZE + length] = '\0';
+        if (lsn == 0 || lsn > skip_lsn) {
+            apply_record((WalRecordType)(uint8_t)record[16], record + WAL_HEADER_SIZE, length);
+            (*applied)++;
+        }
+        if (lsn > *max_lsn) *max_lsn = lsn;
+        offset += WAL_HEADER_SIZE + length;
+    }
+
+    return offset;
+}
+
+static uint64_t file_size(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ * Load state.snap (mọi record phải hợp lệ)
+ * Return: 0 và *lsn nếu thành công, 1 nếu không có snapshot, -1 nếu hỏng
+ */
+static int load_snapshot(uint64_t *lsn) {
+    int fd = open(STATE_SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 1 : -1;
+
+    SnapshotHeader header;
+    uint64_t max_lsn = 0;
+    int applied = 0;
+    int result = -1;
+
+    if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        header.magic == SNAPSHOT_MAGIC) {
+        uint64_t end = replay_records(fd, sizeof(header), 0, &max_lsn, &applied);
+        if (end == file_size(fd) && (uint32_t)applied == header.records) {
+            *lsn = header.lsn;
+            result = 0;
+        }
+    }
+
+    close(fd);
+    if (result < 0) fprintf(stderr, "[STATE] Snapshot %s is corrupt\n", STATE_SNAPSHOT_FILE);
+    return result;
+}
+
+static void sync_directory(void) {
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    if (fsync(fd) < 0) perror("[STATE] Directory fsync failed");
+    close(fd);
+}
+
+// ===========================
+// SNAPSHOT
+// ===========================
+
+/**
+ * Chụp users, groups, friendships (mỗi phần dưới lock của nó) vào buffer
+ */
+static int capture_state(WalBuffer *buffer) {
+    int result = 0;
+
+    mutex_lock(&server_state.users_mutex);
+    for (int i = 0; result == 0 && i < server_state.user_count; i++) {
+        const User *user = &server_state.users[i];
+        result = wal_buffer_append(buffer, WAL_USER, "%s|%s|%ld", user->username,
+                                   user->password, (long)user->last_seen);
+    }
+    mutex_unlock(&server_state.users_mutex);
+
+    mutex_lock(&server_state.groups_mutex);
+    for (int i = 0; result == 0 && i < server_state.group_count; i++) {
+        const Group *group = &server_state.groups[i];
+        char members[MAX_GROUP_MEMBERS * MAX_USERNAME_LEN];
+        format_members(group, members, sizeof(members));
+        result = wal_buffer_append(buffer, WAL_GROUP_CREATE, "%s|%s|%s|%ld", group->group_name,
+                                   group->creator, members, (long)group->created_at);
+    }
+    mutex_unlock(&server_state.groups_mutex);
+
+    if (result == 0) result = friend_graph_snapshot(buffer);
+    return result;
+}
+
+/**
+ * Ghi state hiện tại thành state.snap (file tạm + fsync + rename)
+ */
+static int write_snapshot(uint64_t lsn) {
+    uint64_t started = monotonic_ms();
+    WalBuffer buffer = { 0 };
+
+    if (capture_state(&buffer) < 0) {
+        free(buffer.data);
+        fprintf(stderr, "[STATE] Failed to capture snapshot\n");
+        return -1;
+    }
+
+    SnapshotHeader header = { SNAPSHOT_MAGIC, buffer.records, lsn };
+    int fd = open(STATE_SNAPSHOT_TEMP, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int result = -1;
+
+    if (fd >= 0) {
+        if (write_full(fd, (const char *)&header, sizeof(header)) == 0 &&
+            write_full(fd, buffer.data, buffer.length) == 0 && fsync(fd) == 0) {
+            result = 0;
+        }
+        if (close(fd) < 0) result = -1;
+    }
+
+    if (result == 0 && rename(STATE_SNAPSHOT_TEMP, STATE_SNAPSHOT_FILE) < 0) result = -1;
+
+    if (result < 0) {
+        perror("[STATE] Failed to write snapshot");
+        unlink(STATE_SNAPSHOT_TEMP);
+    } else {
+        sync_directory();
+        printf("[STATE] Snapshot at LSN %llu: %u records, %zu bytes in %llu ms\n",
+               (unsigned long long)lsn, buffer.records, buffer.length + sizeof(header),
+               (unsigned long long)(monotonic_ms() - started));
+    }
+
+    free(buffer.data);
+    return result;
+}
+
+/**
+ * Đổi state.wal -> state.wal.old và mở state.wal mới (đang giữ store.lock)
+ */
+static int rotate_wal(void) {
+    if (rename(STATE_WAL_FILE, STATE_WAL_OLD_FILE) < 0) {
+        perror("[STATE] Failed to rotate WAL");
+        return -1;
+    }
+
+    int fd = open(STATE_WAL_FILE, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("[STATE] Failed to open new WAL");
+        rename(STATE_WAL_OLD_FILE, STATE_WAL_FILE);
+        return -1;
+    }
+
+    if (store.fd >= 0) close(store.fd);
+    store.fd = fd;
+    store.old_lsn = store.next_lsn - 1;
+    store.bytes = 0;
+    store.has_old = true;
+
+    // Record của commit sau này nằm trong file mới: tên file mới phải bền trước
+    if (server_options.wal_fsync >= 0) sync_directory();
+    return 0;
+}
+
+/**
+ * 1 lần snapshot: cắt WAL (nếu lần trước chưa cắt), chụp state, xóa WAL cũ
+ */
+static int take_snapshot(void) {
+    mutex_lock(&store.lock);
+    if (!store.has_old && rotate_wal() < 0) {
+        mutex_unlock(&store.lock);
+        return -1;
+    }
+    uint64_t lsn = store.old_lsn;
+    mutex_unlock(&store.lock);
+
+    if (write_snapshot(lsn) < 0) return -1;
+
+    if (unlink(STATE_WAL_OLD_FILE) < 0 && errno != ENOENT) {
+        perror("[STATE] Failed to remove old WAL");
+        return -1;
+    }
+
+    mutex_lock(&store.lock);
+    store.has_old = false;
+    mutex_unlock(&store.lock);
+    return 0;
+}
+
+static THREAD_RETURN snapshot_thread(void *arg) {
+    (void)arg;
+
+    mutex_lock(&store.lock);
+
+    while (!store.stop_snapshots) {
+        if (!store.snapshot_wanted || store.paused > 0) {
+            pthread_cond_wait(&store.snapshot_wake, &store.lock);
+            continue;
+        }
+
+        store.snapshot_wanted = false;
+        if (store.bytes == 0 && !store.has_old) continue;
+
+        store.snapshot_running = true;
+        mutex_unlock(&store.lock);
+
+        take_snapshot();
+
+        mutex_lock(&store.lock);
+        store.snapshot_running = false;
+        pthread_cond_broadcast(&store.snapshot_done);
+    }
+
+    mutex_unlock(&store.lock);
+    THREAD_RETURN_VALUE;
+}
+
+static void snapshot_expired(Timer *timer) {
+    mutex_lock(&store.lock);
+    store.snapshot_wanted = true;
+    pthread_cond_signal(&store.snapshot_wake);
+    mutex_unlock(&store.lock);
+
+    timer_arm(timer, (uint64_t)server_options.snapshot_interval * 1000);
+}
+
+/**
+ * Chạy snapshot thread (gọi sau start_timer_wheel; hot upgrade: sau khi process cũ
+ * đã nhận ack, nó không còn ghi vào WAL). Snapshot ngay nếu WAL đang có dữ liệu
+ */
+void start_state_snapshots(void) {
+    mutex_lock(&store.lock);
+    if (store.snapshot_started) {
+        mutex_unlock(&store.lock);
+        return;
+    }
+    store.snapshot_started = true;
+    store.snapshot_wanted = true;
+    mutex_unlock(&store.lock);
+
+    if (pthread_create(&store.snapshot_id, NULL, snapshot_thread, NULL) != 0) {
+        fprintf(stderr, "[STATE] Failed to create snapshot thread\n");
+        mutex_lock(&store.lock);
+        store.snapshot_started = false;
+        mutex_unlock(&store.lock);
+        return;
+    }
+
+    if (server_options.snapshot_interval > 0) {
+        store.timer.callback = snapshot_expired;
+        timer_arm(&store.timer, (uint64_t)server_options.snapshot_interval * 1000);
+    }
+}
+
+/**
+ * Hot upgrade: chờ snapshot đang chạy xong và không đổi tên file WAL nữa
+ * (process mới đọc tiếp state.wal từ offset nó đã replay)
+ */
+void pause_state_snapshots(void) {
+    mutex_lock(&store.lock);
+    store.paused++;
+    while (store.snapshot_running) {
+        pthread_cond_wait(&store.snapshot_done, &store.lock);
+    }
+    mutex_unlock(&store.lock);
+}
+
+void resume_state_snapshots(void) {
+    mutex_lock(&store.lock);
+    if (store.paused > 0) store.paused--;
+    pthread_cond_signal(&store.snapshot_wake);
+    mutex_unlock(&store.lock);
+}
+
+// ===========================
+// RECOVERY
+// ===========================
+
+/**
+ * Chuyển users.txt, groups.txt, friendships.txt (format cũ) vào snapshot đầu tiên
+ */
+static int migrate_legacy_files(void) {
+    static const char *files[] = { "users.txt", "groups.txt", "friendships.txt" };
+
+    load_users_from_file(files[0]);
+    load_groups_from_file(files[1]);
+    load_friendships_from_file(files[2]);
+
+    if (access(files[0], F_OK) != 0 && access(files[1], F_OK) != 0 &&
+        access(files[2], F_OK) != 0) {
+        return 0;
+    }
+
+    if (write_snapshot(0) < 0) return -1;
+
+    for (int i = 0; i < 3; i++) {
+        char migrated[64];
+        snprintf(migrated, sizeof(migrated), "%s.migrated", files[i]);
+        if (access(files[i], F_OK) == 0 && rename(files[i], migrated) == 0) {
+            printf("[STATE] Migrated %s into %s (kept as %s)\n", files[i], STATE_SNAPSHOT_FILE, migrated);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Khôi phục state: snapshot + WAL (hoặc import file cũ lần đầu), mở WAL để append.
+ * upgrading: process cũ vẫn còn ghi WAL tới khi đóng băng - không cắt đuôi WAL,
+ * wal_catch_up() đọc tiếp sau khi nhận handoff
+ */
+int init_state_store(bool upgrading) {
+    uint64_t started = monotonic_ms();
+    uint64_t snapshot_lsn = 0;
+    uint64_t max_lsn = 0;
+    int applied = 0;
+
+    int loaded = load_snapshot(&snapshot_lsn);
+    if (loaded < 0) return -1;
+
+    if (loaded > 0 && access(STATE_WAL_FILE, F_OK) != 0 && access(STATE_WAL_OLD_FILE, F_OK) != 0) {
+        if (migrate_legacy_files() < 0) return -1;
+    }
+    max_lsn = snapshot_lsn;
+
+    int old_fd = open(STATE_WAL_OLD_FILE, O_RDONLY);
+    if (old_fd >= 0) {
+        // Snapshot trước dừng giữa chừng: state.wal.old vẫn là 1 phần của log
+        replay_records(old_fd, 0, snapshot_lsn, &max_lsn, &applied);
+        close(old_fd);
+        store.has_old = true;
+        store.old_lsn = max_lsn;
+    }
+
+    store.fd = open(STATE_WAL_FILE, O_RDWR | O_APPEND | O_CREAT, 0600);
+    if (store.fd < 0) {
+        perror("[STATE] Failed to open WAL");
+        return -1;
+    }
+
+    uint64_t end = replay_records(store.fd, 0, snapshot_lsn, &max_lsn, &applied);
+    uint64_t size = file_size(store.fd);
+    if (end < size && !upgrading) {
+        printf("[STATE] Truncating %llu bytes of torn WAL tail\n", (unsigned long long)(size - end));
+        if (ftruncate(store.fd, (off_t)end) < 0) perror("[STATE] Failed to truncate WAL");
+    }
+
+    store.bytes = end;
+    store.next_lsn = max_lsn + 1;
+    store.synced_lsn = max_lsn;
+    store.sync_requested = max_lsn;
+
+    if (server_options.wal_fsync >= 0) {
+        store.stop_syncer = false;
+        if (pthread_create(&store.syncer_id, NULL, wal_syncer_thread, NULL) != 0) {
+            fprintf(stderr, "[STATE] Failed to create WAL syncer thread\n");
+            return -1;
+        }
+        store.syncer_running = true;
+    }
+
+    printf("[SERVER] Recovered %d users, %d groups, %d friendships (snapshot LSN %llu + %d WAL records) in %llu ms\n",
+           server_state.user_count, server_state.group_count, friend_graph_edges(),
+           (unsigned long long)snapshot_lsn, applied,
+           (unsigned long long)(monotonic_ms() - started));
+    return 0;
+}
+
+/**
+ * Hot upgrade (process mới): replay phần WAL process cũ ghi sau lúc init_state_store,
+ * gọi khi process cũ đã đóng băng và worker đã chạy hết
+ */
+void wal_catch_up(void) {
+    mutex_lock(&store.lock);
+
+    uint64_t max_lsn = store.next_lsn - 1;
+    int applied = 0;
+    uint64_t end = replay_records(store.fd, store.bytes, 0, &max_lsn, &applied);
+    uint64_t size = file_size(store.fd);
+
+    if (end < size && ftruncate(store.fd, (off_t)end) < 0) {
+        perror("[STATE] Failed to truncate WAL");
+    }
+
+    store.bytes = end;
+    store.next_lsn = max_lsn + 1;
+    if (max_lsn > store.synced_lsn) store.synced_lsn = max_lsn;
+    if (max_lsn > store.sync_requested) store.sync_requested = max_lsn;
+
+    mutex_unlock(&store.lock);
+
+    if (applied > 0) {
+        printf("[UPGRADE] Replayed %d WAL records written by previous process\n", applied);
+    }
+}
+
+/**
+ * Dừng snapshot thread và syncer (fdatasync nốt WAL nếu bật --wal-fsync)
+ */
+void stop_state_store(void) {
+    mutex_lock(&store.lock);
+    bool snapshots = store.snapshot_started;
+    store.stop_snapshots = true;
+    pthread_cond_signal(&store.snapshot_wake);
+    mutex_unlock(&store.lock);
+
+    if (snapshots) {
+        timer_cancel(&store.timer);
+        pthread_join(store.snapshot_id, NULL);
+    }
+
+    mutex_lock(&store.lock);
+    bool syncer = store.syncer_running;
+    store.sync_requested = store.next_lsn - 1;
+    store.stop_syncer = true;
+    pthread_cond_signal(&store.sync_wake);
+    mutex_unlock(&store.lock);
+
+    if (syncer) pthread_join(store.syncer_id, NULL);
+
+    mutex_lock(&store.lock);
+    store.syncer_running = false;
+    pthread_cond_broadcast(&store.synced);
+    printf("[STATE] WAL: %llu records appended, %llu fdatasync\n",
+           (unsigned long long)store.appended, (unsigned long long)store.syncs);
+    mutex_unlock(&store.lock);
+}
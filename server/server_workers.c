@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// ===========================
+// 15. WORKER POOL
+// ===========================
+// Mode --workers N: I/O thread (client_thread, reactor, io_uring engine) chỉ tách frame,
+// parse rồi xếp request vào mailbox (WorkQueue) của connection. Mailbox có request được
+// đưa vào deque của 1 worker; worker lấy từ đầu deque của mình, hết việc thì lấy trộm
+// từ cuối deque của worker khác. Mỗi mailbox chỉ chạy trên 1 worker tại 1 thời điểm.
+//
+// Tin nhắn private/nhóm đi qua 2 actor: actor connection của sender (giữ thứ tự của
+// user, kiểm tra đăng nhập) chuyển tiếp sang actor conversation có key là cặp
+// private (from, to) hoặc tên nhóm. Actor conversation relay tuần tự nên mọi member
+// thấy tin nhắn của 1 conversation theo cùng 1 thứ tự, các conversation khác nhau
+// chạy song song. Key được hash vào CONVERSATION_LANES mailbox: trùng hash chỉ làm
+// 2 conversation chạy tuần tự với nhau, không bao giờ đảo thứ tự
+
+typedef struct {
+    mutex_t lock;
+    WorkQueue **ring;           // Mỗi mailbox nằm tối đa 1 lần trong cả pool
+    int capacity;               // max_clients + CONVERSATION_LANES: không bao giờ đầy
+    int head;
+    int count;
+    int id;
+    thread_t thread_id;
+} WorkDeque;
+
+static WorkDeque *deques = NULL;
+static int worker_count = 0;
+static unsigned int next_deque = 0;
+static WorkQueue lanes[CONVERSATION_LANES];
+
+// Worker rảnh ngủ trên work_ready, I/O thread chờ chỗ trống trên queue_space
+static mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+static int ready_count = 0;         // Mailbox đang nằm trong deque (atomic)
+static int pending_count = 0;       // Request đã nhận chưa xử lý xong (atomic)
+static int idle_workers = 0;        // Worker đang ngủ (atomic)
+static int space_waiters = 0;       // I/O thread đang chờ chỗ trống (atomic)
+
+/**
+ * Thêm mailbox vào cuối deque
+ */
+static void deque_push(WorkDeque *deque, WorkQueue *queue) {
+    mutex_lock(&deque->lock);
+    deque->ring[(deque->head + deque->count) % deque->capacity] = queue;
+    deque->count++;
+    mutex_unlock(&deque->lock);
+
+    __atomic_add_fetch(&ready_count, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        mutex_lock(&pool_mutex);
+        pthread_cond_signal(&work_ready);
+        mutex_unlock(&pool_mutex);
+    }
+}
+
+/**
+ * Worker sở hữu lấy từ đầu deque (mailbox chờ lâu nhất)
+ */
+static WorkQueue *deque_pop(WorkDeque *deque) {
+    WorkQueue *queue = NULL;
+
+    mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        queue = deque->ring[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    mutex_unlock(&deque->lock);
+
+    return queue;
+}
+
+/**
+ * Worker khác lấy trộm từ cuối deque
+ */
+static WorkQueue *deque_steal(WorkDeque *deque) {
+    WorkQueue *queue = NULL;
+
+    if (__atomic_load_n(&deque->count, __ATOMIC_RELAXED) == 0) return NULL;
+
+    mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        queue = deque->ring[(deque->head + deque->count) % deque->capacity];
+    }
+    mutex_unlock(&deque->lock);
+
+    return queue;
+}
+
+/**
+ * Giữ 1 chỗ trong pool, chặn I/O thread khi đã đủ worker_queue request
+ * (backpressure về TCP: I/O thread ngừng đọc tới khi worker xử lý bớt)
+ */
+static void reserve_pending(void) {
+    int limit = server_options.worker_queue;
+    int pending = __atomic_load_n(&pending_count, __ATOMIC_SEQ_CST);
+
+    while (1) {
+        if (pending < limit) {
+            if (__atomic_compare_exchange_n(&pending_count, &pending, pending + 1, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return;
+            }
+            continue;
+        }
+
+        mutex_lock(&pool_mutex);
+        __atomic_add_fetch(&space_waiters, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pending_count, __ATOMIC_SEQ_CST) >= limit) {
+            pthread_cond_wait(&queue_space, &pool_mutex);
+        }
+        __atomic_sub_fetch(&space_waiters, 1, __ATOMIC_SEQ_CST);
+        mutex_unlock(&pool_mutex);
+
+        pending = __atomic_load_n(&pending_count, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void release_pending(void) {
+    __atomic_sub_fetch(&pending_count, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&space_waiters, __ATOMIC_SEQ_CST) > 0) {
+        mutex_lock(&pool_mutex);
+        pthread_cond_broadcast(&queue_space);
+        mutex_unlock(&pool_mutex);
+    }
+}
+
+static void free_work_item(WorkItem *item) {
+    if (item->upload != NULL) {
+        free(item->upload->data);
+        free(item->upload);
+    }
+    shared_frame_release(item->frame);
+    free(item);
+    release_pending();
+}
+
+/**
+ * Bỏ các request chưa chạy của mailbox (caller giữ work.lock)
+ */
+static void discard_client_work(WorkQueue *queue) {
+    while (queue->head != NULL) {
+        WorkItem *item = queue->head;
+        queue->head = item->next;
+        free_work_item(item);
+    }
+    queue->tail = NULL;
+}
+
+/**
+ * Xếp item vào cuối mailbox, đưa mailbox vào deque nếu chưa được lên lịch
+ * Return: -1 nếu mailbox đã đóng (item đã bị hủy)
+ */
+static int mailbox_post(WorkQueue *queue, WorkItem *item) {
+    item->next = NULL;
+
+    mutex_lock(&queue->lock);
+
+    if (queue->closed) {
+        mutex_unlock(&queue->lock);
+        free_work_item(item);
+        return -1;
+    }
+
+    if (queue->tail == NULL) {
+        queue->head = item;
+    } else {
+        queue->tail->next = item;
+    }
+    queue->tail = item;
+
+    if (!queue->scheduled) {
+        queue->scheduled = true;
+        unsigned int index = __atomic_fetch_add(&next_deque, 1, __ATOMIC_RELAXED);
+        deque_push(&deques[index % worker_count], queue);
+    }
+
+    mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+/**
+ * Tìm actor conversation của tin nhắn: cặp private (không phân biệt chiều) hoặc nhóm
+ * Return: NULL nếu message không thuộc conversation nào
+ */
+static WorkQueue *find_conversation_lane(const PackedMessage *msg) {
+    const char *first = NULL;
+    const char *second = "";
+
+    switch (msg->type) {
+        case MSG_PRIVATE_MESSAGE:
+        case MSG_PRIVATE_CHAT_START:
+        case MSG_PRIVATE_CHAT_END:
+            // Key không phụ thuộc chiều: A->B và B->A vào cùng 1 actor
+            first = strcmp(msg->from, msg->to) < 0 ? msg->from : msg->to;
+            second = first == msg->from ? msg->to : msg->from;
+            break;
+        case MSG_GROUP_MESSAGE:
+            first = msg->to;  // Tên nhóm
+            second = "#";
+            break;
+        default:
+            return NULL;
+    }
+
+    // FNV-1a trên "first\0second"
+    uint32_t hash = 2166136261u;
+    for (const char *p = first; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    hash = hash * 16777619u;
+    for (const char *p = second; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+
+    return &lanes[hash % CONVERSATION_LANES];
+}
+
+/**
+ * Actor conversation: relay tin nhắn theo đúng thứ tự nhận
+ */
+static void run_conversation_item(WorkItem *item) {
+    const PackedMessage *msg = &item->msg;
+
+    switch (msg->type) {
+        case MSG_PRIVATE_MESSAGE:
+            relay_private_message(msg, item->frame);
+            break;
+        case MSG_PRIVATE_CHAT_START:
+            handle_private_chat_start(msg);
+            break;
+        case MSG_PRIVATE_CHAT_END:
+            handle_private_chat_end(msg);
+            break;
+        case MSG_GROUP_MESSAGE:
+            relay_group_message(msg);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Actor connection: chạy 1 request của user
+ * Return: -1 nếu connection cần đóng (logout)
+ */
+static int run_client_item(ClientConnection *client, WorkItem *item, bool *forwarded) {
+    if (item->upload != NULL) {
+        complete_file_upload(item->upload);
+        item->upload = NULL;
+        return 0;
+    }
+
+    // Tin nhắn đã qua kiểm tra đăng nhập được chuyển sang actor conversation
+    WorkQueue *lane = client->is_authenticated ? find_conversation_lane(&item->msg) : NULL;
+    if (lane != NULL) {
+        *forwarded = true;
+        mailbox_post(lane, item);
+        return 0;
+    }
+
+    return dispatch_message(client, &item->msg, item->frame);
+}
+
+/**
+ * Chạy tối đa WORKER_BATCH request của 1 mailbox rồi nhường worker cho mailbox khác
+ */
+static void run_mailbox(WorkDeque *deque, WorkQueue *queue) {
+    mutex_lock(&queue->lock);
+
+    for (int n = 0; n < WORKER_BATCH && queue->head != NULL && !queue->closed; n++) {
+        WorkItem *item = queue->head;
+        queue->head = item->next;
+        if (queue->head == NULL) queue->tail = NULL;
+
+        mutex_unlock(&queue->lock);
+
+        int result = 0;
+        bool forwarded = false;
+
+        begin_send_batch();
+        if (queue->client != NULL) {
+            result = run_client_item(queue->client, item, &forwarded);
+        } else {
+            run_conversation_item(item);
+        }
+        end_send_batch();
+
+        if (!forwarded) {
+            free_work_item(item);
+        }
+
+        mutex_lock(&queue->lock);
+
+        if (result < 0 && !queue->closed) {
+            // Logout: I/O thread thấy EOF và đóng connection như bình thường
+            queue->closed = true;
+            shutdown(queue->client->socket_fd, SHUT_RDWR);
+        }
+    }
+
+    if (queue->closed) {
+        discard_client_work(queue);
+    }
+
+    if (queue->head != NULL) {
+        deque_push(deque, queue);  // Vẫn scheduled, xếp lại cuối hàng
+    } else {
+        queue->scheduled = false;
+        pthread_cond_broadcast(&queue->idle);
+    }
+
+    mutex_unlock(&queue->lock);
+}
+
+/**
+ * Lấy mailbox tiếp theo: deque của mình trước, sau đó lấy trộm
+ */
+static WorkQueue *find_work(WorkDeque *deque) {
+    WorkQueue *queue = deque_pop(deque);
+
+    for (int i = 1; queue == NULL && i < worker_count; i++) {
+        queue = deque_steal(&deques[(deque->id + i) % worker_count]);
+    }
+
+    if (queue != NULL) {
+        __atomic_sub_fetch(&ready_count, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return queue;
+}
+
+static THREAD_RETURN worker_thread(void *arg) {
+    WorkDeque *deque = (WorkDeque *)arg;
+
+    while (1) {
+        WorkQueue *queue = find_work(deque);
+
+        if (queue != NULL) {
+            run_mailbox(deque, queue);
+            continue;
+        }
+
+        mutex_lock(&pool_mutex);
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&ready_count, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&work_ready, &pool_mutex);
+        }
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        mutex_unlock(&pool_mutex);
+    }
+
+    THREAD_RETURN_VALUE;
+}
+
+/**
+ * Xếp 1 request vào mailbox của connection (chặn khi pool đã đầy)
+ * Return: -1 nếu connection đã logout/đóng
+ */
+static int enqueue_client_work(ClientConnection *client, WorkItem *item) {
+    reserve_pending();
+    return mailbox_post(&client->work, item);
+}
+
+/**
+ * Chờ worker pool xử lý xong mọi request đã nhận của connection
+ * Return: -1 nếu connection đã logout
+ */
+static int wait_client_work(ClientConnection *client) {
+    WorkQueue *queue = &client->work;
+
+    mutex_lock(&queue->lock);
+    while (queue->scheduled) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    }
+    int result = queue->closed ? -1 : 0;
+    mutex_unlock(&queue->lock);
+
+    return result;
+}
+
+/**
+ * Chạy request tại chỗ trên I/O thread: field chỉ sống trên stack của lần gọi
+ */
+static int dispatch_view(ClientConnection *client, const MessageView *view) {
+    char storage[sizeof(Message)];  // Đủ cho mọi field ở độ dài tối đa
+    PackedMessage msg;
+    pack_message_view(view, &msg, storage);
+
+    SharedFrame *frame = shared_frame_original(view);
+    int result = dispatch_message(client, &msg, frame);
+    shared_frame_release(frame);
+
+    return result;
+}
+
+/**
+ * Xử lý 1 request đã parse (view trỏ vào buffer nhận): chạy ngay nếu không có
+ * worker pool, ngược lại copy vào WorkItem rồi xếp hàng
+ * Return: -1 nếu connection cần đóng
+ */
+int submit_client_request(ClientConnection *client, const MessageView *view) {
+    if (worker_count == 0) {
+        return dispatch_view(client, view);
+    }
+
+    // File data đi ngay sau frame này nên I/O thread phải tự nhận: chờ các
+    // request trước (vd. login) xong rồi chạy tại chỗ
+    if (view->type == MSG_FILE_SEND) {
+        if (wait_client_work(client) < 0) return -1;
+        return dispatch_view(client, view);
+    }
+
+    // Item chỉ lớn bằng các field thật của request
+    WorkItem *item = malloc(sizeof(WorkItem) + packed_message_size(view));
+    if (item == NULL) return -1;
+
+    item->upload = NULL;
+    item->frame = shared_frame_original(view);
+    pack_message_view(view, &item->msg, item->data);
+
+    return enqueue_client_work(client, item);
+}
+
+/**
+ * Lưu/chuyển tiếp file đã nhận đủ (mode epoll/io_uring)
+ * Return: -1 nếu connection cần đóng
+ */
+int submit_file_upload(ClientConnection *client, FileUpload *upload) {
+    if (worker_count == 0) {
+        complete_file_upload(upload);
+        return 0;
+    }
+
+    WorkItem *item = malloc(sizeof(WorkItem));
+    if (item == NULL) {
+        complete_file_upload(upload);
+        return 0;
+    }
+
+    item->upload = upload;
+    item->frame = NULL;
+
+    return enqueue_client_work(client, item);
+}
+
+/**
+ * Tách connection khỏi worker pool trước khi cleanup: bỏ request chưa chạy
+ * và chờ worker đang chạy request của connection này xong
+ */
+void detach_client_work(ClientConnection *client) {
+    if (worker_count == 0) return;
+
+    WorkQueue *queue = &client->work;
+
+    mutex_lock(&queue->lock);
+    queue->closed = true;
+    discard_client_work(queue);
+    while (queue->scheduled) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    }
+    mutex_unlock(&queue->lock);
+}
+
+/**
+ * Chờ worker xử lý xong mọi request đã nhận (hot upgrade, I/O thread đã dừng đọc)
+ * Return: -1 nếu quá timeout_ms
+ */
+int wait_worker_pool_idle(int timeout_ms) {
+    uint64_t deadline = monotonic_ms() + (uint64_t)timeout_ms;
+
+    while (__atomic_load_n(&pending_count, __ATOMIC_SEQ_CST) > 0) {
+        if (monotonic_ms() >= deadline) return -1;
+        sleep_ms(1);
+    }
+
+    return 0;
+}
+
+/**
+ * Khởi động count worker thread
+ */
+int start_worker_pool(int count) {
+    deques = calloc(count, sizeof(WorkDeque));
+    if (deques == NULL) {
+        perror("Failed to allocate worker deques");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        deques[i].id = i;
+        deques[i].capacity = server_options.max_clients + CONVERSATION_LANES;
+        deques[i].ring = calloc(deques[i].capacity, sizeof(WorkQueue *));
+        if (deques[i].ring == NULL) {
+            perror("Failed to allocate worker deque");
+            return -1;
+        }
+        mutex_init(&deques[i].lock, NULL);
+    }
+
+    for (int i = 0; i < CONVERSATION_LANES; i++) {
+        mutex_init(&lanes[i].lock, NULL);
+        pthread_cond_init(&lanes[i].idle, NULL);
+    }
+
+    worker_count = count;
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&deques[i].thread_id, NULL, worker_thread, &deques[i]) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            return -1;
+        }
+        pthread_detach(deques[i].thread_id);
+    }
+
+    printf("[WORKER] Pool started: %d workers, queue depth %d\n",
+           count, server_options.worker_queue);
+
+    return 0;
+}